@@ -27,30 +27,14 @@ mainApp.controller("main_controller", function($scope) {
 
     $scope.reload = {};
 
-    $scope.reloadImage = function(callback) {
-
-        console.info("Reloading image...");
-
-        var activePreview = $scope.d.activePreview;
-
-        // Execute tonemapping job
-        priv.tonemap.tonemap(
-            toControlFile(activePreview + ".pfm"),
-            $scope.exposure.auto ? null : $scope.exposure.value,
-            function() {
-
-                // Reload preview image
-                domUtils.loadImage("img_main", toControlFile(activePreview + ".bmp"));
-                domUtils.resizeImage("img_main", $scope.zoom.scale);
-
-                if (callback) {
-                    callback();
-                }
-                return;
-
-            }
+    $scope.reloadImage = function() {
+        priv.preview.update(
+            toControlFile("preview.fb"),
+            "img_main",
+            $scope.d.activePreview,
+            $scope.exposure.auto ? null : $scope.exposure.value
         );
-
+        domUtils.resizeImage("img_main", $scope.zoom.scale);
     };
 
     // Exposure controls ======================================================
@@ -74,19 +58,21 @@ mainApp.controller("main_controller", function($scope) {
     $scope.buttonSaveAs = function() {
         console.info("Save as...");
         var savePath = remote.dialog.showSaveDialog({
-            title: "Save Image As BMP",
+            title: "Save Image As PNG",
             filters: [
                 {
-                    name: "BMP Image",
-                    extensions: [".bmp"]
+                    name: "PNG Image",
+                    extensions: ["png"]
                 }
             ]
         });
         console.info("Savepath is " + savePath);
-        fs.copyFileSync(
-            toControlFile($scope.d.activePreview + ".bmp"),
-            savePath
-        );
+        if (!savePath) {
+            return;
+        }
+        var dataUrl = document.getElementById("img_main").toDataURL("image/png");
+        var base64 = dataUrl.substring(dataUrl.indexOf(",") + 1);
+        fs.writeFileSync(savePath, Buffer.from(base64, "base64"));
     };
 
     // ========================================================================
@@ -175,7 +161,7 @@ mainApp.controller("main_controller", function($scope) {
                 }
                 $scope.$apply();
             },
-            // onRefresh
+            // onPreview
             function() {
                 $scope.reloadImage();
             }
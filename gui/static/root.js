@@ -72,7 +72,8 @@ window.onbeforeunload = (e) => {
 // <onIndirectProgress> function(p) p is a Float
 //
 // <onDirectProgress> function(p) p is a Float
-priv.startPbrt = function(onPbrtExit, onRenderFinish, onIndirectProgress, onDirectProgress, onRefresh) {
+// <onPreview> callback() called when new tiles are published to preview.fb
+priv.startPbrt = function(onPbrtExit, onRenderFinish, onIndirectProgress, onDirectProgress, onPreview) {
     log.info("Starting PBRT...");
 
     if (argv.length != 6) {
@@ -103,8 +104,8 @@ priv.startPbrt = function(onPbrtExit, onRenderFinish, onIndirectProgress, onDire
                 onIndirectProgress(ratio);
             } else if (key == "#FINISH") {
                 onRenderFinish();
-            } else if (key == "#REFRESH") {
-                onRefresh();
+            } else if (key == "#PREVIEW") {
+                onPreview();
             }
         }
     }
@@ -0,0 +1,180 @@
+// Reads the preview.fb framebuffer that pbrt publishes in the control
+// directory (see src/integrators/iisptpreviewstream.h) and draws it on a
+// canvas. Only the tiles written since the last update are read and
+// redrawn, unless the exposure or the layer changes.
+
+priv.preview = {};
+
+priv.preview.HEADER_BYTES = 64;
+priv.preview.GAMMA = 1.8;
+
+// Layers in the framebuffer
+priv.preview.LAYERS = {
+    "out_combined": 0,
+    "out_indirect": 1,
+    "out_direct": 2
+};
+
+priv.preview.fb = null;
+
+// <return> the framebuffer state, or null if pbrt hasn't created it yet
+priv.preview.open = function(fbPath) {
+    if (!fs.existsSync(fbPath)) {
+        return null;
+    }
+    var fd = fs.openSync(fbPath, "r");
+    var header = Buffer.alloc(priv.preview.HEADER_BYTES);
+    fs.readSync(fd, header, 0, header.length, 0);
+    if (header.toString("ascii", 0, 8) != "IILEPRV1") {
+        fs.closeSync(fd);
+        return null;
+    }
+
+    var fb = {};
+    fb.fd = fd;
+    fb.width = header.readInt32LE(12);
+    fb.height = header.readInt32LE(16);
+    fb.tileSize = header.readInt32LE(20);
+    fb.tilesX = header.readInt32LE(24);
+    fb.tilesY = header.readInt32LE(28);
+    fb.layerCount = header.readInt32LE(32);
+    var tiles = fb.tilesX * fb.tilesY;
+    fb.layersOffset = Math.ceil((priv.preview.HEADER_BYTES + 8 * tiles) / 64) * 64;
+    fb.layerBytes = fb.width * fb.height * 12;
+
+    // Last frame read for each tile
+    fb.seen = new Float64Array(tiles);
+    fb.frames = Buffer.alloc(8 * tiles);
+    fb.row = Buffer.alloc(fb.tileSize * 12);
+
+    // Copy of the pixels of every layer
+    fb.layers = [];
+    for (var l = 0; l < fb.layerCount; l++) {
+        fb.layers.push(new Float32Array(fb.width * fb.height * 3));
+    }
+
+    fb.gain = null;
+    fb.layer = null;
+    return fb;
+};
+
+// Reads the tiles newer than the last read into fb.layers
+// <return> a list of tile indexes
+priv.preview.readTiles = function(fb) {
+    var changed = [];
+    fs.readSync(fb.fd, fb.frames, 0, fb.frames.length, priv.preview.HEADER_BYTES);
+    var tiles = fb.tilesX * fb.tilesY;
+    for (var t = 0; t < tiles; t++) {
+        var frame = fb.frames.readUInt32LE(8 * t) + 4294967296 * fb.frames.readUInt32LE(8 * t + 4);
+        if (frame <= fb.seen[t]) {
+            continue;
+        }
+        fb.seen[t] = frame;
+        changed.push(t);
+
+        var x0 = (t % fb.tilesX) * fb.tileSize;
+        var y0 = Math.floor(t / fb.tilesX) * fb.tileSize;
+        var x1 = Math.min(x0 + fb.tileSize, fb.width);
+        var y1 = Math.min(y0 + fb.tileSize, fb.height);
+        var rowBytes = (x1 - x0) * 12;
+        for (var l = 0; l < fb.layerCount; l++) {
+            var dest = fb.layers[l];
+            for (var y = y0; y < y1; y++) {
+                var pix = y * fb.width + x0;
+                fs.readSync(fb.fd, fb.row, 0, rowBytes, fb.layersOffset + l * fb.layerBytes + pix * 12);
+                for (var i = 0; i < rowBytes / 4; i++) {
+                    dest[3 * pix + i] = fb.row.readFloatLE(4 * i);
+                }
+            }
+        }
+    }
+    return changed;
+};
+
+// Same automatic exposure as tools/cpfm: the average goes to 1, then the
+// gain is lowered until less than 5% of the values clip
+priv.preview.autoGain = function(vals) {
+    var sum = 0.0;
+    for (var i = 0; i < vals.length; i++) {
+        sum += vals[i];
+    }
+    var avg = sum / vals.length;
+    if (!(avg > 0.0)) {
+        return 0.0;
+    }
+    var gain = Math.log2(1.0 / avg);
+    while (true) {
+        var m = Math.pow(2.0, gain);
+        var clipped = 0;
+        for (var i = 0; i < vals.length; i++) {
+            if (vals[i] * m > 1.0) {
+                clipped++;
+            }
+        }
+        if (clipped / vals.length < 0.05) {
+            return gain;
+        }
+        gain -= 1.0;
+    }
+};
+
+priv.preview.drawRect = function(fb, ctx, vals, x0, y0, x1, y1) {
+    var m = Math.pow(2.0, fb.gain);
+    var invGamma = 1.0 / priv.preview.GAMMA;
+    var img = ctx.createImageData(x1 - x0, y1 - y0);
+    var o = 0;
+    for (var y = y0; y < y1; y++) {
+        for (var x = x0; x < x1; x++) {
+            var p = 3 * (y * fb.width + x);
+            for (var c = 0; c < 3; c++) {
+                img.data[o + c] = 255.0 * Math.pow(Math.max(vals[p + c] * m, 0.0), invGamma);
+            }
+            img.data[o + 3] = 255;
+            o += 4;
+        }
+    }
+    ctx.putImageData(img, x0, y0);
+};
+
+// Updates canvas <canvasId> with the new tiles of <fbPath>
+// <layerName> one of the keys of priv.preview.LAYERS
+// <exposure> a number to use manual exposure, or null to use autoexposure
+priv.preview.update = function(fbPath, canvasId, layerName, exposure) {
+    if (!priv.preview.fb) {
+        priv.preview.fb = priv.preview.open(fbPath);
+        if (!priv.preview.fb) {
+            return;
+        }
+    }
+    var fb = priv.preview.fb;
+    var canvas = document.getElementById(canvasId);
+    if (canvas.width != fb.width || canvas.height != fb.height) {
+        canvas.width = fb.width;
+        canvas.height = fb.height;
+        fb.gain = null;
+    }
+    var ctx = canvas.getContext("2d");
+
+    var changed = priv.preview.readTiles(fb);
+    var layer = priv.preview.LAYERS[layerName];
+    var vals = fb.layers[layer];
+    // Automatic exposure moves in quarter stops, so small changes of the
+    // average don't redraw the whole canvas
+    var gain = exposure != null ? exposure : Math.round(4 * priv.preview.autoGain(vals)) / 4;
+
+    if (gain != fb.gain || layer != fb.layer) {
+        fb.gain = gain;
+        fb.layer = layer;
+        priv.preview.drawRect(fb, ctx, vals, 0, 0, fb.width, fb.height);
+        return;
+    }
+
+    for (var i = 0; i < changed.length; i++) {
+        var t = changed[i];
+        var x0 = (t % fb.tilesX) * fb.tileSize;
+        var y0 = Math.floor(t / fb.tilesX) * fb.tileSize;
+        priv.preview.drawRect(fb, ctx, vals, x0, y0,
+            Math.min(x0 + fb.tileSize, fb.width),
+            Math.min(y0 + fb.tileSize, fb.height));
+    }
+};
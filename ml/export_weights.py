@@ -0,0 +1,102 @@
+import sys
+import os
+import struct
+
+import torch
+from torch.autograd.variable import Variable
+import numpy
+
+import config
+import iispt_net
+
+# =============================================================================
+# Exports the trained model as a flat binary file for the native C++
+# implementation (src/integrators/iisptnnnative.h)
+#
+# Usage:
+#   python3 export_weights.py <weights_out> [<fixture_out>]
+#
+# When <fixture_out> is given, a random input and the corresponding PyTorch
+# output are also written, for the comparison test in src/tests/iisptnn.cpp
+
+# -----------------------------------------------------------------------------
+# Constants
+
+WEIGHTS_MAGIC = b"IISPTNN\0"
+WEIGHTS_VERSION = 1
+IISPT_IMAGE_SIZE = 32
+
+# -----------------------------------------------------------------------------
+# Init
+
+pydir = os.path.dirname(os.path.abspath(__file__)) # root/ml
+rootdir = os.path.dirname(pydir)
+
+# =============================================================================
+# Utilities
+
+def print_stderr(s):
+    sys.stderr.write(s + "\n")
+
+# Older PyTorch versions always aligned corners in bilinear upsampling,
+# newer ones default to align_corners=False
+def get_align_corners(net):
+    for m in net.modules():
+        if isinstance(m, torch.nn.Upsample):
+            ac = getattr(m, "align_corners", True)
+            return bool(ac)
+    return False
+
+def write_weights(net, path):
+    tensors = []
+    for name, value in net.state_dict().items():
+        # Skip integer buffers such as num_batches_tracked
+        if not value.is_floating_point():
+            continue
+        tensors.append((name, value.cpu().float().numpy()))
+
+    with open(path, "wb") as f:
+        f.write(WEIGHTS_MAGIC)
+        f.write(struct.pack("=iii", WEIGHTS_VERSION, int(get_align_corners(net)), len(tensors)))
+        for name, arr in tensors:
+            encoded = name.encode()
+            f.write(struct.pack("=i", len(encoded)))
+            f.write(encoded)
+            f.write(struct.pack("=i", arr.ndim))
+            f.write(struct.pack("=" + "i" * arr.ndim, *arr.shape))
+            f.write(numpy.ascontiguousarray(arr, dtype=numpy.float32).tobytes())
+    print_stderr("Wrote {} tensors to {}".format(len(tensors), path))
+
+# Fixture format:
+# int32 size, (7, size, size) float32 input, (3, size, size) float32 output
+def write_fixture(net, path):
+    rng = numpy.random.RandomState(7)
+    inputArray = rng.uniform(-1.0, 1.0, (1, 7, IISPT_IMAGE_SIZE, IISPT_IMAGE_SIZE)).astype(numpy.float32)
+    outputVariable = net(Variable(torch.from_numpy(inputArray)))
+    outputArray = outputVariable.data.numpy().astype(numpy.float32)
+    with open(path, "wb") as f:
+        f.write(struct.pack("=i", IISPT_IMAGE_SIZE))
+        f.write(inputArray.tobytes())
+        f.write(outputArray.tobytes())
+    print_stderr("Wrote fixture to {}".format(path))
+
+# =============================================================================
+# Main
+
+def main():
+    if len(sys.argv) < 2:
+        print_stderr("Usage: python3 export_weights.py <weights_out> [<fixture_out>]")
+        sys.exit(1)
+    weights_out = os.path.abspath(sys.argv[1])
+    fixture_out = os.path.abspath(sys.argv[2]) if len(sys.argv) > 2 else None
+
+    os.chdir(rootdir)
+    net = iispt_net.IISPTNet()
+    net.load_state_dict(torch.load(config.model_path))
+    net.eval()
+
+    write_weights(net, weights_out)
+    if fixture_out is not None:
+        write_fixture(net, fixture_out)
+
+main()
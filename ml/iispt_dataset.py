@@ -16,7 +16,19 @@
 # {validation_only} - boolean - declares an entire directory
 # to be used only for validation.
 #
-# Dataset files are named like:
+# Sets written by the current reference mode are packed instead:
+# \-set1
+#   \-train.json
+#    -dataset.idx
+#    -dataset_0.bin
+#    -...
+# dataset.idx lists (x, y, shard, record) after a 16 bytes header
+# (magic, version, hemisphere size). Each dataset_<k>.bin shard has a
+# 64 bytes header followed by fixed size records: x, y, 2 reserved int32,
+# then the float32 planes of d (3), n (3), z (1) and p (3), each
+# channel-major like the PBRT ImageFilm. Shards are memory mapped.
+#
+# Older sets have one file per image, named like:
 # type_x_y.pfm
 # type can be:
 # p - path traced ground truth
@@ -31,6 +43,7 @@
 #
 # The dataset contains a list of objects:
 # {directory, x, y, log_normalization, sqrt_normalization, aug}
+# with {shard, record, hemi_size} for packed sets
 # These files are loaded from disk when requested only
 
 # =============================================================================
@@ -61,6 +74,12 @@ random.seed(0)
 TYPE_PREFIXES = ["p", "d", "n", "z"]
 GAMMA_VALUE = 1.2
 
+INDEX_NAME = "dataset.idx"
+INDEX_MAGIC = b"IISPTIX1"
+INDEX_HEADER_BYTES = 16
+SHARD_HEADER_BYTES = 64
+RECORD_HEADER_BYTES = 16
+
 ABLATE_NORMALS = False
 ABLATE_DISTANCE = False
 
@@ -75,6 +94,51 @@ def generate_pfm_filenames(dirname, x, y):
         results.append(a_name)
     return results
 
+# -----------------------------------------------------------------------------
+def shard_path(dirname, shard):
+    return os.path.abspath(os.path.join(dirname, "dataset_{}.bin".format(shard)))
+
+# -----------------------------------------------------------------------------
+def record_floats(hemi_size):
+    return 10 * hemi_size * hemi_size
+
+# -----------------------------------------------------------------------------
+# Shard path -> numpy.memmap of float32, opened on first use
+shard_maps = {}
+
+# -----------------------------------------------------------------------------
+# Loads a packed record
+# <return> a list of PfmImage objects [p, d, n, z]
+def load_packed_pfms(dirname, shard, record, hemi_size):
+    path = shard_path(dirname, shard)
+    if path not in shard_maps:
+        shard_maps[path] = numpy.memmap(path, dtype=numpy.float32, mode="r")
+    floats = record_floats(hemi_size)
+    start = (SHARD_HEADER_BYTES + record * (RECORD_HEADER_BYTES + floats * 4) + RECORD_HEADER_BYTES) // 4
+    planes = numpy.array(shard_maps[path][start : start + floats])
+    planes = planes.reshape((10, hemi_size, hemi_size))
+    location = "{}:{}".format(path, record)
+    def make_pfm(first, last):
+        return pfm.PfmImage(numpy.transpose(planes[first:last], (1, 2, 0)), location)
+    return [make_pfm(7, 10), make_pfm(0, 3), make_pfm(3, 6), make_pfm(6, 7)]
+
+# -----------------------------------------------------------------------------
+# Reads dataset.idx in <set_dir_path>
+# <return> (hemi_size, entries) with entries an (n, 4) array of
+# x, y, shard, record, or None if it isn't a packed set
+def read_index(set_dir_path):
+    index_path = os.path.join(set_dir_path, INDEX_NAME)
+    if not os.path.isfile(index_path):
+        return None
+    with open(index_path, "rb") as f:
+        header = f.read(INDEX_HEADER_BYTES)
+        if len(header) < INDEX_HEADER_BYTES or header[0:8] != INDEX_MAGIC:
+            raise Exception("{} is not a dataset index".format(index_path))
+        hemi_size = int(numpy.frombuffer(header[8:16], dtype=numpy.int32)[1])
+        entries = numpy.fromfile(f, dtype=numpy.int32)
+    entries = entries[0 : (len(entries) // 4) * 4].reshape((-1, 4))
+    return (hemi_size, entries)
+
 # -----------------------------------------------------------------------------
 # Takes 3 PfmImage objects and returns a ConvNpArray for network input
 # <return> a (7, height, width) shaped nparray
@@ -139,16 +203,17 @@ class IISPTDataset(Dataset):
         sqrt_normalization = datum["sqrt_normalization"]
         aug = datum["aug"]
 
-        # Generate file names
-        p_name, d_name, n_name, z_name = generate_pfm_filenames(dirname, x, y)
+        if "shard" in datum:
+            thePfms = load_packed_pfms(dirname, datum["shard"], datum["record"], datum["hemi_size"])
+            p_name, d_name, n_name, z_name = [a.location for a in thePfms]
+        else:
+            # Generate file names
+            p_name, d_name, n_name, z_name = generate_pfm_filenames(dirname, x, y)
 
-        # Load PFM files
-        p_pfm = pfm.load(p_name)
-        d_pfm = pfm.load(d_name)
-        n_pfm = pfm.load(n_name)
-        z_pfm = pfm.load(z_name)
+            # Load PFM files
+            thePfms = [pfm.load(p_name), pfm.load(d_name), pfm.load(n_name), pfm.load(z_name)]
 
-        thePfms = [p_pfm, d_pfm, n_pfm, z_pfm]
+        p_pfm, d_pfm, n_pfm, z_pfm = thePfms
 
         # Data augmentation ---------------------------------------------------
         iispt_transforms.augmentList(thePfms, aug)
@@ -260,9 +325,43 @@ def load_set_directory(set_dir_name, set_dir_path, results_dict, validation_prob
     if "validation_only" in train_info:
         validation_only = train_info["validation_only"]
 
+    def make_value(x, y):
+        value = {}
+        value["directory"] = set_dir_path
+        value["x"] = x
+        value["y"] = y
+        value["log_normalization"] = normalization_intensity
+        value["sqrt_normalization"] = normalization_distance
+        # validation key
+        if validation_only:
+            value["validation"] = True
+        elif random.random() < validation_probability:
+            value["validation"] = True
+        else:
+            value["validation"] = False
+        return value
+
+    added_current = 0
+
+    # Packed set
+    index = read_index(set_dir_path)
+    if index is not None:
+        hemi_size, entries = index
+        for x, y, shard, record in entries.tolist():
+            k = "{}_{}_{}".format(set_dir_name, x, y)
+            if k in results_dict:
+                continue
+            value = make_value(x, y)
+            value["shard"] = shard
+            value["record"] = record
+            value["hemi_size"] = hemi_size
+            results_dict[k] = value
+            added_current += 1
+        print("Added {} packed examples in {}".format(added_current, set_dir_path))
+        return
+
     # Iterate through all the files
     set_content = os.listdir(set_dir_path)
-    added_current = 0
     for a_file_name in set_content:
         # Parse X and Y from filename
         filename_data = parse_filename(a_file_name)
@@ -283,20 +382,7 @@ def load_set_directory(set_dir_name, set_dir_path, results_dict, validation_prob
             print("WARNING: training example {} {} {} incomplete: {}".format(set_dir_name, x, y, check_message))
         
         # Add to results
-        value = {}
-        value["directory"] = set_dir_path
-        value["x"] = x
-        value["y"] = y
-        value["log_normalization"] = normalization_intensity
-        value["sqrt_normalization"] = normalization_distance
-        # validation key
-        if validation_only:
-            value["validation"] = True
-        elif random.random() < validation_probability:
-            value["validation"] = True
-        else:
-            value["validation"] = False
-        results_dict[k] = value
+        results_dict[k] = make_value(x, y)
         added_current += 1
     
     print("Added {} examples in {}".format(added_current, set_dir_path))
@@ -3,6 +3,7 @@ import os
 import subprocess
 import struct
 import time
+import mmap
 
 import torch
 from torch.autograd.variable import Variable
@@ -19,11 +20,6 @@ import iispt_net
 # @prop
 # Will be populated with keys "int_norm" and "dist_norm"
 
-# -----------------------------------------------------------------------------
-# Constants
-
-IISPT_IMAGE_SIZE = 32
-
 # -----------------------------------------------------------------------------
 # Init
 
@@ -45,42 +41,81 @@ def read_float_array(num):
     buff = sys.stdin.buffer.read(num * 4)
     return numpy.frombuffer(buff, dtype=numpy.float32)
 
-# <return> a (7, height, width) shaped ndarray
+# <return> a 1D array of num int32
+def read_int_array(num):
+    buff = sys.stdin.buffer.read(num * 4)
+    return numpy.frombuffer(buff, dtype=numpy.int32)
+
+# <return> a (7, size, size) shaped ndarray
 def read_input():
+    size = int(read_int_array(1)[0])
+
     # Read intensity data
-    intensityArray = read_float_array(IISPT_IMAGE_SIZE * IISPT_IMAGE_SIZE * 3)
+    intensityArray = read_float_array(size * size * 3)
 
     # Read normals data
-    normalsArray = read_float_array(IISPT_IMAGE_SIZE * IISPT_IMAGE_SIZE * 3)
+    normalsArray = read_float_array(size * size * 3)
 
     # Read distance data
-    distanceArray = read_float_array(IISPT_IMAGE_SIZE * IISPT_IMAGE_SIZE * 1)
+    distanceArray = read_float_array(size * size * 1)
 
-    # Reshape read arrays into (height, width, channels)
-    intensityArray = intensityArray.reshape((IISPT_IMAGE_SIZE, IISPT_IMAGE_SIZE, 3))
-    normalsArray = normalsArray.reshape((IISPT_IMAGE_SIZE, IISPT_IMAGE_SIZE, 3))
-    distanceArray = distanceArray.reshape((IISPT_IMAGE_SIZE, IISPT_IMAGE_SIZE, 1))
-
-    # Transpose into (channels, height, width)
-    intensityArray = intensityArray.transpose((2, 0, 1))
-    normalsArray = normalsArray.transpose((2, 0, 1))
-    distanceArray = distanceArray.transpose((2, 0, 1))
+    # Rasters are sent as (channels, height, width)
+    intensityArray = intensityArray.reshape((3, size, size))
+    normalsArray = normalsArray.reshape((3, size, size))
+    distanceArray = distanceArray.reshape((1, size, size))
 
     # Concatenate into single multiarray
     return numpy.concatenate([intensityArray, normalsArray, distanceArray], axis=0)
 
 # =============================================================================
 # <nparray> a shape (channel, height, width) 3D ndarray
-# Outputted as an image with dimensions order as (height, width, channel)
+# Outputted in the same (channel, height, width) order
 def output_to_stdout(nparray):
-    # Reshape into (height, width, channel)
-    data = numpy.transpose(nparray, (1, 2, 0))
-    buff = data.tobytes()
+    buff = numpy.ascontiguousarray(nparray, dtype=numpy.float32).tobytes()
     sys.stdout.buffer.write(buff)
     write_char("x")
     write_char("\n")
     sys.stdout.flush()
 
+# <return> the batch count, or None at end of input
+def read_batch_count():
+    buff = sys.stdin.buffer.read(4)
+    if len(buff) < 4:
+        return None
+    return struct.unpack("=i", buff)[0]
+
+# Hemispheres of one batch can have different sizes. Each one is a
+# contiguous (channels, size, size) array, packed one after the other
+# <sizes> pixels across each hemisphere
+# <inputData> 1D array of the packed inputs
+# <outputData> 1D array receiving the packed outputs
+def run_batch(net, sizes, inputData, outputData):
+    inputOffsets = numpy.concatenate([[0], numpy.cumsum(sizes * sizes * 7)])
+    outputOffsets = numpy.concatenate([[0], numpy.cumsum(sizes * sizes * 3)])
+    # One forward pass per size
+    for size in numpy.unique(sizes):
+        indexes = numpy.nonzero(sizes == size)[0]
+        inputNdArray = numpy.stack([
+            inputData[inputOffsets[i] : inputOffsets[i + 1]].reshape((7, size, size))
+            for i in indexes])
+        outputNdArray = run_network(net, inputNdArray)
+        for j, i in enumerate(indexes):
+            outputData[outputOffsets[i] : outputOffsets[i + 1]] = outputNdArray[j].reshape(-1)
+
+# <return> the pixels across each hemisphere of the batch, and the packed
+#          inputs as a 1D array
+def read_batch_input(count):
+    sizes = read_int_array(count).astype(numpy.int64)
+    return sizes, read_float_array(int(numpy.sum(sizes * sizes * 7)))
+
+# <data> 1D array of the packed outputs
+def output_batch_to_stdout(data):
+    data = numpy.ascontiguousarray(data, dtype=numpy.float32)
+    sys.stdout.buffer.write(data.tobytes())
+    write_char("x")
+    write_char("\n")
+    sys.stdout.flush()
+
 # =============================================================================
 # Processing function
 def process_one(net):
@@ -98,12 +133,88 @@ def process_one(net):
     outputNdArray = outputVariable.data.numpy()[0]
     output_to_stdout(outputNdArray)
 
+# <return> False at end of input
+def process_batch(net):
+    count = read_batch_count()
+    if count is None:
+        return False
+
+    sizes, inputData = read_batch_input(count)
+    outputData = numpy.empty(int(numpy.sum(sizes * sizes * 3)), dtype=numpy.float32)
+    run_batch(net, sizes, inputData, outputData)
+
+    output_batch_to_stdout(outputData)
+    return True
+
+# =============================================================================
+# Shared memory transport, see src/tools/shmring.hpp
+
+SHM_MAGIC = 0x4d485349
+SHM_VERSION = 2
+SHM_HEADER_BYTES = 64
+SHM_SLOT_HEADER_BYTES = 64
+
+def round_up_64(v):
+    return (v + 63) & ~63
+
+def run_network(net, inputNdArray):
+    torchData = torch.from_numpy(inputNdArray).float()
+    outputVariable = net(Variable(torchData))
+    return outputVariable.data.numpy()
+
+def serve_shm(net, memfd, requestfd, responsefd):
+    size = os.fstat(memfd).st_size
+    mm = mmap.mmap(memfd, size)
+    header = numpy.frombuffer(mm, dtype=numpy.int32, count=7, offset=0)
+    magic, version, slots, maxBatch, inputFloats, outputFloats, slotBytes = [int(v) for v in header]
+    if magic != SHM_MAGIC or version != SHM_VERSION:
+        print_stderr("main_stdio_net.py: bad shared memory magic or version")
+        return
+    inputOffset = SHM_SLOT_HEADER_BYTES + round_up_64(maxBatch * 4)
+    outputOffset = inputOffset + round_up_64(maxBatch * inputFloats * 4)
+    print_stderr("main_stdio_net.py: shared memory transport, {} slots of {} hemispheres".format(slots, maxBatch))
+
+    sequence = 0
+    while True:
+        # Number of slots submitted since the last read
+        pending = struct.unpack("=Q", os.read(requestfd, 8))[0]
+        for _ in range(pending):
+            slotBase = SHM_HEADER_BYTES + (sequence % slots) * slotBytes
+            sequence += 1
+            slotHeader = numpy.frombuffer(mm, dtype=numpy.int32, count=2, offset=slotBase)
+            count = int(slotHeader[0])
+            if count < 0:
+                print_stderr("main_stdio_net.py: End of input")
+                return
+
+            # Views on the shared segment, no copies
+            sizes = numpy.frombuffer(mm, dtype=numpy.int32,
+                count=count, offset=slotBase + SHM_SLOT_HEADER_BYTES).astype(numpy.int64)
+            inputArray = numpy.frombuffer(mm, dtype=numpy.float32,
+                count=int(numpy.sum(sizes * sizes * 7)), offset=slotBase + inputOffset)
+            outputArray = numpy.frombuffer(mm, dtype=numpy.float32,
+                count=int(numpy.sum(sizes * sizes * 3)), offset=slotBase + outputOffset)
+
+            run_batch(net, sizes, inputArray, outputArray)
+            slotHeader[1] = 0
+
+            os.write(responsefd, struct.pack("=Q", 1))
+
 # =============================================================================
 # Main
 
 def main():
     print_stderr("main_stdio_net.py: Startup")
-    torch.set_num_threads(1)
+    batch = "--batch" in sys.argv
+    shm = "--shm" in sys.argv
+    if batch:
+        # A single process serves all render threads
+        torch_threads = os.environ.get("IISPT_NN_TORCH_THREADS")
+        if torch_threads is None:
+            torch_threads = os.cpu_count()
+        torch.set_num_threads(int(torch_threads))
+    else:
+        torch.set_num_threads(1)
     # Load model
     net = iispt_net.IISPTNet()
     net.load_state_dict(torch.load(config.model_path))
@@ -111,7 +222,16 @@ def main():
     net.eval()
     print_stderr("Model loaded")
 
-    while True:
-        process_one(net)
+    if shm:
+        fdIndex = sys.argv.index("--shm") + 1
+        memfd, requestfd, responsefd = [int(v) for v in sys.argv[fdIndex : fdIndex + 3]]
+        serve_shm(net, memfd, requestfd, responsefd)
+    elif batch:
+        while process_batch(net):
+            pass
+        print_stderr("main_stdio_net.py: End of input")
+    else:
+        while True:
+            process_one(net)
 
 main()
\ No newline at end of file
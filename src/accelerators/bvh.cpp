@@ -37,7 +37,23 @@
 #include "paramset.h"
 #include "stats.h"
 #include "parallel.h"
+#include "shapes/triangle.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif  // PBRT_HAVE_MMAP
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PBRT_BVH_X86 1
+#include <immintrin.h>
+#endif
 
 namespace pbrt {
 
@@ -45,8 +61,26 @@ STAT_MEMORY_COUNTER("Memory/BVH tree", treeBytes);
 STAT_RATIO("BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
 STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 STAT_COUNTER("BVH/Leaf nodes", leafNodes);
+STAT_RATIO("BVH/Children per wide node", wideChildren, wideNodeCount);
+STAT_RATIO("BVH/Rays per packet node test", packetRays, packetNodeTests);
+STAT_COUNTER("BVH/Cache hits", cacheHits);
+STAT_COUNTER("BVH/Cache misses", cacheMisses);
+STAT_COUNTER("BVH/Build time saved by the cache (ms)", cacheMsSaved);
+// Memory of the triangles of _TriangleMeshPrimitive_s besides the mesh data,
+// against what they would take as a _GeometricPrimitive_ and a _Triangle_
+// each
+STAT_RATIO("BVH/Bytes per compact triangle", compactTriangleBytes,
+           compactTriangles);
+STAT_RATIO("BVH/Bytes per compact triangle as shapes", shapeTriangleBytes,
+           shapeTriangles);
 
 // BVHAccel Local Declarations
+// _std::make_shared()_ allocates the reference counts with the object
+static PBRT_CONSTEXPR size_t SharedPtrCountBytes = 16;
+static PBRT_CONSTEXPR size_t ShapeTriangleBytes =
+    sizeof(BVHItem) + sizeof(std::shared_ptr<Primitive>) +
+    sizeof(GeometricPrimitive) + sizeof(Triangle) + 2 * SharedPtrCountBytes;
+
 struct BVHPrimitiveInfo {
     BVHPrimitiveInfo() {}
     BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3f &bounds)
@@ -103,6 +137,487 @@ struct LinearBVHNode {
     uint8_t pad[1];        // ensure 32 byte total size
 };
 
+// Node of the 4 and 8-wide trees, collapsed from the binary build. Boxes
+// are stored as structure of arrays so that one SIMD register holds a
+// slab of all the children
+template <int N>
+struct WideBVHNode {
+    // Lower x, y, z then upper x, y, z of every child. Unused children
+    // have empty bounds and are never hit
+    float bounds[6][N];
+    // Interior child: index of its node; leaf child: first primitive
+    int32_t offset[N];
+    uint16_t nPrimitives[N];  // 0 -> interior child or unused
+    uint8_t pad[N == 4 ? 8 : 16];  // ensure 128 / 256 byte total size
+};
+
+// WideBVHNode Utility Functions
+template <int N>
+static int CollapseBVHTree(const BVHBuildNode *node,
+                           std::vector<WideBVHNode<N>> &wideNodes) {
+    // Open the interior child with the largest surface area until the node
+    // has _N_ children or only leaves
+    const BVHBuildNode *children[N];
+    int nChildren = 0;
+    if (node->nPrimitives > 0) {
+        // Only a root can be a leaf
+        children[nChildren++] = node;
+    } else {
+        children[nChildren++] = node->children[0];
+        children[nChildren++] = node->children[1];
+    }
+    while (nChildren < N) {
+        int open = -1;
+        Float openArea = 0;
+        for (int i = 0; i < nChildren; ++i) {
+            Float area = children[i]->bounds.SurfaceArea();
+            if (children[i]->nPrimitives == 0 && (open < 0 || area > openArea)) {
+                open = i;
+                openArea = area;
+            }
+        }
+        if (open < 0) break;
+        const BVHBuildNode *opened = children[open];
+        children[open] = opened->children[0];
+        children[nChildren++] = opened->children[1];
+    }
+
+    int index = wideNodes.size();
+    wideNodes.push_back(WideBVHNode<N>());
+    for (int i = 0; i < N; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            wideNodes[index].bounds[axis][i] = Infinity;
+            wideNodes[index].bounds[axis + 3][i] = -Infinity;
+        }
+        wideNodes[index].offset[i] = -1;
+        wideNodes[index].nPrimitives[i] = 0;
+    }
+    ++wideNodeCount;
+    wideChildren += nChildren;
+    for (int i = 0; i < nChildren; ++i) {
+        const BVHBuildNode *child = children[i];
+        // _wideNodes_ grows while the children are collapsed
+        int offset = child->nPrimitives > 0
+                         ? child->firstPrimOffset
+                         : CollapseBVHTree<N>(child, wideNodes);
+        WideBVHNode<N> &wide = wideNodes[index];
+        for (int axis = 0; axis < 3; ++axis) {
+            wide.bounds[axis][i] = child->bounds.pMin[axis];
+            wide.bounds[axis + 3][i] = child->bounds.pMax[axis];
+        }
+        wide.offset[i] = offset;
+        wide.nPrimitives[i] = child->nPrimitives;
+    }
+    return index;
+}
+
+template <int N>
+static WideBVHNode<N> *MakeWideBVH(const BVHBuildNode *root, int *nNodes) {
+    std::vector<WideBVHNode<N>> wideNodes;
+    CollapseBVHTree<N>(root, wideNodes);
+    *nNodes = wideNodes.size();
+    WideBVHNode<N> *nodes = AllocAligned<WideBVHNode<N>>(wideNodes.size());
+    std::copy(wideNodes.begin(), wideNodes.end(), nodes);
+    return nodes;
+}
+
+// Ray values shared by the box tests of a traversal
+struct WideBVHRay {
+    WideBVHRay(const Ray &ray) {
+        for (int axis = 0; axis < 3; ++axis) {
+            o[axis] = ray.o[axis];
+            invDir[axis] = 1 / ray.d[axis];
+            // Rows of _WideBVHNode::bounds_ with the entry and exit slabs
+            near[axis] = invDir[axis] < 0 ? axis + 3 : axis;
+            far[axis] = invDir[axis] < 0 ? axis : axis + 3;
+        }
+    }
+    float o[3], invDir[3];
+    int near[3], far[3];
+};
+
+// Exit distances are scaled up like in _Bounds3::IntersectP()_, so that
+// rounding errors don't lose hits
+static const float WideBVHFarScale = 1 + 2 * gamma(3);
+
+// Box tests return the mask of the children hit before _tMax_ and their
+// entry distances in _tNear_. NaNs from 0 * inf are ignored, like the
+// comparisons in _Bounds3::IntersectP()_ do
+template <int N>
+struct WideBVHBoxesScalar {
+    static int Intersect(const WideBVHNode<N> &node, const WideBVHRay &r,
+                         float tMax, float *tNear) {
+        int mask = 0;
+        for (int i = 0; i < N; ++i) {
+            float t0 = 0, t1 = Infinity;
+            for (int axis = 0; axis < 3; ++axis) {
+                float tEntry =
+                    (node.bounds[r.near[axis]][i] - r.o[axis]) * r.invDir[axis];
+                float tExit =
+                    (node.bounds[r.far[axis]][i] - r.o[axis]) * r.invDir[axis];
+                if (tEntry > t0) t0 = tEntry;
+                if (tExit < t1) t1 = tExit;
+            }
+            t1 = std::min(t1 * WideBVHFarScale, tMax);
+            tNear[i] = t0;
+            if (t0 <= t1) mask |= 1 << i;
+        }
+        return mask;
+    }
+};
+
+#ifdef PBRT_BVH_X86
+struct WideBVHBoxesSse {
+    __attribute__((target("sse2")))
+    static int Intersect(const WideBVHNode<4> &node, const WideBVHRay &r,
+                         float tMax, float *tNear) {
+        // _mm_max_ps() and _mm_min_ps() return their second operand when
+        // one is NaN
+        __m128 t0 = _mm_setzero_ps();
+        __m128 t1 = _mm_set1_ps(Infinity);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 o = _mm_set1_ps(r.o[axis]);
+            __m128 invDir = _mm_set1_ps(r.invDir[axis]);
+            __m128 tEntry = _mm_mul_ps(
+                _mm_sub_ps(_mm_load_ps(node.bounds[r.near[axis]]), o), invDir);
+            __m128 tExit = _mm_mul_ps(
+                _mm_sub_ps(_mm_load_ps(node.bounds[r.far[axis]]), o), invDir);
+            t0 = _mm_max_ps(tEntry, t0);
+            t1 = _mm_min_ps(tExit, t1);
+        }
+        t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(WideBVHFarScale)),
+                        _mm_set1_ps(tMax));
+        _mm_storeu_ps(tNear, t0);
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+    }
+};
+
+struct WideBVHBoxesAvx2 {
+    __attribute__((target("avx2")))
+    static int Intersect(const WideBVHNode<8> &node, const WideBVHRay &r,
+                         float tMax, float *tNear) {
+        __m256 t0 = _mm256_setzero_ps();
+        __m256 t1 = _mm256_set1_ps(Infinity);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 o = _mm256_set1_ps(r.o[axis]);
+            __m256 invDir = _mm256_set1_ps(r.invDir[axis]);
+            __m256 tEntry = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_load_ps(node.bounds[r.near[axis]]), o),
+                invDir);
+            __m256 tExit = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_load_ps(node.bounds[r.far[axis]]), o),
+                invDir);
+            t0 = _mm256_max_ps(tEntry, t0);
+            t1 = _mm256_min_ps(tExit, t1);
+        }
+        t1 = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(WideBVHFarScale)),
+                           _mm256_set1_ps(tMax));
+        _mm256_storeu_ps(tNear, t0);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    }
+};
+#endif  // PBRT_BVH_X86
+
+// The closest triangle of a _TriangleMeshPrimitive_ that a ray has hit so
+// far. Its _SurfaceInteraction_ is only filled in once the traversal is
+// over, rather than for every triangle that shortens the ray
+struct BVHDeferredHit {
+    const BVHItem *item = nullptr;
+    Float b[3];
+};
+
+// Intersection of rays with the items of the leaves
+struct BVHLeaves {
+    bool Intersect(int i, const Ray &ray, SurfaceInteraction *isect,
+                   BVHDeferredHit *deferred) const {
+        const BVHItem &item = items[i];
+        if (item.mesh < 0) {
+            if (!primitives[item.index]->Intersect(ray, isect)) return false;
+            deferred->item = nullptr;
+            return true;
+        }
+        const TriangleMeshPrimitive *mesh = meshes[item.mesh].get();
+        Float tHit, b[3];
+        if (!mesh->IntersectTriangle(item.index, ray, &tHit, b)) return false;
+        // Hits that the alpha mask may cut out are filled in right away
+        if (mesh->HasAlphaMask()) {
+            if (!mesh->FillInteraction(item.index, b, ray, isect))
+                return false;
+            deferred->item = nullptr;
+        } else {
+            deferred->item = &item;
+            for (int j = 0; j < 3; ++j) deferred->b[j] = b[j];
+        }
+        ray.tMax = tHit;
+        return true;
+    }
+    bool IntersectP(int i, const Ray &ray) const {
+        const BVHItem &item = items[i];
+        if (item.mesh < 0) return primitives[item.index]->IntersectP(ray);
+        return meshes[item.mesh]->IntersectPTriangle(item.index, ray);
+    }
+    void Finish(const BVHDeferredHit &deferred, const Ray &ray,
+                SurfaceInteraction *isect) const {
+        // Only triangles without an alpha mask are deferred, so the hit
+        // can't be cut out anymore
+        if (deferred.item)
+            meshes[deferred.item->mesh]->FillInteraction(
+                deferred.item->index, deferred.b, ray, isect);
+    }
+
+    const BVHItem *items;
+    const std::shared_ptr<Primitive> *primitives;
+    const std::shared_ptr<TriangleMeshPrimitive> *meshes;
+};
+
+// Traversal of a wide tree. Children that are hit are visited nearest
+// first, and nodes further than the closest hit found so far are skipped.
+// _AnyHit_ stops at the first hit, for _IntersectP()_
+template <int N, typename Boxes, bool AnyHit>
+inline bool TraverseWideBVH(
+    const WideBVHNode<N> *nodes, const BVHLeaves &leaves, const Ray &ray,
+    SurfaceInteraction *isect) {
+    WideBVHRay r(ray);
+    bool hit = false;
+    BVHDeferredHit deferred;
+    // Every level leaves at most _N_ - 1 children on the stack
+    int nodesToVisit[64 * N];
+    float tToVisit[64 * N];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    while (true) {
+        const WideBVHNode<N> &node = nodes[currentNodeIndex];
+        float tNear[N];
+        int mask = Boxes::Intersect(node, r, ray.tMax, tNear);
+
+        // Sort the children hit by entry distance
+        int order[N];
+        int nHit = 0;
+        while (mask) {
+            int i = Log2Int(uint32_t(mask & -mask));
+            mask &= mask - 1;
+            int j = nHit++;
+            if (!AnyHit)
+                for (; j > 0 && tNear[order[j - 1]] > tNear[i]; --j)
+                    order[j] = order[j - 1];
+            order[j] = i;
+        }
+
+        // Intersect the leaves first, their hits shorten the ray for the
+        // interior children
+        for (int k = 0; k < nHit; ++k) {
+            int i = order[k];
+            if (node.nPrimitives[i] == 0 || tNear[i] > ray.tMax) continue;
+            for (int p = 0; p < node.nPrimitives[i]; ++p) {
+                int item = node.offset[i] + p;
+                if (AnyHit) {
+                    if (leaves.IntersectP(item, ray)) return true;
+                } else if (leaves.Intersect(item, ray, isect, &deferred))
+                    hit = true;
+            }
+        }
+
+        // Push interior children farthest first
+        for (int k = nHit - 1; k >= 0; --k) {
+            int i = order[k];
+            if (node.nPrimitives[i] > 0) continue;
+            nodesToVisit[toVisitOffset] = node.offset[i];
+            tToVisit[toVisitOffset++] = tNear[i];
+        }
+
+        do {
+            if (toVisitOffset == 0) {
+                if (!AnyHit) leaves.Finish(deferred, ray, isect);
+                return hit;
+            }
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        } while (tToVisit[toVisitOffset] > ray.tMax);
+    }
+}
+
+#ifdef PBRT_BVH_X86
+// _flatten_ inlines the traversal and the box tests into functions built
+// for the instruction set of the box tests
+template <bool AnyHit>
+__attribute__((target("sse2"), flatten)) static bool TraverseWideBVHSse(
+    const WideBVHNode<4> *nodes, const BVHLeaves &leaves, const Ray &ray,
+    SurfaceInteraction *isect) {
+    return TraverseWideBVH<4, WideBVHBoxesSse, AnyHit>(nodes, leaves, ray,
+                                                       isect);
+}
+
+template <bool AnyHit>
+__attribute__((target("avx2"), flatten)) static bool TraverseWideBVHAvx2(
+    const WideBVHNode<8> *nodes, const BVHLeaves &leaves, const Ray &ray,
+    SurfaceInteraction *isect) {
+    return TraverseWideBVH<8, WideBVHBoxesAvx2, AnyHit>(nodes, leaves, ray,
+                                                        isect);
+}
+#endif  // PBRT_BVH_X86
+
+// Whether the box tests of _N_-wide nodes have a SIMD version on this CPU
+static bool WideBVHSimdSupported(int n) {
+#ifdef PBRT_BVH_X86
+    __builtin_cpu_init();
+    if (n == 4) return __builtin_cpu_supports("sse2");
+    if (n == 8) return __builtin_cpu_supports("avx2");
+#endif
+    return false;
+}
+
+template <bool AnyHit>
+static bool TraverseWideBVH4(
+    const WideBVHNode<4> *nodes, bool simd, const BVHLeaves &leaves,
+    const Ray &ray, SurfaceInteraction *isect) {
+#ifdef PBRT_BVH_X86
+    if (simd) return TraverseWideBVHSse<AnyHit>(nodes, leaves, ray, isect);
+#endif
+    return TraverseWideBVH<4, WideBVHBoxesScalar<4>, AnyHit>(nodes, leaves,
+                                                             ray, isect);
+}
+
+template <bool AnyHit>
+static bool TraverseWideBVH8(
+    const WideBVHNode<8> *nodes, bool simd, const BVHLeaves &leaves,
+    const Ray &ray, SurfaceInteraction *isect) {
+#ifdef PBRT_BVH_X86
+    if (simd) return TraverseWideBVHAvx2<AnyHit>(nodes, leaves, ray, isect);
+#endif
+    return TraverseWideBVH<8, WideBVHBoxesScalar<8>, AnyHit>(nodes, leaves,
+                                                             ray, isect);
+}
+
+// Up to _RayPacketSize_ rays traversing the binary tree together, as
+// structure of arrays. Unused lanes repeat the first ray
+struct BVHRayPacket {
+    BVHRayPacket(const Ray *rays, int n) {
+        for (int i = 0; i < RayPacketSize; ++i) {
+            const Ray &ray = rays[i < n ? i : 0];
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis][i] = ray.o[axis];
+                invDir[axis][i] = 1 / ray.d[axis];
+            }
+            tMax[i] = ray.tMax;
+        }
+    }
+    float o[3][RayPacketSize], invDir[3][RayPacketSize];
+    float tMax[RayPacketSize];
+};
+
+// Packet box tests return the mask of the rays that hit _b_. Like the wide
+// node tests, the entry slab is chosen by the sign of the direction and
+// NaNs are ignored
+struct BVHPacketBoxesScalar {
+    static int Intersect(const Bounds3f &b, const BVHRayPacket &packet) {
+        int mask = 0;
+        for (int i = 0; i < RayPacketSize; ++i) {
+            float t0 = 0, t1 = Infinity;
+            for (int axis = 0; axis < 3; ++axis) {
+                float invDir = packet.invDir[axis][i];
+                float tEntry = ((invDir < 0 ? b.pMax : b.pMin)[axis] -
+                                packet.o[axis][i]) *
+                               invDir;
+                float tExit = ((invDir < 0 ? b.pMin : b.pMax)[axis] -
+                               packet.o[axis][i]) *
+                              invDir;
+                if (tEntry > t0) t0 = tEntry;
+                if (tExit < t1) t1 = tExit;
+            }
+            t1 = std::min(t1 * WideBVHFarScale, packet.tMax[i]);
+            if (t0 <= t1) mask |= 1 << i;
+        }
+        return mask;
+    }
+};
+
+#ifdef PBRT_BVH_X86
+struct BVHPacketBoxesAvx2 {
+    static_assert(RayPacketSize == 8, "One AVX register per packet");
+    __attribute__((target("avx2")))
+    static int Intersect(const Bounds3f &b, const BVHRayPacket &packet) {
+        __m256 t0 = _mm256_setzero_ps();
+        __m256 t1 = _mm256_set1_ps(Infinity);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 o = _mm256_loadu_ps(packet.o[axis]);
+            __m256 invDir = _mm256_loadu_ps(packet.invDir[axis]);
+            __m256 pMin = _mm256_set1_ps(b.pMin[axis]);
+            __m256 pMax = _mm256_set1_ps(b.pMax[axis]);
+            // _mm256_blendv_ps() picks its second operand where the sign
+            // bit of the direction is set
+            __m256 tEntry = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_blendv_ps(pMin, pMax, invDir), o), invDir);
+            __m256 tExit = _mm256_mul_ps(
+                _mm256_sub_ps(_mm256_blendv_ps(pMax, pMin, invDir), o), invDir);
+            t0 = _mm256_max_ps(tEntry, t0);
+            t1 = _mm256_min_ps(tExit, t1);
+        }
+        t1 = _mm256_min_ps(_mm256_mul_ps(t1, _mm256_set1_ps(WideBVHFarScale)),
+                           _mm256_loadu_ps(packet.tMax));
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    }
+};
+#endif  // PBRT_BVH_X86
+
+// Traversal of the binary tree by a packet. A node is fetched once for all
+// the rays that reach it, and the children are visited in the order of the
+// first of them
+template <typename Boxes>
+inline void TraverseBVHPacket(
+    const LinearBVHNode *nodes, const BVHLeaves &leaves, int n,
+    const Ray *rays, SurfaceInteraction *isects, bool *hits) {
+    BVHRayPacket packet(rays, n);
+    BVHDeferredHit deferred[RayPacketSize];
+    int nodesToVisit[64], masksToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int mask = (1 << n) - 1;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        ++packetNodeTests;
+        for (int m = mask; m; m &= m - 1) ++packetRays;
+        mask &= Boxes::Intersect(node->bounds, packet);
+        if (mask && node->nPrimitives == 0) {
+            // Put far BVH node on _nodesToVisit_ stack, advance to near
+            // node
+            int first = Log2Int(uint32_t(mask & -mask));
+            nodesToVisit[toVisitOffset] = currentNodeIndex + 1;
+            masksToVisit[toVisitOffset++] = mask;
+            if (packet.invDir[node->axis][first] < 0)
+                currentNodeIndex = node->secondChildOffset;
+            else {
+                nodesToVisit[toVisitOffset - 1] = node->secondChildOffset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+            continue;
+        }
+        if (mask) {
+            // Intersect the rays that reached the leaf with its primitives
+            for (int p = 0; p < node->nPrimitives; ++p) {
+                int item = node->primitivesOffset + p;
+                for (int m = mask; m; m &= m - 1) {
+                    int i = Log2Int(uint32_t(m & -m));
+                    if (leaves.Intersect(item, rays[i], &isects[i],
+                                         &deferred[i])) {
+                        hits[i] = true;
+                        packet.tMax[i] = rays[i].tMax;
+                    }
+                }
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset];
+        mask = masksToVisit[toVisitOffset];
+    }
+    for (int i = 0; i < n; ++i) leaves.Finish(deferred[i], rays[i], &isects[i]);
+}
+
+#ifdef PBRT_BVH_X86
+__attribute__((target("avx2"), flatten)) static void TraverseBVHPacketAvx2(
+    const LinearBVHNode *nodes, const BVHLeaves &leaves, int n,
+    const Ray *rays, SurfaceInteraction *isects, bool *hits) {
+    TraverseBVHPacket<BVHPacketBoxesAvx2>(nodes, leaves, n, rays, isects, hits);
+}
+#endif  // PBRT_BVH_X86
+
 // BVHAccel Utility Functions
 inline uint32_t LeftShift3(uint32_t x) {
     CHECK_LE(x, (1 << 10));
@@ -179,64 +694,453 @@ static void RadixSort(std::vector<MortonPrimitive> *v) {
     if (nPasses & 1) std::swap(*v, tempVector);
 }
 
+struct BucketInfo {
+    int count = 0;
+    Bounds3f bounds;
+};
+
+// Buckets of the approximate SAH
+static PBRT_CONSTEXPR int nSAHBuckets = 12;
+
+inline int SAHBucket(const Bounds3f &centroidBounds, int dim,
+                     const Point3f &centroid) {
+    int b = nSAHBuckets * centroidBounds.Offset(centroid)[dim];
+    if (b == nSAHBuckets) b = nSAHBuckets - 1;
+    CHECK_GE(b, 0);
+    CHECK_LT(b, nSAHBuckets);
+    return b;
+}
+
+// Returns the bucket after which splitting minimizes the SAH cost, and
+// that cost in _minCost_
+static int MinCostSplitBucket(const BucketInfo *buckets,
+                              const Bounds3f &bounds, Float *minCost) {
+    // Compute costs for splitting after each bucket
+    Float cost[nSAHBuckets - 1];
+    for (int i = 0; i < nSAHBuckets - 1; ++i) {
+        Bounds3f b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j) {
+            b0 = Union(b0, buckets[j].bounds);
+            count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nSAHBuckets; ++j) {
+            b1 = Union(b1, buckets[j].bounds);
+            count1 += buckets[j].count;
+        }
+        cost[i] = 1 +
+                  (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) /
+                      bounds.SurfaceArea();
+    }
+
+    // Find bucket to split at that minimizes SAH metric
+    *minCost = cost[0];
+    int minCostSplitBucket = 0;
+    for (int i = 1; i < nSAHBuckets - 1; ++i) {
+        if (cost[i] < *minCost) {
+            *minCost = cost[i];
+            minCostSplitBucket = i;
+        }
+    }
+    return minCostSplitBucket;
+}
+
+// Ranges of more primitives than this are split by _buildTop()_ with
+// parallel binning and partitioning, smaller ones are built by
+// _recursiveBuild()_ as parallel tasks. The tree doesn't depend on the
+// number of threads
+static PBRT_CONSTEXPR int ParallelBuildMinPrimitives = 16 * 1024;
+// Primitives per iteration of the parallel loops of _buildTop()_
+static PBRT_CONSTEXPR int ParallelBuildChunk = 4096;
+
+struct BVHBuildTask {
+    int start, end;
+    BVHBuildNode **node;
+};
+
+// Stable partition of _primitiveInfo[start, end)_, in parallel. Returns
+// the index of the first primitive for which _pred_ is false
+template <typename Predicate>
+static int ParallelPartition(std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                             int start, int end, const Predicate &pred) {
+    int nPrimitives = end - start;
+    int nChunks = (nPrimitives + ParallelBuildChunk - 1) / ParallelBuildChunk;
+    std::unique_ptr<bool[]> first(new bool[nPrimitives]);
+    std::vector<int> nFirst(nChunks, 0);
+    ParallelFor([&](int64_t c) {
+        int s = c * ParallelBuildChunk;
+        int e = std::min(s + ParallelBuildChunk, nPrimitives);
+        for (int i = s; i < e; ++i) {
+            first[i] = pred(primitiveInfo[start + i]);
+            nFirst[c] += first[i];
+        }
+    }, nChunks);
+
+    // Find where the primitives of each chunk go in the two sets
+    std::vector<int> firstOffset(nChunks), secondOffset(nChunks);
+    int nFirstTotal = 0;
+    for (int c = 0; c < nChunks; ++c) nFirstTotal += nFirst[c];
+    for (int c = 0, f = 0, s = nFirstTotal; c < nChunks; ++c) {
+        firstOffset[c] = f;
+        secondOffset[c] = s;
+        f += nFirst[c];
+        s += std::min(ParallelBuildChunk, nPrimitives - c * ParallelBuildChunk) -
+             nFirst[c];
+    }
+
+    std::vector<BVHPrimitiveInfo> partitioned(nPrimitives);
+    ParallelFor([&](int64_t c) {
+        int s = c * ParallelBuildChunk;
+        int e = std::min(s + ParallelBuildChunk, nPrimitives);
+        int f = firstOffset[c], o = secondOffset[c];
+        for (int i = s; i < e; ++i)
+            partitioned[first[i] ? f++ : o++] = primitiveInfo[start + i];
+    }, nChunks);
+    ParallelFor([&](int64_t c) {
+        int s = c * ParallelBuildChunk;
+        int e = std::min(s + ParallelBuildChunk, nPrimitives);
+        std::copy(&partitioned[s], &partitioned[0] + e,
+                  &primitiveInfo[start + s]);
+    }, nChunks);
+    return start + nFirstTotal;
+}
+
+// BVH cache files hold a _BVHCacheHeader_, the flattened nodes and the
+// index in the scene of each primitive in tree order. The nodes start at
+// _BVHCacheNodesOffset_, so that they keep their alignment when the file
+// is mapped
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t key;
+    int32_t width, nPrimitives, nNodes;
+    float buildSeconds;
+    Bounds3f bounds;
+};
+
+static const char BVHCacheMagic[8] = {'p', 'b', 'r', 't', 'B', 'V', 'H', 0};
+static PBRT_CONSTEXPR uint32_t BVHCacheVersion = 2;
+static PBRT_CONSTEXPR size_t BVHCacheNodesOffset =
+    (sizeof(BVHCacheHeader) + 63) & ~size_t(63);
+
+static size_t BVHNodeSize(int width) {
+    return width == 4 ? sizeof(WideBVHNode<4>)
+                      : width == 8 ? sizeof(WideBVHNode<8>)
+                                   : sizeof(LinearBVHNode);
+}
+
+static uint64_t MixBVHCacheKey(uint64_t h, uint64_t v) {
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    return (h ^ v) * 0xc4ceb9fe1a85ec53ull;
+}
+
+// The builders only look at the primitive bounds, so the key covers them
+// and the build parameters: scenes with the same bounds in the same order
+// get the same tree, whatever their primitives are. The number of meshes
+// tells apart scenes whose triangles are compact from the others
+static uint64_t BVHCacheKey(const std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                            int nMeshes, int maxPrimsInNode, int splitMethod,
+                            int width) {
+    uint64_t h = MixBVHCacheKey(BVHCacheVersion, sizeof(Float));
+    h = MixBVHCacheKey(h, primitiveInfo.size());
+    h = MixBVHCacheKey(h, nMeshes);
+    h = MixBVHCacheKey(h, maxPrimsInNode);
+    h = MixBVHCacheKey(h, splitMethod);
+    h = MixBVHCacheKey(h, width);
+    for (const BVHPrimitiveInfo &pi : primitiveInfo) {
+        uint64_t words[sizeof(Bounds3f) / sizeof(uint64_t)];
+        memcpy(words, &pi.bounds, sizeof(words));
+        for (uint64_t w : words) h = MixBVHCacheKey(h, w);
+    }
+    return h;
+}
+
+static void FreeBVHCacheData(char *data, size_t bytes) {
+#ifdef PBRT_HAVE_MMAP
+    munmap(data, bytes);
+#else
+    FreeAligned(data);
+#endif
+}
+
 // BVHAccel Method Definitions
 BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
-                   int maxPrimsInNode, SplitMethod splitMethod)
+                   int maxPrimsInNode, SplitMethod splitMethod, int width,
+                   bool simd, const std::string &cacheDir)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)),
       splitMethod(splitMethod),
+      width(width),
+      simd(simd && WideBVHSimdSupported(width)),
+      packetSimd(simd && WideBVHSimdSupported(RayPacketSize)),
       primitives(std::move(p)) {
+    CHECK(width == 2 || width == 4 || width == 8);
     ProfilePhase _(Prof::AccelConstruction);
-    if (primitives.empty()) return;
-    // Build BVH from _primitives_
+    // Take _TriangleMeshPrimitive_s apart into their triangles
+    std::vector<std::shared_ptr<Primitive>> others;
+    for (std::shared_ptr<Primitive> &prim : primitives) {
+        std::shared_ptr<TriangleMeshPrimitive> mesh =
+            std::dynamic_pointer_cast<TriangleMeshPrimitive>(prim);
+        if (mesh) {
+            for (int i = 0; i < mesh->NumTriangles(); ++i)
+                items.push_back({int32_t(meshes.size()), i});
+            meshes.push_back(std::move(mesh));
+        } else {
+            items.push_back({-1, int32_t(others.size())});
+            others.push_back(std::move(prim));
+        }
+    }
+    primitives.swap(others);
+    if (items.empty()) return;
+    // Build BVH from _items_
 
     // Initialize _primitiveInfo_ array for primitives
-    std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
-    for (size_t i = 0; i < primitives.size(); ++i)
-        primitiveInfo[i] = {i, primitives[i]->WorldBound()};
+    std::vector<BVHPrimitiveInfo> primitiveInfo(items.size());
+    auto initPrimitiveInfo = [&](int64_t i) {
+        const BVHItem &item = items[i];
+        primitiveInfo[i] = {size_t(i),
+                            item.mesh < 0
+                                ? primitives[item.index]->WorldBound()
+                                : meshes[item.mesh]->TriangleBound(item.index)};
+    };
+    // Small scenes are built without _ParallelFor()_, so that they can be
+    // built before _ParallelInit()_
+    if (items.size() > ParallelBuildMinPrimitives)
+        ParallelFor(initPrimitiveInfo, items.size(), ParallelBuildChunk);
+    else
+        for (size_t i = 0; i < items.size(); ++i) initPrimitiveInfo(i);
 
-    // Build BVH tree for primitives using _primitiveInfo_
+    // Load the tree from the BVH cache if it has been built before
+    std::string cacheFile;
+    uint64_t cacheKey = 0;
+    if (!cacheDir.empty()) {
+        cacheKey = BVHCacheKey(primitiveInfo, meshes.size(),
+                               this->maxPrimsInNode, int(splitMethod), width);
+        cacheFile = cacheDir + StringPrintf("/bvh-%016" PRIx64 ".cache",
+                                            cacheKey);
+        if (loadCache(cacheFile, cacheKey)) return;
+        ++cacheMisses;
+    }
+    auto buildStart = std::chrono::steady_clock::now();
+
+    // Build BVH tree for primitives using _primitiveInfo_; the parallel
+    // build allocates the nodes of its subtrees from per-thread arenas
     MemoryArena arena(1024 * 1024);
+    std::vector<MemoryArena> threadArenas(MaxThreadIndex());
     int totalNodes = 0;
-    std::vector<std::shared_ptr<Primitive>> orderedPrims;
-    orderedPrims.reserve(primitives.size());
+    std::vector<BVHItem> orderedPrims;
+    orderedPrims.reserve(items.size());
     BVHBuildNode *root;
     if (splitMethod == SplitMethod::HLBVH)
         root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
     else
-        root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-                              &totalNodes, orderedPrims);
-    primitives.swap(orderedPrims);
+        root = parallelBuild(arena, threadArenas.data(), primitiveInfo,
+                             &totalNodes, orderedPrims);
+    items.swap(orderedPrims);
     primitiveInfo.resize(0);
     LOG(INFO) << StringPrintf("BVH created with %d nodes for %d "
                               "primitives (%.2f MB), arena allocated %.2f MB",
-                              totalNodes, (int)primitives.size(),
+                              totalNodes, (int)items.size(),
                               float(totalNodes * sizeof(LinearBVHNode)) /
                               (1024.f * 1024.f),
                               float(arena.TotalAllocated()) /
                               (1024.f * 1024.f));
 
-    // Compute representation of depth-first traversal of BVH tree
-    treeBytes += totalNodes * sizeof(LinearBVHNode) + sizeof(*this) +
-                 primitives.size() * sizeof(primitives[0]);
-    nodes = AllocAligned<LinearBVHNode>(totalNodes);
-    int offset = 0;
-    flattenBVHTree(root, &offset);
-    CHECK_EQ(totalNodes, offset);
+    bounds = root->bounds;
+    int nNodes = 0;
+    if (width == 4 || width == 8) {
+        // Collapse the binary tree into wide nodes
+        if (width == 4) {
+            nodes4 = MakeWideBVH<4>(root, &nNodes);
+            treeBytes += nNodes * sizeof(WideBVHNode<4>);
+        } else {
+            nodes8 = MakeWideBVH<8>(root, &nNodes);
+            treeBytes += nNodes * sizeof(WideBVHNode<8>);
+        }
+        LOG(INFO) << StringPrintf("BVH collapsed to %d %d-wide nodes, %s box "
+                                  "tests", nNodes, width,
+                                  this->simd ? "SIMD" : "scalar");
+    } else {
+        // Compute representation of depth-first traversal of BVH tree
+        treeBytes += totalNodes * sizeof(LinearBVHNode);
+        nodes = AllocAligned<LinearBVHNode>(totalNodes);
+        flattenBVHTree(root, &nNodes);
+        CHECK_EQ(totalNodes, nNodes);
+    }
+
+    if (!cacheFile.empty()) {
+        std::chrono::duration<double> buildTime =
+            std::chrono::steady_clock::now() - buildStart;
+        writeCache(cacheFile, cacheKey, nNodes, buildTime.count());
+    }
+    orderPrimitives();
 }
 
-Bounds3f BVHAccel::WorldBound() const {
-    return nodes ? nodes[0].bounds : Bounds3f();
+// Puts _primitives_ in the order of the leaves, like the triangles of
+// _meshes_ are once the tree is built, and counts the memory of the items
+void BVHAccel::orderPrimitives() {
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    for (BVHItem &item : items)
+        if (item.mesh < 0) {
+            orderedPrims.push_back(std::move(primitives[item.index]));
+            item.index = orderedPrims.size() - 1;
+        }
+    primitives.swap(orderedPrims);
+    treeBytes += sizeof(*this) + items.size() * sizeof(BVHItem) +
+                 primitives.size() * sizeof(primitives[0]) +
+                 meshes.size() * sizeof(meshes[0]);
+
+    int64_t nTriangles = items.size() - primitives.size();
+    compactTriangles += nTriangles;
+    compactTriangleBytes += nTriangles * sizeof(BVHItem) +
+                            meshes.size() * (sizeof(meshes[0]) +
+                                             sizeof(TriangleMeshPrimitive) +
+                                             sizeof(Triangle) +
+                                             2 * SharedPtrCountBytes);
+    shapeTriangles += nTriangles;
+    shapeTriangleBytes += nTriangles * ShapeTriangleBytes;
 }
 
-struct BucketInfo {
-    int count = 0;
-    Bounds3f bounds;
-};
+// Points the nodes into the BVH cache file _file_ and puts _items_ in its
+// order. Returns false when the file is missing or doesn't match the
+// scene, so that the tree gets built
+bool BVHAccel::loadCache(const std::string &file, uint64_t key) {
+    auto loadStart = std::chrono::steady_clock::now();
+    char *data = nullptr;
+    size_t bytes = 0;
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat stat;
+    if (fstat(fd, &stat) == 0 && stat.st_size > 0) {
+        bytes = stat.st_size;
+        void *ptr = mmap(0, bytes, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+        if (ptr != MAP_FAILED) data = (char *)ptr;
+    }
+    close(fd);
+#else
+    std::ifstream in(file, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    bytes = in.tellg();
+    data = AllocAligned<char>(bytes);
+    in.seekg(0);
+    if (!in.read(data, bytes)) {
+        FreeAligned(data);
+        data = nullptr;
+    }
+#endif
+    if (!data) {
+        Warning("BVH cache \"%s\" can't be read.  Building the BVH.",
+                file.c_str());
+        return false;
+    }
+
+    // Check that the file is complete and was written for this scene
+    const BVHCacheHeader &header = *(const BVHCacheHeader *)data;
+    size_t nodeSize = BVHNodeSize(width);
+    bool valid = bytes >= BVHCacheNodesOffset;
+    if (valid)
+        valid = !memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) &&
+                header.version == BVHCacheVersion &&
+                header.nodeSize == nodeSize && header.key == key &&
+                header.width == width &&
+                header.nPrimitives == (int)items.size() &&
+                header.nNodes > 0 &&
+                bytes == BVHCacheNodesOffset + header.nNodes * nodeSize +
+                             items.size() * sizeof(BVHItem);
+    const BVHItem *orderedItems = nullptr;
+    if (valid) {
+        orderedItems = (const BVHItem *)(data + BVHCacheNodesOffset +
+                                         header.nNodes * nodeSize);
+        for (size_t i = 0; i < items.size() && valid; ++i) {
+            const BVHItem &item = orderedItems[i];
+            valid = item.mesh < 0
+                        ? item.mesh == -1 && item.index >= 0 &&
+                              item.index < (int)primitives.size()
+                        : item.mesh < (int)meshes.size() && item.index >= 0 &&
+                              item.index < meshes[item.mesh]->NumTriangles();
+        }
+    }
+    if (!valid) {
+        Warning("BVH cache \"%s\" doesn't match the scene.  Building the "
+                "BVH.", file.c_str());
+        FreeBVHCacheData(data, bytes);
+        return false;
+    }
+
+    items.assign(orderedItems, orderedItems + items.size());
+    bounds = header.bounds;
+    cacheData = data;
+    cacheBytes = bytes;
+    char *nodeData = data + BVHCacheNodesOffset;
+    if (width == 4)
+        nodes4 = (WideBVHNode<4> *)nodeData;
+    else if (width == 8)
+        nodes8 = (WideBVHNode<8> *)nodeData;
+    else
+        nodes = (LinearBVHNode *)nodeData;
+    treeBytes += header.nNodes * nodeSize;
+
+    std::chrono::duration<double> loadTime =
+        std::chrono::steady_clock::now() - loadStart;
+    ++cacheHits;
+    cacheMsSaved += std::max<int64_t>(
+        0, int64_t(1000 * (header.buildSeconds - loadTime.count())));
+    LOG(INFO) << StringPrintf("BVH with %d nodes loaded from %s in %.3f s, "
+                              "built in %.3f s", header.nNodes, file.c_str(),
+                              loadTime.count(), header.buildSeconds);
+    orderPrimitives();
+    return true;
+}
+
+// Saves the tree that was just built to the BVH cache. The file is written
+// under another name and renamed, so that renders started at the same time
+// never load it half written
+void BVHAccel::writeCache(const std::string &file, uint64_t key, int nNodes,
+                          double buildSeconds) const {
+    BVHCacheHeader header;
+    memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+    header.version = BVHCacheVersion;
+    header.nodeSize = BVHNodeSize(width);
+    header.key = key;
+    header.width = width;
+    header.nPrimitives = items.size();
+    header.nNodes = nNodes;
+    header.buildSeconds = buildSeconds;
+    header.bounds = bounds;
+    char headerBlock[BVHCacheNodesOffset] = {};
+    memcpy(headerBlock, &header, sizeof(header));
+    const char *nodeData = width == 4 ? (const char *)nodes4
+                                      : width == 8 ? (const char *)nodes8
+                                                   : (const char *)nodes;
+
+    std::string tempFile =
+        file + StringPrintf(".%" PRIx64 ".tmp",
+                            uint64_t(std::chrono::steady_clock::now()
+                                         .time_since_epoch()
+                                         .count()) ^
+                                uint64_t(uintptr_t(this)));
+    std::ofstream out(tempFile, std::ios::binary);
+    out.write(headerBlock, sizeof(headerBlock));
+    out.write(nodeData, nNodes * header.nodeSize);
+    out.write((const char *)items.data(), items.size() * sizeof(BVHItem));
+    out.close();
+    if (!out || std::rename(tempFile.c_str(), file.c_str()) != 0) {
+        std::remove(tempFile.c_str());
+        Warning("BVH cache \"%s\" can't be written.", file.c_str());
+        return;
+    }
+    LOG(INFO) << StringPrintf("BVH saved to %s", file.c_str());
+}
+
+Bounds3f BVHAccel::WorldBound() const { return bounds; }
 
 BVHBuildNode *BVHAccel::recursiveBuild(
     MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
     int end, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) {
+    std::vector<BVHItem> &orderedPrims) {
     CHECK_NE(start, end);
     BVHBuildNode *node = arena.Alloc<BVHBuildNode>();
     (*totalNodes)++;
@@ -247,10 +1151,10 @@ BVHBuildNode *BVHAccel::recursiveBuild(
     int nPrimitives = end - start;
     if (nPrimitives == 1) {
         // Create leaf _BVHBuildNode_
-        int firstPrimOffset = orderedPrims.size();
+        int firstPrimOffset = start;
         for (int i = start; i < end; ++i) {
             int primNum = primitiveInfo[i].primitiveNumber;
-            orderedPrims.push_back(primitives[primNum]);
+            orderedPrims[i] = items[primNum];
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
         return node;
@@ -265,10 +1169,10 @@ BVHBuildNode *BVHAccel::recursiveBuild(
         int mid = (start + end) / 2;
         if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
             // Create leaf _BVHBuildNode_
-            int firstPrimOffset = orderedPrims.size();
+            int firstPrimOffset = start;
             for (int i = start; i < end; ++i) {
                 int primNum = primitiveInfo[i].primitiveNumber;
-                orderedPrims.push_back(primitives[primNum]);
+                orderedPrims[i] = items[primNum];
             }
             node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
             return node;
@@ -317,50 +1221,20 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                                      });
                 } else {
                     // Allocate _BucketInfo_ for SAH partition buckets
-                    PBRT_CONSTEXPR int nBuckets = 12;
-                    BucketInfo buckets[nBuckets];
+                    BucketInfo buckets[nSAHBuckets];
 
                     // Initialize _BucketInfo_ for SAH partition buckets
                     for (int i = start; i < end; ++i) {
-                        int b = nBuckets *
-                                centroidBounds.Offset(
-                                    primitiveInfo[i].centroid)[dim];
-                        if (b == nBuckets) b = nBuckets - 1;
-                        CHECK_GE(b, 0);
-                        CHECK_LT(b, nBuckets);
+                        int b = SAHBucket(centroidBounds, dim,
+                                          primitiveInfo[i].centroid);
                         buckets[b].count++;
                         buckets[b].bounds =
                             Union(buckets[b].bounds, primitiveInfo[i].bounds);
                     }
 
-                    // Compute costs for splitting after each bucket
-                    Float cost[nBuckets - 1];
-                    for (int i = 0; i < nBuckets - 1; ++i) {
-                        Bounds3f b0, b1;
-                        int count0 = 0, count1 = 0;
-                        for (int j = 0; j <= i; ++j) {
-                            b0 = Union(b0, buckets[j].bounds);
-                            count0 += buckets[j].count;
-                        }
-                        for (int j = i + 1; j < nBuckets; ++j) {
-                            b1 = Union(b1, buckets[j].bounds);
-                            count1 += buckets[j].count;
-                        }
-                        cost[i] = 1 +
-                                  (count0 * b0.SurfaceArea() +
-                                   count1 * b1.SurfaceArea()) /
-                                      bounds.SurfaceArea();
-                    }
-
-                    // Find bucket to split at that minimizes SAH metric
-                    Float minCost = cost[0];
-                    int minCostSplitBucket = 0;
-                    for (int i = 1; i < nBuckets - 1; ++i) {
-                        if (cost[i] < minCost) {
-                            minCost = cost[i];
-                            minCostSplitBucket = i;
-                        }
-                    }
+                    Float minCost;
+                    int minCostSplitBucket =
+                        MinCostSplitBucket(buckets, bounds, &minCost);
 
                     // Either create leaf or split primitives at selected SAH
                     // bucket
@@ -369,20 +1243,17 @@ BVHBuildNode *BVHAccel::recursiveBuild(
                         BVHPrimitiveInfo *pmid = std::partition(
                             &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
                             [=](const BVHPrimitiveInfo &pi) {
-                                int b = nBuckets *
-                                        centroidBounds.Offset(pi.centroid)[dim];
-                                if (b == nBuckets) b = nBuckets - 1;
-                                CHECK_GE(b, 0);
-                                CHECK_LT(b, nBuckets);
-                                return b <= minCostSplitBucket;
+                                return SAHBucket(centroidBounds, dim,
+                                                 pi.centroid) <=
+                                       minCostSplitBucket;
                             });
                         mid = pmid - &primitiveInfo[0];
                     } else {
                         // Create leaf _BVHBuildNode_
-                        int firstPrimOffset = orderedPrims.size();
+                        int firstPrimOffset = start;
                         for (int i = start; i < end; ++i) {
                             int primNum = primitiveInfo[i].primitiveNumber;
-                            orderedPrims.push_back(primitives[primNum]);
+                            orderedPrims[i] = items[primNum];
                         }
                         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
                         return node;
@@ -401,10 +1272,156 @@ BVHBuildNode *BVHAccel::recursiveBuild(
     return node;
 }
 
+BVHBuildNode *BVHAccel::parallelBuild(
+    MemoryArena &arena, MemoryArena *threadArenas,
+    std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
+    std::vector<BVHItem> &orderedPrims) {
+    // Split the upper levels of the tree
+    BVHBuildNode *root;
+    std::vector<BVHBuildNode *> upperNodes;
+    std::vector<BVHBuildTask> tasks;
+    buildTop(arena, primitiveInfo, 0, items.size(), &root, totalNodes,
+             upperNodes, tasks);
+
+    // Build the subtrees below them in parallel, largest first
+    std::sort(tasks.begin(), tasks.end(),
+              [](const BVHBuildTask &a, const BVHBuildTask &b) {
+                  return a.end - a.start > b.end - b.start;
+              });
+    orderedPrims.resize(items.size());
+    if (tasks.size() == 1) {
+        *tasks[0].node = recursiveBuild(arena, primitiveInfo, tasks[0].start,
+                                        tasks[0].end, totalNodes, orderedPrims);
+        return root;
+    }
+    std::atomic<int> atomicTotal(*totalNodes);
+    ParallelFor([&](int64_t i) {
+        const BVHBuildTask &task = tasks[i];
+        int nodesCreated = 0;
+        *task.node = recursiveBuild(threadArenas[ThreadIndex], primitiveInfo,
+                                    task.start, task.end, &nodesCreated,
+                                    orderedPrims);
+        atomicTotal += nodesCreated;
+    }, tasks.size());
+    *totalNodes = atomicTotal;
+
+    // Bound the upper nodes, children before their parents
+    for (auto node = upperNodes.rbegin(); node != upperNodes.rend(); ++node)
+        (*node)->InitInterior((*node)->splitAxis, (*node)->children[0],
+                              (*node)->children[1]);
+    return root;
+}
+
+void BVHAccel::buildTop(MemoryArena &arena,
+                        std::vector<BVHPrimitiveInfo> &primitiveInfo,
+                        int start, int end, BVHBuildNode **node,
+                        int *totalNodes,
+                        std::vector<BVHBuildNode *> &upperNodes,
+                        std::vector<BVHBuildTask> &tasks) {
+    int nPrimitives = end - start;
+    if (nPrimitives <= ParallelBuildMinPrimitives) {
+        tasks.push_back({start, end, node});
+        return;
+    }
+
+    // Compute bounds of the primitives and of their centroids
+    int nChunks = (nPrimitives + ParallelBuildChunk - 1) / ParallelBuildChunk;
+    std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+    ParallelFor([&](int64_t c) {
+        int s = start + c * ParallelBuildChunk;
+        int e = std::min(s + ParallelBuildChunk, end);
+        for (int i = s; i < e; ++i) {
+            chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+            chunkCentroidBounds[c] =
+                Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+        }
+    }, nChunks);
+    Bounds3f bounds, centroidBounds;
+    for (int c = 0; c < nChunks; ++c) {
+        bounds = Union(bounds, chunkBounds[c]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+    }
+    int dim = centroidBounds.MaximumExtent();
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        // _recursiveBuild()_ makes the leaf
+        tasks.push_back({start, end, node});
+        return;
+    }
+
+    // Partition primitives based on _splitMethod_, like _recursiveBuild()_
+    int mid;
+    switch (splitMethod) {
+    case SplitMethod::Middle: {
+        Float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
+        mid = ParallelPartition(primitiveInfo, start, end,
+                                [dim, pmid](const BVHPrimitiveInfo &pi) {
+                                    return pi.centroid[dim] < pmid;
+                                });
+        if (mid != start && mid != end) break;
+    }
+    case SplitMethod::EqualCounts: {
+        mid = (start + end) / 2;
+        std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+                         &primitiveInfo[end - 1] + 1,
+                         [dim](const BVHPrimitiveInfo &a,
+                               const BVHPrimitiveInfo &b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+        break;
+    }
+    case SplitMethod::SAH:
+    default: {
+        // Initialize _BucketInfo_ for SAH partition buckets in parallel
+        std::vector<BucketInfo> chunkBuckets(nChunks * nSAHBuckets);
+        ParallelFor([&](int64_t c) {
+            BucketInfo *buckets = &chunkBuckets[c * nSAHBuckets];
+            int s = start + c * ParallelBuildChunk;
+            int e = std::min(s + ParallelBuildChunk, end);
+            for (int i = s; i < e; ++i) {
+                int b = SAHBucket(centroidBounds, dim,
+                                  primitiveInfo[i].centroid);
+                buckets[b].count++;
+                buckets[b].bounds =
+                    Union(buckets[b].bounds, primitiveInfo[i].bounds);
+            }
+        }, nChunks);
+        BucketInfo buckets[nSAHBuckets];
+        for (int c = 0; c < nChunks; ++c)
+            for (int b = 0; b < nSAHBuckets; ++b) {
+                buckets[b].count += chunkBuckets[c * nSAHBuckets + b].count;
+                buckets[b].bounds =
+                    Union(buckets[b].bounds,
+                          chunkBuckets[c * nSAHBuckets + b].bounds);
+            }
+
+        // Ranges this large are always split, they have more than
+        // _maxPrimsInNode_ primitives
+        Float minCost;
+        int minCostSplitBucket = MinCostSplitBucket(buckets, bounds, &minCost);
+        mid = ParallelPartition(
+            primitiveInfo, start, end, [=](const BVHPrimitiveInfo &pi) {
+                return SAHBucket(centroidBounds, dim, pi.centroid) <=
+                       minCostSplitBucket;
+            });
+        break;
+    }
+    }
+
+    // The children are filled in by the recursive calls and the tasks
+    BVHBuildNode *interior = arena.Alloc<BVHBuildNode>();
+    (*totalNodes)++;
+    interior->splitAxis = dim;
+    upperNodes.push_back(interior);
+    *node = interior;
+    buildTop(arena, primitiveInfo, start, mid, &interior->children[0],
+             totalNodes, upperNodes, tasks);
+    buildTop(arena, primitiveInfo, mid, end, &interior->children[1],
+             totalNodes, upperNodes, tasks);
+}
+
 BVHBuildNode *BVHAccel::HLBVHBuild(
     MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims) const {
+    int *totalNodes, std::vector<BVHItem> &orderedPrims) const {
     // Compute bounding box of all primitive centroids
     Bounds3f bounds;
     for (const BVHPrimitiveInfo &pi : primitiveInfo)
@@ -448,7 +1465,7 @@ BVHBuildNode *BVHAccel::HLBVHBuild(
 
     // Create LBVHs for treelets in parallel
     std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
-    orderedPrims.resize(primitives.size());
+    orderedPrims.resize(items.size());
     ParallelFor([&](int i) {
         // Generate _i_th LBVH treelet
         int nodesCreated = 0;
@@ -475,8 +1492,8 @@ BVHBuildNode *BVHAccel::emitLBVH(
     BVHBuildNode *&buildNodes,
     const std::vector<BVHPrimitiveInfo> &primitiveInfo,
     MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-    std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-    std::atomic<int> *orderedPrimsOffset, int bitIndex) const {
+    std::vector<BVHItem> &orderedPrims, std::atomic<int> *orderedPrimsOffset,
+    int bitIndex) const {
     CHECK_GT(nPrimitives, 0);
     if (bitIndex == -1 || nPrimitives < maxPrimsInNode) {
         // Create and return leaf node of LBVH treelet
@@ -486,7 +1503,7 @@ BVHBuildNode *BVHAccel::emitLBVH(
         int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
         for (int i = 0; i < nPrimitives; ++i) {
             int primitiveIndex = mortonPrims[i].primitiveIndex;
-            orderedPrims[firstPrimOffset + i] = primitives[primitiveIndex];
+            orderedPrims[firstPrimOffset + i] = items[primitiveIndex];
             bounds = Union(bounds, primitiveInfo[primitiveIndex].bounds);
         }
         node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
@@ -657,12 +1674,29 @@ int BVHAccel::flattenBVHTree(BVHBuildNode *node, int *offset) {
     return myOffset;
 }
 
-BVHAccel::~BVHAccel() { FreeAligned(nodes); }
+BVHAccel::~BVHAccel() {
+    if (cacheData) {
+        FreeBVHCacheData(cacheData, cacheBytes);
+        return;
+    }
+    FreeAligned(nodes);
+    FreeAligned(nodes4);
+    FreeAligned(nodes8);
+}
 
 bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    BVHLeaves leaves = {items.data(), primitives.data(), meshes.data()};
+    if (nodes4 || nodes8) {
+        ProfilePhase p(Prof::AccelIntersect);
+        return nodes4 ? TraverseWideBVH4<false>(nodes4, simd, leaves, ray,
+                                                isect)
+                      : TraverseWideBVH8<false>(nodes8, simd, leaves, ray,
+                                                isect);
+    }
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersect);
     bool hit = false;
+    BVHDeferredHit deferred;
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
     // Follow ray through BVH nodes to find primitive intersections
@@ -675,8 +1709,8 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             if (node->nPrimitives > 0) {
                 // Intersect ray with primitives in leaf BVH node
                 for (int i = 0; i < node->nPrimitives; ++i)
-                    if (primitives[node->primitivesOffset + i]->Intersect(
-                            ray, isect))
+                    if (leaves.Intersect(node->primitivesOffset + i, ray,
+                                         isect, &deferred))
                         hit = true;
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
@@ -696,10 +1730,19 @@ bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
     }
+    leaves.Finish(deferred, ray, isect);
     return hit;
 }
 
 bool BVHAccel::IntersectP(const Ray &ray) const {
+    BVHLeaves leaves = {items.data(), primitives.data(), meshes.data()};
+    if (nodes4 || nodes8) {
+        ProfilePhase p(Prof::AccelIntersectP);
+        return nodes4 ? TraverseWideBVH4<true>(nodes4, simd, leaves, ray,
+                                               nullptr)
+                      : TraverseWideBVH8<true>(nodes8, simd, leaves, ray,
+                                               nullptr);
+    }
     if (!nodes) return false;
     ProfilePhase p(Prof::AccelIntersectP);
     Vector3f invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
@@ -712,8 +1755,7 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
             // Process BVH node _node_ for traversal
             if (node->nPrimitives > 0) {
                 for (int i = 0; i < node->nPrimitives; ++i) {
-                    if (primitives[node->primitivesOffset + i]->IntersectP(
-                            ray)) {
+                    if (leaves.IntersectP(node->primitivesOffset + i, ray)) {
                         return true;
                     }
                 }
@@ -737,6 +1779,30 @@ bool BVHAccel::IntersectP(const Ray &ray) const {
     return false;
 }
 
+void BVHAccel::IntersectN(int n, const Ray *rays, SurfaceInteraction *isects,
+                          bool *hits) const {
+    // Wide trees already test several boxes at a time for a single ray
+    if (!nodes) {
+        Aggregate::IntersectN(n, rays, isects, hits);
+        return;
+    }
+    ProfilePhase p(Prof::AccelIntersect);
+    BVHLeaves leaves = {items.data(), primitives.data(), meshes.data()};
+    for (int i = 0; i < n; ++i) hits[i] = false;
+    for (int i = 0; i < n; i += RayPacketSize) {
+        int count = std::min(RayPacketSize, n - i);
+#ifdef PBRT_BVH_X86
+        if (packetSimd) {
+            TraverseBVHPacketAvx2(nodes, leaves, count, &rays[i],
+                                  &isects[i], &hits[i]);
+            continue;
+        }
+#endif
+        TraverseBVHPacket<BVHPacketBoxesScalar>(nodes, leaves, count, &rays[i],
+                                                &isects[i], &hits[i]);
+    }
+}
+
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     std::vector<std::shared_ptr<Primitive>> prims, const ParamSet &ps) {
     std::string splitMethodName = ps.FindOneString("splitmethod", "sah");
@@ -756,7 +1822,25 @@ std::shared_ptr<BVHAccel> CreateBVHAccelerator(
     }
 
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
-    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, splitMethod);
+    int width = ps.FindOneInt("width", 2);
+    if (width != 2 && width != 4 && width != 8) {
+        Warning("BVH width %d unsupported.  Using 2.", width);
+        width = 2;
+    }
+#ifdef PBRT_FLOAT_AS_DOUBLE
+    // Wide nodes store single precision bounds
+    if (width != 2) {
+        Warning("BVH width %d needs single precision Float.  Using 2.", width);
+        width = 2;
+    }
+#endif
+    bool simd = ps.FindOneBool("simd", true);
+    std::string cacheDir = ps.FindOneString("cachedir", PbrtOptions.bvhCache);
+    // Used by pbrtShape(), which hands triangle meshes to BVHs as
+    // _TriangleMeshPrimitive_s unless it is false
+    ps.FindOneBool("compacttriangles", true);
+    return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode,
+                                      splitMethod, width, simd, cacheDir);
 }
 
 }  // namespace pbrt
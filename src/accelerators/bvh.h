@@ -48,8 +48,18 @@ struct BVHBuildNode;
 
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct BVHBuildTask;
 struct MortonPrimitive;
 struct LinearBVHNode;
+template <int N>
+struct WideBVHNode;
+class TriangleMeshPrimitive;
+
+// A primitive in the leaves of a _BVHAccel_: triangle _index_ of mesh
+// _mesh_, or the scene primitive _index_ when _mesh_ is -1
+struct BVHItem {
+    int32_t mesh, index;
+};
 
 // BVHAccel Declarations
 class BVHAccel : public Aggregate {
@@ -60,38 +70,74 @@ class BVHAccel : public Aggregate {
     // BVHAccel Public Methods
     BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
              int maxPrimsInNode = 1,
-             SplitMethod splitMethod = SplitMethod::SAH);
+             SplitMethod splitMethod = SplitMethod::SAH, int width = 2,
+             bool simd = true, const std::string &cacheDir = "");
     Bounds3f WorldBound() const;
     ~BVHAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
+    void IntersectN(int n, const Ray *rays, SurfaceInteraction *isects,
+                    bool *hits) const;
 
   private:
     // BVHAccel Private Methods
     BVHBuildNode *recursiveBuild(
         MemoryArena &arena, std::vector<BVHPrimitiveInfo> &primitiveInfo,
         int start, int end, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims);
+        std::vector<BVHItem> &orderedPrims);
+    BVHBuildNode *parallelBuild(
+        MemoryArena &arena, MemoryArena *threadArenas,
+        std::vector<BVHPrimitiveInfo> &primitiveInfo, int *totalNodes,
+        std::vector<BVHItem> &orderedPrims);
+    void buildTop(MemoryArena &arena,
+                  std::vector<BVHPrimitiveInfo> &primitiveInfo, int start,
+                  int end, BVHBuildNode **node, int *totalNodes,
+                  std::vector<BVHBuildNode *> &upperNodes,
+                  std::vector<BVHBuildTask> &tasks);
     BVHBuildNode *HLBVHBuild(
         MemoryArena &arena, const std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims) const;
+        int *totalNodes, std::vector<BVHItem> &orderedPrims) const;
     BVHBuildNode *emitLBVH(
         BVHBuildNode *&buildNodes,
         const std::vector<BVHPrimitiveInfo> &primitiveInfo,
         MortonPrimitive *mortonPrims, int nPrimitives, int *totalNodes,
-        std::vector<std::shared_ptr<Primitive>> &orderedPrims,
-        std::atomic<int> *orderedPrimsOffset, int bitIndex) const;
+        std::vector<BVHItem> &orderedPrims,
+        std::atomic<int> *orderedPrimsOffset,
+        int bitIndex) const;
     BVHBuildNode *buildUpperSAH(MemoryArena &arena,
                                 std::vector<BVHBuildNode *> &treeletRoots,
                                 int start, int end, int *totalNodes) const;
     int flattenBVHTree(BVHBuildNode *node, int *offset);
+    bool loadCache(const std::string &file, uint64_t key);
+    void writeCache(const std::string &file, uint64_t key, int nNodes,
+                    double buildSeconds) const;
+    void orderPrimitives();
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    // Children per node: 2 keeps the binary tree, 4 and 8 collapse it into
+    // _WideBVHNode_s whose child boxes are tested together with SSE or AVX2
+    const int width;
+    // Wide nodes are tested with the SIMD kernels rather than one box at a
+    // time; false when the CPU lacks them
+    bool simd;
+    // Ray packets through the binary tree test each box against all of
+    // their rays with AVX2
+    bool packetSimd;
+    // The leaves point into _items_, which point into _primitives_ or into
+    // the triangles of _meshes_
+    std::vector<BVHItem> items;
     std::vector<std::shared_ptr<Primitive>> primitives;
+    std::vector<std::shared_ptr<TriangleMeshPrimitive>> meshes;
+    Bounds3f bounds;
     LinearBVHNode *nodes = nullptr;
+    WideBVHNode<4> *nodes4 = nullptr;
+    WideBVHNode<8> *nodes8 = nullptr;
+    // Mapping of the BVH cache file the nodes point into, when they were
+    // loaded rather than built
+    char *cacheData = nullptr;
+    size_t cacheBytes = 0;
 };
 
 std::shared_ptr<BVHAccel> CreateBVHAccelerator(
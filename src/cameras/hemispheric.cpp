@@ -47,10 +47,13 @@ Spectrum HemisphericCamera::getLightSampleNn(Vector3f wi)
 
     Float theta = std::acos(wiCamera.y);
     Float phi = std::atan2(wiCamera.z, wiCamera.x);
-    int y = PbrtOptions.iisptHemiSize * theta / Pi;
-    int x = PbrtOptions.iisptHemiSize * phi / Pi;
-    if (x >= 0 && x < PbrtOptions.iisptHemiSize &&
-            y >= 0 && y < PbrtOptions.iisptHemiSize)
+    // Hemispheres can have different sizes, see iispthemilod.h
+    int width = nn_film->get_image_film()->get_width();
+    int height = nn_film->get_image_film()->get_height();
+    int y = height * theta / Pi;
+    int x = width * phi / Pi;
+    if (x >= 0 && x < width &&
+            y >= 0 && y < height)
     {
         PfmItem rgbpix = nn_film->get_camera_coord_jacobian(x, y);
         return rgbpix.as_spectrum();
@@ -83,6 +86,87 @@ void HemisphericCamera::set_nn_film(
         )
 {
     this->nn_film = nn_film;
+
+    // Pixel (x, y) covers sin(theta) * (pi / width) * (pi / height) of
+    // solid angle
+    int width = nn_film->get_image_film()->get_width();
+    int height = nn_film->get_image_film()->get_height();
+    std::vector<Float> func (width * height);
+    for (int y = 0; y < height; y++) {
+        Float sin_theta = std::sin(Pi * (y + 0.5) / height);
+        for (int x = 0; x < width; x++) {
+            Float lum = nn_film->get_camera_coord(x, y).as_spectrum().y();
+            func[y * width + x] = std::max((Float) 0.0, lum) * sin_theta;
+        }
+    }
+    nn_distribution.reset(new Distribution2D(&func[0], width, height));
+}
+
+// ============================================================================
+Spectrum HemisphericCamera::sample_nn(
+        const Point2f &u,
+        Vector3f* wi,
+        Float* pdf
+        ) const
+{
+    *pdf = 0.0;
+    if (!nn_distribution) {
+        return Spectrum(0.0);
+    }
+
+    Float map_pdf;
+    Point2f uv = nn_distribution->SampleContinuous(u, &map_pdf);
+    if (map_pdf == 0.0) {
+        return Spectrum(0.0);
+    }
+
+    Float theta = Pi * uv[1];
+    Float phi = Pi * uv[0];
+    Float sin_theta = std::sin(theta);
+    if (sin_theta == 0.0) {
+        return Spectrum(0.0);
+    }
+
+    Vector3f dir(sin_theta * std::cos(phi), std::cos(theta),
+                 sin_theta * std::sin(phi));
+    *wi = Normalize(CameraToWorld(shutterOpen, dir));
+    *pdf = map_pdf / (Pi * Pi * sin_theta);
+
+    int width = nn_film->get_image_film()->get_width();
+    int height = nn_film->get_image_film()->get_height();
+    int x = std::min((int) (uv[0] * width), width - 1);
+    int y = std::min((int) (uv[1] * height), height - 1);
+    return nn_film->get_camera_coord(x, y).as_spectrum();
+}
+
+// ============================================================================
+Spectrum HemisphericCamera::eval_nn(
+        const Vector3f &wi,
+        Float* pdf
+        ) const
+{
+    *pdf = 0.0;
+    if (!nn_distribution) {
+        return Spectrum(0.0);
+    }
+
+    Vector3f wiCamera = Normalize(WorldToCamera->operator ()(wi));
+    Float theta = std::acos(Clamp(wiCamera.y, -1.0, 1.0));
+    Float phi = std::atan2(wiCamera.z, wiCamera.x);
+    Float sin_theta = std::sin(theta);
+    if (phi < 0.0 || sin_theta == 0.0) {
+        // Behind the hemisphere
+        return Spectrum(0.0);
+    }
+
+    Point2f uv (phi / Pi, theta / Pi);
+    *pdf = nn_distribution->Pdf(uv) / (Pi * Pi * sin_theta);
+
+    int width = nn_film->get_image_film()->get_width();
+    int height = nn_film->get_image_film()->get_height();
+    int x = std::min((int) (uv[0] * width), width - 1);
+    int y = std::min((int) (uv[1] * height), height - 1);
+    return nn_film->get_camera_coord(x, y).as_spectrum();
 }
 
 // ============================================================================
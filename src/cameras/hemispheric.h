@@ -9,6 +9,7 @@
 // cameras/hemispheric.h*
 #include "camera.h"
 #include "film.h"
+#include "sampling.h"
 #include "film/intensityfilm.h"
 
 namespace pbrt {
@@ -22,6 +23,10 @@ private:
     // Fields -----------------------------------------------------------------
     std::shared_ptr<IntensityFilm> nn_film = nullptr;
 
+    // Luminance times solid angle of the NN film pixels, in camera
+    // coordinates, built by set_nn_film
+    std::unique_ptr<Distribution2D> nn_distribution;
+
     // Location and direction of this camera
     Vector3f look_direction;
     Point3f originPosition;
@@ -73,6 +78,24 @@ public:
             Vector3f* wi
             );
 
+    // Sample a direction of the NN film proportionally to its luminance
+    // <u> uniform random numbers
+    // <wi> world space direction
+    // <pdf> solid angle density of <wi>, 0 if nothing could be sampled
+    // Returns the NN radiance along <wi>, without the jacobian factor
+    Spectrum sample_nn(
+            const Point2f &u,
+            Vector3f* wi,
+            Float* pdf
+            ) const;
+
+    // NN radiance along world space <wi> and the solid angle density
+    // sample_nn would have chosen it with
+    Spectrum eval_nn(
+            const Vector3f &wi,
+            Float* pdf
+            ) const;
+
     Vector3f get_look_direction() {
         return this->look_direction;
     }
@@ -57,6 +57,7 @@
 #include "integrators/mlt.h"
 #include "integrators/ao.h"
 #include "integrators/iispt.h"
+#include "integrators/iispthemilod.h"
 #include "integrators/path.h"
 #include "integrators/sppm.h"
 #include "integrators/volpath.h"
@@ -292,8 +293,8 @@ class TransformCache {
 
     void Clear() {
         transformCacheBytes += arena.TotalAllocated() + hashTable.size() * sizeof(Transform *);
-        hashTable.resize(512);
         hashTable.clear();
+        hashTable.resize(512);
         hashTableOccupancy = 0;
         arena.Reset();
     }
@@ -370,6 +371,7 @@ static TransformSet curTransform;
 static uint32_t activeTransformBits = AllTransformsBits;
 static std::map<std::string, TransformSet> namedCoordinateSystems;
 static std::unique_ptr<RenderOptions> renderOptions;
+static WorldEndCallback worldEndCallback;
 static GraphicsState graphicsState;
 static std::vector<GraphicsState> pushedGraphicsStates;
 static std::vector<TransformSet> pushedTransforms;
@@ -788,6 +790,18 @@ std::shared_ptr<Primitive> MakeAccelerator(
     return accel;
 }
 
+// The triangles of a mesh as one _TriangleMeshPrimitive_ when they are going
+// into a BVH, which takes it apart. nullptr for other shapes and
+// accelerators
+static std::shared_ptr<Primitive> MakeCompactTriangles(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &mtl, const MediumInterface &mi) {
+    if (renderOptions->AcceleratorName != "bvh" ||
+        !renderOptions->AcceleratorParams.FindOneBool("compacttriangles", true))
+        return nullptr;
+    return CreateTriangleMeshPrimitive(shapes, mtl, mi);
+}
+
 Camera *MakeCamera(const std::string &name, const ParamSet &paramSet,
                    const TransformSet &cam2worldSet, Float transformStart,
                    Float transformEnd, Film *film) {
@@ -1391,6 +1405,14 @@ void pbrtShape(const std::string &name, const ParamSet &params) {
         std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
         params.ReportUnused();
         MediumInterface mi = graphicsState.CreateMediumInterface();
+        // Meshes without area lights don't need a primitive per triangle
+        std::shared_ptr<Primitive> mesh;
+        if (graphicsState.areaLight == "")
+            mesh = MakeCompactTriangles(shapes, mtl, mi);
+        if (mesh) {
+            prims.push_back(mesh);
+            shapes.clear();
+        }
         prims.reserve(shapes.size());
         for (auto s : shapes) {
             // Possibly create area light for shape
@@ -1605,7 +1627,8 @@ void pbrtObjectInstance(const std::string &name) {
         renderOptions->instances[name];
     if (in.empty()) return;
     ++nObjectInstancesUsed;
-    if (in.size() > 1) {
+    if (in.size() > 1 ||
+        std::dynamic_pointer_cast<TriangleMeshPrimitive>(in[0])) {
         // Create aggregate for instance _Primitive_s
         std::shared_ptr<Primitive> accel(
             MakeAccelerator(renderOptions->AcceleratorName, std::move(in),
@@ -1646,6 +1669,10 @@ void pbrtWorldEnd() {
     // Create scene and render
     if (PbrtOptions.cat || PbrtOptions.toPly) {
         printf("%*sWorldEnd\n", catIndentCount, "");
+    } else if (worldEndCallback) {
+        std::shared_ptr<const Camera> camera(renderOptions->MakeCamera());
+        std::unique_ptr<Scene> scene(renderOptions->MakeScene());
+        if (scene && camera) worldEndCallback(*scene, camera);
     } else {
         std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
         std::unique_ptr<Scene> scene(renderOptions->MakeScene());
@@ -1691,6 +1718,10 @@ void pbrtWorldEnd() {
                                  namedCoordinateSystems.end());
 }
 
+void pbrtSetWorldEndCallback(WorldEndCallback callback) {
+    worldEndCallback = callback;
+}
+
 Scene *RenderOptions::MakeScene() {
     std::shared_ptr<Primitive> accelerator =
         MakeAccelerator(AcceleratorName, std::move(primitives), AcceleratorParams);
@@ -1736,8 +1767,9 @@ Integrator *RenderOptions::MakeIntegrator() const {
         integrator = CreateSPPMIntegrator(IntegratorParams, camera);
     } else if (IntegratorName == "iispt") {
         std::cerr << "api.cpp: Call CreateIISPTIntegrator\n";
-        // Create aux camera
-        std::shared_ptr<Camera> dcamera (MakeCamera(PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize));
+        // Create aux camera, large enough for every hemisphere size
+        int hemi_size = iispt_hemi_max_size();
+        std::shared_ptr<Camera> dcamera (MakeCamera(hemi_size, hemi_size));
         // Create integrator
         integrator = CreateIISPTIntegrator(IntegratorParams, camera,
             dcamera);
@@ -39,6 +39,8 @@
 #define PBRT_CORE_API_H
 
 // core/api.h*
+#include <functional>
+
 #include "pbrt.h"
 #include "tools/nnconnectormanager.h"
 #include "tools/generalutils.h"
@@ -90,6 +92,12 @@ void pbrtObjectEnd();
 void pbrtObjectInstance(const std::string &name);
 void pbrtWorldEnd();
 
+// When set, WorldEnd hands the scene and camera to <callback> instead of
+// rendering them with the scene's integrator. Used by the benchmark tools
+typedef std::function<void(const Scene &, std::shared_ptr<const Camera>)>
+    WorldEndCallback;
+void pbrtSetWorldEndCallback(WorldEndCallback callback);
+
 }  // namespace pbrt
 
 #endif  // PBRT_CORE_API_H
@@ -224,6 +224,101 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
         new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
+void TraceCameraPackets(const Scene &scene, const Camera &camera,
+                        Sampler &sampler, const std::vector<Point2i> &pixels,
+                        const CameraSampleShader &shade) {
+    // Packets hold the samples of _pixelsPerPacket_ pixels, or
+    // _RayPacketSize_ samples of one pixel
+    int64_t spp = sampler.samplesPerPixel;
+    int pixelsPerPacket =
+        std::max(1, RayPacketSize / (int)std::min<int64_t>(spp, RayPacketSize));
+    Float differentialScale = 1 / std::sqrt((Float)spp);
+    CameraSample cameraSamples[RayPacketSize];
+    RayDifferential cameraRays[RayPacketSize];
+    Float rayWeights[RayPacketSize];
+    Ray rays[RayPacketSize];
+    SurfaceInteraction isects[RayPacketSize];
+    bool hits[RayPacketSize];
+    int rayIndex[RayPacketSize];
+    for (size_t first = 0; first < pixels.size(); first += pixelsPerPacket) {
+        size_t last = std::min(first + pixelsPerPacket, pixels.size());
+        for (int64_t s0 = 0; s0 < spp; s0 += RayPacketSize) {
+            int64_t s1 = std::min(s0 + RayPacketSize, spp);
+            // Generate the camera rays of the packet
+            int n = 0, nRays = 0;
+            for (size_t p = first; p < last; ++p) {
+                if (s0 == 0) {
+                    ProfilePhase pp(Prof::StartPixel);
+                    sampler.StartPixel(pixels[p]);
+                }
+                for (int64_t s = s0; s < s1; ++s, ++n) {
+                    sampler.SetSampleNumber(s);
+                    cameraSamples[n] = sampler.GetCameraSample(pixels[p]);
+                    rayWeights[n] = camera.GenerateRayDifferential(
+                        cameraSamples[n], &cameraRays[n]);
+                    cameraRays[n].ScaleDifferentials(differentialScale);
+                    rayIndex[n] = -1;
+                    if (rayWeights[n] > 0) {
+                        rays[nRays] = cameraRays[n];
+                        rayIndex[n] = nRays++;
+                    }
+                }
+            }
+
+            // Find the first hits of the packet together
+            scene.IntersectN(nRays, rays, isects, hits);
+
+            // Shade the samples in order. Samplers restart the pixel when
+            // the packet spans several of them
+            n = 0;
+            for (size_t p = first; p < last; ++p) {
+                if (last - first > 1) {
+                    ProfilePhase pp(Prof::StartPixel);
+                    sampler.StartPixel(pixels[p]);
+                }
+                for (int64_t s = s0; s < s1; ++s, ++n) {
+                    sampler.SetSampleNumber(s);
+                    // The camera dimensions were used above
+                    sampler.GetCameraSample(pixels[p]);
+                    SurfaceInteraction *isect = nullptr;
+                    int r = rayIndex[n];
+                    if (r >= 0) {
+                        cameraRays[n].tMax = rays[r].tMax;
+                        if (hits[r]) isect = &isects[r];
+                    }
+                    shade(p, cameraSamples[n], cameraRays[n], rayWeights[n],
+                          isect);
+                }
+            }
+        }
+    }
+}
+
+// Black, with an error message, if _L_ is not a valid radiance value
+static Spectrum CheckRadiance(const Spectrum &L, const Point2i &pixel,
+                              const Sampler &sampler) {
+    if (L.HasNaNs()) {
+        LOG(ERROR) << StringPrintf(
+            "Not-a-number radiance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        return Spectrum(0.f);
+    } else if (L.y() < -1e-5) {
+        LOG(ERROR) << StringPrintf(
+            "Negative luminance value, %f, returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            L.y(), pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        return Spectrum(0.f);
+    } else if (std::isinf(L.y())) {
+        LOG(ERROR) << StringPrintf(
+            "Infinite luminance value returned "
+            "for pixel (%d, %d), sample %d. Setting to black.",
+            pixel.x, pixel.y, (int)sampler.CurrentSampleNumber());
+        return Spectrum(0.f);
+    }
+    return L;
+}
+
 void SamplerIntegrator::Render(const Scene &scene, bool writeFile)
 {
     Preprocess(scene, *sampler);
@@ -259,69 +354,87 @@ void SamplerIntegrator::Render(const Scene &scene, bool writeFile)
                 camera->film->GetFilmTile(tileBounds);
 
             // Loop over pixels in tile to render them
-            for (Point2i pixel : tileBounds) {
-                {
+            if (UsesFirstHits()) {
+                // Runs of pixels inside _pixelBounds_ are traced together
+                std::vector<Point2i> pixels;
+                auto traceRun = [&]() {
+                    TraceCameraPackets(
+                        scene, *camera, *tileSampler, pixels,
+                        [&](int pixelIndex, const CameraSample &cameraSample,
+                            RayDifferential &ray, Float rayWeight,
+                            SurfaceInteraction *isect) {
+                            ++nCameraRays;
+                            Spectrum L(0.f);
+                            if (rayWeight > 0)
+                                L = LiFirstHit(ray, isect, scene,
+                                               *tileSampler, arena);
+                            L = CheckRadiance(L, pixels[pixelIndex],
+                                              *tileSampler);
+                            VLOG(1) << "Camera sample: " << cameraSample
+                                    << " -> ray: " << ray << " -> L = " << L;
+                            filmTile->AddSample(cameraSample.pFilm, L,
+                                                rayWeight);
+                            arena.Reset();
+                        });
+                    pixels.clear();
+                };
+                for (Point2i pixel : tileBounds) {
+                    if (InsideExclusive(pixel, pixelBounds)) {
+                        pixels.push_back(pixel);
+                        continue;
+                    }
+                    // Start the skipped pixels too, in order, like the
+                    // scalar loop below, so that Samplers that use RNGs
+                    // give the same values to the rendered ones
+                    traceRun();
                     ProfilePhase pp(Prof::StartPixel);
                     tileSampler->StartPixel(pixel);
                 }
-
-                // Do this check after the StartPixel() call; this keeps
-                // the usage of RNG values from (most) Samplers that use
-                // RNGs consistent, which improves reproducability /
-                // debugging.
-                if (!InsideExclusive(pixel, pixelBounds))
-                    continue;
-
-                do {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
-
-                    // Issue warning if unexpected radiance value returned
-                    if (L.HasNaNs()) {
-                        LOG(ERROR) << StringPrintf(
-                            "Not-a-number radiance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (L.y() < -1e-5) {
-                        LOG(ERROR) << StringPrintf(
-                            "Negative luminance value, %f, returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            L.y(), pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (std::isinf(L.y())) {
-                          LOG(ERROR) << StringPrintf(
-                            "Infinite luminance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
+                traceRun();
+            } else {
+                for (Point2i pixel : tileBounds) {
+                    {
+                        ProfilePhase pp(Prof::StartPixel);
+                        tileSampler->StartPixel(pixel);
                     }
-                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                        ray << " -> L = " << L;
-
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
 
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
+                    // Do this check after the StartPixel() call; this keeps
+                    // the usage of RNG values from (most) Samplers that use
+                    // RNGs consistent, which improves reproducability /
+                    // debugging.
+                    if (!InsideExclusive(pixel, pixelBounds))
+                        continue;
+
+                    do {
+                        // Initialize _CameraSample_ for current sample
+                        CameraSample cameraSample =
+                            tileSampler->GetCameraSample(pixel);
+
+                        // Generate camera ray for current sample
+                        RayDifferential ray;
+                        Float rayWeight =
+                            camera->GenerateRayDifferential(cameraSample, &ray);
+                        ray.ScaleDifferentials(
+                            1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                        ++nCameraRays;
+
+                        // Evaluate radiance along camera ray
+                        Spectrum L(0.f);
+                        if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
+
+                        // Issue warning if unexpected radiance value returned
+                        L = CheckRadiance(L, pixel, *tileSampler);
+                        VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
+                            ray << " -> L = " << L;
+
+                        // Add camera ray's contribution to image
+                        filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+                        // Free _MemoryArena_ memory from computing image sample
+                        // value
+                        arena.Reset();
+                    } while (tileSampler->StartNextSample());
+                }
             }
 
             // Merge image tile into _Film_
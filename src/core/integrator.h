@@ -46,6 +46,7 @@
 #include "reflection.h"
 #include "sampler.h"
 #include "material.h"
+#include <functional>
 
 namespace pbrt {
 
@@ -73,6 +74,23 @@ Spectrum EstimateDirect(const Interaction &it, const Point2f &uShading,
 std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
     const Scene &scene);
 
+// Called for each camera sample traced by _TraceCameraPackets()_, in pixel
+// and sample order, with _sampler_ positioned just after the camera
+// dimensions of the sample. _isect_ is the first hit of _ray_, or nullptr
+// when the ray missed or was not traced because _rayWeight_ is zero
+typedef std::function<void(int pixelIndex, const CameraSample &cameraSample,
+                           RayDifferential &ray, Float rayWeight,
+                           SurfaceInteraction *isect)>
+    CameraSampleShader;
+
+// Generates the camera rays of every sample of _pixels_ and finds their
+// first hits with _Scene::IntersectN()_, _RayPacketSize_ rays at a time:
+// the samples of one pixel, or of neighbouring pixels when there are fewer
+// samples per pixel than that
+void TraceCameraPackets(const Scene &scene, const Camera &camera,
+                        Sampler &sampler, const std::vector<Point2i> &pixels,
+                        const CameraSampleShader &shade);
+
 // SamplerIntegrator Declarations
 class SamplerIntegrator : public Integrator {
   public:
@@ -87,6 +105,14 @@ class SamplerIntegrator : public Integrator {
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
+    // Integrators whose _LiFirstHit()_ uses the given first hit instead of
+    // tracing the camera ray again have their camera rays traced in packets
+    virtual bool UsesFirstHits() const { return false; }
+    virtual Spectrum LiFirstHit(const RayDifferential &ray,
+                                SurfaceInteraction *isect, const Scene &scene,
+                                Sampler &sampler, MemoryArena &arena) const {
+        return Li(ray, scene, sampler, arena);
+    }
     Spectrum SpecularReflect(const RayDifferential &ray,
                              const SurfaceInteraction &isect,
                              const Scene &scene, Sampler &sampler,
@@ -179,6 +179,20 @@ struct Options {
     std::string iileDSampler = std::string("random"); // can also be "sobol" or "halton" or "lowdiscrepancy"
     // IILE control directory
     char* iileControl = NULL;
+    // IILE checkpoint file, empty when checkpoints are disabled
+    std::string iileCheckpoint;
+    // Continue the IILE render from iileCheckpoint
+    bool iileResume = false;
+    // Port the IILE coordinator listens on for workers, -1 renders alone
+    int iileServe = -1;
+    // host:port of the coordinator, when rendering as a worker
+    std::string iileWorker;
+    // IILE neural network backend: "service" (one shared batched process),
+    // "pipe" (one process per render thread) or "native" (in process C++)
+    std::string iileNnBackend = std::string("service");
+    // Directory where BVHs are saved and loaded again by later runs on the
+    // same geometry, empty when they are always built
+    std::string bvhCache;
 };
 
 extern Options PbrtOptions;
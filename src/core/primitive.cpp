@@ -43,6 +43,11 @@ STAT_MEMORY_COUNTER("Memory/Primitives", primitiveMemory);
 
 // Primitive Method Definitions
 Primitive::~Primitive() {}
+void Primitive::IntersectN(int n, const Ray *rays, SurfaceInteraction *isects,
+                           bool *hits) const {
+    for (int i = 0; i < n; ++i) hits[i] = Intersect(rays[i], &isects[i]);
+}
+
 const AreaLight *Aggregate::GetAreaLight() const {
     LOG(FATAL) <<
         "Aggregate::GetAreaLight() method"
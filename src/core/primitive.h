@@ -46,6 +46,9 @@
 
 namespace pbrt {
 
+// Rays traced together by _Primitive::IntersectN()_ implementations
+static PBRT_CONSTEXPR int RayPacketSize = 8;
+
 // Primitive Declarations
 class Primitive {
   public:
@@ -54,6 +57,11 @@ class Primitive {
     virtual Bounds3f WorldBound() const = 0;
     virtual bool Intersect(const Ray &r, SurfaceInteraction *) const = 0;
     virtual bool IntersectP(const Ray &r) const = 0;
+    // Intersects a stream of _n_ rays, with the same results as calling
+    // _Intersect()_ on each one; _hits_ receives the return values.
+    // Aggregates override it to traverse coherent rays together
+    virtual void IntersectN(int n, const Ray *rays, SurfaceInteraction *isects,
+                            bool *hits) const;
     virtual const AreaLight *GetAreaLight() const = 0;
     virtual const Material *GetMaterial() const = 0;
     virtual void ComputeScatteringFunctions(SurfaceInteraction *isect,
@@ -53,6 +53,12 @@ bool Scene::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
     return aggregate->Intersect(ray, isect);
 }
 
+void Scene::IntersectN(int n, const Ray *rays, SurfaceInteraction *isects,
+                       bool *hits) const {
+    nIntersectionTests += n;
+    aggregate->IntersectN(n, rays, isects, hits);
+}
+
 bool Scene::IntersectP(const Ray &ray) const {
     ++nShadowTests;
     DCHECK_NE(ray.d, Vector3f(0,0,0));
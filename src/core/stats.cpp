@@ -90,6 +90,10 @@ void PrintStats(FILE *dest) { statsAccumulator.Print(dest); }
 
 void ClearStats() { statsAccumulator.Clear(); }
 
+std::map<std::string, int64_t> GetStatsCounters() {
+    return statsAccumulator.Counters();
+}
+
 static void getCategoryAndTitle(const std::string &str, std::string *category,
                                 std::string *title) {
     const char *s = str.c_str();
@@ -66,6 +66,8 @@ class StatRegisterer {
 
 void PrintStats(FILE *dest);
 void ClearStats();
+// Counters reported so far, by "Category/Title"
+std::map<std::string, int64_t> GetStatsCounters();
 void ReportThreadStats();
 
 class StatsAccumulator {
@@ -118,6 +120,7 @@ class StatsAccumulator {
 
     void Print(FILE *file);
     void Clear();
+    const std::map<std::string, int64_t> &Counters() const { return counters; }
 
   private:
     // StatsAccumulator Private Data
@@ -182,6 +185,13 @@ enum class Prof {
     TexFiltTrilerp,
     TexFiltEWA,
     TexFiltPtex,
+    IILEFindIntersection,
+    IILERenderHemisphere,
+    IILENormalizeMaps,
+    IILENNSubmit,
+    IILENNWait,
+    IILESampleHemisphere,
+    IILEFilmMonitorAdd,
     NumProfCategories
 };
 
@@ -237,6 +247,13 @@ static const char *ProfNames[] = {
     "MIPMap::Lookup() (trilinear)",
     "MIPMap::Lookup() (EWA)",
     "Ptex lookup",
+    "IisptRenderRunner::find_intersection()",
+    "IISPTdIntegrator::RenderHemisphere()",
+    "IisptRenderRunner::normalizeMapsDownstream()",
+    "IisptNnBackend::submit()",
+    "IILE NN result wait",
+    "IisptRenderRunner::sample_hemisphere()",
+    "IisptFilmMonitor::add_n_samples()",
 };
 
 static_assert((int)Prof::NumProfCategories ==
@@ -18,4 +18,33 @@ void DistanceFilm::clear()
     film->set_all(PfmItem(0.0, 0.0, 0.0));
 }
 
+// ============================================================================
+float DistanceFilm::harmonic_mean()
+{
+    const float* d = film->get_data();
+    int n = film->size();
+    double inverse_sum = 0.0;
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (d[i] > 0.0f) {
+            inverse_sum += 1.0 / d[i];
+            count++;
+        }
+    }
+    if (count == 0) {
+        return -1.0;
+    }
+    return count / inverse_sum;
+}
+
+// ============================================================================
+std::unique_ptr<DistanceFilm> DistanceFilm::clone()
+{
+    std::unique_ptr<DistanceFilm> copy (
+                new DistanceFilm(film->get_width(), film->get_height())
+                );
+    copy->film = std::make_shared<ImageFilm>(*film);
+    return copy;
+}
+
 } // namespace pbrt
@@ -48,6 +48,14 @@ public:
 
     // Clear ==================================================================
     void clear();
+
+    // Harmonic mean ==========================================================
+    // Of the positive distances, -1 if there are none
+    float harmonic_mean();
+
+    // Clone ==================================================================
+    // Deep copy, for keeping the film while the original is reused
+    std::unique_ptr<DistanceFilm> clone();
 };
 
 } // namespace pbrt
@@ -4,6 +4,7 @@
 #include "imageio.h"
 #include <fstream>
 #include <csignal>
+#include <cstring>
 
 namespace pbrt {
 
@@ -19,7 +20,14 @@ static void write_float_value(std::ofstream &ofs, float val) {
 void ImageFilm::set(int x, int y, PfmItem pixel) {
 
     int idx = y * width + x;
-    data[idx] = pixel;
+    if (num_components == 1) {
+        data[idx] = pixel.get_single_component();
+    } else {
+        int plane = width * height;
+        data[idx] = pixel.r;
+        data[plane + idx] = pixel.g;
+        data[2 * plane + idx] = pixel.b;
+    }
 
 }
 
@@ -34,7 +42,12 @@ void ImageFilm::set_camera_coord(int xx, int yy, PfmItem pixel)
 PfmItem ImageFilm::get(int x, int y) {
 
     int idx = y * width + x;
-    return data[idx];
+    if (num_components == 1) {
+        return PfmItem(data[idx]);
+    } else {
+        int plane = width * height;
+        return PfmItem(data[idx], data[plane + idx], data[2 * plane + idx]);
+    }
 
 }
 
@@ -59,7 +72,7 @@ void ImageFilm::write(std::string filename) {
     // Write pixels
     for (int y = 0; y < height; y++) {
         for (int x = 0; x < width; x++) {
-            PfmItem pix = data[y * width + x];
+            PfmItem pix = get(x, y);
             if (num_components == 1) {
                 float val = pix.get_single_component();
                 write_float_value(ofs, val);
@@ -163,38 +176,51 @@ void ImageFilm::set_all(
         PfmItem pix
         )
 {
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            set(x, y, pix);
-        }
+    int plane = width * height;
+    if (num_components == 1) {
+        std::fill(data, data + plane, pix.get_single_component());
+    } else {
+        std::fill(get_plane(0), get_plane(0) + plane, pix.r);
+        std::fill(get_plane(1), get_plane(1) + plane, pix.g);
+        std::fill(get_plane(2), get_plane(2) + plane, pix.b);
     }
 }
 
 // ============================================================================
 // Populate from float array
 
-void ImageFilm::populate_from_float_array(float* floats) {
-    if (num_components == 1) {
-        int fidx = 0;
-        int limit = width * height;
-        for (int i = 0; i < limit; i++) {
-            data[i] = PfmItem(floats[fidx]);
-            fidx++;
-        }
-    } else {
-        int fidx = 0;
-        int limit = width * height;
-        for (int i = 0; i < limit; i++) {
-            float r, g, b;
-            r = floats[fidx];
-            fidx++;
-            g = floats[fidx];
-            fidx++;
-            b = floats[fidx];
-            fidx++;
-            data[i] = PfmItem(r, g, b);
-        }
+void ImageFilm::populate_from_float_array(const float* floats) {
+    std::memcpy(data, floats, size() * sizeof(float));
+}
+
+void ImageFilm::copy_to_float_array(float* floats) const {
+    std::memcpy(floats, data, size() * sizeof(float));
+}
+
+// ============================================================================
+// Sum of one plane
+// Four partial sums break the dependency chain of the additions, the
+// accumulation stays in double as the previous per-pixel version did
+
+double ImageFilm::sum_plane(int c) const
+{
+    const float* p = get_plane(c);
+    int n = width * height;
+    double s0 = 0.0;
+    double s1 = 0.0;
+    double s2 = 0.0;
+    double s3 = 0.0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += p[i + 0];
+        s1 += p[i + 1];
+        s2 += p[i + 2];
+        s3 += p[i + 3];
+    }
+    for (; i < n; i++) {
+        s0 += p[i];
     }
+    return (s0 + s1) + (s2 + s3);
 }
 
 // ============================================================================
@@ -203,22 +229,10 @@ void ImageFilm::populate_from_float_array(float* floats) {
 float ImageFilm::computeMean()
 {
     double sum = 0.0;
-    int count = 0;
-
-    for (int i = 0; i < data.size(); i++) {
-        PfmItem item = data[i];
-        if (num_components == 1) {
-            sum += item.get_single_component();
-            count += 1;
-        } else {
-            float r, g, b;
-            item.get_triple_component(r, g, b);
-            sum += (r + g + b);
-            count += 3;
-        }
+    for (int c = 0; c < num_components; c++) {
+        sum += sum_plane(c);
     }
-
-    return sum / count;
+    return sum / size();
 }
 
 void ImageFilm::computeMeanChannels(float &rres, float &gres, float &bres)
@@ -228,29 +242,15 @@ void ImageFilm::computeMeanChannels(float &rres, float &gres, float &bres)
         std::raise(SIGKILL);
     }
 
-    double rsum = 0.0;
-    double gsum = 0.0;
-    double bsum = 0.0;
-    int count = 0;
-
-    for (int i = 0; i < data.size(); i++) {
-        PfmItem item = data[i];
-        float r, g, b;
-        item.get_triple_component(r, g, b);
-        rsum += r;
-        gsum += g;
-        bsum += b;
-        count += 1;
-    }
-
+    int count = width * height;
     if (count == 0) {
         std::cerr << "imagefilm.cpp:computeMeanChannels, count is zero at the end\n";
         std::raise(SIGKILL);
     }
 
-    rres = rsum / count;
-    gres = gsum / count;
-    bres = bsum / count;
+    rres = sum_plane(0) / count;
+    gres = sum_plane(1) / count;
+    bres = sum_plane(2) / count;
 }
 
 
@@ -258,46 +258,21 @@ void ImageFilm::computeMeanChannels(float &rres, float &gres, float &bres)
 
 float ImageFilm::computeMax()
 {
-    for (int i = 0; i < data.size(); i++) {
-        PfmItem item = data[i];
-        if (num_components == 1) {
-            float x = item.get_single_component();
-            maxVal = std::max(maxVal, x);
-        } else {
-            float r, g, b;
-            item.get_triple_component(r, g, b);
-            maxVal = std::max(maxVal, r);
-            maxVal = std::max(maxVal, g);
-            maxVal = std::max(maxVal, b);
-        }
+    int n = size();
+    float m = maxVal;
+    for (int i = 0; i < n; i++) {
+        m = std::max(m, data[i]);
     }
+    maxVal = m;
 
     return maxVal;
 }
 
-// ============================================================================
-// Map
-
-void ImageFilm::map(std::function<float(float)> func)
-{
-    for (int i = 0; i < data.size(); i++) {
-        PfmItem item = data[i];
-        if (num_components == 1) {
-            item.r = func(item.r);
-        } else {
-            item.r = func(item.r);
-            item.g = func(item.g);
-            item.b = func(item.b);
-        }
-        data[i] = item;
-    }
-}
-
 // ============================================================================
 // Multiply
 void ImageFilm::multiply(float ratio)
 {
-    map([&](float v) {
+    map([ratio](float v) {
         return v * ratio;
     });
 }
@@ -308,14 +283,14 @@ void ImageFilm::multiplyChannels(float rm, float gm, float bm)
         std::cerr << "imagefilm.cpp:multiplyChannels cannot be applied on greyscale images\n";
         std::raise(SIGKILL);
     }
-    for (int i = 0; i < data.size(); i++) {
-        PfmItem item = data[i];
-
-        item.r = rm * item.r;
-        item.g = gm * item.g;
-        item.b = bm * item.b;
-
-        data[i] = item;
+    int n = width * height;
+    float mul[3] = {rm, gm, bm};
+    for (int c = 0; c < 3; c++) {
+        float* p = get_plane(c);
+        float m = mul[c];
+        for (int i = 0; i < n; i++) {
+            p[i] = m * p[i];
+        }
     }
 }
 
@@ -323,12 +298,12 @@ void ImageFilm::multiplyChannels(float rm, float gm, float bm)
 // Log
 void ImageFilm::positiveLog()
 {
-    map([&](float v) {
+    map([](float v) {
         float vv = v;
-        if (vv <= 0.0) {
-            vv = 0.0;
+        if (vv <= 0.0f) {
+            vv = 0.0f;
         }
-        return std::log(1.0 + vv);
+        return std::log1p(vv);
     });
 }
 
@@ -336,12 +311,12 @@ void ImageFilm::positiveLog()
 // PositiveLogInverse
 void ImageFilm::positiveLogInverse()
 {
-    map([&](float v) {
+    map([](float v) {
         float y = v;
-        if (y < 0.0) {
-            y = 0.0;
+        if (y < 0.0f) {
+            y = 0.0f;
         }
-        return std::exp(y) - 1.0;
+        return std::expm1(y);
     });
 }
 
@@ -349,7 +324,7 @@ void ImageFilm::positiveLogInverse()
 // Add
 void ImageFilm::add(float amount)
 {
-    map([&](float v) {
+    map([amount](float v) {
         return v + amount;
     });
 }
@@ -363,31 +338,25 @@ void ImageFilm::normalize(float minVal, float maxVal)
     if (r == 0) {
         r = 1.0;
     }
+    float inv_r = 1.0f / r;
 
-    map([&](float v) {
-        float x = v;
-        x = x - mid;
-        x = x / r;
-        if (x < -1.0) {
-            return -1.0f;
-        } else if (x > 1.0) {
-            return 1.0f;
-        } else {
-            return x;
-        }
+    map([mid, inv_r](float v) {
+        float x = (v - mid) * inv_r;
+        return std::min(1.0f, std::max(-1.0f, x));
     });
 }
 
 // ============================================================================
 void ImageFilm::testPrintValueSamples()
 {
-    for (int i = 0; i < data.size(); i += 51) {
+    for (int i = 0; i < width * height; i += 51) {
+        PfmItem item = get(i % width, i / width);
         if (num_components == 1) {
-            float val = data[i].get_single_component();
+            float val = item.get_single_component();
             std::cerr << " " << val;
         } else {
             float r, g, b;
-            data[i].get_triple_component(r, g, b);
+            item.get_triple_component(r, g, b);
             std::cerr << " ["<< r <<"]["<< g <<"]["<< b <<"]";
         }
     }
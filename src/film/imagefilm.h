@@ -5,15 +5,21 @@
 #include <vector>
 #include <iostream>
 #include <cstdlib>
-#include <functional>
+#include <algorithm>
 #include <cmath>
 #include <limits>
 
+#include "memory.h"
 #include "pfmitem.h"
 #include "tools/iisptmathutils.h"
 
 namespace pbrt {
 
+// Pixels are stored as planar (channel, height, width) floats in a single
+// cache line aligned block, so that whole images can be copied with memcpy
+// and the per-pixel operations below are plain loops over contiguous
+// floats that the compiler vectorises.
+// Rows are in image order: Y goes from top to bottom.
 class ImageFilm
 {
 
@@ -25,14 +31,26 @@ private:
     int height;
     int num_components;
 
-    std::vector<PfmItem> data;
+    // num_components planes of width * height floats
+    float* data = NULL;
 
     float maxVal = std::numeric_limits<float>::min();
 
     // ========================================================================
     // Private methods
 
-    void map(std::function<float(float)> func);
+    // Apply <func> to every float of every component
+    template <typename F>
+    void map(F func) {
+        int n = size();
+        float* d = data;
+        for (int i = 0; i < n; i++) {
+            d[i] = func(d[i]);
+        }
+    }
+
+    // Sum of the floats of one plane
+    double sum_plane(int c) const;
 
 public:
 
@@ -52,12 +70,49 @@ public:
             exit(0);
         }
 
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                data.push_back(PfmItem(0.0, 0.0, 0.0));
-            }
-        }
+        data = AllocAligned<float>(size());
+        std::fill(data, data + size(), 0.f);
+
+    }
+
+    ImageFilm(const ImageFilm &other) :
+        width(other.width),
+        height(other.height),
+        num_components(other.num_components),
+        maxVal(other.maxVal)
+    {
+        data = AllocAligned<float>(size());
+        std::copy(other.data, other.data + size(), data);
+    }
+
+    ImageFilm& operator=(const ImageFilm &other) = delete;
+
+    ~ImageFilm() {
+        FreeAligned(data);
+    }
+
+    // Raw access =============================================================
+
+    // Total number of floats, width * height * components
+    int size() const {
+        return width * height * num_components;
+    }
+
+    float* get_data() {
+        return data;
+    }
 
+    const float* get_data() const {
+        return data;
+    }
+
+    // First float of component <c>
+    float* get_plane(int c) {
+        return data + c * width * height;
+    }
+
+    const float* get_plane(int c) const {
+        return data + c * width * height;
     }
 
     // Set ====================================================================
@@ -100,7 +155,11 @@ public:
 
     // ========================================================================
     // Populate from float array
-    void populate_from_float_array(float* floats);
+    // <floats> holds size() floats in planar (channel, height, width) order
+    void populate_from_float_array(const float* floats);
+
+    // Copy the pixels into <floats>, planar (channel, height, width) order
+    void copy_to_float_array(float* floats) const;
 
     // ========================================================================
     // Compute mean
@@ -18,4 +18,14 @@ void NormalFilm::clear()
     film->set_all(PfmItem(0.0, 0.0, 0.0));
 }
 
+// ============================================================================
+std::unique_ptr<NormalFilm> NormalFilm::clone()
+{
+    std::unique_ptr<NormalFilm> copy (
+                new NormalFilm(film->get_width(), film->get_height())
+                );
+    copy->film = std::make_shared<ImageFilm>(*film);
+    return copy;
+}
+
 }// namespace pbrt
@@ -45,6 +45,10 @@ public:
 
     // Clear ==================================================================
     void clear();
+
+    // Clone ==================================================================
+    // Deep copy, for keeping the film while the original is reused
+    std::unique_ptr<NormalFilm> clone();
 };
 
 } // namespace pbrt
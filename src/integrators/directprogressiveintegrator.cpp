@@ -1,7 +1,42 @@
 #include "directprogressiveintegrator.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+#include "stats.h"
+
 namespace pbrt {
 
+STAT_PERCENT("IILE/Direct pixel samples skipped as converged", directSkipped, directVisited);
+
+// ============================================================================
+DirectProgressiveIntegrator::DirectProgressiveIntegrator(
+        std::shared_ptr<const Camera> camera,
+        std::unique_ptr<Sampler> sampler,
+        Bounds2i pixelBounds
+        )
+{
+    this->camera = camera;
+    this->sampler = std::move(sampler);
+    this->pixelBounds = pixelBounds;
+
+    // Read environment variables
+    char* min_samples_env = std::getenv("IISPT_DIRECT_MIN_SAMPLES");
+    if (min_samples_env == NULL) {
+        this->minSamples = 4;
+    } else {
+        this->minSamples = std::max(2, std::stoi(std::string(min_samples_env)));
+    }
+
+    char* threshold_env = std::getenv("IISPT_DIRECT_THRESHOLD");
+    if (threshold_env == NULL) {
+        this->threshold = 0.02;
+    } else {
+        this->threshold = std::stod(std::string(threshold_env));
+    }
+}
+
 void DirectProgressiveIntegrator::preprocess(
         const Scene &scene
         )
@@ -53,30 +88,18 @@ Spectrum DirectProgressiveIntegrator::Li(const RayDifferential &ray,
 }
 
 
-void DirectProgressiveIntegrator::RenderOnePass(
+int DirectProgressiveIntegrator::RenderTile(
         const Scene &scene,
-        IisptFilmMonitor* filmMonitor
+        IisptFilmMonitor* filmMonitor,
+        Bounds2i tileBounds
         )
 {
-    // Compute number of tiles, _nTiles_, to use for parallel rendering
-    Bounds2i sampleBounds = camera->film->GetSampleBounds();
-
-    int x0 = sampleBounds.pMin.x;
-    int x1 = sampleBounds.pMax.x;
-    int y0 = sampleBounds.pMin.y;
-    int y1 = sampleBounds.pMax.y;
-    Bounds2i tileBounds (Point2i(x0, y0), Point2i(x1, y1));
-
     std::vector<Point2i> additionPoints;
     std::vector<Spectrum> additionSpectrums;
     std::vector<double> additionWeights;
 
     MemoryArena arena;
 
-    // Get _FilmTile_ for tile
-    std::unique_ptr<FilmTile> filmTile =
-        camera->film->GetFilmTile(tileBounds);
-
     for (Point2i pixel : tileBounds) {
         {
             sampler->StartPixel(pixel);
@@ -89,6 +112,13 @@ void DirectProgressiveIntegrator::RenderOnePass(
         if (!InsideExclusive(pixel, pixelBounds))
             continue;
 
+        ++directVisited;
+        if (threshold > 0.0 &&
+                filmMonitor->converged(pixel.x, pixel.y, minSamples, threshold)) {
+            ++directSkipped;
+            continue;
+        }
+
         // Run the pixel loop only once to force rendering a single pass
         {
             // Initialize _CameraSample_ for current sample
@@ -146,7 +176,7 @@ void DirectProgressiveIntegrator::RenderOnePass(
 
     filmMonitor->add_n_samples(additionPoints, additionSpectrums, additionWeights);
 
-
+    return additionPoints.size();
 }
 
 Spectrum DirectProgressiveIntegrator::SpecularReflect(
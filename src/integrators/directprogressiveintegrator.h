@@ -9,6 +9,11 @@
 
 namespace pbrt {
 
+// Direct illumination of the IILE render, one sample per pixel at a time.
+// Pixels are skipped once the film monitor, which must track variance,
+// reports them converged: after IISPT_DIRECT_MIN_SAMPLES samples, when
+// the standard error of the mean luminance is under IISPT_DIRECT_THRESHOLD
+// times the mean.
 class DirectProgressiveIntegrator
 {
 public:
@@ -19,17 +24,16 @@ public:
     std::vector<int> nLightSamples;
     const int maxDepth = 5;
 
+    int minSamples;
+    // 0 disables adaptive sampling
+    double threshold;
+
     // Constructor ============================================================
     DirectProgressiveIntegrator(
             std::shared_ptr<const Camera> camera,
             std::unique_ptr<Sampler> sampler,
             Bounds2i pixelBounds
-            )
-    {
-        this->camera = camera;
-        this->sampler = std::move(sampler);
-        this->pixelBounds = pixelBounds;
-    }
+            );
 
     // Methods ================================================================
 
@@ -49,9 +53,13 @@ public:
                                           const Scene &scene, Sampler &sampler,
                                           MemoryArena &arena, int depth) const;
 
-    void RenderOnePass(
+    // Takes one sample in each pixel of <tileBounds> that hasn't converged
+    // and adds them to <filmMonitor>
+    // <return> the number of samples taken
+    int RenderTile(
             const Scene &scene,
-            IisptFilmMonitor* filmMonitor
+            IisptFilmMonitor* filmMonitor,
+            Bounds2i tileBounds
             );
 
 };
@@ -51,11 +51,17 @@
 #include "integrators/iisptschedulemonitor.h"
 #include "integrators/iisptfilmmonitor.h"
 #include "integrators/iisptrenderrunner.h"
+#include "integrators/iisptpreviewstream.h"
+#include "integrators/iispttrace.h"
+#include "integrators/iisptcheckpoint.h"
+#include "integrators/iisptdistributed.h"
 
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <sys/stat.h>
@@ -77,20 +83,6 @@ static Vector2i get_sample_extent(std::shared_ptr<const Camera> camera) {
     return sampleExtent;
 }
 
-// Generate reference file name -----------------------------------------------
-// extension must start with a .
-static std::string generate_reference_name(std::string identifier_type, Point2i pixel, std::string extension) {
-    std::string generated_path =
-            IISPT_REFERENCE_DIRECTORY +
-            identifier_type +
-            "_" +
-            std::to_string(pixel.x) +
-            "_" +
-            std::to_string(pixel.y) +
-            extension;
-    return generated_path;
-}
-
 // Create auxiliary path integrator for reference mode
 static std::shared_ptr<PathIntegrator> create_aux_path_integrator(
         int path_pixel_samples,
@@ -133,40 +125,6 @@ static std::shared_ptr<PathIntegrator> create_aux_path_integrator(
     return path_integrator;
 }
 
-// Check if file exists
-static inline bool file_exists(std::string& name) {
-    std::ifstream f(name.c_str());
-    return f.good();
-}
-
-// Utility to execute a lambda only if the file doesn't exist already
-template<typename Func>
-static void exec_if_not_exists(std::string file_path, Func f) {
-    if (PbrtOptions.referenceResume == 0) {
-        f();
-        return;
-    }
-    if (!file_exists(file_path)) {
-        f();
-    }
-}
-
-// Utility to execute a lambda only if at least one of the files doesn't
-// exist
-template<typename Func>
-static void exec_if_one_not_exists(std::vector<std::string> &file_paths, Func f) {
-    if (PbrtOptions.referenceResume == 0) {
-        f();
-        return;
-    }
-    for (std::string fp : file_paths) {
-        if (!file_exists(fp)) {
-            f();
-            return;
-        }
-    }
-}
-
 // IISPTIntegrator Method Definitions =========================================
 
 // Constructor
@@ -357,10 +315,33 @@ void IISPTIntegrator::Render(const Scene &scene) {
 // Render normal 2
 void IISPTIntegrator::render_normal_2(const Scene &scene) {
 
+    if (!PbrtOptions.iileWorker.empty()) {
+        render_worker(scene);
+        return;
+    }
+
     Preprocess(scene);
 
+    // Starts the trace clock
+    IisptTrace::getInstance().set_thread_name("Main");
+
+    unsigned noCpus = iile::cpusCountFull();
+    // noCpus = 1;
+
+    bool distributed = PbrtOptions.iileServe >= 0;
+
+    // The coordinator hands out the tasks of a single queue in order, so
+    // they don't depend on the workers
     std::shared_ptr<IisptScheduleMonitor> schedule_monitor (
-                new IisptScheduleMonitor(camera->film->GetSampleBounds())
+                new IisptScheduleMonitor(
+                    camera->film->GetSampleBounds(),
+                    distributed ? 1 : noCpus
+                    )
+                );
+
+    // Hemispheres are shared across threads and passes
+    std::shared_ptr<IisptHemisphereCache> hemi_cache (
+                new IisptHemisphereCache(scene.WorldBound())
                 );
 
     std::shared_ptr<IisptFilmMonitor> film_monitor_indirect (
@@ -369,12 +350,51 @@ void IISPTIntegrator::render_normal_2(const Scene &scene) {
                     )
                 );
 
+    // The direct pass skips the pixels that converged
     std::shared_ptr<IisptFilmMonitor> film_monitor_direct (
                 new IisptFilmMonitor(
-                    camera->film->GetSampleBounds()
+                    camera->film->GetSampleBounds(),
+                    true
                     )
                 );
 
+    // Restore before the runners read their seeds from the schedule
+    std::unique_ptr<IisptCheckpoint> checkpoint;
+    if (!PbrtOptions.iileCheckpoint.empty()) {
+        checkpoint.reset(new IisptCheckpoint(
+                             PbrtOptions.iileCheckpoint,
+                             schedule_monitor.get(),
+                             film_monitor_indirect.get(),
+                             film_monitor_direct.get()
+                             ));
+        if (PbrtOptions.iileResume) {
+            checkpoint->read();
+        }
+    } else if (PbrtOptions.iileResume) {
+        std::cerr << "iispt.cpp: --resume needs --iileCheckpoint, starting from the beginning\n";
+    }
+
+    // Created after the checkpoint is read, tasks resume from there
+    std::unique_ptr<IisptCoordinator> coordinator;
+    if (distributed) {
+        coordinator.reset(new IisptCoordinator(
+                              schedule_monitor.get(),
+                              film_monitor_indirect.get(),
+                              PbrtOptions.iileIndirectTasks
+                              ));
+        if (!coordinator->listen(PbrtOptions.iileServe)) {
+            std::raise(SIGKILL);
+        }
+    }
+
+    std::atomic<bool> threadsFinished (false);
+    std::thread checkpointThread;
+    if (checkpoint) {
+        checkpointThread = std::thread([&checkpoint, &threadsFinished]() {
+            checkpoint->run_periodic(threadsFinished);
+        });
+    }
+
     // Create and start the directory control thread
     std::atomic<bool> renderingFinished;
     renderingFinished = false;
@@ -383,17 +403,15 @@ void IISPTIntegrator::render_normal_2(const Scene &scene) {
     });
 
     // Create thread pool for indirect pass
-    unsigned noCpus = iile::cpusCountFull();
-    // noCpus = 1;
     ThreadPool threadPool (noCpus);
     std::vector<std::future<void>> futures;
 
     // Start threads
     for (int i = 0; i < noCpus; i++) {
-        std::shared_ptr<IisptNnConnector> nnConnector =
+        std::shared_ptr<IisptNnBackend> nnConnector =
                 iile::NnConnectorManager::getInstance().getInstance().get(i);
 
-        futures.push_back(threadPool.enqueue([i, schedule_monitor, film_monitor_indirect, film_monitor_direct, this, &scene, nnConnector]() {
+        futures.push_back(threadPool.enqueue([i, schedule_monitor, film_monitor_indirect, film_monitor_direct, this, &scene, nnConnector, hemi_cache, &coordinator]() {
             std::shared_ptr<IisptRenderRunner> runner (
                         new IisptRenderRunner(
                             schedule_monitor,
@@ -404,16 +422,25 @@ void IISPTIntegrator::render_normal_2(const Scene &scene) {
                             sampler,
                             i,
                             camera->film->GetSampleBounds(),
-                            nnConnector
+                            nnConnector,
+                            hemi_cache
                             )
                         );
-            if (i % 2 == 0) {
+            // With workers the indirect pass only ends when they are done,
+            // so the local direct pass goes first
+            if (coordinator) {
+                runner->set_remote_tasks(coordinator.get());
+            }
+            if (i % 2 == 0 || coordinator) {
                 runner->run_direct(scene);
                 runner->run(scene);
             } else {
                 runner->run(scene);
                 runner->run_direct(scene);
             }
+            // Pool threads are not pbrt worker threads, so their
+            // statistics have to be merged explicitly
+            ReportThreadStats();
         }));
     }
 
@@ -426,8 +453,25 @@ void IISPTIntegrator::render_normal_2(const Scene &scene) {
         futures[i].get();
     }
 
+    if (coordinator) {
+        coordinator->wait();
+    }
+
+    // The final checkpoint can be resumed with more tasks or samples
+    threadsFinished = true;
+    if (checkpoint) {
+        checkpointThread.join();
+        checkpoint->write();
+    }
+
     iile::NnConnectorManager::getInstance().stopAll();
 
+    IisptTrace::getInstance().write();
+
+    schedule_monitor->print_utilisation();
+
+    hemi_cache->print_stats();
+
     std::cerr << "iispt.cpp: saving indirect EXR\n";
 
     film_monitor_indirect->to_intensity_film()->pbrt_write("/tmp/iispt_indirect.exr");
@@ -452,18 +496,98 @@ void IISPTIntegrator::render_normal_2(const Scene &scene) {
 
 }
 
+// ============================================================================
+// Render worker
+// Only renders indirect tasks, the coordinator does the direct pass and
+// writes the images
+void IISPTIntegrator::render_worker(const Scene &scene) {
+
+    Preprocess(scene);
+
+    IisptTrace::getInstance().set_thread_name("Main");
+
+    unsigned noCpus = iile::cpusCountFull();
+
+    IisptWorkerClient client;
+    if (!client.connect(PbrtOptions.iileWorker, camera->film->GetSampleBounds())) {
+        std::raise(SIGKILL);
+    }
+
+    // Only used for the seeds and the film bounds, tasks and results go
+    // through the client
+    std::shared_ptr<IisptScheduleMonitor> schedule_monitor (
+                new IisptScheduleMonitor(
+                    camera->film->GetSampleBounds(),
+                    noCpus
+                    )
+                );
+
+    std::shared_ptr<IisptHemisphereCache> hemi_cache (
+                new IisptHemisphereCache(scene.WorldBound())
+                );
+
+    std::shared_ptr<IisptFilmMonitor> film_monitor_indirect (
+                new IisptFilmMonitor(
+                    camera->film->GetSampleBounds()
+                    )
+                );
+
+    std::shared_ptr<IisptFilmMonitor> film_monitor_direct (
+                new IisptFilmMonitor(
+                    camera->film->GetSampleBounds()
+                    )
+                );
+
+    ThreadPool threadPool (noCpus);
+    std::vector<std::future<void>> futures;
+
+    for (int i = 0; i < noCpus; i++) {
+        std::shared_ptr<IisptNnBackend> nnConnector =
+                iile::NnConnectorManager::getInstance().get(i);
+
+        futures.push_back(threadPool.enqueue([i, schedule_monitor, film_monitor_indirect, film_monitor_direct, this, &scene, nnConnector, hemi_cache, &client]() {
+            std::shared_ptr<IisptRenderRunner> runner (
+                        new IisptRenderRunner(
+                            schedule_monitor,
+                            film_monitor_indirect,
+                            film_monitor_direct,
+                            camera,
+                            dcamera,
+                            sampler,
+                            i,
+                            camera->film->GetSampleBounds(),
+                            nnConnector,
+                            hemi_cache
+                            )
+                        );
+            runner->set_remote_tasks(&client);
+            runner->run(scene);
+            ReportThreadStats();
+        }));
+    }
+
+    for (int i = 0; i < noCpus; i++) {
+        futures[i].get();
+    }
+
+    iile::NnConnectorManager::getInstance().stopAll();
+
+    IisptTrace::getInstance().write();
+
+    hemi_cache->print_stats();
+
+    std::cerr << "iispt.cpp: worker done\n";
+}
+
 // Render reference ===========================================================
+// Reference hemispheres are rendered by one thread per CPU, each with its
+// own IISPTdIntegrator and shard of the packed dataset
 void IISPTIntegrator::render_reference(const Scene &scene) {
 
     Preprocess(scene);
 
     write_info_file(IISPT_REFERENCE_DIRECTORY + IISPT_REFERENCE_TRAIN_INFO);
 
-    // Create the auxiliary integrator for intersection-view
-    this->dintegrator = std::shared_ptr<IISPTdIntegrator>(CreateIISPTdIntegrator(dcamera, 13));
-    // Preprocess on auxiliary integrator
-    dintegrator->Preprocess(scene);
-
     // Compute number of tiles
     Bounds2i sampleBounds = camera->film->GetSampleBounds();
     Vector2i sampleExtent = sampleBounds.Diagonal();
@@ -476,53 +600,67 @@ void IISPTIntegrator::render_reference(const Scene &scene) {
         return;
     }
 
-    // Read reference control variables
-    char* reference_control_mod_env = std::getenv("IISPT_REFERENCE_CONTROL_MOD");
-    int reference_control_mod = 1;
-    if (reference_control_mod_env != NULL) {
-        reference_control_mod = std::stoi(
-                    std::string(reference_control_mod_env));
-    }
-
-    char* reference_control_match_env =
-            std::getenv("IISPT_REFERENCE_CONTROL_MATCH");
-    int reference_control_match = 0;
-    if (reference_control_match_env != NULL) {
-        reference_control_match = std::stoi(
-                    std::string(reference_control_match_env)
-                    );
-    }
-
-    int ref_idx = 0;
-
+    std::vector<Point2i> reference_pixels;
     for (int px_y = 0; px_y < sampleExtent.y; px_y += reference_tile_interval_y) {
         for (int px_x = 0; px_x < sampleExtent.x; px_x += reference_tile_interval_x) {
+            reference_pixels.push_back(Point2i(px_x, px_y));
+        }
+    }
 
-            ref_idx++;
-            if ((ref_idx % reference_control_mod) != reference_control_match) {
-                // This pixel is not a job of the current process
-                continue;
-            }
+    unsigned noCpus = iile::cpusCountFull();
 
-            std::cerr << "Current pixel ["<< px_x <<"] ["<< px_y <<"]" << std::endl;
+    IisptDatasetWriter writer (
+                IISPT_REFERENCE_DIRECTORY,
+                PbrtOptions.iisptHemiSize,
+                noCpus,
+                PbrtOptions.referenceResume != 0
+                );
 
-            CameraSample current_sample;
-            current_sample.pFilm = Point2f(px_x, px_y);
-            current_sample.time = 0;
+    std::atomic<int> next_pixel (0);
 
-            // Render IISPTd views and Reference views
-            RayDifferential ray;
-            Float rayWeight = camera->GenerateRayDifferential(current_sample, &ray);
-            // It's a single pass per pixel, so we don't scale the differential
-            ray.ScaleDifferentials(1);
-            // The Li method, in reference mode, will automatically save the reference images
-            // to the out/ directory
-            Li_reference(ray, scene, Point2i(px_x, px_y));
+    ThreadPool threadPool (noCpus);
+    std::vector<std::future<void>> futures;
 
+    for (int i = 0; i < noCpus; i++) {
+        futures.push_back(threadPool.enqueue([i, this, &scene, &reference_pixels, &next_pixel, &writer]() {
+            // Create the auxiliary integrator for intersection-view
+            std::shared_ptr<IISPTdIntegrator> dintegrator =
+                    CreateIISPTdIntegrator(dcamera, 13 + i);
+            dintegrator->Preprocess(scene);
+
+            while (true) {
+                int pixel_idx = next_pixel++;
+                if (pixel_idx >= (int) reference_pixels.size()) {
+                    break;
+                }
+                Point2i pixel = reference_pixels[pixel_idx];
+                if (writer.contains(pixel.x, pixel.y)) {
+                    continue;
+                }
+
+                std::cerr << "Current pixel ["<< pixel.x <<"] ["<< pixel.y <<"]" << std::endl;
+
+                CameraSample current_sample;
+                current_sample.pFilm = Point2f(pixel.x, pixel.y);
+                current_sample.time = 0;
+
+                // Render IISPTd views and Reference views
+                RayDifferential ray;
+                camera->GenerateRayDifferential(current_sample, &ray);
+                // It's a single pass per pixel, so we don't scale the differential
+                ray.ScaleDifferentials(1);
+                Li_reference(ray, scene, pixel, dintegrator.get(), writer, i, pixel_idx);
+            }
+            ReportThreadStats();
+        }));
+    }
 
-        }
+    for (int i = 0; i < noCpus; i++) {
+        futures[i].get();
     }
 
+    std::cerr << "iispt.cpp: " << writer.size() << " reference hemispheres in " << IISPT_REFERENCE_DIRECTORY << std::endl;
+
 }
 
 // Estimate direct ============================================================
@@ -647,9 +785,15 @@ Spectrum IISPTIntegrator::Li_direct(
 }
 
 // New version ================================================================
+// Renders the hemisphere at the intersection of <ray> and appends it to
+// <shard> of the dataset
 void IISPTIntegrator::Li_reference(const RayDifferential &ray,
                              const Scene &scene,
-                             Point2i pixel
+                             Point2i pixel,
+                             IISPTdIntegrator* dintegrator,
+                             IisptDatasetWriter &writer,
+                             int shard,
+                             int seed
                              ) const {
 
     // Find closest ray intersection or return background radiance
@@ -671,8 +815,7 @@ void IISPTIntegrator::Li_reference(const RayDifferential &ray,
     // surface normal
     Ray auxRay = isect.SpawnRay(Vector3f(surfNormal));
 
-    // testCamera is used for the hemispheric rendering
-    std::string reference_d_name = generate_reference_name("d", pixel, ".pfm");
+    // Network input, rendered the same way as in the indirect pass -----------
     std::shared_ptr<HemisphericCamera> auxCamera (
                 CreateHemisphericCamera(
                     PbrtOptions.iisptHemiSize,
@@ -680,66 +823,52 @@ void IISPTIntegrator::Li_reference(const RayDifferential &ray,
                     dcamera->medium,
                     auxRay.o,
                     auxRay.d,
-                    reference_d_name
+                    std::string("/tmp/null")
                     )
                 );
 
-    // Create 1spp sampler
-    std::unique_ptr<Sampler> one_spp_sampler (
-                new RandomSampler(1)
-                );
-
-    // In Reference mode, save the rendered view ------------------------------
-    std::vector<std::string> direct_reference_names;
-    direct_reference_names.push_back(reference_d_name);
-    std::string reference_z_name = generate_reference_name("z", pixel, ".pfm");
-    direct_reference_names.push_back(reference_z_name);
-    std::string reference_n_name = generate_reference_name("n", pixel, ".pfm");
-    direct_reference_names.push_back(reference_n_name);
-    exec_if_one_not_exists(direct_reference_names, [&]() {
-        // Start rendering the hemispherical view
-        this->dintegrator->RenderView(
-                    scene,
-                    auxCamera.get(),
-                    one_spp_sampler.get()
-                    );
-        dintegrator->save_reference(
-                    auxCamera,
-                    reference_z_name, // distance map
-                    reference_n_name  // normal map
-                    );
-    });
+    std::unique_ptr<IntensityFilm> d_film =
+            dintegrator->RenderHemisphere(scene, auxCamera.get());
+    // The high spp render below overwrites the integrator's films
+    std::unique_ptr<NormalFilm> n_film =
+            dintegrator->get_normal_film()->clone();
+    std::unique_ptr<DistanceFilm> z_film =
+            dintegrator->get_distance_film()->clone();
 
     // Reference mode, High SPP path tracing ----------------------------------
-    std::string reference_b_name = generate_reference_name("p", pixel, ".pfm");
-    exec_if_not_exists(reference_b_name, [&]() {
-        std::shared_ptr<HemisphericCamera> high_spp_camera (
-                    CreateHemisphericCamera(
-                        PbrtOptions.iisptHemiSize,
-                        PbrtOptions.iisptHemiSize,
-                        dcamera->medium,
-                        auxRay.o,
-                        auxRay.d,
-                        reference_b_name
-                        )
-                    );
-
-        // Create 1spp sampler
-        std::unique_ptr<Sampler> high_spp_sampler (
-                    new RandomSampler(PbrtOptions.referencePixelSamples)
-                    );
+    std::shared_ptr<HemisphericCamera> high_spp_camera (
+                CreateHemisphericCamera(
+                    PbrtOptions.iisptHemiSize,
+                    PbrtOptions.iisptHemiSize,
+                    dcamera->medium,
+                    auxRay.o,
+                    auxRay.d,
+                    std::string("/tmp/null")
+                    )
+                );
 
-        this->dintegrator->RenderView(
-                    scene,
-                    high_spp_camera.get(),
-                    high_spp_sampler.get()
-                    );
+    std::unique_ptr<Sampler> high_spp_sampler (
+                new RandomSampler(PbrtOptions.referencePixelSamples, seed)
+                );
 
-        this->dintegrator->save_reference_camera_only(
-                    high_spp_camera
-                    );
+    dintegrator->RenderView(
+                scene,
+                high_spp_camera.get(),
+                high_spp_sampler.get()
+                );
 
-    });
+    std::unique_ptr<IntensityFilm> p_film =
+            dintegrator->get_intensity_film(high_spp_camera.get());
+
+    writer.write(
+                shard,
+                pixel.x,
+                pixel.y,
+                d_film->get_image_film().get(),
+                n_film->get_image_film().get(),
+                z_film->get_image_film().get(),
+                p_film->get_image_film().get()
+                );
 
 }
 
@@ -765,22 +894,59 @@ void IISPTIntegrator::directoryControlThread(
     std::string directOutPath (controlDir + std::string("/out_direct.pfm"));
     std::string combinedOutPath (controlDir + std::string("/out_combined.pfm"));
 
+    IisptPreviewStream preview (controlDir, indirectFilmMonitor.get());
+
+    // The interval between publishes adapts to the data: it backs off
+    // while nothing changes, and otherwise keeps publishing under a
+    // tenth of the control thread's time
+    int min_interval = 100;
+    char* min_interval_env = std::getenv("IISPT_PREVIEW_MIN_INTERVAL");
+    if (min_interval_env != NULL) {
+        min_interval = std::max(1, std::stoi(std::string(min_interval_env)));
+    }
+    int max_interval = 2000;
+    char* max_interval_env = std::getenv("IISPT_PREVIEW_MAX_INTERVAL");
+    if (max_interval_env != NULL) {
+        max_interval = std::max(min_interval, std::stoi(std::string(max_interval_env)));
+    }
+
+    int interval = min_interval;
     while (1) {
-        iile::sleepMillis(2000); // Sleep for 2 seconds each time
+        // Sleep in short steps to notice the end of the render
+        for (int waited = 0; waited < interval && !renderingFinished; waited += 20) {
+            iile::sleepMillis(std::min(20, interval - waited));
+        }
 
-        // Write the indirect film and direct film
-        indirectFilmMonitor->to_intensity_film()->pbrt_write(indirectOutPath);
-        directFilmMonitor->to_intensity_film()->pbrt_write(directOutPath);
+        // Read before publishing, so the last publish has every sample
+        bool finished = renderingFinished;
 
-        // Generate temporary combined
-        std::shared_ptr<IisptFilmMonitor> combinedFilm =
-                indirectFilmMonitor->merge_into(directFilmMonitor.get());
-        combinedFilm->to_intensity_film()->pbrt_write(combinedOutPath);
+        auto start = std::chrono::steady_clock::now();
+        int tiles = preview.publish(
+                    indirectFilmMonitor.get(),
+                    directFilmMonitor.get()
+                    );
+        std::chrono::duration<double, std::milli> cost =
+                std::chrono::steady_clock::now() - start;
+
+        if (tiles > 0) {
+            std::cout << "#PREVIEW!" << preview.get_frame() << std::endl;
+            interval = std::max(min_interval, (int) (10.0 * cost.count()));
+        } else {
+            interval = 2 * interval;
+        }
+        interval = std::min(interval, max_interval);
 
-        std::cout << "#REFRESH!" << std::endl;
+        if (finished) {
+            // Full resolution images of the final result
+            indirectFilmMonitor->to_intensity_film()->pbrt_write(indirectOutPath);
+            directFilmMonitor->to_intensity_film()->pbrt_write(directOutPath);
+            std::shared_ptr<IisptFilmMonitor> combinedFilm =
+                    indirectFilmMonitor->merge_into(directFilmMonitor.get());
+            combinedFilm->to_intensity_film()->pbrt_write(combinedOutPath);
 
-        if (renderingFinished) {
+            preview.set_finished();
             std::cout << "#FINISH!" << std::endl;
+            ReportThreadStats();
             return;
         }
     }
@@ -51,6 +51,7 @@
 #include "tools/generalutils.h"
 #include "tools/nnconnectormanager.h"
 #include "integrators/iisptfilmmonitor.h"
+#include "integrators/iisptdatasetwriter.h"
 #include "samplers/random.h"
 
 namespace pbrt {
@@ -82,13 +83,20 @@ public:
 
     void Li_reference(const RayDifferential &ray,
                                  const Scene &scene,
-                                 Point2i pixel
+                                 Point2i pixel,
+                                 IISPTdIntegrator* dintegrator,
+                                 IisptDatasetWriter &writer,
+                                 int shard,
+                                 int seed
                                  ) const;
 
     void Render(const Scene &scene);
 
     void render_normal_2(const Scene &scene);
 
+    // Indirect tasks of the coordinator at PbrtOptions.iileWorker
+    void render_worker(const Scene &scene);
+
     void render_reference(const Scene &scene);
 
 private:
@@ -100,7 +108,6 @@ private:
     std::shared_ptr<Sampler> sampler;
 
     std::shared_ptr<Camera> dcamera;
-    std::shared_ptr<IISPTdIntegrator> dintegrator;
 
     // Private methods --------------------------------------------------------
 
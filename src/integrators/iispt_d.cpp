@@ -33,6 +33,7 @@
 
 // integrators/iispt_d.cpp*
 #include "integrators/iispt_d.h"
+#include "integrators/iispthemilod.h"
 #include "interaction.h"
 #include "paramset.h"
 #include "camera.h"
@@ -63,6 +64,11 @@ void IISPTdIntegrator::Preprocess(const Scene &scene) {
         CreateLightSampleDistribution(lightSampleStrategy, scene);
 }
 
+// ============================================================================
+void IISPTdIntegrator::reseed(int seed) {
+    sampler_internal = std::shared_ptr<Sampler>(sampler_internal->Clone(seed));
+}
+
 Spectrum IISPTdIntegrator::Li(const RayDifferential &r,
                               const Scene &scene,
                               Sampler &sampler,
@@ -70,7 +76,9 @@ Spectrum IISPTdIntegrator::Li(const RayDifferential &r,
                               int depth,
                               int x,
                               int y,
-                              Camera* camera
+                              Camera* camera,
+                              bool first_traced,
+                              SurfaceInteraction* first_isect
                               ) {
     ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f), beta(1.f);
@@ -93,7 +101,17 @@ Spectrum IISPTdIntegrator::Li(const RayDifferential &r,
 
         // Intersect _ray_ with scene and store intersection in _isect_
         SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
+        bool foundIntersection;
+        if (first_traced) {
+            // The camera ray was traced with its packet
+            foundIntersection = first_isect != NULL;
+            if (foundIntersection) {
+                isect = *first_isect;
+            }
+            first_traced = false;
+        } else {
+            foundIntersection = scene.Intersect(ray, &isect);
+        }
 
         if (depth == 0 && bounces == 0) {
             if (foundIntersection) {
@@ -269,71 +287,58 @@ void IISPTdIntegrator::RenderView(
                 std::unique_ptr<FilmTile> filmTile =
                     camera->film->GetFilmTile(tileBounds);
 
-                // Loop over pixels in tile to render them
+                // Camera rays of the tile are traced in packets
+                std::vector<Point2i> pixels;
                 for (Point2i pixel : tileBounds) {
-                    {
-                        ProfilePhase pp(Prof::StartPixel);
-                        tileSampler->StartPixel(pixel);
+                    if (InsideExclusive(pixel, pixelBounds)) {
+                        pixels.push_back(pixel);
                     }
-
-                    // Do this check after the StartPixel() call; this keeps
-                    // the usage of RNG values from (most) Samplers that use
-                    // RNGs consistent, which improves reproducability /
-                    // debugging.
-                    if (!InsideExclusive(pixel, pixelBounds))
-                        continue;
-
-                    do {
-                        // Initialize _CameraSample_ for current sample
-                        CameraSample cameraSample =
-                            tileSampler->GetCameraSample(pixel);
-
-                        // Generate camera ray for current sample
-                        RayDifferential ray;
-                        Float rayWeight =
-                            camera->GenerateRayDifferential(cameraSample, &ray);
-                        ray.ScaleDifferentials(
-                            1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-
-                        // Evaluate radiance along camera ray
-                        Spectrum L(0.f);
-                        if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena, 0, pixel.x, pixel.y, camera);
-
-                        // Issue warning if unexpected radiance value returned
-                        if (L.HasNaNs()) {
-                            LOG(ERROR) << StringPrintf(
-                                "Not-a-number radiance value returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        } else if (L.y() < -1e-5) {
-                            LOG(ERROR) << StringPrintf(
-                                "Negative luminance value, %f, returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                L.y(), pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        } else if (std::isinf(L.y())) {
-                              LOG(ERROR) << StringPrintf(
-                                "Infinite luminance value returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        }
-                        VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                            ray << " -> L = " << L;
-
-                        // Add camera ray's contribution to image
-                        filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-
-                        // Free _MemoryArena_ memory from computing image sample
-                        // value
-                        arena.Reset();
-                    } while (tileSampler->StartNextSample());
                 }
 
+                TraceCameraPackets(scene, *camera, *tileSampler, pixels,
+                        [&](int pixel_index, const CameraSample &cameraSample,
+                            RayDifferential &ray, Float rayWeight,
+                            SurfaceInteraction *isect) {
+                    Point2i pixel = pixels[pixel_index];
+
+                    // Evaluate radiance along camera ray
+                    Spectrum L(0.f);
+                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena, 0, pixel.x, pixel.y, camera, true, isect);
+
+                    // Issue warning if unexpected radiance value returned
+                    if (L.HasNaNs()) {
+                        LOG(ERROR) << StringPrintf(
+                            "Not-a-number radiance value returned "
+                            "for pixel (%d, %d), sample %d. Setting to black.",
+                            pixel.x, pixel.y,
+                            (int)tileSampler->CurrentSampleNumber());
+                        L = Spectrum(0.f);
+                    } else if (L.y() < -1e-5) {
+                        LOG(ERROR) << StringPrintf(
+                            "Negative luminance value, %f, returned "
+                            "for pixel (%d, %d), sample %d. Setting to black.",
+                            L.y(), pixel.x, pixel.y,
+                            (int)tileSampler->CurrentSampleNumber());
+                        L = Spectrum(0.f);
+                    } else if (std::isinf(L.y())) {
+                          LOG(ERROR) << StringPrintf(
+                            "Infinite luminance value returned "
+                            "for pixel (%d, %d), sample %d. Setting to black.",
+                            pixel.x, pixel.y,
+                            (int)tileSampler->CurrentSampleNumber());
+                        L = Spectrum(0.f);
+                    }
+                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
+                        ray << " -> L = " << L;
+
+                    // Add camera ray's contribution to image
+                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+                    // Free _MemoryArena_ memory from computing image sample
+                    // value
+                    arena.Reset();
+                });
+
                 // Merge image tile into _Film_
                 camera->film->MergeFilmTile(std::move(filmTile));
             }
@@ -347,117 +352,105 @@ void IISPTdIntegrator::RenderView(
         Camera* camera
         )
 {
-    // There is no preprocess here.
-    // It must have already been called by the host.
+    RenderView(scene, camera, sampler.get());
+}
 
-    // Clear normal and distance film
-    normal_film->clear();
-    distance_film->clear();
+// ============================================================================
+std::unique_ptr<IntensityFilm> IISPTdIntegrator::RenderHemisphere(
+        const Scene &scene,
+        Camera* camera
+        )
+{
+    // Hemispheres can have different sizes, see iispthemilod.h
+    resize_maps(camera->film->fullResolution.x, camera->film->fullResolution.y);
 
-    // Render image tiles in parallel
+    if (hemi_film_rasteriser) {
+        RenderView(scene, camera);
+        return get_intensity_film(camera);
+    }
 
-    // Compute number of tiles, _nTiles_, to use for parallel rendering
-    Bounds2i sampleBounds = camera->film->GetSampleBounds();
-    Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-                   (sampleExtent.y + tileSize - 1) / tileSize);
+    // There is no preprocess here.
+    // It must have already been called by the host.
 
-    {
-        for (int tiley = 0; tiley < nTiles.y; tiley++) {
-            for (int tilex = 0; tilex < nTiles.x; tilex++) {
-                Point2i tile (tilex, tiley);
-                // Render section of image corresponding to _tile_
+    Bounds2i bounds = Intersect(camera->film->croppedPixelBounds, pixelBounds);
+    int width = camera->film->croppedPixelBounds.Diagonal().x;
+    int height = camera->film->croppedPixelBounds.Diagonal().y;
+    std::unique_ptr<IntensityFilm> intensity (
+                new IntensityFilm(width, height)
+                );
 
-                // Allocate _MemoryArena_ for tile
-                MemoryArena arena;
+    // Every pixel of <bounds> is written below, no need to clear the
+    // normal and distance films
+    Sampler &hemi_sampler = *sampler_internal;
 
-                // Get sampler instance for tile
-                int seed = tile.y * nTiles.x + tile.x;
-                std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+    // Camera rays are traced in packets of neighbouring pixels
+    std::vector<Point2i> pixels;
+    for (Point2i pixel : bounds) {
+        pixels.push_back(pixel);
+    }
+    std::vector<Spectrum> sums (pixels.size(), Spectrum(0.f));
+    std::vector<Float> weight_sums (pixels.size(), 0.0);
+    std::vector<bool> traced (pixels.size(), false);
+
+    TraceCameraPackets(scene, *camera, hemi_sampler, pixels,
+            [&](int pixel_index, const CameraSample &camera_sample,
+                RayDifferential &ray, Float ray_weight,
+                SurfaceInteraction *isect) {
+        Point2i pixel = pixels[pixel_index];
+
+        Spectrum L (0.f);
+        if (ray_weight > 0) {
+            L = Li(ray, scene, hemi_sampler, hemi_arena[0], 0, pixel.x, pixel.y, camera, true, isect);
+            traced[pixel_index] = true;
+        }
 
-                // Compute sample bounds for tile
-                int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-                int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-                int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-                int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-                Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+        // Same rejection as RenderView, without the log messages
+        if (L.HasNaNs() || L.y() < -1e-5 || std::isinf(L.y())) {
+            L = Spectrum(0.f);
+        }
 
-                // Get _FilmTile_ for tile
-                std::unique_ptr<FilmTile> filmTile =
-                    camera->film->GetFilmTile(tileBounds);
+        sums[pixel_index] += ray_weight * L;
+        weight_sums[pixel_index] += ray_weight;
 
-                // Loop over pixels in tile to render them
-                for (Point2i pixel : tileBounds) {
-                    {
-                        ProfilePhase pp(Prof::StartPixel);
-                        tileSampler->StartPixel(pixel);
-                    }
+        hemi_arena[0].Reset();
+    });
 
-                    // Do this check after the StartPixel() call; this keeps
-                    // the usage of RNG values from (most) Samplers that use
-                    // RNGs consistent, which improves reproducability /
-                    // debugging.
-                    if (!InsideExclusive(pixel, pixelBounds))
-                        continue;
-
-                    do {
-                        // Initialize _CameraSample_ for current sample
-                        CameraSample cameraSample =
-                            tileSampler->GetCameraSample(pixel);
-
-                        // Generate camera ray for current sample
-                        RayDifferential ray;
-                        Float rayWeight =
-                            camera->GenerateRayDifferential(cameraSample, &ray);
-                        ray.ScaleDifferentials(
-                            1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-
-                        // Evaluate radiance along camera ray
-                        Spectrum L(0.f);
-                        if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena, 0, pixel.x, pixel.y, camera);
-
-                        // Issue warning if unexpected radiance value returned
-                        if (L.HasNaNs()) {
-                            LOG(ERROR) << StringPrintf(
-                                "Not-a-number radiance value returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        } else if (L.y() < -1e-5) {
-                            LOG(ERROR) << StringPrintf(
-                                "Negative luminance value, %f, returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                L.y(), pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        } else if (std::isinf(L.y())) {
-                              LOG(ERROR) << StringPrintf(
-                                "Infinite luminance value returned "
-                                "for pixel (%d, %d), sample %d. Setting to black.",
-                                pixel.x, pixel.y,
-                                (int)tileSampler->CurrentSampleNumber());
-                            L = Spectrum(0.f);
-                        }
-                        VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                            ray << " -> L = " << L;
-
-                        // Add camera ray's contribution to image
-                        filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-
-                        // Free _MemoryArena_ memory from computing image sample
-                        // value
-                        arena.Reset();
-                    } while (tileSampler->StartNextSample());
-                }
+    for (size_t i = 0; i < pixels.size(); i++) {
+        Point2i pixel = pixels[i];
 
-                // Merge image tile into _Film_
-                camera->film->MergeFilmTile(std::move(filmTile));
-            }
+        if (!traced[i]) {
+            distance_film->set_camera_coord(pixel.x, pixel.y, 0.0);
+            normal_film->set_camera_coord(pixel.x, pixel.y, Normal3f(0.0, 0.0, 0.0));
         }
+
+        Float rgb[3];
+        sums[i].ToRGB(rgb);
+        Float inv_weight = weight_sums[i] > 0 ? 1 / weight_sums[i] : 0;
+        intensity->set_camera_coord(
+                    pixel.x - camera->film->croppedPixelBounds.pMin.x,
+                    pixel.y - camera->film->croppedPixelBounds.pMin.y,
+                    std::max((Float) 0, rgb[0] * inv_weight),
+                    std::max((Float) 0, rgb[1] * inv_weight),
+                    std::max((Float) 0, rgb[2] * inv_weight)
+                    );
     }
 
+    return intensity;
+}
+
+// Resize maps ================================================================
+void IISPTdIntegrator::resize_maps(int width, int height)
+{
+    std::shared_ptr<ImageFilm> current = distance_film->get_image_film();
+    if (current->get_width() == width && current->get_height() == height) {
+        return;
+    }
+    distance_film = std::unique_ptr<DistanceFilm>(
+                new DistanceFilm(width, height)
+                );
+    normal_film = std::unique_ptr<NormalFilm>(
+                new NormalFilm(width, height)
+                );
 }
 
 // Save reference image =======================================================
@@ -504,9 +497,11 @@ std::shared_ptr<IISPTdIntegrator> CreateIISPTdIntegrator(
     LOG(INFO) << "CreateIISPTdIntegrator: in";
     int maxDepth = 3; // NOTE Hard-coded "maxdepth"
 
+    // Large enough for every hemisphere size
+    int hemi_size = iispt_hemi_max_size();
     Bounds2i pixelBounds (
                 Point2i(0, 0),
-                Point2i(PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize)
+                Point2i(hemi_size, hemi_size)
                 );
 
     Sampler* samplerPtr;
@@ -39,6 +39,7 @@
 #define PBRT_INTEGRATORS_IISPT_D_H
 
 // integrators/iispt_d.h*
+#include <cstdlib>
 #include "pbrt.h"
 #include "integrator.h"
 #include "scene.h"
@@ -71,6 +72,19 @@ private:
   std::unique_ptr<DistanceFilm> distance_film;
   std::unique_ptr<NormalFilm> normal_film;
 
+  // Reused by every RenderHemisphere call. A single element vector, like
+  // the arenas of SPPM: a MemoryArena member would make the integrator
+  // over-aligned for plain new
+  std::vector<MemoryArena> hemi_arena;
+
+  // IISPT_HEMI_RASTERISER, "film" makes RenderHemisphere go through the
+  // camera film like RenderView
+  bool hemi_film_rasteriser;
+
+  // Reallocates the normal and distance films if they are not
+  // <width> x <height>
+  void resize_maps(int width, int height);
+
   const Float rrThreshold = 0.5;
   const std::string lightSampleStrategy = std::string("spatial");
   std::unique_ptr<LightDistribution> lightDistribution;
@@ -88,7 +102,8 @@ public:
         camera(camera),
         sampler_internal(sampler),
         pixelBounds(pixelBounds),
-        maxDepth(maxDepth)
+        maxDepth(maxDepth),
+        hemi_arena(1)
     {
         distance_film = std::unique_ptr<DistanceFilm>(
             new DistanceFilm(
@@ -104,8 +119,15 @@ public:
                         )
                     );
 
+        char* rasteriser_env = std::getenv("IISPT_HEMI_RASTERISER");
+        hemi_film_rasteriser =
+                rasteriser_env != NULL &&
+                std::string(rasteriser_env) == std::string("film");
+
     }
 
+    // <first_traced> when the camera ray was already traced with
+    // TraceCameraPackets: <first_isect> is its hit, NULL if it missed
     Spectrum Li(const RayDifferential &r,
                                   const Scene &scene,
                                   Sampler &sampler,
@@ -113,7 +135,9 @@ public:
                                   int depth,
                                   int x,
                                   int y,
-                                  Camera* camera
+                                  Camera* camera,
+                                  bool first_traced = false,
+                                  SurfaceInteraction* first_isect = NULL
                                   );
 
     Spectrum Li(
@@ -131,6 +155,10 @@ public:
 
     void Preprocess(const Scene &scene);
 
+    // Restarts the sampler of RenderHemisphere from <seed>, so that the
+    // hemispheres that follow don't depend on the ones rendered before
+    void reseed(int seed);
+
     void RenderView(
             const Scene &scene,
             Camera* camera
@@ -142,6 +170,15 @@ public:
             Sampler* sampler
             );
 
+    // Single threaded render of a hemisphere view, for the indirect pass.
+    // Reuses the integrator's sampler and arena and writes every pixel
+    // straight into the returned film, without the camera film's filter;
+    // normals and distances go to get_normal_film() and get_distance_film()
+    std::unique_ptr<IntensityFilm> RenderHemisphere(
+            const Scene &scene,
+            Camera* camera
+            );
+
     void save_reference(std::shared_ptr<Camera> camera,
                                           std::string distance_filename,
                                           std::string normal_filename
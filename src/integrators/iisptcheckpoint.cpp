@@ -0,0 +1,236 @@
+#include "iisptcheckpoint.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+#include "tools/generalutils.h"
+
+namespace pbrt {
+
+static const char CHECKPOINT_MAGIC[8] = {'I', 'I', 'S', 'P', 'T', 'C', 'K', '1'};
+
+// ============================================================================
+// Writers return false on the first error
+
+template <typename T>
+static bool write_value(FILE* f, const T &value)
+{
+    return std::fwrite(&value, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+static bool write_vector(FILE* f, const std::vector<T> &values)
+{
+    int64_t count = values.size();
+    return write_value(f, count) &&
+            (count == 0 || std::fwrite(values.data(), sizeof(T), count, f) == (size_t) count);
+}
+
+// ============================================================================
+// Readers return false on the first error. Counts larger than the rest of
+// the file are errors, rather than huge allocations
+
+template <typename T>
+static bool read_value(FILE* f, T &value)
+{
+    return std::fread(&value, sizeof(T), 1, f) == 1;
+}
+
+template <typename T>
+static bool read_vector(FILE* f, long file_bytes, std::vector<T> &values)
+{
+    int64_t count;
+    if (!read_value(f, count) || count < 0 ||
+            count > (int64_t) (file_bytes / sizeof(T))) {
+        return false;
+    }
+    values.resize(count);
+    return count == 0 || std::fread(values.data(), sizeof(T), count, f) == (size_t) count;
+}
+
+// ============================================================================
+IisptCheckpoint::IisptCheckpoint(
+        const std::string &path,
+        IisptScheduleMonitor* schedule_monitor,
+        IisptFilmMonitor* film_monitor_indirect,
+        IisptFilmMonitor* film_monitor_direct
+        )
+{
+    this->path = path;
+    this->schedule_monitor = schedule_monitor;
+    this->film_monitor_indirect = film_monitor_indirect;
+    this->film_monitor_direct = film_monitor_direct;
+
+    char* interval_env = std::getenv("IISPT_CHECKPOINT_INTERVAL");
+    if (interval_env == NULL) {
+        interval = 300;
+    } else {
+        interval = std::max(1, std::stoi(std::string(interval_env)));
+    }
+}
+
+// ============================================================================
+bool IisptCheckpoint::write()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // Only the copy happens with the commits paused
+    schedule_monitor->pause_commits();
+    IisptScheduleState schedule = schedule_monitor->save_state();
+    std::vector<double> indirect = film_monitor_indirect->save_state();
+    std::vector<double> direct = film_monitor_direct->save_state();
+    schedule_monitor->resume_commits();
+
+    std::string tmp_path = path + std::string(".tmp");
+    if (!write_file(tmp_path, schedule, indirect, direct)) {
+        std::cerr << "iisptcheckpoint.cpp: could not write " << tmp_path << std::endl;
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "iisptcheckpoint.cpp: could not rename " << tmp_path << " to " << path << std::endl;
+        return false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "iisptcheckpoint.cpp: wrote " << path << " with " << schedule.tasks_completed << " tasks completed in " << elapsed.count() << "s" << std::endl;
+    return true;
+}
+
+// ============================================================================
+bool IisptCheckpoint::write_file(
+        const std::string &file_path,
+        const IisptScheduleState &schedule,
+        const std::vector<double> &indirect,
+        const std::vector<double> &direct
+        )
+{
+    FILE* f = std::fopen(file_path.c_str(), "wb");
+    if (f == NULL) {
+        return false;
+    }
+
+    Bounds2i bounds = film_monitor_indirect->get_film_bounds();
+    int32_t header[5] = {
+        IISPT_CHECKPOINT_VERSION,
+        bounds.pMin.x, bounds.pMin.y, bounds.pMax.x, bounds.pMax.y
+    };
+
+    bool ok = std::fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC), 1, f) == 1 &&
+            write_value(f, header) &&
+            write_value(f, schedule.pass) &&
+            write_value(f, schedule.current_radius) &&
+            write_value(f, schedule.tasks_completed) &&
+            write_value(f, schedule.next_direct_tile) &&
+            write_value(f, schedule.resumes) &&
+            write_vector(f, schedule.pending_direct_tiles) &&
+            write_vector(f, schedule.cost_grid) &&
+            write_value(f, (int64_t) schedule.open_passes.size());
+    for (const IisptScheduleOpenPass &open : schedule.open_passes) {
+        ok = ok &&
+                write_value(f, open.pass) &&
+                write_value(f, open.tilesize) &&
+                write_value(f, open.completed_area) &&
+                write_vector(f, open.completed);
+    }
+    ok = ok &&
+            write_vector(f, indirect) &&
+            write_vector(f, direct);
+
+    // The data has to be on disk before the rename replaces the last
+    // good checkpoint
+    ok = ok && std::fflush(f) == 0 && fsync(fileno(f)) == 0;
+    return std::fclose(f) == 0 && ok;
+}
+
+// ============================================================================
+bool IisptCheckpoint::read()
+{
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        std::cerr << "iisptcheckpoint.cpp: no checkpoint at " << path << ", starting from the beginning" << std::endl;
+        return false;
+    }
+    std::fseek(f, 0, SEEK_END);
+    long file_bytes = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+
+    char magic[8];
+    int32_t header[5];
+    if (std::fread(magic, sizeof(magic), 1, f) != 1 ||
+            !read_value(f, header) ||
+            std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+            header[0] != IISPT_CHECKPOINT_VERSION) {
+        std::cerr << "iisptcheckpoint.cpp: " << path << " is not a checkpoint" << std::endl;
+        std::raise(SIGKILL);
+    }
+    Bounds2i bounds = film_monitor_indirect->get_film_bounds();
+    if (header[1] != bounds.pMin.x || header[2] != bounds.pMin.y ||
+            header[3] != bounds.pMax.x || header[4] != bounds.pMax.y) {
+        std::cerr << "iisptcheckpoint.cpp: " << path << " is the checkpoint of another film" << std::endl;
+        std::raise(SIGKILL);
+    }
+
+    IisptScheduleState schedule;
+    int64_t open_passes;
+    bool ok = read_value(f, schedule.pass) &&
+            read_value(f, schedule.current_radius) &&
+            read_value(f, schedule.tasks_completed) &&
+            read_value(f, schedule.next_direct_tile) &&
+            read_value(f, schedule.resumes) &&
+            read_vector(f, file_bytes, schedule.pending_direct_tiles) &&
+            read_vector(f, file_bytes, schedule.cost_grid) &&
+            read_value(f, open_passes) &&
+            open_passes >= 0 && open_passes <= file_bytes;
+    for (int64_t i = 0; ok && i < open_passes; i++) {
+        IisptScheduleOpenPass open;
+        ok = read_value(f, open.pass) &&
+                read_value(f, open.tilesize) &&
+                read_value(f, open.completed_area) &&
+                read_vector(f, file_bytes, open.completed);
+        schedule.open_passes.push_back(open);
+    }
+    std::vector<double> indirect;
+    std::vector<double> direct;
+    ok = ok &&
+            read_vector(f, file_bytes, indirect) &&
+            read_vector(f, file_bytes, direct);
+    std::fclose(f);
+
+    if (!ok) {
+        std::cerr << "iisptcheckpoint.cpp: " << path << " is truncated" << std::endl;
+        std::raise(SIGKILL);
+    }
+    if (!film_monitor_indirect->restore_state(indirect) ||
+            !film_monitor_direct->restore_state(direct)) {
+        std::cerr << "iisptcheckpoint.cpp: film data in " << path << " doesn't match the film monitors" << std::endl;
+        std::raise(SIGKILL);
+    }
+    schedule_monitor->restore_state(schedule);
+
+    std::cerr << "iisptcheckpoint.cpp: resumed from " << path << std::endl;
+    return true;
+}
+
+// ============================================================================
+void IisptCheckpoint::run_periodic(std::atomic<bool> &finished)
+{
+    std::cerr << "iisptcheckpoint.cpp: writing " << path << " every " << interval << "s" << std::endl;
+
+    while (!finished) {
+        // Sleep in short steps to notice the end of the render
+        for (int waited = 0; waited < 1000 * interval && !finished; waited += 100) {
+            iile::sleepMillis(100);
+        }
+        if (!finished) {
+            write();
+        }
+    }
+}
+
+} // namespace pbrt
@@ -0,0 +1,83 @@
+#ifndef IISPTCHECKPOINT_H
+#define IISPTCHECKPOINT_H
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "integrators/iisptfilmmonitor.h"
+#include "integrators/iisptschedulemonitor.h"
+
+namespace pbrt {
+
+const int IISPT_CHECKPOINT_VERSION = 1;
+
+// ============================================================================
+// Binary checkpoint of an IILE render, so that a render killed after hours
+// can continue where it was.
+//
+// The file starts with "IISPTCK1" and the int32 version and film bounds
+// (pMin.x, pMin.y, pMax.x, pMax.y), followed by the IisptScheduleState and
+// the save_state() of the indirect and of the direct film monitor. Counts
+// are int64, the data is written as it is in memory, so a checkpoint can
+// only be resumed by the same build on the same machine.
+//
+// The file is written next to its final path and renamed over it, so a
+// crash while writing leaves the previous checkpoint intact.
+class IisptCheckpoint
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    std::string path;
+
+    IisptScheduleMonitor* schedule_monitor;
+
+    IisptFilmMonitor* film_monitor_indirect;
+
+    IisptFilmMonitor* film_monitor_direct;
+
+    // Seconds between periodic checkpoints
+    int interval;
+
+    // Private methods --------------------------------------------------------
+
+    bool write_file(
+            const std::string &file_path,
+            const IisptScheduleState &schedule,
+            const std::vector<double> &indirect,
+            const std::vector<double> &direct
+            );
+
+public:
+
+    // Constructor ------------------------------------------------------------
+    IisptCheckpoint(
+            const std::string &path,
+            IisptScheduleMonitor* schedule_monitor,
+            IisptFilmMonitor* film_monitor_indirect,
+            IisptFilmMonitor* film_monitor_direct
+            );
+
+    // Public methods ---------------------------------------------------------
+
+    // Pauses the commits of the render threads while the state is copied
+    // <return> false if the file could not be written
+    bool write();
+
+    // Restores the monitors, before the render threads start.
+    // <return> false if there is no checkpoint yet. Checkpoints of another
+    // film or that cannot be read stop the render
+    bool read();
+
+    // Writes a checkpoint every IISPT_CHECKPOINT_INTERVAL seconds until
+    // <finished> is set
+    void run_periodic(std::atomic<bool> &finished);
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTCHECKPOINT_H
@@ -0,0 +1,258 @@
+#include "iisptdatasetwriter.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <unistd.h>
+
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("IILE/Reference hemispheres written", referenceRecordsWritten);
+
+static const char SHARD_MAGIC[8] = {'I', 'I', 'S', 'P', 'T', 'D', 'S', '1'};
+static const char INDEX_MAGIC[8] = {'I', 'I', 'S', 'P', 'T', 'I', 'X', '1'};
+
+// ============================================================================
+static long file_size(FILE* f)
+{
+    if (std::fseek(f, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    return std::ftell(f);
+}
+
+// ============================================================================
+IisptDatasetWriter::IisptDatasetWriter(
+        const std::string &directory,
+        int hemi_size,
+        int shards,
+        bool resume
+        )
+{
+    this->directory = directory;
+    this->hemi_size = hemi_size;
+    this->record_bytes = compute_record_bytes(hemi_size);
+
+    std::vector<IisptDatasetIndexEntry> entries = read_index(resume);
+
+    // Records are appended to a shard in order, so the indexed ones are
+    // the first of each shard
+    std::map<int, int> indexed_records;
+    for (const IisptDatasetIndexEntry &e : entries) {
+        indexed_records[e.shard] = std::max(indexed_records[e.shard], e.record + 1);
+    }
+
+    // Start a fresh index with the records that are still valid
+    index_file = std::fopen((directory + IISPT_DATASET_INDEX_NAME).c_str(), "wb");
+    if (index_file == NULL) {
+        std::cerr << "iisptdatasetwriter.cpp: could not create " << directory << IISPT_DATASET_INDEX_NAME << std::endl;
+        std::raise(SIGKILL);
+    }
+    int32_t index_header[2] = {IISPT_DATASET_VERSION, hemi_size};
+    write_or_die(index_file, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    write_or_die(index_file, index_header, sizeof(index_header));
+    for (const IisptDatasetIndexEntry &e : entries) {
+        write_or_die(index_file, &e, sizeof(e));
+        done.insert(std::make_pair(e.x, e.y));
+    }
+    std::fflush(index_file);
+
+    for (int k = 0; k < shards; k++) {
+        auto found = indexed_records.find(k);
+        open_shard(k, found == indexed_records.end() ? 0 : found->second);
+    }
+
+    std::cerr << "iisptdatasetwriter.cpp: " << done.size() << " records in " << directory << ", " << shards << " shards" << std::endl;
+}
+
+// ============================================================================
+IisptDatasetWriter::~IisptDatasetWriter()
+{
+    for (FILE* f : shard_files) {
+        std::fclose(f);
+    }
+    std::fclose(index_file);
+}
+
+// ============================================================================
+int IisptDatasetWriter::compute_record_bytes(int hemi_size)
+{
+    return IISPT_DATASET_RECORD_HEADER_BYTES +
+            IISPT_DATASET_RECORD_PLANES * hemi_size * hemi_size * sizeof(float);
+}
+
+// ============================================================================
+std::string IisptDatasetWriter::shard_path(int shard) const
+{
+    return directory + IISPT_DATASET_SHARD_PREFIX + std::to_string(shard) +
+            IISPT_DATASET_SHARD_EXTENSION;
+}
+
+// ============================================================================
+// Index entries whose records are complete on disk. Empty when not
+// resuming or when there is no index yet
+std::vector<IisptDatasetIndexEntry> IisptDatasetWriter::read_index(bool resume)
+{
+    std::vector<IisptDatasetIndexEntry> entries;
+    if (!resume) {
+        return entries;
+    }
+
+    FILE* f = std::fopen((directory + IISPT_DATASET_INDEX_NAME).c_str(), "rb");
+    if (f == NULL) {
+        return entries;
+    }
+
+    char magic[8];
+    int32_t header[2];
+    if (std::fread(magic, sizeof(magic), 1, f) != 1 ||
+            std::fread(header, sizeof(header), 1, f) != 1 ||
+            std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+            header[0] != IISPT_DATASET_VERSION) {
+        std::cerr << "iisptdatasetwriter.cpp: " << directory << IISPT_DATASET_INDEX_NAME << " is not a dataset index" << std::endl;
+        std::raise(SIGKILL);
+    }
+    if (header[1] != hemi_size) {
+        std::cerr << "iisptdatasetwriter.cpp: cannot resume a dataset of hemisphere size " << header[1] << " with size " << hemi_size << std::endl;
+        std::raise(SIGKILL);
+    }
+
+    // A partially written last entry is dropped by fread
+    std::vector<IisptDatasetIndexEntry> indexed;
+    IisptDatasetIndexEntry e;
+    while (std::fread(&e, sizeof(e), 1, f) == 1) {
+        indexed.push_back(e);
+    }
+    std::fclose(f);
+
+    // Complete records in each shard file
+    std::map<int, long> shard_sizes;
+    std::set<std::pair<int, int>> seen;
+    for (const IisptDatasetIndexEntry &e : indexed) {
+        if (shard_sizes.find(e.shard) == shard_sizes.end()) {
+            FILE* sf = std::fopen(shard_path(e.shard).c_str(), "rb");
+            long records = 0;
+            if (sf != NULL) {
+                long bytes = file_size(sf);
+                if (bytes >= IISPT_DATASET_SHARD_HEADER_BYTES) {
+                    records = (bytes - IISPT_DATASET_SHARD_HEADER_BYTES) / record_bytes;
+                }
+                std::fclose(sf);
+            }
+            shard_sizes[e.shard] = records;
+        }
+        if (e.record < shard_sizes[e.shard] &&
+                seen.insert(std::make_pair(e.x, e.y)).second) {
+            entries.push_back(e);
+        }
+    }
+    return entries;
+}
+
+// ============================================================================
+// Opens <shard> for appending after its first <records> records, creating
+// it when <records> is 0
+void IisptDatasetWriter::open_shard(int shard, int records)
+{
+    std::string path = shard_path(shard);
+    FILE* f;
+    if (records > 0) {
+        long keep = IISPT_DATASET_SHARD_HEADER_BYTES + (long) records * record_bytes;
+        if (truncate(path.c_str(), keep) != 0) {
+            std::cerr << "iisptdatasetwriter.cpp: could not truncate " << path << std::endl;
+            std::raise(SIGKILL);
+        }
+        f = std::fopen(path.c_str(), "ab");
+    } else {
+        f = std::fopen(path.c_str(), "wb");
+        if (f != NULL) {
+            char header[IISPT_DATASET_SHARD_HEADER_BYTES];
+            std::memset(header, 0, sizeof(header));
+            int32_t fields[4] = {IISPT_DATASET_VERSION, hemi_size, record_bytes, shard};
+            std::memcpy(header, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+            std::memcpy(header + sizeof(SHARD_MAGIC), fields, sizeof(fields));
+            write_or_die(f, header, sizeof(header));
+            std::fflush(f);
+        }
+    }
+    if (f == NULL) {
+        std::cerr << "iisptdatasetwriter.cpp: could not open " << path << std::endl;
+        std::raise(SIGKILL);
+    }
+    shard_files.push_back(f);
+    shard_records.push_back(records);
+}
+
+// ============================================================================
+void IisptDatasetWriter::write_or_die(FILE* f, const void* data, size_t bytes)
+{
+    if (std::fwrite(data, 1, bytes, f) != bytes) {
+        std::cerr << "iisptdatasetwriter.cpp: write failed" << std::endl;
+        std::raise(SIGKILL);
+    }
+}
+
+// ============================================================================
+void IisptDatasetWriter::write_plane(FILE* f, ImageFilm* film, int components)
+{
+    if (film->get_width() != hemi_size ||
+            film->get_height() != hemi_size ||
+            film->get_components() != components) {
+        std::cerr << "iisptdatasetwriter.cpp: expected a " << hemi_size << "x" << hemi_size << "x" << components << " film, got " << film->get_width() << "x" << film->get_height() << "x" << film->get_components() << std::endl;
+        std::raise(SIGKILL);
+    }
+    write_or_die(f, film->get_data(), film->size() * sizeof(float));
+}
+
+// ============================================================================
+bool IisptDatasetWriter::contains(int x, int y)
+{
+    std::lock_guard<std::mutex> lock (index_mutex);
+    return done.count(std::make_pair(x, y)) > 0;
+}
+
+// ============================================================================
+int IisptDatasetWriter::size()
+{
+    std::lock_guard<std::mutex> lock (index_mutex);
+    return done.size();
+}
+
+// ============================================================================
+void IisptDatasetWriter::write(
+        int shard,
+        int x,
+        int y,
+        ImageFilm* d,
+        ImageFilm* n,
+        ImageFilm* z,
+        ImageFilm* p
+        )
+{
+    FILE* f = shard_files[shard];
+    int32_t record_header[4] = {x, y, 0, 0};
+    write_or_die(f, record_header, sizeof(record_header));
+    write_plane(f, d, 3);
+    write_plane(f, n, 3);
+    write_plane(f, z, 1);
+    write_plane(f, p, 3);
+    std::fflush(f);
+
+    IisptDatasetIndexEntry e;
+    e.x = x;
+    e.y = y;
+    e.shard = shard;
+    e.record = shard_records[shard]++;
+
+    std::lock_guard<std::mutex> lock (index_mutex);
+    write_or_die(index_file, &e, sizeof(e));
+    std::fflush(index_file);
+    done.insert(std::make_pair(x, y));
+    ++referenceRecordsWritten;
+}
+
+} // namespace pbrt
@@ -0,0 +1,130 @@
+#ifndef IISPTDATASETWRITER_H
+#define IISPTDATASETWRITER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "film/imagefilm.h"
+
+namespace pbrt {
+
+// Files of a packed dataset, in the reference output directory
+const std::string IISPT_DATASET_INDEX_NAME = std::string("dataset.idx");
+const std::string IISPT_DATASET_SHARD_PREFIX = std::string("dataset_");
+const std::string IISPT_DATASET_SHARD_EXTENSION = std::string(".bin");
+
+const int IISPT_DATASET_VERSION = 1;
+const int IISPT_DATASET_SHARD_HEADER_BYTES = 64;
+const int IISPT_DATASET_INDEX_HEADER_BYTES = 16;
+const int IISPT_DATASET_RECORD_HEADER_BYTES = 16;
+
+// Float planes of a record: d (3), n (3), z (1), p (3)
+const int IISPT_DATASET_RECORD_PLANES = 10;
+
+// ============================================================================
+// One index entry: the hemisphere of pixel <x>, <y> is record <record> of
+// shard <shard>
+struct IisptDatasetIndexEntry
+{
+    int32_t x;
+    int32_t y;
+    int32_t shard;
+    int32_t record;
+};
+
+// ============================================================================
+// Packed training dataset written by the reference mode.
+//
+// Each render thread appends to its own shard, dataset_<k>.bin:
+// a 64 bytes header ("IISPTDS1", version, hemisphere size, record bytes,
+// shard number, as little endian int32) followed by fixed size records.
+// A record is x, y and 2 reserved int32, then the float32 planes of
+// d (3 x S x S), n (3 x S x S), z (S x S) and p (3 x S x S), laid out
+// exactly like ImageFilm data, so shards can be memory mapped.
+//
+// dataset.idx has a 16 bytes header ("IISPTIX1", version, hemisphere
+// size) followed by an IisptDatasetIndexEntry per record. An entry is
+// appended only after its record has been flushed, so on resume the index
+// tells which pixels are done, and records past the last indexed one of a
+// shard are truncated away.
+class IisptDatasetWriter
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    std::string directory;
+
+    int hemi_size;
+
+    int record_bytes;
+
+    std::vector<FILE*> shard_files;
+
+    // Records in each shard
+    std::vector<int> shard_records;
+
+    FILE* index_file;
+
+    // Guards the index file and <done>
+    std::mutex index_mutex;
+
+    std::set<std::pair<int, int>> done;
+
+    // Private methods --------------------------------------------------------
+
+    std::string shard_path(int shard) const;
+
+    std::vector<IisptDatasetIndexEntry> read_index(bool resume);
+
+    void open_shard(int shard, int records);
+
+    static void write_or_die(FILE* f, const void* data, size_t bytes);
+
+    void write_plane(FILE* f, ImageFilm* film, int components);
+
+public:
+
+    // Constructor ------------------------------------------------------------
+    // With <resume>, existing records in <directory> are kept and
+    // contains() reports them; otherwise the dataset is started over
+    IisptDatasetWriter(
+            const std::string &directory,
+            int hemi_size,
+            int shards,
+            bool resume
+            );
+
+    ~IisptDatasetWriter();
+
+    // Public methods ---------------------------------------------------------
+
+    static int compute_record_bytes(int hemi_size);
+
+    // True if pixel <x>, <y> is already in the dataset
+    bool contains(int x, int y);
+
+    int size();
+
+    // Appends a record to <shard>. Each shard must be written by a single
+    // thread at a time, different shards can be written concurrently
+    void write(
+            int shard,
+            int x,
+            int y,
+            ImageFilm* d,
+            ImageFilm* n,
+            ImageFilm* z,
+            ImageFilm* p
+            );
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTDATASETWRITER_H
@@ -0,0 +1,513 @@
+#include "iisptdistributed.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+#include "stats.h"
+#include "tools/generalutils.h"
+
+namespace pbrt {
+
+STAT_COUNTER("IILE/Distributed tasks requeued", distributedRequeued);
+
+// The wire format is the in-memory layout of the values, coordinator and
+// workers have to run the same build on the same architecture.
+//
+// A worker opens with "IILEDST1" and the int32 version, film bounds,
+// indirect tasks and hemisphere size; the coordinator answers an int32,
+// 0 if it renders the same. Then the worker sends
+//   REQUEST                            answered with TASK and a task,
+//                                      WAIT or DONE
+//   RESULT, task, int64 count, sums    not answered
+static const char DISTRIBUTED_MAGIC[8] = {'I', 'I', 'L', 'E', 'D', 'S', 'T', '1'};
+
+static const int32_t IISPT_DISTRIBUTED_REQUEST = 1;
+static const int32_t IISPT_DISTRIBUTED_RESULT = 2;
+
+static const int32_t IISPT_DISTRIBUTED_TASK = 1;
+static const int32_t IISPT_DISTRIBUTED_WAIT = 2;
+static const int32_t IISPT_DISTRIBUTED_DONE = 3;
+
+// How often workers ask again after a WAIT
+static const int WAIT_POLL_MS = 100;
+
+// ============================================================================
+static bool send_all(int fd, const void* data, size_t bytes)
+{
+    const char* p = (const char*) data;
+    while (bytes > 0) {
+        ssize_t sent = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        bytes -= sent;
+    }
+    return true;
+}
+
+// ============================================================================
+static bool recv_all(int fd, void* data, size_t bytes)
+{
+    char* p = (char*) data;
+    while (bytes > 0) {
+        ssize_t received = recv(fd, p, bytes, 0);
+        if (received <= 0) {
+            return false;
+        }
+        p += received;
+        bytes -= received;
+    }
+    return true;
+}
+
+// ============================================================================
+static void hello_header(Bounds2i film_bounds, int32_t header[7])
+{
+    header[0] = IISPT_DISTRIBUTED_VERSION;
+    header[1] = film_bounds.pMin.x;
+    header[2] = film_bounds.pMin.y;
+    header[3] = film_bounds.pMax.x;
+    header[4] = film_bounds.pMax.y;
+    header[5] = PbrtOptions.iileIndirectTasks;
+    header[6] = PbrtOptions.iisptHemiSize;
+}
+
+// ============================================================================
+IisptTaskResult iispt_task_result(
+        const std::vector<Point2i> &pts,
+        const std::vector<Spectrum> &ss,
+        const std::vector<double> &weights
+        )
+{
+    IisptTaskResult result;
+    std::unordered_map<int64_t, size_t> positions;
+    for (size_t i = 0; i < pts.size(); i++) {
+        int64_t key = ((int64_t) pts[i].y << 32) | (uint32_t) pts[i].x;
+        auto found = positions.find(key);
+        if (found == positions.end()) {
+            IisptPixelSum sum;
+            sum.x = pts[i].x;
+            sum.y = pts[i].y;
+            sum.r = sum.g = sum.b = sum.weight = 0.0;
+            found = positions.insert(std::make_pair(key, result.size())).first;
+            result.push_back(sum);
+        }
+        float rgb[3];
+        ss[i].ToRGB(rgb);
+        IisptPixelSum &sum = result[found->second];
+        sum.r += rgb[0];
+        sum.g += rgb[1];
+        sum.b += rgb[2];
+        sum.weight += weights[i];
+    }
+    return result;
+}
+
+// Coordinator ================================================================
+
+// ============================================================================
+IisptCoordinator::IisptCoordinator(
+        IisptScheduleMonitor* schedule_monitor,
+        IisptFilmMonitor* film_monitor,
+        int tasks
+        )
+{
+    this->schedule_monitor = schedule_monitor;
+    this->film_monitor = film_monitor;
+    this->tasks = tasks;
+    // Resumed schedules start after the completed tasks
+    this->next_merge = schedule_monitor->get_task_number();
+}
+
+// ============================================================================
+IisptCoordinator::~IisptCoordinator()
+{
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        stopping = true;
+        // Wakes up accept() and the recv() of the connections
+        if (listen_fd >= 0) {
+            shutdown(listen_fd, SHUT_RDWR);
+        }
+        for (const auto &entry : connection_fds) {
+            shutdown(entry.second, SHUT_RDWR);
+        }
+    }
+    if (accept_thread.joinable()) {
+        accept_thread.join();
+    }
+    // No new connections after the accept thread is gone
+    for (std::thread &t : connection_threads) {
+        t.join();
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+}
+
+// ============================================================================
+bool IisptCoordinator::listen(int port)
+{
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "iisptdistributed.cpp: could not create the coordinator socket\n";
+        return false;
+    }
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    socklen_t address_size = sizeof(address);
+    if (bind(listen_fd, (sockaddr*) &address, sizeof(address)) != 0 ||
+            ::listen(listen_fd, 64) != 0 ||
+            getsockname(listen_fd, (sockaddr*) &address, &address_size) != 0) {
+        std::cerr << "iisptdistributed.cpp: could not listen on port " << port << std::endl;
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    this->port = ntohs(address.sin_port);
+
+    accept_thread = std::thread([this]() {
+        accept_loop();
+    });
+
+    std::cerr << "iisptdistributed.cpp: coordinator listening on port " << this->port << std::endl;
+    return true;
+}
+
+// ============================================================================
+void IisptCoordinator::accept_loop()
+{
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        std::unique_lock<std::mutex> lock (mutex);
+        if (stopping) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        if (fd < 0) {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        int connection = next_connection++;
+        connection_fds[connection] = fd;
+        connection_threads.push_back(std::thread([this, connection, fd]() {
+            serve(connection, fd);
+        }));
+    }
+}
+
+// ============================================================================
+void IisptCoordinator::serve(int connection, int fd)
+{
+    char magic[8];
+    int32_t header[7];
+    int32_t expected[7];
+    hello_header(film_monitor->get_film_bounds(), expected);
+    bool ok = recv_all(fd, magic, sizeof(magic)) &&
+            recv_all(fd, header, sizeof(header)) &&
+            std::memcmp(magic, DISTRIBUTED_MAGIC, sizeof(magic)) == 0;
+    int32_t status = ok && std::memcmp(header, expected, sizeof(header)) == 0 ? 0 : 1;
+    if (ok && status != 0) {
+        std::cerr << "iisptdistributed.cpp: rejected worker " << connection << ", it renders another film, task count or hemisphere size\n";
+    }
+    ok = ok && send_all(fd, &status, sizeof(status)) && status == 0;
+
+    if (ok) {
+        std::cerr << "iisptdistributed.cpp: worker " << connection << " connected\n";
+    }
+
+    while (ok) {
+        int32_t kind;
+        if (!recv_all(fd, &kind, sizeof(kind))) {
+            break;
+        }
+        if (kind == IISPT_DISTRIBUTED_REQUEST) {
+            IisptScheduleMonitorTask task;
+            int32_t reply;
+            {
+                std::unique_lock<std::mutex> lock (mutex);
+                reply = take_task(connection, task);
+            }
+            ok = send_all(fd, &reply, sizeof(reply)) &&
+                    (reply != IISPT_DISTRIBUTED_TASK || send_all(fd, &task, sizeof(task)));
+        } else if (kind == IISPT_DISTRIBUTED_RESULT) {
+            IisptScheduleMonitorTask task;
+            int64_t count;
+            ok = recv_all(fd, &task, sizeof(task)) &&
+                    recv_all(fd, &count, sizeof(count)) &&
+                    count >= 0 &&
+                    count <= (int64_t) (task.x1 - task.x0) * (task.y1 - task.y0);
+            IisptTaskResult result;
+            if (ok) {
+                result.resize(count);
+                ok = count == 0 || recv_all(fd, result.data(), count * sizeof(IisptPixelSum));
+            }
+            if (ok) {
+                finish_task(connection, task, result);
+            }
+        } else {
+            ok = false;
+        }
+    }
+
+    drop(connection);
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        connection_fds.erase(connection);
+        close(fd);
+        if (!stopping) {
+            std::cerr << "iisptdistributed.cpp: worker " << connection << " disconnected\n";
+        }
+    }
+    ReportThreadStats();
+}
+
+// ============================================================================
+int IisptCoordinator::take_task(int connection, IisptScheduleMonitorTask &task)
+{
+    bool found = false;
+    if (!requeued.empty()) {
+        task = requeued.begin()->second;
+        requeued.erase(requeued.begin());
+        found = true;
+    } else if (!schedule_exhausted) {
+        // The single queue of the monitor is always thread 0. Tasks are
+        // timed from hand-out to result, see finish_task()
+        task = schedule_monitor->take_task(0);
+        if (task.taskNumber < tasks) {
+            found = true;
+        } else {
+            schedule_exhausted = true;
+        }
+    }
+    if (found) {
+        outstanding[task.taskNumber] = std::make_pair(task, connection);
+        handed_out[task.taskNumber] = std::chrono::steady_clock::now();
+        return IISPT_DISTRIBUTED_TASK;
+    }
+    return next_merge >= tasks ? IISPT_DISTRIBUTED_DONE : IISPT_DISTRIBUTED_WAIT;
+}
+
+// ============================================================================
+void IisptCoordinator::finish_task(
+        int connection,
+        const IisptScheduleMonitorTask &task,
+        const IisptTaskResult &result
+        )
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    auto found = outstanding.find(task.taskNumber);
+    if (found == outstanding.end() || found->second.second != connection) {
+        return;
+    }
+    // The coordinator's copy, a worker can't move a task
+    finished[task.taskNumber] = std::make_pair(found->second.first, result);
+    outstanding.erase(found);
+    std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - handed_out[task.taskNumber];
+    finished_seconds[task.taskNumber] = elapsed.count();
+    handed_out.erase(task.taskNumber);
+
+    Bounds2i bounds = film_monitor->get_film_bounds();
+    while (!finished.empty() && finished.begin()->first == next_merge) {
+        const IisptScheduleMonitorTask &merged = finished.begin()->second.first;
+        {
+            IisptScheduleCommit commit (schedule_monitor);
+            for (const IisptPixelSum &sum : finished.begin()->second.second) {
+                if (sum.x >= merged.x0 && sum.x < merged.x1 &&
+                        sum.y >= merged.y0 && sum.y < merged.y1 &&
+                        Inside(Point2i(sum.x, sum.y), bounds)) {
+                    film_monitor->add_pixel_sum(
+                                Point2i(sum.x, sum.y),
+                                sum.r, sum.g, sum.b, sum.weight);
+                }
+            }
+            schedule_monitor->complete_task(
+                        merged, finished_seconds[next_merge]);
+        }
+        finished.erase(finished.begin());
+        finished_seconds.erase(next_merge);
+        next_merge++;
+    }
+    cv.notify_all();
+}
+
+// ============================================================================
+void IisptCoordinator::drop(int connection)
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    for (auto it = outstanding.begin(); it != outstanding.end(); ) {
+        if (it->second.second == connection) {
+            requeued[it->first] = it->second.first;
+            ++distributedRequeued;
+            handed_out.erase(it->first);
+            it = outstanding.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    cv.notify_all();
+}
+
+// ============================================================================
+bool IisptCoordinator::next_task(IisptScheduleMonitorTask &task)
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    while (true) {
+        int reply = take_task(-1, task);
+        if (reply == IISPT_DISTRIBUTED_TASK) {
+            return true;
+        }
+        if (reply == IISPT_DISTRIBUTED_DONE) {
+            return false;
+        }
+        cv.wait(lock);
+    }
+}
+
+// ============================================================================
+void IisptCoordinator::submit(
+        const IisptScheduleMonitorTask &task,
+        const IisptTaskResult &result
+        )
+{
+    finish_task(-1, task, result);
+}
+
+// ============================================================================
+void IisptCoordinator::wait()
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    cv.wait(lock, [this]() { return next_merge >= tasks; });
+}
+
+// Worker =====================================================================
+
+// ============================================================================
+IisptWorkerClient::~IisptWorkerClient()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// ============================================================================
+bool IisptWorkerClient::connect(const std::string &address, Bounds2i film_bounds)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "iisptdistributed.cpp: coordinator address " << address << " is not host:port\n";
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    std::string service = address.substr(colon + 1);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = NULL;
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0) {
+        std::cerr << "iisptdistributed.cpp: could not resolve " << address << std::endl;
+        return false;
+    }
+    for (addrinfo* a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        std::cerr << "iisptdistributed.cpp: could not connect to " << address << std::endl;
+        return false;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    int32_t header[7];
+    hello_header(film_bounds, header);
+    int32_t status = -1;
+    if (!send_all(fd, DISTRIBUTED_MAGIC, sizeof(DISTRIBUTED_MAGIC)) ||
+            !send_all(fd, header, sizeof(header)) ||
+            !recv_all(fd, &status, sizeof(status)) ||
+            status != 0) {
+        std::cerr << "iisptdistributed.cpp: the coordinator at " << address << " refused this worker, it renders another film, task count or hemisphere size\n";
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    std::cerr << "iisptdistributed.cpp: connected to the coordinator at " << address << std::endl;
+    return true;
+}
+
+// ============================================================================
+bool IisptWorkerClient::next_task(IisptScheduleMonitorTask &task)
+{
+    while (true) {
+        int32_t reply;
+        {
+            std::unique_lock<std::mutex> lock (mutex);
+            if (failed) {
+                return false;
+            }
+            int32_t kind = IISPT_DISTRIBUTED_REQUEST;
+            if (!send_all(fd, &kind, sizeof(kind)) ||
+                    !recv_all(fd, &reply, sizeof(reply)) ||
+                    (reply == IISPT_DISTRIBUTED_TASK && !recv_all(fd, &task, sizeof(task)))) {
+                std::cerr << "iisptdistributed.cpp: lost the coordinator\n";
+                failed = true;
+                return false;
+            }
+        }
+        if (reply == IISPT_DISTRIBUTED_TASK) {
+            return true;
+        }
+        if (reply != IISPT_DISTRIBUTED_WAIT) {
+            return false;
+        }
+        iile::sleepMillis(WAIT_POLL_MS);
+    }
+}
+
+// ============================================================================
+void IisptWorkerClient::submit(
+        const IisptScheduleMonitorTask &task,
+        const IisptTaskResult &result
+        )
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    if (failed) {
+        return;
+    }
+    int32_t kind = IISPT_DISTRIBUTED_RESULT;
+    int64_t count = result.size();
+    if (!send_all(fd, &kind, sizeof(kind)) ||
+            !send_all(fd, &task, sizeof(task)) ||
+            !send_all(fd, &count, sizeof(count)) ||
+            (count > 0 && !send_all(fd, result.data(), count * sizeof(IisptPixelSum)))) {
+        std::cerr << "iisptdistributed.cpp: lost the coordinator\n";
+        failed = true;
+    }
+}
+
+} // namespace pbrt
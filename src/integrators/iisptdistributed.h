@@ -0,0 +1,217 @@
+#ifndef IISPTDISTRIBUTED_H
+#define IISPTDISTRIBUTED_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spectrum.h"
+#include "integrators/iisptfilmmonitor.h"
+#include "integrators/iisptschedulemonitor.h"
+
+namespace pbrt {
+
+const int IISPT_DISTRIBUTED_VERSION = 1;
+
+// ============================================================================
+// Sums of the samples a task added to one pixel
+struct IisptPixelSum
+{
+    int32_t x;
+    int32_t y;
+    double r;
+    double g;
+    double b;
+    double weight;
+};
+
+// Pixel sums of a task, in the order the pixels were first sampled
+typedef std::vector<IisptPixelSum> IisptTaskResult;
+
+// Sums the samples of a task per pixel, like IisptFilmMonitor::add_n_samples
+IisptTaskResult iispt_task_result(
+        const std::vector<Point2i> &pts,
+        const std::vector<Spectrum> &ss,
+        const std::vector<double> &weights
+        );
+
+// ============================================================================
+// Where render threads take indirect tasks from and send their results to
+// when the indirect pass is distributed
+class IisptRemoteTasks
+{
+public:
+
+    virtual ~IisptRemoteTasks() {}
+
+    // Blocks until a task is available
+    // <return> false when the indirect pass is over
+    virtual bool next_task(IisptScheduleMonitorTask &task) = 0;
+
+    virtual void submit(
+            const IisptScheduleMonitorTask &task,
+            const IisptTaskResult &result
+            ) = 0;
+
+};
+
+// ============================================================================
+// Hands out the indirect tasks of a single-queue IisptScheduleMonitor to
+// the render threads of this process and to the workers connected over
+// TCP, and merges their results into the film monitor.
+//
+// Results are merged in task number order, whatever order they arrive
+// in. Render threads seed their samplers from the task number, so the
+// image doesn't depend on how many workers there were or on which of
+// them ran a task. Tasks of a worker that disconnects are handed out
+// again with the same number.
+//
+// Merges go through the commits of the schedule monitor, so checkpoints
+// keep working on the coordinator.
+class IisptCoordinator : public IisptRemoteTasks
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    IisptScheduleMonitor* schedule_monitor;
+
+    IisptFilmMonitor* film_monitor;
+
+    // Tasks with a number below this are part of the render
+    int tasks;
+
+    // Protects everything below
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Handed out, by task number, with the connection that has them.
+    // -1 is this process
+    std::map<int, std::pair<IisptScheduleMonitorTask, int>> outstanding;
+
+    // When the tasks in <outstanding> were handed out
+    std::map<int, std::chrono::steady_clock::time_point> handed_out;
+
+    // Tasks of dropped workers, handed out before new ones
+    std::map<int, IisptScheduleMonitorTask> requeued;
+
+    // Waiting for the tasks before them to be merged
+    std::map<int, std::pair<IisptScheduleMonitorTask, IisptTaskResult>> finished;
+
+    // Seconds from hand-out to result of the tasks in <finished>
+    std::map<int, double> finished_seconds;
+
+    int next_merge;
+
+    bool schedule_exhausted = false;
+
+    bool stopping = false;
+
+    int listen_fd = -1;
+
+    int port = 0;
+
+    std::thread accept_thread;
+
+    int next_connection = 0;
+
+    std::map<int, int> connection_fds;
+
+    std::vector<std::thread> connection_threads;
+
+    // Private methods --------------------------------------------------------
+
+    // <mutex> must be held
+    // <return> one of the IISPT_DISTRIBUTED_ reply kinds
+    int take_task(int connection, IisptScheduleMonitorTask &task);
+
+    void finish_task(
+            int connection,
+            const IisptScheduleMonitorTask &task,
+            const IisptTaskResult &result
+            );
+
+    void accept_loop();
+
+    void serve(int connection, int fd);
+
+    // Requeues the tasks of <connection>
+    void drop(int connection);
+
+public:
+
+    // Constructor ------------------------------------------------------------
+
+    // <schedule_monitor> must have a single thread, so tasks are handed
+    // out in order and never split
+    IisptCoordinator(
+            IisptScheduleMonitor* schedule_monitor,
+            IisptFilmMonitor* film_monitor,
+            int tasks
+            );
+
+    ~IisptCoordinator();
+
+    // Public methods ---------------------------------------------------------
+
+    // Accepts workers on <port>, any free port if 0
+    // <return> false if the port cannot be bound
+    bool listen(int port);
+
+    int get_port() const {
+        return port;
+    }
+
+    bool next_task(IisptScheduleMonitorTask &task);
+
+    void submit(
+            const IisptScheduleMonitorTask &task,
+            const IisptTaskResult &result
+            );
+
+    // Blocks until every task is merged
+    void wait();
+
+};
+
+// ============================================================================
+// Connection of a worker process to an IisptCoordinator. Shared by the
+// render threads of the worker, one request at a time
+class IisptWorkerClient : public IisptRemoteTasks
+{
+private:
+
+    int fd = -1;
+
+    std::mutex mutex;
+
+    bool failed = false;
+
+public:
+
+    ~IisptWorkerClient();
+
+    // <address> host:port of the coordinator. Fails if the coordinator
+    // renders another film, task count or hemisphere size
+    bool connect(const std::string &address, Bounds2i film_bounds);
+
+    // Polls the coordinator while all the tasks are handed out but not
+    // merged, another worker may drop some
+    bool next_task(IisptScheduleMonitorTask &task);
+
+    void submit(
+            const IisptScheduleMonitorTask &task,
+            const IisptTaskResult &result
+            );
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTDISTRIBUTED_H
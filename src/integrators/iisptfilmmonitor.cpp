@@ -1,45 +1,73 @@
 #include "iisptfilmmonitor.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace pbrt {
 
 // ============================================================================
 IisptFilmMonitor::IisptFilmMonitor(
-        Bounds2i film_bounds
+        Bounds2i film_bounds,
+        bool track_variance
         ) {
 
     this->film_bounds = film_bounds;
 
     // Initialize sampling density map
     Vector2i film_diagonal = film_bounds.Diagonal();
-    for (int y = 0; y <= film_diagonal.y; y++) {
-        std::vector<IisptPixel> row;
-        for (int x = 0; x <= film_diagonal.x; x++) {
-            IisptPixel pix;
-            row.push_back(pix);
-        }
-        pixels.push_back(row);
+    this->width = film_diagonal.x + 1;
+    this->height = film_diagonal.y + 1;
+    this->pixels = std::unique_ptr<IisptAtomicPixel[]>(
+                new IisptAtomicPixel[width * height]
+                );
+
+    this->tiles_x = (width + PREVIEW_TILE - 1) / PREVIEW_TILE;
+    this->tiles_y = (height + PREVIEW_TILE - 1) / PREVIEW_TILE;
+    this->dirty_tiles = std::unique_ptr<std::atomic<bool>[]>(
+                new std::atomic<bool>[tiles_x * tiles_y]
+                );
+    for (int i = 0; i < tiles_x * tiles_y; i++) {
+        dirty_tiles[i] = false;
+    }
+
+    if (track_variance) {
+        this->moments = std::unique_ptr<IisptPixelMoments[]>(
+                    new IisptPixelMoments[width * height]
+                    );
     }
 }
 
 // ============================================================================
 
-void IisptFilmMonitor::add_sample(Point2i pt, Spectrum s, double weight)
+void IisptFilmMonitor::mark_all_dirty()
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
+    for (int i = 0; i < tiles_x * tiles_y; i++) {
+        dirty_tiles[i] = true;
+    }
+}
 
-    execute_on_pixel([&](int fx, int fy) {
-        IisptPixel pix = (pixels[fy])[fx];
-        pix.weight += weight;
+// ============================================================================
 
-        float rgb[3];
-        s.ToRGB(rgb);
-        pix.r += rgb[0];
-        pix.g += rgb[1];
-        pix.b += rgb[2];
+void IisptFilmMonitor::take_dirty_tiles(std::vector<int> &tiles)
+{
+    for (int i = 0; i < tiles_x * tiles_y; i++) {
+        if (dirty_tiles[i].load() && dirty_tiles[i].exchange(false)) {
+            tiles.push_back(i);
+        }
+    }
+}
 
-        (pixels[fy])[fx] = pix;
-    }, pt.x, pt.y);
+// ============================================================================
 
+void IisptFilmMonitor::add_sample(Point2i pt, Spectrum s, double weight)
+{
+    float rgb[3];
+    s.ToRGB(rgb);
+    pixels[pixel_index(pt.x, pt.y)].add(rgb[0], rgb[1], rgb[2], weight);
+    if (moments) {
+        moments[pixel_index(pt.x, pt.y)].add(s.y());
+    }
+    mark_dirty(pt.x, pt.y);
 }
 
 // ============================================================================
@@ -50,25 +78,106 @@ void IisptFilmMonitor::add_n_samples(
         std::vector<double> &weights
         )
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
     for (int i = 0; i < pts.size(); i++) {
-        Point2i pt = pts[i];
-        execute_on_pixel([&](int fx, int fy) {
-            IisptPixel pix = (pixels[fy])[fx];
-            pix.weight += weights[i];
+        float rgb[3];
+        ss[i].ToRGB(rgb);
+        pixels[pixel_index(pts[i].x, pts[i].y)].add(
+                    rgb[0], rgb[1], rgb[2], weights[i]);
+        if (moments) {
+            moments[pixel_index(pts[i].x, pts[i].y)].add(ss[i].y());
+        }
+        mark_dirty(pts[i].x, pts[i].y);
+    }
+}
+
+// ============================================================================
+
+void IisptFilmMonitor::add_pixel_sum(
+        Point2i pt,
+        double r,
+        double g,
+        double b,
+        double weight
+        )
+{
+    pixels[pixel_index(pt.x, pt.y)].add(r, g, b, weight);
+    mark_dirty(pt.x, pt.y);
+}
 
-            float rgb[3];
-            ss[i].ToRGB(rgb);
+// ============================================================================
+
+bool IisptFilmMonitor::converged(
+        int x,
+        int y,
+        int min_samples,
+        double threshold
+        ) const
+{
+    if (!moments) {
+        return false;
+    }
+    const IisptPixelMoments &m = moments[pixel_index(x, y)];
+    double n = m.count.load();
+    if (n < min_samples || n < 2.0) {
+        return false;
+    }
+    double mean = m.sum.load() / n;
+    // Sample variance, clamped against rounding
+    double variance = std::max(0.0, (m.sum_sq.load() - n * mean * mean) / (n - 1.0));
+    double standard_error = std::sqrt(variance / n);
+    return standard_error <= threshold * std::abs(mean);
+}
 
-            pix.r += rgb[0];
-            pix.g += rgb[1];
-            pix.b += rgb[2];
+// ============================================================================
 
-            (pixels[fy])[fx] = pix;
-        }, pt.x, pt.y);
+std::vector<double> IisptFilmMonitor::save_state() const
+{
+    int n = width * height;
+    std::vector<double> state;
+    state.reserve((moments ? 7 : 4) * n);
+    for (int i = 0; i < n; i++) {
+        IisptPixel pix = pixels[i].load();
+        state.push_back(pix.r);
+        state.push_back(pix.g);
+        state.push_back(pix.b);
+        state.push_back(pix.weight);
     }
+    if (moments) {
+        for (int i = 0; i < n; i++) {
+            state.push_back(moments[i].sum.load());
+            state.push_back(moments[i].sum_sq.load());
+            state.push_back(moments[i].count.load());
+        }
+    }
+    return state;
+}
+
+// ============================================================================
 
+bool IisptFilmMonitor::restore_state(const std::vector<double> &state)
+{
+    int n = width * height;
+    if (state.size() != (size_t) (moments ? 7 : 4) * n) {
+        return false;
+    }
+    const double* p = state.data();
+    for (int i = 0; i < n; i++) {
+        IisptPixel pix;
+        pix.r = *p++;
+        pix.g = *p++;
+        pix.b = *p++;
+        pix.weight = *p++;
+        pixels[i].set(pix);
+    }
+    if (moments) {
+        for (int i = 0; i < n; i++) {
+            moments[i].sum.store(*p++);
+            moments[i].sum_sq.store(*p++);
+            moments[i].count.store(*p++);
+        }
+    }
+    mark_all_dirty();
+    return true;
 }
 
 // ============================================================================
@@ -77,91 +186,65 @@ void IisptFilmMonitor::addFromIntensityFilm(
         IntensityFilm* intensityFilm
         )
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
     // The intensity film is straight up while the film monitor
     // data is in camera format
 
     std::shared_ptr<ImageFilm> imageFilm = intensityFilm->get_image_film();
     int height = imageFilm->get_height();
     int width = imageFilm->get_width();
+    const float* rplane = imageFilm->get_plane(0);
+    const float* gplane = imageFilm->get_plane(1);
+    const float* bplane = imageFilm->get_plane(2);
     for (int y = 0; y < height; y++) {
+        int row = (height - 1 - y) * width;
+        IisptAtomicPixel* line = &pixels[y * this->width];
         for (int x = 0; x < width; x++) {
-            PfmItem item = imageFilm->get(x, height - 1 - y);
-            IisptPixel pix = (pixels[y])[x];
-            pix.weight += 1.0;
-            float r, g, b;
-            item.get_triple_component(r, g, b);
-            pix.r += r;
-            pix.g += g;
-            pix.b += b;
-
-            (pixels[y])[x] = pix;
+            line[x].add(rplane[row + x], gplane[row + x], bplane[row + x], 1.0);
         }
     }
-
+    mark_all_dirty();
 }
 
 void IisptFilmMonitor::setFromIntensityFilm(
         IntensityFilm* intensityFilm
         )
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
     // The intensity film is straight up while the film monitor
     // data is in camera format
 
     std::shared_ptr<ImageFilm> imageFilm = intensityFilm->get_image_film();
     int height = imageFilm->get_height();
     int width = imageFilm->get_width();
+    const float* rplane = imageFilm->get_plane(0);
+    const float* gplane = imageFilm->get_plane(1);
+    const float* bplane = imageFilm->get_plane(2);
     for (int y = 0; y < height; y++) {
+        int row = (height - 1 - y) * width;
+        IisptAtomicPixel* line = &pixels[y * this->width];
         for (int x = 0; x < width; x++) {
-            PfmItem item = imageFilm->get(x, height - 1 - y);
             IisptPixel pix;
             pix.weight = 1.0;
-            float r, g, b;
-            item.get_triple_component(r, g, b);
-            pix.r = r;
-            pix.g = g;
-            pix.b = b;
-
-            (pixels[y])[x] = pix;
+            pix.r = rplane[row + x];
+            pix.g = gplane[row + x];
+            pix.b = bplane[row + x];
+            line[x].set(pix);
         }
     }
+    mark_all_dirty();
 }
 
 // ============================================================================
 
 Bounds2i IisptFilmMonitor::get_film_bounds()
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
     return film_bounds;
 }
 
 // ============================================================================
 
-void IisptFilmMonitor::execute_on_pixel(
-        std::function<void (int, int)> func,
-        int x,
-        int y)
-{
-    int xstart = get_film_bounds().pMin.x;
-    int ystart = get_film_bounds().pMin.y;
-    int film_x = x - xstart;
-    int film_y = y - ystart;
-    func(film_x, film_y);
-}
-
-// ============================================================================
-
 std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film_priv(
         bool reversed)
 {
-    Vector2i diagonal = film_bounds.Diagonal();
-    int width = diagonal.x + 1;
-    int height = diagonal.y + 1;
-
     std::shared_ptr<IntensityFilm> intensity_film (
                 new IntensityFilm(
                     width,
@@ -169,30 +252,21 @@ std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film_priv(
                     )
                 );
 
+    std::shared_ptr<ImageFilm> image_film = intensity_film->get_image_film();
+    float* rplane = image_film->get_plane(0);
+    float* gplane = image_film->get_plane(1);
+    float* bplane = image_film->get_plane(2);
+
     for (int y = 0; y < height; y++) {
+        // Camera films have Y going upwards
+        int row = reversed ? (height - 1 - y) * width : y * width;
+        const IisptAtomicPixel* line = &pixels[y * width];
         for (int x = 0; x < width; x++) {
-            IisptPixel pix = (pixels[y])[x];
+            IisptPixel pix = line[x].load();
             if (pix.weight > 0.0) {
-                double r = pix.r / (pix.weight);
-                double g = pix.g / (pix.weight);
-                double b = pix.b / (pix.weight);
-                if (reversed) {
-                    intensity_film->set_camera_coord(
-                                x,
-                                y,
-                                (float) r,
-                                (float) g,
-                                (float) b
-                                );
-                } else {
-                    intensity_film->set(
-                                x,
-                                y,
-                                (float) r,
-                                (float) g,
-                                (float) b
-                                );
-                }
+                rplane[row + x] = (float) (pix.r / pix.weight);
+                gplane[row + x] = (float) (pix.g / pix.weight);
+                bplane[row + x] = (float) (pix.b / pix.weight);
             }
         }
     }
@@ -204,12 +278,7 @@ std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film_priv(
 
 std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film()
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
-    std::shared_ptr<IntensityFilm> intensity_film =
-            to_intensity_film_priv(false);
-
-    return intensity_film;
+    return to_intensity_film_priv(false);
 }
 
 // ============================================================================
@@ -218,12 +287,7 @@ std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film()
 
 std::shared_ptr<IntensityFilm> IisptFilmMonitor::to_intensity_film_reversed()
 {
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-
-    std::shared_ptr<IntensityFilm> intensity_film =
-            to_intensity_film_priv(true);
-
-    return intensity_film;
+    return to_intensity_film_priv(true);
 }
 
 // ============================================================================
@@ -232,10 +296,6 @@ std::shared_ptr<IisptFilmMonitor> IisptFilmMonitor::merge_into(
         IisptFilmMonitor* other
         )
 {
-    // Acquire lock on BOTH films
-    std::unique_lock<std::recursive_mutex> lock (mutex);
-    std::unique_lock<std::recursive_mutex> lock2 (other->mutex);
-
     // Create result film
     std::shared_ptr<IisptFilmMonitor> res (
                 new IisptFilmMonitor(film_bounds)
@@ -251,25 +311,24 @@ std::shared_ptr<IisptFilmMonitor> IisptFilmMonitor::merge_into(
 
     for (int y = film_bounds.pMin.y; y < film_bounds.pMax.y; y++) {
         for (int x = film_bounds.pMin.x; x < film_bounds.pMax.x; x++) {
-            execute_on_pixel([&](int fx, int fy) {
-                IisptPixel pix = (pixels[fy])[fx];
-                IisptPixel ot = (other->pixels[fy])[fx];
-                IisptPixel resultPixel;
-
-                // Normalize the pixels
-                pix.normalize();
-                ot.normalize();
+            int idx = pixel_index(x, y);
+            IisptPixel pix = pixels[idx].load();
+            IisptPixel ot = other->pixels[idx].load();
+            IisptPixel resultPixel;
 
-                resultPixel.r = pix.r + ot.r;
-                resultPixel.g = pix.g + ot.g;
-                resultPixel.b = pix.b + ot.b;
-                resultPixel.weight = 1.0;
+            // Normalize the pixels
+            pix.normalize();
+            ot.normalize();
 
-                (res->pixels[fy])[fx] = resultPixel;
+            resultPixel.r = pix.r + ot.r;
+            resultPixel.g = pix.g + ot.g;
+            resultPixel.b = pix.b + ot.b;
+            resultPixel.weight = 1.0;
 
-            }, x, y);
+            res->pixels[idx].set(resultPixel);
         }
     }
+    res->mark_all_dirty();
 
     return res;
 
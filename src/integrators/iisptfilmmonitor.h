@@ -1,10 +1,9 @@
 #ifndef IISPTFILMMONITOR_H
 #define IISPTFILMMONITOR_H
 
+#include <atomic>
 #include <memory>
-#include <mutex>
 #include <vector>
-#include <functional>
 #include <csignal>
 #include "film.h"
 #include "integrators/iisptfilmtile.h"
@@ -15,27 +14,80 @@
 namespace pbrt {
 
 // ============================================================================
+// Luminance moments of the samples of one pixel, for convergence tests
+struct IisptPixelMoments {
+    IisptAtomicDouble sum;
+    IisptAtomicDouble sum_sq;
+    IisptAtomicDouble count;
+
+    void add(double y)
+    {
+        sum.add(y);
+        sum_sq.add(y * y);
+        count.add(1.0);
+    }
+};
+
+// ============================================================================
+// Accumulates samples from all the render threads without locking.
+// Pixels live in a single row-major array and every component is added
+// with an atomic compare and swap, so writers only contend when they hit
+// the same pixel at the same time. Snapshots read the array while writers
+// keep going, see IisptAtomicPixel for what they can observe.
+//
+// Writes also flag the PREVIEW_TILE sized tile they land in, so the
+// preview stream only publishes the tiles that changed since the last
+// take_dirty_tiles(). The flag is set after the pixel is updated, and
+// take_dirty_tiles() clears it before the tile is read, so a sample is
+// either in the tile as read or leaves the tile flagged.
+//
+// Monitors created with <track_variance> also keep the luminance moments
+// of every pixel, so samplers can skip the pixels that converged.
 class IisptFilmMonitor
 {
-private:
+public:
 
-    // Fields -----------------------------------------------------------------
+    static const int PREVIEW_TILE = 32;
 
-    std::recursive_mutex mutex;
+private:
 
-    std::vector<std::vector<IisptPixel>> pixels;
+    // Fields -----------------------------------------------------------------
 
     // The bounds of the film are taken inclusively
     Bounds2i film_bounds;
 
+    int width;
+    int height;
+
+    std::unique_ptr<IisptAtomicPixel[]> pixels;
+
+    int tiles_x;
+    int tiles_y;
+
+    std::unique_ptr<std::atomic<bool>[]> dirty_tiles;
+
+    // Null unless variance is tracked
+    std::unique_ptr<IisptPixelMoments[]> moments;
+
     // Private methods --------------------------------------------------------
 
-    // <func> void function(int film_x, int film_y)
-    void execute_on_pixel(
-            std::function<void(int, int)> func,
-            int x,
-            int y
-            );
+    // Index in <pixels> of film pixel <x>, <y>
+    int pixel_index(int x, int y) const {
+        return (y - film_bounds.pMin.y) * width + (x - film_bounds.pMin.x);
+    }
+
+    // Only writes the flag when it's not set already, to keep the tile's
+    // cache line shared between the render threads
+    void mark_dirty(int x, int y) {
+        std::atomic<bool> &flag = dirty_tiles[
+                ((y - film_bounds.pMin.y) / PREVIEW_TILE) * tiles_x +
+                (x - film_bounds.pMin.x) / PREVIEW_TILE];
+        if (!flag.load()) {
+            flag.store(true);
+        }
+    }
+
+    void mark_all_dirty();
 
     std::shared_ptr<IntensityFilm> to_intensity_film_priv(
             bool reversed);
@@ -44,7 +96,8 @@ public:
 
     // Constructor ------------------------------------------------------------
     IisptFilmMonitor(
-            Bounds2i film_bounds
+            Bounds2i film_bounds,
+            bool track_variance = false
             );
 
     // Public methods ---------------------------------------------------------
@@ -59,6 +112,9 @@ public:
             std::vector<double> &weights
             );
 
+    // Adds the sums of several samples of pixel <pt> at once
+    void add_pixel_sum(Point2i pt, double r, double g, double b, double weight);
+
     std::shared_ptr<IntensityFilm> to_intensity_film();
 
     std::shared_ptr<IntensityFilm> to_intensity_film_reversed();
@@ -72,6 +128,54 @@ public:
     void setFromIntensityFilm(
             IntensityFilm* intensityFilm
             );
+
+    // Variance ---------------------------------------------------------------
+
+    // True when film pixel <x>, <y> has at least <min_samples> samples and
+    // the standard error of its mean luminance is at most <threshold> times
+    // the mean. Always false without variance tracking
+    bool converged(int x, int y, int min_samples, double threshold) const;
+
+    // Checkpoints ------------------------------------------------------------
+
+    bool tracks_variance() const {
+        return (bool) moments;
+    }
+
+    // r, g, b and weight of every pixel, followed by the luminance sum,
+    // sum of squares and count of every pixel when variance is tracked.
+    // Only consistent while nothing is added
+    std::vector<double> save_state() const;
+
+    // <return> false if <state> doesn't have the size of save_state()
+    bool restore_state(const std::vector<double> &state);
+
+    // Preview tiles ----------------------------------------------------------
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int get_tiles_x() const {
+        return tiles_x;
+    }
+
+    int get_tiles_y() const {
+        return tiles_y;
+    }
+
+    // Appends to <tiles> the indexes of the tiles written since the last
+    // call, and clears their flags
+    void take_dirty_tiles(std::vector<int> &tiles);
+
+    // Pixel <x>, <y> of the monitor, from 0 to width and height
+    IisptPixel get_pixel(int x, int y) const {
+        return pixels[y * width + x].load();
+    }
 };
 
 } // namespace pbrt
@@ -0,0 +1,107 @@
+#include "iispthemilod.h"
+
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace pbrt {
+
+// Hemisphere pixels a BSDF lobe should cover
+static const Float LOBE_PIXELS = 16;
+
+// BSDF directions sampled to find the lobe density. The centre of the
+// sample square is the peak of the microfacet lobes
+static const int PDF_SAMPLES = 5;
+static const Float PDF_SAMPLE_U[PDF_SAMPLES][2] = {
+    {0.5, 0.5}, {0.25, 0.25}, {0.75, 0.25}, {0.25, 0.75}, {0.75, 0.75}
+};
+
+// Grazing views don't make the footprint of a tile infinite
+static const Float MIN_COS = 0.1;
+
+// ============================================================================
+std::vector<int> iispt_hemi_levels()
+{
+    std::vector<int> levels;
+    char* lod_env = std::getenv("IISPT_HEMI_LOD");
+    if (lod_env == NULL) {
+        levels.push_back(PbrtOptions.iisptHemiSize);
+        return levels;
+    }
+
+    std::stringstream ss (lod_env);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int level = std::atoi(item.c_str());
+        // The NN halves the hemisphere 3 times
+        if (level <= 0 || level % 8 != 0) {
+            std::cerr << "iispthemilod.cpp: IISPT_HEMI_LOD sizes must be multiples of 8, got [" << item << "]\n";
+            std::raise(SIGKILL);
+        }
+        levels.push_back(level);
+    }
+    if (levels.empty()) {
+        std::cerr << "iispthemilod.cpp: IISPT_HEMI_LOD is empty\n";
+        std::raise(SIGKILL);
+    }
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    return levels;
+}
+
+// ============================================================================
+int iispt_hemi_max_size()
+{
+    return iispt_hemi_levels().back();
+}
+
+// ============================================================================
+IisptHemiLod::IisptHemiLod()
+{
+    this->levels = iispt_hemi_levels();
+}
+
+// ============================================================================
+int IisptHemiLod::choose(
+        const BSDF &bsdf,
+        const Vector3f &wo,
+        Float pixel_angle,
+        int tilesize
+        ) const
+{
+    if (!enabled()) {
+        return levels.back();
+    }
+
+    // Specular bounces are followed before the hemisphere is placed
+    BxDFType flags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+    Float max_pdf = 0;
+    for (int i = 0; i < PDF_SAMPLES; i++) {
+        Vector3f wi;
+        Float pdf = 0;
+        Point2f u (PDF_SAMPLE_U[i][0], PDF_SAMPLE_U[i][1]);
+        Spectrum f = bsdf.Sample_f(wo, &wi, u, &pdf, flags);
+        if (!f.IsBlack()) {
+            max_pdf = std::max(max_pdf, pdf);
+        }
+    }
+    Float size = std::sqrt(2 * Pi * LOBE_PIXELS * max_pdf);
+
+    if (pixel_angle > 0 && tilesize > 0) {
+        Float cos_theta = std::max(MIN_COS, AbsCosTheta(bsdf.WorldToLocal(wo)));
+        size = std::min(size, Pi * cos_theta / (pixel_angle * tilesize));
+    }
+
+    for (int level : levels) {
+        if (level >= size) {
+            return level;
+        }
+    }
+    return levels.back();
+}
+
+} // namespace pbrt
@@ -0,0 +1,76 @@
+#ifndef IISPTHEMILOD_H
+#define IISPTHEMILOD_H
+
+#include <vector>
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "reflection.h"
+
+namespace pbrt {
+
+// ============================================================================
+// Sizes a hemisphere can be computed at, from IISPT_HEMI_LOD, ascending.
+// Just --iispt_hemi_size when the variable is not set
+std::vector<int> iispt_hemi_levels();
+
+// Largest of iispt_hemi_levels(). The auxiliary camera, the hemisphere
+// integrators and the NN transport buffers are sized for it
+int iispt_hemi_max_size();
+
+// ============================================================================
+// Chooses the size of the hemisphere computed at a sample point.
+//
+// Rendering a hemisphere and evaluating the NN on it cost about as much as
+// it has pixels, but only glossy surfaces see the detail of a large one.
+// The size is the smallest level of at least
+//     sqrt(2 pi LOBE_PIXELS pdf)
+// pixels across, where pdf is the largest BSDF density of a few sampled
+// directions: a lobe of about 1 / pdf steradians then covers LOBE_PIXELS
+// hemisphere pixels. A diffuse surface needs 6 pixels across.
+// The tile interpolating the hemisphere limits it to
+//     pi cos / (pixel_angle tilesize)
+// pixels across. pixel_angle tilesize / cos is the projected footprint of
+// the tile seen from the camera; finer detail would shift across the tile
+// by parallax anyway.
+class IisptHemiLod
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    std::vector<int> levels;
+
+public:
+
+    // Constructor ------------------------------------------------------------
+    IisptHemiLod();
+
+    IisptHemiLod(const std::vector<int> &levels) :
+        levels(levels)
+    {
+
+    }
+
+    // Public methods ---------------------------------------------------------
+
+    bool enabled() const {
+        return levels.size() > 1;
+    }
+
+    // <wo> towards the viewer, world space
+    // <pixel_angle> between the primary rays of adjacent pixels, 0 if not
+    //               known
+    // <tilesize> of the task the hemisphere belongs to
+    int choose(
+            const BSDF &bsdf,
+            const Vector3f &wo,
+            Float pixel_angle,
+            int tilesize
+            ) const;
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTHEMILOD_H
@@ -0,0 +1,203 @@
+#include "iispthemispherecache.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_PERCENT("IILE/Hemisphere cache hits", hemiCacheHits, hemiCacheLookups);
+STAT_COUNTER("IILE/Hemisphere cache insertions", hemiCacheInsertions);
+
+// Minimum dot product between the normals of an entry and a lookup
+static const Float NORMAL_THRESHOLD = 0.95;
+
+// Cells per side of the scene bounds
+static const Float GRID_RESOLUTION = 128;
+
+// ============================================================================
+IisptHemisphereCache::IisptHemisphereCache(const Bounds3f &world_bound)
+{
+    this->world_bound = world_bound;
+
+    this->shards = std::unique_ptr<Shard[]>(new Shard[SHARDS]);
+
+    Float diagonal = world_bound.Diagonal().Length();
+    this->cell_size = diagonal > 0 ? diagonal / GRID_RESOLUTION : 1.0;
+
+    this->entries = 0;
+    this->lookups = 0;
+    this->hits = 0;
+
+    char* size_env = std::getenv("IISPT_HEMI_CACHE_SIZE");
+    if (size_env == NULL) {
+        max_entries = 4096;
+    } else {
+        max_entries = std::max(0, std::stoi(std::string(size_env)));
+    }
+
+    char* error_env = std::getenv("IISPT_HEMI_CACHE_ERROR");
+    if (error_env == NULL) {
+        error = 0.1;
+    } else {
+        error = std::stof(std::string(error_env));
+    }
+
+    char* reuse_env = std::getenv("IISPT_HEMI_CACHE_REUSE");
+    if (reuse_env == NULL) {
+        max_reuse = 3;
+    } else {
+        max_reuse = std::stoi(std::string(reuse_env));
+    }
+
+    std::cerr << "iispthemispherecache.cpp: " << max_entries << " entries, cell size " << cell_size << std::endl;
+}
+
+// ============================================================================
+Point3i IisptHemisphereCache::cell_of(const Point3f &p) const
+{
+    Vector3f offset = (p - world_bound.pMin) / cell_size;
+    return Point3i(
+                (int) std::floor(offset.x),
+                (int) std::floor(offset.y),
+                (int) std::floor(offset.z)
+                );
+}
+
+// 21 bits per axis
+uint64_t IisptHemisphereCache::cell_key(const Point3i &cell)
+{
+    const uint64_t mask = (1ull << 21) - 1;
+    return ((uint64_t) (cell.x & mask)) |
+            (((uint64_t) (cell.y & mask)) << 21) |
+            (((uint64_t) (cell.z & mask)) << 42);
+}
+
+// ============================================================================
+// The closest valid entry wins
+std::shared_ptr<HemisphericCamera> IisptHemisphereCache::lookup(
+        const Point3f &p,
+        const Normal3f &n,
+        int min_size
+        )
+{
+    if (!enabled()) {
+        return nullptr;
+    }
+
+    ++hemiCacheLookups;
+    lookups++;
+
+    Point3i centre = cell_of(p);
+    std::shared_ptr<IisptHemisphereCacheEntry> best;
+    Float best_distance = Infinity;
+
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                uint64_t key = cell_key(centre + Vector3i(dx, dy, dz));
+                Shard &shard = shard_of(key);
+                std::unique_lock<std::mutex> lock (shard.mutex);
+                auto it = shard.cells.find(key);
+                if (it == shard.cells.end()) {
+                    continue;
+                }
+                for (const std::shared_ptr<IisptHemisphereCacheEntry> &entry : it->second) {
+                    Float d = Distance(p, entry->position);
+                    if (d > entry->valid_radius || d >= best_distance) {
+                        continue;
+                    }
+                    if (Dot(n, entry->normal) < NORMAL_THRESHOLD) {
+                        continue;
+                    }
+                    if (entry->uses.load() >= max_reuse) {
+                        continue;
+                    }
+                    if (entry->camera->film->fullResolution.x < min_size) {
+                        continue;
+                    }
+                    best = entry;
+                    best_distance = d;
+                }
+            }
+        }
+    }
+
+    if (!best) {
+        return nullptr;
+    }
+
+    // Concurrent lookups may both pass the check above, which only lets
+    // an entry go slightly over its reuse budget
+    best->uses++;
+    ++hemiCacheHits;
+    hits++;
+    return best->camera;
+}
+
+// ============================================================================
+void IisptHemisphereCache::insert(
+        const Point3f &p,
+        const Normal3f &n,
+        Float harmonic_mean_distance,
+        std::shared_ptr<HemisphericCamera> camera
+        )
+{
+    if (!enabled() || !camera) {
+        return;
+    }
+
+    std::shared_ptr<IisptHemisphereCacheEntry> entry (
+                new IisptHemisphereCacheEntry()
+                );
+    entry->position = p;
+    entry->normal = n;
+    // Lookups only reach the neighbouring cells
+    entry->valid_radius = harmonic_mean_distance > 0 ?
+                std::min(cell_size, error * harmonic_mean_distance) :
+                cell_size;
+    entry->camera = std::move(camera);
+    entry->uses = 0;
+
+    uint64_t key = cell_key(cell_of(p));
+    Shard &shard = shard_of(key);
+    std::unique_lock<std::mutex> lock (shard.mutex);
+
+    shard.cells[key].push_back(entry);
+    shard.order.push_back(entry);
+    ++hemiCacheInsertions;
+
+    // Each shard evicts its own oldest entries
+    int shard_capacity = std::max(1, max_entries / SHARDS);
+    if ((int) shard.order.size() <= shard_capacity) {
+        entries++;
+        return;
+    }
+    std::shared_ptr<IisptHemisphereCacheEntry> oldest = shard.order.front();
+    shard.order.pop_front();
+    uint64_t oldest_key = cell_key(cell_of(oldest->position));
+    std::vector<std::shared_ptr<IisptHemisphereCacheEntry>> &cell =
+            shard.cells[oldest_key];
+    cell.erase(std::remove(cell.begin(), cell.end(), oldest), cell.end());
+    if (cell.empty()) {
+        shard.cells.erase(oldest_key);
+    }
+}
+
+// ============================================================================
+void IisptHemisphereCache::print_stats()
+{
+    if (!enabled()) {
+        return;
+    }
+    int64_t l = lookups;
+    int64_t h = hits;
+    double rate = l > 0 ? 100.0 * h / l : 0.0;
+    std::cerr << "iispthemispherecache.cpp: " << entries << " hemispheres cached, "
+              << h << " hits of " << l << " lookups (" << rate << "%)" << std::endl;
+}
+
+} // namespace pbrt
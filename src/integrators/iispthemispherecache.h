@@ -0,0 +1,124 @@
+#ifndef IISPTHEMISPHERECACHE_H
+#define IISPTHEMISPHERECACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "geometry.h"
+#include "cameras/hemispheric.h"
+
+namespace pbrt {
+
+// ============================================================================
+// A hemisphere evaluated by the NN, as seen from <position>
+struct IisptHemisphereCacheEntry
+{
+    Point3f position;
+    Normal3f normal;
+    // Lookups farther than this from <position> do not use the entry
+    Float valid_radius;
+    std::shared_ptr<HemisphericCamera> camera;
+    std::atomic<int> uses;
+};
+
+// ============================================================================
+// Persistent cache of NN hemispheres shared by all the render threads,
+// indexed by world-space position and normal.
+//
+// Like an irradiance cache, each hemisphere is valid within a radius
+// proportional to the harmonic mean distance of the geometry it sees
+// (IISPT_HEMI_CACHE_ERROR), for normals within about 18 degrees.
+// Entries are stored in a hashed uniform grid whose cells are as large as
+// the largest valid radius, so a lookup only visits the 27 cells around
+// the query point. The grid is split in shards with their own mutex.
+//
+// A hemisphere is reused at most IISPT_HEMI_CACHE_REUSE times, after which
+// the following passes compute a fresh one, so the progressive passes
+// still add new information. The oldest entries are evicted when the cache
+// holds IISPT_HEMI_CACHE_SIZE hemispheres; 0 disables the cache.
+class IisptHemisphereCache
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    static const int SHARDS = 64;
+
+    struct Shard {
+        std::mutex mutex;
+        // Cell key -> entries
+        std::unordered_map<uint64_t,
+            std::vector<std::shared_ptr<IisptHemisphereCacheEntry>>> cells;
+        // Insertion order, for eviction
+        std::deque<std::shared_ptr<IisptHemisphereCacheEntry>> order;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+
+    Bounds3f world_bound;
+
+    Float cell_size;
+
+    int max_entries;
+
+    Float error;
+
+    int max_reuse;
+
+    std::atomic<int> entries;
+
+    std::atomic<int64_t> lookups;
+
+    std::atomic<int64_t> hits;
+
+    // Private methods --------------------------------------------------------
+
+    Point3i cell_of(const Point3f &p) const;
+
+    static uint64_t cell_key(const Point3i &cell);
+
+    Shard& shard_of(uint64_t key) {
+        return shards[(key * 0x9E3779B97F4A7C15ull) >> 58];
+    }
+
+public:
+
+    // Constructor ------------------------------------------------------------
+    IisptHemisphereCache(const Bounds3f &world_bound);
+
+    // Public methods ---------------------------------------------------------
+
+    bool enabled() const {
+        return max_entries > 0;
+    }
+
+    // Hemisphere valid at <p>, <n>, or nullptr
+    // <min_size> skips hemispheres with fewer pixels across, computed where
+    // the BSDF needed less detail
+    std::shared_ptr<HemisphericCamera> lookup(
+            const Point3f &p,
+            const Normal3f &n,
+            int min_size = 0
+            );
+
+    // <harmonic_mean_distance> of the geometry seen by the hemisphere,
+    // negative if it sees none
+    void insert(
+            const Point3f &p,
+            const Normal3f &n,
+            Float harmonic_mean_distance,
+            std::shared_ptr<HemisphericCamera> camera
+            );
+
+    void print_stats();
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTHEMISPHERECACHE_H
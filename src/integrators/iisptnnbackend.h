@@ -0,0 +1,71 @@
+#ifndef IISPTNNBACKEND_H
+#define IISPTNNBACKEND_H
+
+#include <future>
+#include <memory>
+#include "film/distancefilm.h"
+#include "film/intensityfilm.h"
+#include "film/normalfilm.h"
+
+namespace pbrt {
+
+// Common interface of the objects that can turn a normalized hemisphere
+// (intensity, normals, distance) into the estimated indirect radiance
+// hemisphere.
+// Render runners only talk to this interface, so that per-thread child
+// processes and shared services can be swapped without touching the
+// runners.
+
+// Output of an asynchronous request
+struct IisptNnResult {
+    std::unique_ptr<IntensityFilm> film;
+    // 1 if an error occurred, 0 if all ok
+    int status = 1;
+};
+
+class IisptNnBackend
+{
+public:
+
+    virtual ~IisptNnBackend() = default;
+
+    // <status> becomes 1 if an error occurred
+    //                  0 if all ok
+    // Must be safe to call concurrently if the same backend is shared
+    // between render threads
+    virtual std::unique_ptr<IntensityFilm> communicate(
+            IntensityFilm* intensity,
+            DistanceFilm* distance,
+            NormalFilm* normals,
+            int &status
+            ) = 0;
+
+    // Queue a hemisphere and return without waiting for the network.
+    // The backend takes ownership of the films until the result is ready.
+    // Backends that cannot overlap requests evaluate it immediately.
+    virtual std::future<IisptNnResult> submit(
+            std::unique_ptr<IntensityFilm> intensity,
+            std::unique_ptr<DistanceFilm> distance,
+            std::unique_ptr<NormalFilm> normals
+            )
+    {
+        IisptNnResult result;
+        result.film = communicate(
+                    intensity.get(),
+                    distance.get(),
+                    normals.get(),
+                    result.status
+                    );
+        std::promise<IisptNnResult> promise;
+        promise.set_value(std::move(result));
+        return promise.get_future();
+    }
+
+    // Release external resources (child processes, threads)
+    virtual void sendEOF() {}
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTNNBACKEND_H
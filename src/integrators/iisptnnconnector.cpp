@@ -1,12 +1,29 @@
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include "iisptnnconnector.h"
+#include "iispthemilod.h"
 
 namespace pbrt {
 
+// ============================================================================
+// Utilities
+
+// Write the pixels of <film> into <dst> as (components, height, width)
+// <return> the number of floats written
+static int pack_image_film(ImageFilm* film, float* dst) {
+    // The input ImageFilm is assumed to already have the
+    // correct Y axis direction
+    film->copy_to_float_array(dst);
+    return film->size();
+}
+
 // ============================================================================
 // Constructor
-IisptNnConnector::IisptNnConnector() {
+IisptNnConnector::IisptNnConnector(bool batch, int max_batch) :
+    batch(batch),
+    max_batch(max_batch)
+{
 
     // Get environment variable
     char* nn_py_path = getenv("IISPT_STDIO_NET_PY_PATH");
@@ -15,74 +32,132 @@ IisptNnConnector::IisptNnConnector() {
         exit(1);
     }
 
-    char *const argv[] = {
+    // Transport, shared memory unless disabled or unavailable
+    bool use_shm = true;
+    char* transport_env = getenv("IISPT_NN_TRANSPORT");
+    if (transport_env != NULL) {
+        std::string transport (transport_env);
+        if (transport == "pipe") {
+            use_shm = false;
+        } else if (transport != "shm") {
+            std::cerr << "iisptnnconnector.cpp: unknown IISPT_NN_TRANSPORT [" << transport << "], using shm\n";
+        }
+    }
+    if (use_shm) {
+        int hemisize = iispt_hemi_max_size();
+        shm = std::unique_ptr<ShmRing>(
+                    new ShmRing(SHM_SLOTS, max_batch, input_floats(hemisize), output_floats(hemisize))
+                    );
+        if (!shm->ok()) {
+            std::cerr << "iisptnnconnector.cpp: shared memory not available, falling back to pipes\n";
+            shm.reset();
+        }
+    }
+
+    std::vector<std::string> args = {
         "python3",
         "-u",
-        nn_py_path,
-        NULL
+        std::string(nn_py_path)
     };
+    if (batch) {
+        args.push_back("--batch");
+    }
+    std::vector<int> inherit_fds;
+    if (shm) {
+        args.push_back("--shm");
+        inherit_fds = shm->get_fds();
+        for (int fd : inherit_fds) {
+            args.push_back(std::to_string(fd));
+        }
+    } else {
+        int hemisize = iispt_hemi_max_size();
+        pipe_input.resize(max_batch * input_floats(hemisize));
+        pipe_output.resize(max_batch * output_floats(hemisize));
+    }
+
+    std::vector<char*> argv;
+    for (std::string &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(NULL);
 
     child_process = std::unique_ptr<ChildProcess>(
                 new ChildProcess(
                     std::string("python3"),
-                    argv
+                    &argv[0],
+                    inherit_fds
                     )
                 );
 
 }
 
+// ============================================================================
+// Sizes
+
+int IisptNnConnector::input_floats(int hemisize)
+{
+    return hemisize * hemisize * 7;
+}
+
+int IisptNnConnector::output_floats(int hemisize)
+{
+    return hemisize * hemisize * 3;
+}
+
+// ============================================================================
+// Pack input
+void IisptNnConnector::pack_input(
+        IntensityFilm* intensity,
+        DistanceFilm* distance,
+        NormalFilm* normals,
+        float* dst
+        )
+{
+    int offset = 0;
+    offset += pack_image_film(intensity->get_image_film().get(), &dst[offset]);
+    offset += pack_image_film(normals->get_image_film().get(), &dst[offset]);
+    offset += pack_image_film(distance->get_image_film().get(), &dst[offset]);
+}
+
 // ============================================================================
 // Pipe image film
 void IisptNnConnector::pipe_image_film(std::shared_ptr<ImageFilm> film) {
     if (film == NULL) {
         std::cerr << "Film is null!" << std::endl;
     }
-    int height = film->get_height();
-    int width = film->get_width();
-    int components = film->get_components();
-
-    // The input ImageFilm is assumed to already have the
-    // correct Y axis direction
-
-    int nfloats = height * width * components;
+    int nfloats = film->get_height() * film->get_width() * film->get_components();
     std::vector<float> floatarray (nfloats);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            PfmItem pixel_item = film->get(x, y);
-            if (components == 1) {
-                int idx = y * width + x;
-                floatarray[idx] = pixel_item.get_single_component();
-            } else if (components == 3) {
-                Float r;
-                Float g;
-                Float b;
-                pixel_item.get_triple_component(r, g, b);
-                int idx = 3 * (y * width + x);
-                floatarray[idx + 0] = r;
-                floatarray[idx + 1] = g;
-                floatarray[idx + 2] = b;
-            } else {
-                std::cerr << "iisptnnconnector.cpp: Error, components is neither 1 nor 3. Stopping..." << std::endl;
-                exit(1);
-            }
-        }
-    }
+    pack_image_film(film.get(), &floatarray[0]);
 
     child_process->write_n_float32(&floatarray[0], nfloats);
 }
 
+// ============================================================================
+// Check magic characters
+// <return> 0 if they match, 1 otherwise
+int IisptNnConnector::read_magic()
+{
+    char c0 = child_process->read_char();
+    char c1 = child_process->read_char();
+    if (c0 == 'x' && c1 == '\n') {
+        return 0;
+    } else {
+        std::cerr << "iisptnnconnector.cpp: magic characters don't match: ["<< c0 <<"] ["<< c1 <<"]" << std::endl;
+        return 1;
+    }
+}
+
 // ============================================================================
 // Read image film
 
 // <status> becomes 1 if errors occurred
 //                  0 if all OK
 std::unique_ptr<IntensityFilm> IisptNnConnector::read_image_film(
+        int hemisize,
         int &status
         )
 {
-    int hemisize = PbrtOptions.iisptHemiSize;
-
     std::unique_ptr<IntensityFilm> film (
                 new IntensityFilm(
                     hemisize,
@@ -90,7 +165,7 @@ std::unique_ptr<IntensityFilm> IisptNnConnector::read_image_film(
                     )
                 );
 
-    int nfloat = hemisize * hemisize * 3;
+    int nfloat = output_floats(hemisize);
     std::vector<float> floatarray (nfloat);
 
     // Read
@@ -103,17 +178,8 @@ std::unique_ptr<IntensityFilm> IisptNnConnector::read_image_film(
 
     film->populate_from_float_array(&floatarray[0]);
 
-    // Check magic characters
-    char c0 = child_process->read_char();
-    char c1 = child_process->read_char();
-    if (c0 == 'x' && c1 == '\n') {
-        status = 0;
-        return film;
-    } else {
-        std::cerr << "iisptnnconnector.cpp: magic characters don't match: ["<< c0 <<"] ["<< c1 <<"]" << std::endl;
-        status = 1;
-        return film;
-    }
+    status = read_magic();
+    return film;
 
 }
 
@@ -129,14 +195,32 @@ std::unique_ptr<IntensityFilm> IisptNnConnector::communicate(
         int &status
         )
 {
-    // Write rasters
+    // Hemispheres can have different sizes, see iispthemilod.h
+    int hemisize = intensity->get_image_film()->get_width();
+
+    if (batch || shm) {
+        // A batch of one
+        pack_input(intensity, distance, normals, input_buffer());
+        std::unique_ptr<IntensityFilm> output_film (
+                    new IntensityFilm(hemisize, hemisize)
+                    );
+        const float* output;
+        status = communicate_buffer(1, &hemisize, &output);
+        if (!status) {
+            output_film->populate_from_float_array((float*) output);
+        }
+        return output_film;
+    }
+
+    // Write size and rasters
+    child_process->write_int32(hemisize);
     pipe_image_film(intensity->get_image_film());
     pipe_image_film(normals->get_image_film());
     pipe_image_film(distance->get_image_film());
 
     // Read output from child process
     int st = -1;
-    std::unique_ptr<IntensityFilm> output_film = read_image_film(st);
+    std::unique_ptr<IntensityFilm> output_film = read_image_film(hemisize, st);
     if (st) {
         std::cerr << "iisptnnconnector.cpp: An error occurred when reading output image" << std::endl;
         status = 1;
@@ -147,9 +231,140 @@ std::unique_ptr<IntensityFilm> IisptNnConnector::communicate(
     }
 }
 
+// ============================================================================
+// Input buffer
+// Shared memory slot, or local buffer sent through the pipe
+float* IisptNnConnector::input_buffer()
+{
+    if (shm) {
+        return shm->input(next_slot);
+    } else {
+        return &pipe_input[0];
+    }
+}
+
+// ============================================================================
+// Max in flight
+// Pipes stay at one request, a second one could fill both pipe buffers
+int IisptNnConnector::max_in_flight()
+{
+    if (shm) {
+        return shm->get_slots();
+    } else {
+        return 1;
+    }
+}
+
+// ============================================================================
+// Submit buffer
+
+// Pipe protocol: int32 count, count int32 sizes, then the packed inputs
+// The child answers with the outputs followed by the magic characters
+// Shared memory protocol: see shmring.hpp
+int IisptNnConnector::submit_buffer(
+        int count,
+        const int* sizes
+        )
+{
+    if (count > max_batch) {
+        std::cerr << "iisptnnconnector.cpp: batch of ["<< count <<"] exceeds the maximum ["<< max_batch <<"]\n";
+        return 1;
+    }
+    if ((int) in_flight.size() >= max_in_flight()) {
+        std::cerr << "iisptnnconnector.cpp: submit_buffer() with ["<< in_flight.size() <<"] requests in flight\n";
+        return 1;
+    }
+
+    if (shm) {
+        int slot = next_slot;
+        next_slot = (next_slot + 1) % shm->get_slots();
+        *shm->count(slot) = count;
+        *shm->status(slot) = -1;
+        std::copy(sizes, sizes + count, shm->sizes(slot));
+        shm->submit();
+        in_flight.push_back(slot);
+        return 0;
+    }
+
+    if (!batch) {
+        std::cerr << "iisptnnconnector.cpp: submit_buffer() needs a batched connector when using pipes\n";
+        return 1;
+    }
+
+    int in_floats = 0;
+    int out_floats = 0;
+    child_process->write_int32(count);
+    for (int i = 0; i < count; i++) {
+        child_process->write_int32(sizes[i]);
+        in_floats += input_floats(sizes[i]);
+        out_floats += output_floats(sizes[i]);
+    }
+    child_process->write_n_float32(&pipe_input[0], in_floats);
+    in_flight.push_back(out_floats);
+    return 0;
+}
+
+// ============================================================================
+// Wait buffer
+int IisptNnConnector::wait_buffer(const float** output)
+{
+    if (in_flight.empty()) {
+        std::cerr << "iisptnnconnector.cpp: wait_buffer() without a request in flight\n";
+        return 1;
+    }
+    int request = in_flight.front();
+    in_flight.pop_front();
+
+    if (shm) {
+        // Slots complete in order, the oldest one is done as soon as
+        // anything is
+        while (completed == 0) {
+            int done = shm->wait_completed(1000);
+            if (done > 0) {
+                completed += done;
+            } else if (done < 0 || !child_process->is_alive()) {
+                std::cerr << "iisptnnconnector.cpp: NN child process is not responding\n";
+                return 1;
+            }
+        }
+        completed--;
+        *output = shm->output(request);
+        return *shm->status(request) == 0 ? 0 : 1;
+    }
+
+    int code = child_process->read_n_float32(&pipe_output[0], request);
+    if (code) {
+        std::cerr << "iisptnnconnector.cpp: Error when reading batch output" << std::endl;
+        return 1;
+    }
+    *output = &pipe_output[0];
+
+    return read_magic();
+}
+
+// ============================================================================
+// Communicate buffer
+int IisptNnConnector::communicate_buffer(
+        int count,
+        const int* sizes,
+        const float** output
+        )
+{
+    int status = submit_buffer(count, sizes);
+    if (status) {
+        return status;
+    }
+    return wait_buffer(output);
+}
+
 // ============================================================================
 void IisptNnConnector::sendEOF()
 {
+    if (shm) {
+        // Ask the child to exit
+        *shm->count(next_slot) = -1;
+        shm->submit();
+    }
     child_process->writeEOF();
 }
 
@@ -1,34 +1,71 @@
 #ifndef IISPTNNCONNECTOR_H
 #define IISPTNNCONNECTOR_H
 
+#include <deque>
 #include <memory>
 #include "tools/childprocess.hpp"
+#include "tools/shmring.hpp"
 #include "film/distancefilm.h"
 #include "film/imagefilm.h"
 #include "film/intensityfilm.h"
 #include "film/normalfilm.h"
+#include "integrators/iisptnnbackend.h"
 
 namespace pbrt {
 
 // Represents an instance of a child process connected to the python
 // neural network
-class IisptNnConnector
+class IisptNnConnector : public IisptNnBackend
 {
 
 private: // ===================================================================
 
     std::unique_ptr<ChildProcess> child_process;
 
+    // With shared memory the next request is packed while the child
+    // evaluates the previous one
+    static const int SHM_SLOTS = 2;
+
+    // True if the child was started with the batched protocol
+    bool batch;
+
+    // Maximum number of hemispheres per request
+    int max_batch;
+
+    // Shared memory transport, NULL when using pipes
+    std::unique_ptr<ShmRing> shm;
+
+    int next_slot = 0;
+
+    // Requests submitted and not collected yet, oldest first: the slot
+    // with shared memory, the number of output floats with pipes
+    std::deque<int> in_flight;
+
+    // Slots completed by the child and not collected yet
+    int completed = 0;
+
+    // Pipe transport buffers
+    std::vector<float> pipe_input;
+    std::vector<float> pipe_output;
+
     void pipe_image_film(std::shared_ptr<ImageFilm> film);
 
     std::unique_ptr<IntensityFilm> read_image_film(
+            int hemisize,
             int &status
             );
 
+    int read_magic();
+
 public: // ====================================================================
 
     // Constructor
-    IisptNnConnector();
+    // With <batch> the child reads a hemisphere count before every
+    // request and evaluates all of them in a single forward pass.
+    // Data goes through a shared memory segment, or through the stdio
+    // pipes when IISPT_NN_TRANSPORT=pipe or shared memory is not
+    // available.
+    IisptNnConnector(bool batch = false, int max_batch = 1);
 
     // Communicate
     std::unique_ptr<IntensityFilm> communicate(IntensityFilm* intensity,
@@ -37,8 +74,52 @@ public: // ====================================================================
             int &status
             );
 
+    // Where the next request must be packed, room for max_batch
+    // hemispheres of the largest size, one after the other.
+    // With shared memory this is the slot seen by the child, so inputs
+    // are written only once. Only valid while fewer than max_in_flight()
+    // requests are submitted
+    float* input_buffer();
+
+    // Number of requests that can be submitted before collecting the
+    // oldest one: the shared memory slots, 1 with pipes
+    int max_in_flight();
+
+    // Send the first <count> hemispheres of input_buffer() without waiting,
+    // hemisphere i is <sizes>[i] pixels across
+    // Returns 0 if all ok, 1 if an error occurred
+    int submit_buffer(int count, const int* sizes);
+
+    // Wait for the oldest submitted request
+    // <output> points to its outputs one after the other, valid until
+    // max_in_flight() more requests are submitted
+    // Returns 0 if all ok, 1 if an error occurred
+    int wait_buffer(const float** output);
+
+    // submit_buffer() followed by wait_buffer()
+    int communicate_buffer(
+            int count,
+            const int* sizes,
+            const float** output
+            );
+
     void sendEOF();
 
+    // Number of floats sent for a single hemisphere
+    static int input_floats(int hemisize);
+
+    // Number of floats received for a single hemisphere
+    static int output_floats(int hemisize);
+
+    // Write the network input of one hemisphere into <dst>, in the same
+    // layout used on the pipe: intensity, normals, distance
+    static void pack_input(
+            IntensityFilm* intensity,
+            DistanceFilm* distance,
+            NormalFilm* normals,
+            float* dst
+            );
+
 };
 
 } // namespace pbrt
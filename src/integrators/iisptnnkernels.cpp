@@ -0,0 +1,736 @@
+#include "iisptnnkernels.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IISPTNN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace pbrt {
+
+// ============================================================================
+// Utilities
+
+static float* grow(std::vector<float> &v, int n) {
+    if (v.size() < n) {
+        v.resize(n);
+    }
+    return &v[0];
+}
+
+// Source coordinate of a x2 bilinear upsampling, as computed by PyTorch
+static void upsample_coord(int dst, int in_size, bool align_corners,
+                           int &i0, int &i1, float &lambda)
+{
+    float src;
+    if (align_corners) {
+        src = in_size > 1 ?
+                    dst * (float) (in_size - 1) / (float) (2 * in_size - 1) :
+                    0.0f;
+    } else {
+        src = std::max((dst + 0.5f) * 0.5f - 0.5f, 0.0f);
+    }
+    i0 = std::min((int) src, in_size - 1);
+    i1 = std::min(i0 + 1, in_size - 1);
+    lambda = src - i0;
+}
+
+// ============================================================================
+// Scalar reference
+
+static void conv2d_scalar(
+        const float* weight,
+        const float* bias,
+        int cin,
+        int cout,
+        int ksize,
+        const float* in,
+        int h,
+        int w,
+        float* out,
+        std::vector<float> &scratch
+        )
+{
+    int pad = ksize / 2;
+    int ph = h + 2 * pad;
+    int pw = w + 2 * pad;
+
+    // Zero padded copy of the input
+    const float* padded = in;
+    if (pad > 0) {
+        float* p = grow(scratch, cin * ph * pw);
+        std::fill(p, p + cin * ph * pw, 0.0f);
+        for (int i = 0; i < cin; i++) {
+            for (int y = 0; y < h; y++) {
+                std::memcpy(&p[(i * ph + y + pad) * pw + pad],
+                            &in[(i * h + y) * w],
+                            w * sizeof(float));
+            }
+        }
+        padded = p;
+    }
+
+    int ksq = ksize * ksize;
+    for (int o = 0; o < cout; o++) {
+        float* oplane = &out[o * h * w];
+        std::fill(oplane, oplane + h * w, bias[o]);
+        for (int i = 0; i < cin; i++) {
+            const float* iplane = &padded[i * ph * pw];
+            const float* wk = &weight[(o * cin + i) * ksq];
+            for (int ky = 0; ky < ksize; ky++) {
+                for (int kx = 0; kx < ksize; kx++) {
+                    float wv = wk[ky * ksize + kx];
+                    for (int y = 0; y < h; y++) {
+                        const float* src = &iplane[(y + ky) * pw + kx];
+                        float* dst = &oplane[y * w];
+                        for (int x = 0; x < w; x++) {
+                            dst[x] += wv * src[x];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void max_pool2_scalar(const float* in, int channels, int h, int w,
+                             float* out)
+{
+    int oh = h / 2;
+    int ow = w / 2;
+    for (int c = 0; c < channels; c++) {
+        const float* ip = &in[c * h * w];
+        float* op = &out[c * oh * ow];
+        for (int y = 0; y < oh; y++) {
+            const float* r0 = &ip[(2 * y) * w];
+            const float* r1 = &ip[(2 * y + 1) * w];
+            for (int x = 0; x < ow; x++) {
+                op[y * ow + x] = std::max(
+                            std::max(r0[2 * x], r0[2 * x + 1]),
+                            std::max(r1[2 * x], r1[2 * x + 1]));
+            }
+        }
+    }
+}
+
+static void upsample_bilinear2_scalar(const float* in, int channels, int h,
+                                      int w, float* out, bool align_corners)
+{
+    int oh = 2 * h;
+    int ow = 2 * w;
+    for (int y = 0; y < oh; y++) {
+        int y0, y1;
+        float ly;
+        upsample_coord(y, h, align_corners, y0, y1, ly);
+        for (int x = 0; x < ow; x++) {
+            int x0, x1;
+            float lx;
+            upsample_coord(x, w, align_corners, x0, x1, lx);
+            for (int c = 0; c < channels; c++) {
+                const float* ip = &in[c * h * w];
+                float top = (1.0f - lx) * ip[y0 * w + x0] + lx * ip[y0 * w + x1];
+                float bot = (1.0f - lx) * ip[y1 * w + x0] + lx * ip[y1 * w + x1];
+                out[(c * oh + y) * ow + x] = (1.0f - ly) * top + ly * bot;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// GEMM
+// c[r * ldc + j] = bias[r] + sum_kk a[r * k + kk] * b[kk * ldb + j]
+// for r < m, j < n
+
+typedef void (*GemmFunc)(const float* a, const float* bias, int m, int k,
+                         const float* b, int ldb, int n, float* c, int ldc);
+
+static void gemm_scalar_range(const float* a, const float* bias,
+                              int r0, int r1, int k,
+                              const float* b, int ldb, int j0, int j1,
+                              float* c, int ldc)
+{
+    for (int r = r0; r < r1; r++) {
+        for (int j = j0; j < j1; j++) {
+            float sum = bias[r];
+            for (int kk = 0; kk < k; kk++) {
+                sum += a[r * k + kk] * b[kk * ldb + j];
+            }
+            c[r * ldc + j] = sum;
+        }
+    }
+}
+
+#ifdef IISPTNN_X86
+
+// SSE: 4 rows x 8 columns per block
+__attribute__((target("sse2")))
+static void gemm_sse(const float* a, const float* bias, int m, int k,
+                     const float* b, int ldb, int n, float* c, int ldc)
+{
+    int r = 0;
+    for (; r + 4 <= m; r += 4) {
+        const float* a0 = &a[(r + 0) * k];
+        const float* a1 = &a[(r + 1) * k];
+        const float* a2 = &a[(r + 2) * k];
+        const float* a3 = &a[(r + 3) * k];
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m128 c00 = _mm_set1_ps(bias[r + 0]), c01 = c00;
+            __m128 c10 = _mm_set1_ps(bias[r + 1]), c11 = c10;
+            __m128 c20 = _mm_set1_ps(bias[r + 2]), c21 = c20;
+            __m128 c30 = _mm_set1_ps(bias[r + 3]), c31 = c30;
+            for (int kk = 0; kk < k; kk++) {
+                const float* bp = &b[kk * ldb + j];
+                __m128 b0 = _mm_loadu_ps(bp);
+                __m128 b1 = _mm_loadu_ps(bp + 4);
+                __m128 w0 = _mm_set1_ps(a0[kk]);
+                __m128 w1 = _mm_set1_ps(a1[kk]);
+                __m128 w2 = _mm_set1_ps(a2[kk]);
+                __m128 w3 = _mm_set1_ps(a3[kk]);
+                c00 = _mm_add_ps(c00, _mm_mul_ps(w0, b0));
+                c01 = _mm_add_ps(c01, _mm_mul_ps(w0, b1));
+                c10 = _mm_add_ps(c10, _mm_mul_ps(w1, b0));
+                c11 = _mm_add_ps(c11, _mm_mul_ps(w1, b1));
+                c20 = _mm_add_ps(c20, _mm_mul_ps(w2, b0));
+                c21 = _mm_add_ps(c21, _mm_mul_ps(w2, b1));
+                c30 = _mm_add_ps(c30, _mm_mul_ps(w3, b0));
+                c31 = _mm_add_ps(c31, _mm_mul_ps(w3, b1));
+            }
+            _mm_storeu_ps(&c[(r + 0) * ldc + j], c00);
+            _mm_storeu_ps(&c[(r + 0) * ldc + j + 4], c01);
+            _mm_storeu_ps(&c[(r + 1) * ldc + j], c10);
+            _mm_storeu_ps(&c[(r + 1) * ldc + j + 4], c11);
+            _mm_storeu_ps(&c[(r + 2) * ldc + j], c20);
+            _mm_storeu_ps(&c[(r + 2) * ldc + j + 4], c21);
+            _mm_storeu_ps(&c[(r + 3) * ldc + j], c30);
+            _mm_storeu_ps(&c[(r + 3) * ldc + j + 4], c31);
+        }
+        gemm_scalar_range(a, bias, r, r + 4, k, b, ldb, j, n, c, ldc);
+    }
+    // Remaining rows, one at a time
+    for (; r < m; r++) {
+        const float* ar = &a[r * k];
+        int j = 0;
+        for (; j + 4 <= n; j += 4) {
+            __m128 acc = _mm_set1_ps(bias[r]);
+            for (int kk = 0; kk < k; kk++) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(ar[kk]),
+                                                 _mm_loadu_ps(&b[kk * ldb + j])));
+            }
+            _mm_storeu_ps(&c[r * ldc + j], acc);
+        }
+        gemm_scalar_range(a, bias, r, r + 1, k, b, ldb, j, n, c, ldc);
+    }
+}
+
+// AVX2: 4 rows x 16 columns per block
+__attribute__((target("avx2,fma")))
+static void gemm_avx2(const float* a, const float* bias, int m, int k,
+                      const float* b, int ldb, int n, float* c, int ldc)
+{
+    int r = 0;
+    for (; r + 4 <= m; r += 4) {
+        const float* a0 = &a[(r + 0) * k];
+        const float* a1 = &a[(r + 1) * k];
+        const float* a2 = &a[(r + 2) * k];
+        const float* a3 = &a[(r + 3) * k];
+        int j = 0;
+        for (; j + 16 <= n; j += 16) {
+            __m256 c00 = _mm256_set1_ps(bias[r + 0]), c01 = c00;
+            __m256 c10 = _mm256_set1_ps(bias[r + 1]), c11 = c10;
+            __m256 c20 = _mm256_set1_ps(bias[r + 2]), c21 = c20;
+            __m256 c30 = _mm256_set1_ps(bias[r + 3]), c31 = c30;
+            for (int kk = 0; kk < k; kk++) {
+                const float* bp = &b[kk * ldb + j];
+                __m256 b0 = _mm256_loadu_ps(bp);
+                __m256 b1 = _mm256_loadu_ps(bp + 8);
+                __m256 w0 = _mm256_broadcast_ss(&a0[kk]);
+                __m256 w1 = _mm256_broadcast_ss(&a1[kk]);
+                __m256 w2 = _mm256_broadcast_ss(&a2[kk]);
+                __m256 w3 = _mm256_broadcast_ss(&a3[kk]);
+                c00 = _mm256_fmadd_ps(w0, b0, c00);
+                c01 = _mm256_fmadd_ps(w0, b1, c01);
+                c10 = _mm256_fmadd_ps(w1, b0, c10);
+                c11 = _mm256_fmadd_ps(w1, b1, c11);
+                c20 = _mm256_fmadd_ps(w2, b0, c20);
+                c21 = _mm256_fmadd_ps(w2, b1, c21);
+                c30 = _mm256_fmadd_ps(w3, b0, c30);
+                c31 = _mm256_fmadd_ps(w3, b1, c31);
+            }
+            _mm256_storeu_ps(&c[(r + 0) * ldc + j], c00);
+            _mm256_storeu_ps(&c[(r + 0) * ldc + j + 8], c01);
+            _mm256_storeu_ps(&c[(r + 1) * ldc + j], c10);
+            _mm256_storeu_ps(&c[(r + 1) * ldc + j + 8], c11);
+            _mm256_storeu_ps(&c[(r + 2) * ldc + j], c20);
+            _mm256_storeu_ps(&c[(r + 2) * ldc + j + 8], c21);
+            _mm256_storeu_ps(&c[(r + 3) * ldc + j], c30);
+            _mm256_storeu_ps(&c[(r + 3) * ldc + j + 8], c31);
+        }
+        for (; j + 8 <= n; j += 8) {
+            __m256 c0 = _mm256_set1_ps(bias[r + 0]);
+            __m256 c1 = _mm256_set1_ps(bias[r + 1]);
+            __m256 c2 = _mm256_set1_ps(bias[r + 2]);
+            __m256 c3 = _mm256_set1_ps(bias[r + 3]);
+            for (int kk = 0; kk < k; kk++) {
+                __m256 bv = _mm256_loadu_ps(&b[kk * ldb + j]);
+                c0 = _mm256_fmadd_ps(_mm256_broadcast_ss(&a0[kk]), bv, c0);
+                c1 = _mm256_fmadd_ps(_mm256_broadcast_ss(&a1[kk]), bv, c1);
+                c2 = _mm256_fmadd_ps(_mm256_broadcast_ss(&a2[kk]), bv, c2);
+                c3 = _mm256_fmadd_ps(_mm256_broadcast_ss(&a3[kk]), bv, c3);
+            }
+            _mm256_storeu_ps(&c[(r + 0) * ldc + j], c0);
+            _mm256_storeu_ps(&c[(r + 1) * ldc + j], c1);
+            _mm256_storeu_ps(&c[(r + 2) * ldc + j], c2);
+            _mm256_storeu_ps(&c[(r + 3) * ldc + j], c3);
+        }
+        gemm_scalar_range(a, bias, r, r + 4, k, b, ldb, j, n, c, ldc);
+    }
+    // Remaining rows, one at a time
+    for (; r < m; r++) {
+        const float* ar = &a[r * k];
+        int j = 0;
+        for (; j + 8 <= n; j += 8) {
+            __m256 acc = _mm256_set1_ps(bias[r]);
+            for (int kk = 0; kk < k; kk++) {
+                acc = _mm256_fmadd_ps(_mm256_broadcast_ss(&ar[kk]),
+                                      _mm256_loadu_ps(&b[kk * ldb + j]), acc);
+            }
+            _mm256_storeu_ps(&c[r * ldc + j], acc);
+        }
+        gemm_scalar_range(a, bias, r, r + 1, k, b, ldb, j, n, c, ldc);
+    }
+}
+
+// AVX-512: 4 rows x 32 columns per block, narrower columns go to AVX2
+__attribute__((target("avx512f,avx2,fma")))
+static void gemm_avx512(const float* a, const float* bias, int m, int k,
+                        const float* b, int ldb, int n, float* c, int ldc)
+{
+    int r = 0;
+    int j = 0;
+    int n32 = n - n % 32;
+    for (; r + 4 <= m; r += 4) {
+        const float* a0 = &a[(r + 0) * k];
+        const float* a1 = &a[(r + 1) * k];
+        const float* a2 = &a[(r + 2) * k];
+        const float* a3 = &a[(r + 3) * k];
+        for (j = 0; j < n32; j += 32) {
+            __m512 c00 = _mm512_set1_ps(bias[r + 0]), c01 = c00;
+            __m512 c10 = _mm512_set1_ps(bias[r + 1]), c11 = c10;
+            __m512 c20 = _mm512_set1_ps(bias[r + 2]), c21 = c20;
+            __m512 c30 = _mm512_set1_ps(bias[r + 3]), c31 = c30;
+            for (int kk = 0; kk < k; kk++) {
+                const float* bp = &b[kk * ldb + j];
+                __m512 b0 = _mm512_loadu_ps(bp);
+                __m512 b1 = _mm512_loadu_ps(bp + 16);
+                __m512 w0 = _mm512_set1_ps(a0[kk]);
+                __m512 w1 = _mm512_set1_ps(a1[kk]);
+                __m512 w2 = _mm512_set1_ps(a2[kk]);
+                __m512 w3 = _mm512_set1_ps(a3[kk]);
+                c00 = _mm512_fmadd_ps(w0, b0, c00);
+                c01 = _mm512_fmadd_ps(w0, b1, c01);
+                c10 = _mm512_fmadd_ps(w1, b0, c10);
+                c11 = _mm512_fmadd_ps(w1, b1, c11);
+                c20 = _mm512_fmadd_ps(w2, b0, c20);
+                c21 = _mm512_fmadd_ps(w2, b1, c21);
+                c30 = _mm512_fmadd_ps(w3, b0, c30);
+                c31 = _mm512_fmadd_ps(w3, b1, c31);
+            }
+            _mm512_storeu_ps(&c[(r + 0) * ldc + j], c00);
+            _mm512_storeu_ps(&c[(r + 0) * ldc + j + 16], c01);
+            _mm512_storeu_ps(&c[(r + 1) * ldc + j], c10);
+            _mm512_storeu_ps(&c[(r + 1) * ldc + j + 16], c11);
+            _mm512_storeu_ps(&c[(r + 2) * ldc + j], c20);
+            _mm512_storeu_ps(&c[(r + 2) * ldc + j + 16], c21);
+            _mm512_storeu_ps(&c[(r + 3) * ldc + j], c30);
+            _mm512_storeu_ps(&c[(r + 3) * ldc + j + 16], c31);
+        }
+    }
+    if (r > 0 && n32 < n) {
+        gemm_avx2(a, bias, r, k, b + n32, ldb, n - n32, c + n32, ldc);
+    }
+    if (r < m) {
+        gemm_avx2(a + r * k, bias + r, m - r, k, b, ldb, n, c + r * ldc, ldc);
+    }
+}
+
+// ============================================================================
+// Max pool
+
+__attribute__((target("sse2")))
+static void max_pool2_sse(const float* in, int channels, int h, int w,
+                          float* out)
+{
+    int oh = h / 2;
+    int ow = w / 2;
+    for (int c = 0; c < channels; c++) {
+        const float* ip = &in[c * h * w];
+        float* op = &out[c * oh * ow];
+        for (int y = 0; y < oh; y++) {
+            const float* r0 = &ip[(2 * y) * w];
+            const float* r1 = &ip[(2 * y + 1) * w];
+            float* orow = &op[y * ow];
+            int x = 0;
+            for (; x + 4 <= ow; x += 4) {
+                __m128 va = _mm_max_ps(_mm_loadu_ps(&r0[2 * x]),
+                                       _mm_loadu_ps(&r1[2 * x]));
+                __m128 vb = _mm_max_ps(_mm_loadu_ps(&r0[2 * x + 4]),
+                                       _mm_loadu_ps(&r1[2 * x + 4]));
+                __m128 even = _mm_shuffle_ps(va, vb, _MM_SHUFFLE(2, 0, 2, 0));
+                __m128 odd = _mm_shuffle_ps(va, vb, _MM_SHUFFLE(3, 1, 3, 1));
+                _mm_storeu_ps(&orow[x], _mm_max_ps(even, odd));
+            }
+            for (; x < ow; x++) {
+                orow[x] = std::max(std::max(r0[2 * x], r0[2 * x + 1]),
+                                   std::max(r1[2 * x], r1[2 * x + 1]));
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void max_pool2_avx2(const float* in, int channels, int h, int w,
+                           float* out)
+{
+    int oh = h / 2;
+    int ow = w / 2;
+    for (int c = 0; c < channels; c++) {
+        const float* ip = &in[c * h * w];
+        float* op = &out[c * oh * ow];
+        for (int y = 0; y < oh; y++) {
+            const float* r0 = &ip[(2 * y) * w];
+            const float* r1 = &ip[(2 * y + 1) * w];
+            float* orow = &op[y * ow];
+            int x = 0;
+            for (; x + 8 <= ow; x += 8) {
+                __m256 va = _mm256_max_ps(_mm256_loadu_ps(&r0[2 * x]),
+                                          _mm256_loadu_ps(&r1[2 * x]));
+                __m256 vb = _mm256_max_ps(_mm256_loadu_ps(&r0[2 * x + 8]),
+                                          _mm256_loadu_ps(&r1[2 * x + 8]));
+                // Shuffles work within 128 bit lanes, the permute puts
+                // the 64 bit pairs back in order
+                __m256 even = _mm256_shuffle_ps(va, vb, _MM_SHUFFLE(2, 0, 2, 0));
+                __m256 odd = _mm256_shuffle_ps(va, vb, _MM_SHUFFLE(3, 1, 3, 1));
+                __m256 m = _mm256_max_ps(even, odd);
+                m = _mm256_castpd_ps(_mm256_permute4x64_pd(
+                                         _mm256_castps_pd(m),
+                                         _MM_SHUFFLE(3, 1, 2, 0)));
+                _mm256_storeu_ps(&orow[x], m);
+            }
+            for (; x < ow; x++) {
+                orow[x] = std::max(std::max(r0[2 * x], r0[2 * x + 1]),
+                                   std::max(r1[2 * x], r1[2 * x + 1]));
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Upsample, vertical blend of two rows
+// Same operation order as the scalar version, results are identical
+
+__attribute__((target("sse2")))
+static void blend_rows_sse(const float* top, const float* bot, float ly,
+                           int n, float* out)
+{
+    __m128 wt = _mm_set1_ps(1.0f - ly);
+    __m128 wb = _mm_set1_ps(ly);
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(wt, _mm_loadu_ps(&top[x])),
+                              _mm_mul_ps(wb, _mm_loadu_ps(&bot[x])));
+        _mm_storeu_ps(&out[x], v);
+    }
+    for (; x < n; x++) {
+        out[x] = (1.0f - ly) * top[x] + ly * bot[x];
+    }
+}
+
+__attribute__((target("avx2")))
+static void blend_rows_avx2(const float* top, const float* bot, float ly,
+                            int n, float* out)
+{
+    __m256 wt = _mm256_set1_ps(1.0f - ly);
+    __m256 wb = _mm256_set1_ps(ly);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(wt, _mm256_loadu_ps(&top[x])),
+                                 _mm256_mul_ps(wb, _mm256_loadu_ps(&bot[x])));
+        _mm256_storeu_ps(&out[x], v);
+    }
+    // Scalar tail, calling the SSE version here would mix legacy SSE and
+    // VEX encoded instructions
+    for (; x < n; x++) {
+        out[x] = (1.0f - ly) * top[x] + ly * bot[x];
+    }
+}
+
+#endif // IISPTNN_X86
+
+// ============================================================================
+// Level selection
+
+bool IisptNnKernels::supported(IisptNnSimd level)
+{
+    switch (level) {
+    case IisptNnSimd::Scalar:
+        return true;
+#ifdef IISPTNN_X86
+    case IisptNnSimd::Sse:
+        return __builtin_cpu_supports("sse2");
+    case IisptNnSimd::Avx2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case IisptNnSimd::Avx512:
+        return __builtin_cpu_supports("avx512f") &&
+                __builtin_cpu_supports("avx2") &&
+                __builtin_cpu_supports("fma");
+#endif
+    default:
+        return false;
+    }
+}
+
+std::string IisptNnKernels::name(IisptNnSimd level)
+{
+    switch (level) {
+    case IisptNnSimd::Scalar:
+        return "scalar";
+    case IisptNnSimd::Sse:
+        return "sse";
+    case IisptNnSimd::Avx2:
+        return "avx2";
+    case IisptNnSimd::Avx512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+static IisptNnSimd detect_level()
+{
+    IisptNnSimd best = IisptNnSimd::Scalar;
+    IisptNnSimd levels[] = {
+        IisptNnSimd::Sse,
+        IisptNnSimd::Avx2,
+        IisptNnSimd::Avx512
+    };
+    for (IisptNnSimd level : levels) {
+        if (IisptNnKernels::supported(level)) {
+            best = level;
+        }
+    }
+
+    char* simd_env = std::getenv("IISPT_NN_SIMD");
+    if (simd_env != NULL) {
+        std::string requested (simd_env);
+        IisptNnSimd all[] = {
+            IisptNnSimd::Scalar,
+            IisptNnSimd::Sse,
+            IisptNnSimd::Avx2,
+            IisptNnSimd::Avx512
+        };
+        bool found = false;
+        for (IisptNnSimd level : all) {
+            if (IisptNnKernels::name(level) == requested) {
+                found = true;
+                if (IisptNnKernels::supported(level)) {
+                    best = level;
+                } else {
+                    std::cerr << "iisptnnkernels.cpp: IISPT_NN_SIMD=" << requested
+                              << " is not supported by this CPU, using "
+                              << IisptNnKernels::name(best) << std::endl;
+                }
+            }
+        }
+        if (!found) {
+            std::cerr << "iisptnnkernels.cpp: unknown IISPT_NN_SIMD value ["
+                      << requested << "]\n";
+        }
+    }
+    return best;
+}
+
+const IisptNnKernels& IisptNnKernels::get()
+{
+    static IisptNnKernels kernels (detect_level());
+    return kernels;
+}
+
+// ============================================================================
+// Convolution
+
+// Gathers the receptive fields of the pixels [p0, p0 + nb) of a
+// (cin, h, w) input, zero padded by ksize/2.
+// <col> (cin * ksize * ksize, nb)
+static void im2col(const float* in, int cin, int h, int w, int ksize,
+                   int p0, int nb, float* col)
+{
+    int pad = ksize / 2;
+    int ksq = ksize * ksize;
+    for (int i = 0; i < cin; i++) {
+        const float* iplane = &in[i * h * w];
+        for (int ky = 0; ky < ksize; ky++) {
+            for (int kx = 0; kx < ksize; kx++) {
+                float* crow = &col[(i * ksq + ky * ksize + kx) * nb];
+                int dy = ky - pad;
+                int dx = kx - pad;
+                int j = 0;
+                while (j < nb) {
+                    // Copy what remains of the current output row
+                    int p = p0 + j;
+                    int y = p / w;
+                    int x = p % w;
+                    int run = std::min(w - x, nb - j);
+                    int iy = y + dy;
+                    if (iy < 0 || iy >= h) {
+                        std::fill(&crow[j], &crow[j + run], 0.0f);
+                    } else {
+                        const float* irow = &iplane[iy * w];
+                        for (int t = 0; t < run; t++) {
+                            int ix = x + t + dx;
+                            crow[j + t] = (ix >= 0 && ix < w) ? irow[ix] : 0.0f;
+                        }
+                    }
+                    j += run;
+                }
+            }
+        }
+    }
+}
+
+void IisptNnKernels::conv2d(
+        const float* weight,
+        const float* bias,
+        int cin,
+        int cout,
+        int ksize,
+        const float* in,
+        int h,
+        int w,
+        float* out,
+        std::vector<float> &scratch
+        ) const
+{
+    GemmFunc gemm = NULL;
+#ifdef IISPTNN_X86
+    switch (level) {
+    case IisptNnSimd::Sse:
+        gemm = gemm_sse;
+        break;
+    case IisptNnSimd::Avx2:
+        gemm = gemm_avx2;
+        break;
+    case IisptNnSimd::Avx512:
+        gemm = gemm_avx512;
+        break;
+    default:
+        break;
+    }
+#endif
+    if (gemm == NULL) {
+        conv2d_scalar(weight, bias, cin, cout, ksize, in, h, w, out, scratch);
+        return;
+    }
+
+    int hw = h * w;
+    int kd = cin * ksize * ksize;
+
+    // 1x1 convolutions read the input directly
+    if (ksize == 1) {
+        gemm(weight, bias, cout, kd, in, hw, hw, out, hw);
+        return;
+    }
+
+    int nb = std::min(COLUMN_BLOCK, hw);
+    float* col = grow(scratch, kd * nb);
+    for (int p0 = 0; p0 < hw; p0 += nb) {
+        int n = std::min(nb, hw - p0);
+        im2col(in, cin, h, w, ksize, p0, n, col);
+        gemm(weight, bias, cout, kd, col, n, n, &out[p0], hw);
+    }
+}
+
+// ============================================================================
+// Max pool
+
+void IisptNnKernels::max_pool2(
+        const float* in,
+        int channels,
+        int h,
+        int w,
+        float* out
+        ) const
+{
+#ifdef IISPTNN_X86
+    if (level == IisptNnSimd::Avx2 || level == IisptNnSimd::Avx512) {
+        max_pool2_avx2(in, channels, h, w, out);
+        return;
+    } else if (level == IisptNnSimd::Sse) {
+        max_pool2_sse(in, channels, h, w, out);
+        return;
+    }
+#endif
+    max_pool2_scalar(in, channels, h, w, out);
+}
+
+// ============================================================================
+// Upsample
+
+void IisptNnKernels::upsample_bilinear2(
+        const float* in,
+        int channels,
+        int h,
+        int w,
+        float* out,
+        bool align_corners,
+        std::vector<float> &scratch
+        ) const
+{
+#ifdef IISPTNN_X86
+    if (level != IisptNnSimd::Scalar) {
+        int oh = 2 * h;
+        int ow = 2 * w;
+
+        // Horizontal pass into (channels, h, ow)
+        std::vector<int> xs0 (ow);
+        std::vector<int> xs1 (ow);
+        std::vector<float> lxs (ow);
+        for (int x = 0; x < ow; x++) {
+            upsample_coord(x, w, align_corners, xs0[x], xs1[x], lxs[x]);
+        }
+        float* rows = grow(scratch, channels * h * ow);
+        for (int r = 0; r < channels * h; r++) {
+            const float* irow = &in[r * w];
+            float* hrow = &rows[r * ow];
+            for (int x = 0; x < ow; x++) {
+                float lx = lxs[x];
+                hrow[x] = (1.0f - lx) * irow[xs0[x]] + lx * irow[xs1[x]];
+            }
+        }
+
+        // Vertical pass
+        for (int y = 0; y < oh; y++) {
+            int y0, y1;
+            float ly;
+            upsample_coord(y, h, align_corners, y0, y1, ly);
+            for (int c = 0; c < channels; c++) {
+                const float* top = &rows[(c * h + y0) * ow];
+                const float* bot = &rows[(c * h + y1) * ow];
+                float* orow = &out[(c * oh + y) * ow];
+                if (level == IisptNnSimd::Sse) {
+                    blend_rows_sse(top, bot, ly, ow, orow);
+                } else {
+                    blend_rows_avx2(top, bot, ly, ow, orow);
+                }
+            }
+        }
+        return;
+    }
+#endif
+    upsample_bilinear2_scalar(in, channels, h, w, out, align_corners);
+}
+
+} // namespace pbrt
@@ -0,0 +1,99 @@
+#ifndef IISPTNNKERNELS_H
+#define IISPTNNKERNELS_H
+
+#include <string>
+#include <vector>
+
+namespace pbrt {
+
+// ============================================================================
+// Instruction set used by the network kernels
+enum class IisptNnSimd {
+    Scalar,
+    Sse,
+    Avx2,
+    Avx512
+};
+
+// ============================================================================
+// Compute kernels of the native IISPTNet (iisptnnnative.h).
+// Tensors are (channel, height, width) float arrays.
+//
+// Convolutions are lowered to im2col + a register blocked GEMM. Columns are
+// processed in blocks of COLUMN_BLOCK pixels so that the im2col buffer of
+// the widest layer stays in L2; for the default 32x32 hemisphere every layer
+// is a whole number of blocks or a single block.
+// Transposed convolutions are converted to convolutions when the weights
+// are loaded, so they share the same kernels.
+//
+// The Scalar level is the plain reference implementation the SIMD levels
+// are tested and benchmarked against.
+class IisptNnKernels
+{
+private:
+
+    IisptNnSimd level;
+
+public:
+
+    static const int COLUMN_BLOCK = 64;
+
+    IisptNnKernels(IisptNnSimd level) :
+        level(level)
+    {
+
+    }
+
+    // Best level supported by the CPU, can be lowered with
+    // IISPT_NN_SIMD=scalar|sse|avx2|avx512
+    static const IisptNnKernels& get();
+
+    static bool supported(IisptNnSimd level);
+
+    static std::string name(IisptNnSimd level);
+
+    IisptNnSimd get_level() const {
+        return level;
+    }
+
+    // Stride 1 convolution with zero padding ksize/2
+    // <weight> (cout, cin, ksize, ksize)
+    // <scratch> grown as needed
+    void conv2d(
+            const float* weight,
+            const float* bias,
+            int cin,
+            int cout,
+            int ksize,
+            const float* in,
+            int h,
+            int w,
+            float* out,
+            std::vector<float> &scratch
+            ) const;
+
+    // 2x2 max pooling, stride 2
+    void max_pool2(
+            const float* in,
+            int channels,
+            int h,
+            int w,
+            float* out
+            ) const;
+
+    // x2 bilinear upsampling with PyTorch coordinates
+    void upsample_bilinear2(
+            const float* in,
+            int channels,
+            int h,
+            int w,
+            float* out,
+            bool align_corners,
+            std::vector<float> &scratch
+            ) const;
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTNNKERNELS_H
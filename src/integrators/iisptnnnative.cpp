@@ -0,0 +1,569 @@
+#include "iisptnnnative.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+namespace pbrt {
+
+// ============================================================================
+// Constants
+
+static const char WEIGHTS_MAGIC[8] = {'I', 'I', 'S', 'P', 'T', 'N', 'N', '\0'};
+static const int WEIGHTS_VERSION = 1;
+static const float LEAKY_RELU_SLOPE = 0.2;
+static const float BATCH_NORM_EPS = 1e-5;
+
+// ============================================================================
+// Scratch memory
+// Every render thread gets its own buffers, sized on first use
+
+struct IisptNnScratch {
+    std::vector<float> conv;
+    std::vector<float> upsample;
+    std::vector<float> pooled;
+    std::vector<float> tmp1;
+    std::vector<float> tmp2;
+    // Skip connections are concatenated along the channel axis:
+    // the first half is filled by the decoder upsampling, the second
+    // half by the encoder output
+    std::vector<float> cat0;
+    std::vector<float> cat1;
+    std::vector<float> cat2;
+};
+
+static float* scratch_buffer(std::vector<float> &v, int n) {
+    if (v.size() < n) {
+        v.resize(n);
+    }
+    return &v[0];
+}
+
+// ============================================================================
+// Element wise layers
+
+static void leaky_relu(float* x, int n) {
+    for (int i = 0; i < n; i++) {
+        if (x[i] < 0.0f) {
+            x[i] *= LEAKY_RELU_SLOPE;
+        }
+    }
+}
+
+static void relu(float* x, int n) {
+    for (int i = 0; i < n; i++) {
+        x[i] = std::max(x[i], 0.0f);
+    }
+}
+
+static void batch_norm(
+        const IisptNnNet::BatchNorm &bn,
+        float* x,
+        int channels,
+        int plane
+        )
+{
+    for (int c = 0; c < channels; c++) {
+        float s = bn.scale[c];
+        float t = bn.shift[c];
+        float* p = &x[c * plane];
+        for (int i = 0; i < plane; i++) {
+            p[i] = p[i] * s + t;
+        }
+    }
+}
+
+// ============================================================================
+// Weights file
+
+bool IisptNnNet::read_tensors(
+        std::istream &in,
+        TensorMap &tensors,
+        bool &align_corners
+        )
+{
+    char magic[8];
+    in.read(magic, 8);
+    if (!in || std::memcmp(magic, WEIGHTS_MAGIC, 8) != 0) {
+        std::cerr << "iisptnnnative.cpp: not an IISPTNet weights file\n";
+        return false;
+    }
+
+    int32_t header[3];
+    in.read((char*) header, sizeof(header));
+    if (!in || header[0] != WEIGHTS_VERSION) {
+        std::cerr << "iisptnnnative.cpp: unsupported weights file version\n";
+        return false;
+    }
+    align_corners = header[1] != 0;
+    int count = header[2];
+
+    for (int t = 0; t < count; t++) {
+        int32_t name_length;
+        in.read((char*) &name_length, 4);
+        if (!in || name_length <= 0 || name_length > 1024) {
+            std::cerr << "iisptnnnative.cpp: bad tensor name in weights file\n";
+            return false;
+        }
+        std::string name (name_length, '\0');
+        in.read(&name[0], name_length);
+
+        int32_t ndim;
+        in.read((char*) &ndim, 4);
+        if (!in || ndim < 0 || ndim > 8) {
+            std::cerr << "iisptnnnative.cpp: bad shape for tensor " << name << std::endl;
+            return false;
+        }
+        Tensor tensor;
+        int n = 1;
+        for (int d = 0; d < ndim; d++) {
+            int32_t dim;
+            in.read((char*) &dim, 4);
+            tensor.shape.push_back(dim);
+            n *= dim;
+        }
+        tensor.data.resize(n);
+        in.read((char*) &tensor.data[0], n * sizeof(float));
+        if (!in) {
+            std::cerr << "iisptnnnative.cpp: truncated data for tensor " << name << std::endl;
+            return false;
+        }
+        tensors[name] = std::move(tensor);
+    }
+    return true;
+}
+
+void IisptNnNet::write_tensors(
+        std::ostream &out,
+        const TensorMap &tensors,
+        bool align_corners
+        )
+{
+    out.write(WEIGHTS_MAGIC, 8);
+    int32_t header[3] = {
+        WEIGHTS_VERSION,
+        align_corners ? 1 : 0,
+        (int32_t) tensors.size()
+    };
+    out.write((const char*) header, sizeof(header));
+    for (auto &kv : tensors) {
+        int32_t name_length = kv.first.size();
+        out.write((const char*) &name_length, 4);
+        out.write(kv.first.data(), name_length);
+        int32_t ndim = kv.second.shape.size();
+        out.write((const char*) &ndim, 4);
+        for (int d = 0; d < ndim; d++) {
+            int32_t dim = kv.second.shape[d];
+            out.write((const char*) &dim, 4);
+        }
+        out.write((const char*) kv.second.data.data(),
+                  kv.second.data.size() * sizeof(float));
+    }
+}
+
+// ============================================================================
+// Layer loading
+
+static const IisptNnNet::Tensor* find_tensor(
+        const IisptNnNet::TensorMap &tensors,
+        const std::string &name,
+        const std::vector<int> &shape
+        )
+{
+    auto it = tensors.find(name);
+    if (it == tensors.end()) {
+        std::cerr << "iisptnnnative.cpp: missing tensor " << name << std::endl;
+        return NULL;
+    }
+    if (it->second.shape != shape) {
+        std::cerr << "iisptnnnative.cpp: unexpected shape for tensor " << name << std::endl;
+        return NULL;
+    }
+    return &it->second;
+}
+
+static bool load_conv(
+        const IisptNnNet::TensorMap &tensors,
+        const std::string &prefix,
+        int cin,
+        int cout,
+        int ksize,
+        IisptNnNet::Conv &conv
+        )
+{
+    const IisptNnNet::Tensor* w =
+            find_tensor(tensors, prefix + ".weight", {cout, cin, ksize, ksize});
+    const IisptNnNet::Tensor* b =
+            find_tensor(tensors, prefix + ".bias", {cout});
+    if (w == NULL || b == NULL) {
+        return false;
+    }
+    conv.cin = cin;
+    conv.cout = cout;
+    conv.ksize = ksize;
+    conv.weight = w->data;
+    conv.bias = b->data;
+    return true;
+}
+
+// A stride 1 ConvTranspose2d with padding p equals a convolution with
+// padding ksize-1-p over the transposed and spatially flipped kernel.
+// All the transposed convolutions of IISPTNet have ksize 3, padding 1.
+static bool load_conv_transpose(
+        const IisptNnNet::TensorMap &tensors,
+        const std::string &prefix,
+        int cin,
+        int cout,
+        int ksize,
+        IisptNnNet::Conv &conv
+        )
+{
+    const IisptNnNet::Tensor* w =
+            find_tensor(tensors, prefix + ".weight", {cin, cout, ksize, ksize});
+    const IisptNnNet::Tensor* b =
+            find_tensor(tensors, prefix + ".bias", {cout});
+    if (w == NULL || b == NULL) {
+        return false;
+    }
+    conv.cin = cin;
+    conv.cout = cout;
+    conv.ksize = ksize;
+    conv.weight.resize(cout * cin * ksize * ksize);
+    int ksq = ksize * ksize;
+    for (int o = 0; o < cout; o++) {
+        for (int i = 0; i < cin; i++) {
+            for (int kk = 0; kk < ksq; kk++) {
+                conv.weight[(o * cin + i) * ksq + kk] =
+                        w->data[(i * cout + o) * ksq + (ksq - 1 - kk)];
+            }
+        }
+    }
+    conv.bias = b->data;
+    return true;
+}
+
+static bool load_batch_norm(
+        const IisptNnNet::TensorMap &tensors,
+        const std::string &prefix,
+        int channels,
+        IisptNnNet::BatchNorm &bn
+        )
+{
+    const IisptNnNet::Tensor* gamma =
+            find_tensor(tensors, prefix + ".weight", {channels});
+    const IisptNnNet::Tensor* beta =
+            find_tensor(tensors, prefix + ".bias", {channels});
+    const IisptNnNet::Tensor* mean =
+            find_tensor(tensors, prefix + ".running_mean", {channels});
+    const IisptNnNet::Tensor* var =
+            find_tensor(tensors, prefix + ".running_var", {channels});
+    if (gamma == NULL || beta == NULL || mean == NULL || var == NULL) {
+        return false;
+    }
+    bn.scale.resize(channels);
+    bn.shift.resize(channels);
+    for (int c = 0; c < channels; c++) {
+        float s = gamma->data[c] / std::sqrt(var->data[c] + BATCH_NORM_EPS);
+        bn.scale[c] = s;
+        bn.shift[c] = beta->data[c] - mean->data[c] * s;
+    }
+    return true;
+}
+
+// ============================================================================
+// Load
+
+bool IisptNnNet::load(std::istream &in)
+{
+    TensorMap tensors;
+    bool ac;
+    if (!read_tensors(in, tensors, ac)) {
+        return false;
+    }
+    return load(tensors, ac);
+}
+
+bool IisptNnNet::load(const TensorMap &tensors, bool align_corners)
+{
+    // K is the number of output channels of the first convolution
+    auto first = tensors.find("encoder0.0.weight");
+    if (first == tensors.end() || first->second.shape.size() != 4) {
+        std::cerr << "iisptnnnative.cpp: missing tensor encoder0.0.weight\n";
+        return false;
+    }
+    int K = first->second.shape[0];
+
+    bool ok =
+        load_conv(tensors, "encoder0.0", 7, K, 3, e0c0) &&
+        load_conv(tensors, "encoder0.2", K, K, 3, e0c1) &&
+
+        load_conv(tensors, "encoder1.1", K, 2*K, 3, e1c0) &&
+        load_batch_norm(tensors, "encoder1.3", 2*K, e1bn) &&
+        load_conv(tensors, "encoder1.4", 2*K, 2*K, 3, e1c1) &&
+
+        load_conv(tensors, "encoder2.1", 2*K, 4*K, 3, e2c0) &&
+        load_batch_norm(tensors, "encoder2.3", 4*K, e2bn) &&
+        load_conv(tensors, "encoder2.4", 4*K, 4*K, 3, e2c1) &&
+
+        load_conv(tensors, "encoder3.1", 4*K, 8*K, 3, e3c0) &&
+        load_batch_norm(tensors, "encoder3.3", 8*K, e3bn) &&
+        load_conv(tensors, "encoder3.4", 8*K, 4*K, 3, e3c1) &&
+
+        load_conv_transpose(tensors, "decoder0.0", 8*K, 4*K, 3, d0c0) &&
+        load_batch_norm(tensors, "decoder0.2", 4*K, d0bn) &&
+        load_conv_transpose(tensors, "decoder0.3", 4*K, 2*K, 3, d0c1) &&
+
+        load_conv_transpose(tensors, "decoder1.0", 4*K, 2*K, 3, d1c0) &&
+        load_batch_norm(tensors, "decoder1.2", 2*K, d1bn) &&
+        load_conv_transpose(tensors, "decoder1.3", 2*K, K, 3, d1c1) &&
+
+        load_conv_transpose(tensors, "decoder2.0", 2*K, K, 3, d2c0) &&
+        load_conv_transpose(tensors, "decoder2.2", K, K, 3, d2c1) &&
+        load_conv(tensors, "decoder2.4", K, 3, 1, d2c2);
+
+    if (!ok) {
+        return false;
+    }
+    this->k = K;
+    this->align_corners = align_corners;
+    return true;
+}
+
+// ============================================================================
+// Random weights
+
+IisptNnNet::TensorMap IisptNnNet::random_tensors(int K, unsigned int seed)
+{
+    std::mt19937 rng (seed);
+    std::uniform_real_distribution<float> u (-1.0f, 1.0f);
+    TensorMap t;
+
+    auto add = [&](const std::string &name, std::vector<int> shape,
+                   float scale, float offset) {
+        Tensor tensor;
+        tensor.shape = shape;
+        int n = 1;
+        for (int d : shape) {
+            n *= d;
+        }
+        for (int i = 0; i < n; i++) {
+            tensor.data.push_back(offset + scale * u(rng));
+        }
+        t[name] = tensor;
+    };
+    auto conv = [&](const std::string &p, int cin, int cout, int ksize) {
+        add(p + ".weight", {cout, cin, ksize, ksize},
+            1.0f / std::sqrt((float) (cin * ksize * ksize)), 0.0f);
+        add(p + ".bias", {cout}, 0.1f, 0.0f);
+    };
+    auto convT = [&](const std::string &p, int cin, int cout) {
+        add(p + ".weight", {cin, cout, 3, 3},
+            1.0f / std::sqrt((float) (cin * 9)), 0.0f);
+        add(p + ".bias", {cout}, 0.1f, 0.0f);
+    };
+    auto bn = [&](const std::string &p, int channels) {
+        add(p + ".weight", {channels}, 0.2f, 1.0f);
+        add(p + ".bias", {channels}, 0.1f, 0.0f);
+        add(p + ".running_mean", {channels}, 0.1f, 0.0f);
+        add(p + ".running_var", {channels}, 0.2f, 1.0f);
+    };
+
+    conv("encoder0.0", 7, K, 3);
+    conv("encoder0.2", K, K, 3);
+    conv("encoder1.1", K, 2 * K, 3);
+    bn("encoder1.3", 2 * K);
+    conv("encoder1.4", 2 * K, 2 * K, 3);
+    conv("encoder2.1", 2 * K, 4 * K, 3);
+    bn("encoder2.3", 4 * K);
+    conv("encoder2.4", 4 * K, 4 * K, 3);
+    conv("encoder3.1", 4 * K, 8 * K, 3);
+    bn("encoder3.3", 8 * K);
+    conv("encoder3.4", 8 * K, 4 * K, 3);
+    convT("decoder0.0", 8 * K, 4 * K);
+    bn("decoder0.2", 4 * K);
+    convT("decoder0.3", 4 * K, 2 * K);
+    convT("decoder1.0", 4 * K, 2 * K);
+    bn("decoder1.2", 2 * K);
+    convT("decoder1.3", 2 * K, K);
+    convT("decoder2.0", 2 * K, K);
+    convT("decoder2.2", K, K);
+    conv("decoder2.4", K, 3, 1);
+    return t;
+}
+
+
+// ============================================================================
+// Forward
+
+void IisptNnNet::forward(const float* input, float* output, int size) const
+{
+    forward(input, output, size, IisptNnKernels::get());
+}
+
+void IisptNnNet::forward(
+        const float* input,
+        float* output,
+        int size,
+        const IisptNnKernels &kernels
+        ) const
+{
+    static thread_local IisptNnScratch scratch;
+
+    auto conv2d = [&](const Conv &l, const float* in, int h, float* out) {
+        kernels.conv2d(&l.weight[0], &l.bias[0], l.cin, l.cout, l.ksize,
+                       in, h, h, out, scratch.conv);
+    };
+    auto max_pool2 = [&](const float* in, int channels, int h, float* out) {
+        kernels.max_pool2(in, channels, h, h, out);
+    };
+    auto upsample_bilinear2 = [&](const float* in, int channels, int h,
+                                  float* out) {
+        kernels.upsample_bilinear2(in, channels, h, h, out, align_corners,
+                                   scratch.upsample);
+    };
+
+    int K = k;
+    int s0 = size;
+    int s1 = size / 2;
+    int s2 = size / 4;
+    int s3 = size / 8;
+    int p0 = s0 * s0;
+    int p1 = s1 * s1;
+    int p2 = s2 * s2;
+    int p3 = s3 * s3;
+
+    float* cat0 = scratch_buffer(scratch.cat0, 2*K * p0);
+    float* cat1 = scratch_buffer(scratch.cat1, 4*K * p1);
+    float* cat2 = scratch_buffer(scratch.cat2, 8*K * p2);
+    float* tmp1 = scratch_buffer(scratch.tmp1, 8*K * p3 > 2*K * p0 ?
+                                     8*K * p3 : 2*K * p0);
+    float* tmp2 = scratch_buffer(scratch.tmp2, K * p0);
+    float* pooled = scratch_buffer(scratch.pooled, K * p1);
+
+    // Encoder outputs, second half of the concatenation buffers
+    float* x0 = &cat0[K * p0];
+    float* x1 = &cat1[2*K * p1];
+    float* x2 = &cat2[4*K * p2];
+
+    // encoder0, 7 -> K at s0
+    conv2d(e0c0, input, s0, tmp1);
+    leaky_relu(tmp1, K * p0);
+    conv2d(e0c1, tmp1, s0, x0);
+    leaky_relu(x0, K * p0);
+
+    // encoder1, K -> 2K at s1
+    max_pool2(x0, K, s0, pooled);
+    conv2d(e1c0, pooled, s1, tmp1);
+    leaky_relu(tmp1, 2*K * p1);
+    batch_norm(e1bn, tmp1, 2*K, p1);
+    conv2d(e1c1, tmp1, s1, x1);
+    leaky_relu(x1, 2*K * p1);
+
+    // encoder2, 2K -> 4K at s2
+    max_pool2(x1, 2*K, s1, pooled);
+    conv2d(e2c0, pooled, s2, tmp1);
+    leaky_relu(tmp1, 4*K * p2);
+    batch_norm(e2bn, tmp1, 4*K, p2);
+    conv2d(e2c1, tmp1, s2, x2);
+    leaky_relu(x2, 4*K * p2);
+
+    // encoder3, 4K -> 4K at s3, upsampled into cat2
+    max_pool2(x2, 4*K, s2, pooled);
+    conv2d(e3c0, pooled, s3, tmp1);
+    leaky_relu(tmp1, 8*K * p3);
+    batch_norm(e3bn, tmp1, 8*K, p3);
+    conv2d(e3c1, tmp1, s3, tmp2);
+    leaky_relu(tmp2, 4*K * p3);
+    upsample_bilinear2(tmp2, 4*K, s3, cat2);
+
+    // decoder0, 8K -> 2K at s2, upsampled into cat1
+    conv2d(d0c0, cat2, s2, tmp1);
+    leaky_relu(tmp1, 4*K * p2);
+    batch_norm(d0bn, tmp1, 4*K, p2);
+    conv2d(d0c1, tmp1, s2, tmp2);
+    leaky_relu(tmp2, 2*K * p2);
+    upsample_bilinear2(tmp2, 2*K, s2, cat1);
+
+    // decoder1, 4K -> K at s1, upsampled into cat0
+    conv2d(d1c0, cat1, s1, tmp1);
+    leaky_relu(tmp1, 2*K * p1);
+    batch_norm(d1bn, tmp1, 2*K, p1);
+    conv2d(d1c1, tmp1, s1, tmp2);
+    leaky_relu(tmp2, K * p1);
+    upsample_bilinear2(tmp2, K, s1, cat0);
+
+    // decoder2, 2K -> 3 at s0
+    conv2d(d2c0, cat0, s0, tmp1);
+    leaky_relu(tmp1, K * p0);
+    conv2d(d2c1, tmp1, s0, tmp2);
+    leaky_relu(tmp2, K * p0);
+    conv2d(d2c2, tmp2, s0, output);
+    relu(output, 3 * p0);
+}
+
+// ============================================================================
+// Backend
+
+IisptNnNative::IisptNnNative()
+{
+    char* weights_path = getenv("IISPT_NN_WEIGHTS_PATH");
+    if (weights_path == NULL) {
+        std::cerr << "ERROR, environment variable IISPT_NN_WEIGHTS_PATH is not defined. Shutting down..." << std::endl;
+        exit(1);
+    }
+
+    std::ifstream in (weights_path, std::ios::binary);
+    std::shared_ptr<IisptNnNet> loaded (new IisptNnNet());
+    if (!in || !loaded->load(in)) {
+        std::cerr << "iisptnnnative.cpp: could not load weights from " << weights_path << std::endl;
+        exit(1);
+    }
+    std::cerr << "iisptnnnative.cpp: loaded IISPTNet with K=" << loaded->get_k()
+              << " from " << weights_path << std::endl;
+    net = loaded;
+}
+
+std::unique_ptr<IntensityFilm> IisptNnNative::communicate(
+        IntensityFilm* intensity,
+        DistanceFilm* distance,
+        NormalFilm* normals,
+        int &status
+        )
+{
+    // Hemispheres can have different sizes, see iispthemilod.h
+    int hemisize = intensity->get_image_film()->get_width();
+    int plane = hemisize * hemisize;
+
+    std::unique_ptr<IntensityFilm> output_film (
+                new IntensityFilm(hemisize, hemisize)
+                );
+
+    if (hemisize % 8 != 0 || intensity->get_image_film()->get_height() != hemisize) {
+        std::cerr << "iisptnnnative.cpp: hemispheres must be square, with a size multiple of 8\n";
+        status = 1;
+        return output_film;
+    }
+
+    static thread_local std::vector<float> input;
+    static thread_local std::vector<float> output;
+    input.resize(7 * plane);
+    output.resize(3 * plane);
+
+    // The films are already (channel, height, width)
+    intensity->get_image_film()->copy_to_float_array(&input[0]);
+    normals->get_image_film()->copy_to_float_array(&input[3 * plane]);
+    distance->get_image_film()->copy_to_float_array(&input[6 * plane]);
+
+    net->forward(&input[0], &output[0], hemisize);
+
+    output_film->populate_from_float_array(&output[0]);
+
+    status = 0;
+    return output_film;
+}
+
+} // namespace pbrt
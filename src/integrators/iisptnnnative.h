@@ -0,0 +1,150 @@
+#ifndef IISPTNNNATIVE_H
+#define IISPTNNNATIVE_H
+
+#include <istream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "integrators/iisptnnbackend.h"
+#include "integrators/iisptnnkernels.h"
+
+namespace pbrt {
+
+// ============================================================================
+// C++ implementation of IISPTNet (ml/iispt_net.py), evaluated in process.
+// Weights are read from the flat binary file written by
+// ml/export_weights.py:
+//
+//   char[8]  magic "IISPTNN\0"
+//   int32    version (1)
+//   int32    align_corners used by the bilinear upsampling (0 or 1)
+//   int32    number of tensors
+//   for each tensor:
+//     int32    name length, followed by the name (state_dict key)
+//     int32    number of dimensions, followed by the dimensions
+//     float32  data, in PyTorch (row major) order
+//
+// Tensors are CHW without batch dimension, the layout used by the
+// training code.
+class IisptNnNet
+{
+public:
+
+    // A convolution with stride 1 and "same" padding.
+    // Transposed convolutions are converted to this form when loaded.
+    struct Conv {
+        int cin = 0;
+        int cout = 0;
+        int ksize = 0;
+        // (cout, cin, ksize, ksize)
+        std::vector<float> weight;
+        // (cout)
+        std::vector<float> bias;
+    };
+
+    // Eval mode BatchNorm folded into a per channel affine transform
+    struct BatchNorm {
+        std::vector<float> scale;
+        std::vector<float> shift;
+    };
+
+private:
+
+    int k = 0;
+
+    bool align_corners = false;
+
+    Conv e0c0, e0c1;
+    Conv e1c0, e1c1;
+    BatchNorm e1bn;
+    Conv e2c0, e2c1;
+    BatchNorm e2bn;
+    Conv e3c0, e3c1;
+    BatchNorm e3bn;
+    Conv d0c0, d0c1;
+    BatchNorm d0bn;
+    Conv d1c0, d1c1;
+    BatchNorm d1bn;
+    Conv d2c0, d2c1, d2c2;
+
+public:
+
+    // Named tensors as stored in the weights file
+    struct Tensor {
+        std::vector<int> shape;
+        std::vector<float> data;
+    };
+
+    typedef std::map<std::string, Tensor> TensorMap;
+
+    // <return> false and prints the reason if the stream is not a valid
+    //          weights file for IISPTNet
+    bool load(std::istream &in);
+
+    bool load(const TensorMap &tensors, bool align_corners);
+
+    int get_k() const {
+        return k;
+    }
+
+    bool get_align_corners() const {
+        return align_corners;
+    }
+
+    // <input>  (7, size, size) normalized intensity, normals, distance
+    // <output> (3, size, size)
+    // <size> must be a multiple of 8
+    // Safe to call concurrently, scratch memory is per thread
+    void forward(const float* input, float* output, int size) const;
+
+    // Same as above with an explicit instruction set, used by the tests
+    // and the benchmark
+    void forward(const float* input, float* output, int size,
+                 const IisptNnKernels &kernels) const;
+
+    static bool read_tensors(std::istream &in, TensorMap &tensors,
+                             bool &align_corners);
+
+    static void write_tensors(std::ostream &out, const TensorMap &tensors,
+                              bool align_corners);
+
+    // Weights with the shapes of IISPTNet and plausible magnitudes, for
+    // tests and benchmarks
+    static TensorMap random_tensors(int k, unsigned int seed);
+
+};
+
+// ============================================================================
+// Backend evaluating the network in process.
+// The same object is shared by all render threads.
+class IisptNnNative : public IisptNnBackend
+{
+private:
+
+    std::shared_ptr<const IisptNnNet> net;
+
+public:
+
+    // Loads the weights from IISPT_NN_WEIGHTS_PATH
+    IisptNnNative();
+
+    IisptNnNative(std::shared_ptr<const IisptNnNet> net) :
+        net(net)
+    {
+
+    }
+
+    std::unique_ptr<IntensityFilm> communicate(
+            IntensityFilm* intensity,
+            DistanceFilm* distance,
+            NormalFilm* normals,
+            int &status
+            );
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTNNNATIVE_H
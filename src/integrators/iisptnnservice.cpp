@@ -0,0 +1,279 @@
+#include "iisptnnservice.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "iispttrace.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_INT_DISTRIBUTION("IILE/NN batch occupancy (hemispheres)", nnBatchOccupancy);
+STAT_FLOAT_DISTRIBUTION("IILE/NN queue wait (ms)", nnQueueWaitMs);
+STAT_COUNTER("IILE/NN batches", nnBatches);
+STAT_COUNTER("IILE/NN hemispheres", nnHemispheres);
+
+// ============================================================================
+IisptNnService::IisptNnService(int max_batch_size)
+{
+    // Read environment variables
+    char* batch_size_env = std::getenv("IISPT_NN_BATCH_SIZE");
+    if (batch_size_env == NULL) {
+        this->max_batch_size = max_batch_size;
+    } else {
+        this->max_batch_size = std::stoi(std::string(batch_size_env));
+    }
+    if (this->max_batch_size < 1) {
+        this->max_batch_size = 1;
+    }
+
+    char* latency_env = std::getenv("IISPT_NN_BATCH_LATENCY_US");
+    if (latency_env == NULL) {
+        max_latency = std::chrono::microseconds(2000);
+    } else {
+        max_latency = std::chrono::microseconds(
+                    std::stoi(std::string(latency_env)));
+    }
+
+    std::cerr << "iisptnnservice.cpp: max batch size " << this->max_batch_size
+              << ", max latency " << max_latency.count() << "us" << std::endl;
+
+    connector = std::unique_ptr<IisptNnConnector>(
+                new IisptNnConnector(true, this->max_batch_size)
+                );
+
+    worker = std::thread([this]() {
+        worker_loop();
+    });
+}
+
+// ============================================================================
+IisptNnService::~IisptNnService()
+{
+    sendEOF();
+}
+
+// ============================================================================
+// Queue a request
+// If the service is already stopped the result is an error
+std::future<IisptNnResult> IisptNnService::enqueue(
+        std::unique_ptr<Request> request
+        )
+{
+    std::future<IisptNnResult> result = request->result.get_future();
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        if (stopping) {
+            std::cerr << "iisptnnservice.cpp: request received after sendEOF()\n";
+            IisptNnResult error;
+            request->result.set_value(std::move(error));
+            return result;
+        }
+        request->enqueued = std::chrono::steady_clock::now();
+        queue.push_back(std::move(request));
+    }
+    cv.notify_all();
+    return result;
+}
+
+// ============================================================================
+// Called by the render runners. Blocks until the batch containing this
+// request has been evaluated
+std::unique_ptr<IntensityFilm> IisptNnService::communicate(
+        IntensityFilm* intensity,
+        DistanceFilm* distance,
+        NormalFilm* normals,
+        int &status
+        )
+{
+    std::unique_ptr<Request> request (new Request());
+    request->intensity = intensity;
+    request->distance = distance;
+    request->normals = normals;
+
+    IisptNnResult result = enqueue(std::move(request)).get();
+    status = result.status;
+    if (!result.film) {
+        int hemisize = intensity->get_image_film()->get_width();
+        result.film = std::unique_ptr<IntensityFilm>(
+                    new IntensityFilm(hemisize, hemisize)
+                    );
+    }
+    return std::move(result.film);
+}
+
+// ============================================================================
+// Asynchronous version of communicate()
+std::future<IisptNnResult> IisptNnService::submit(
+        std::unique_ptr<IntensityFilm> intensity,
+        std::unique_ptr<DistanceFilm> distance,
+        std::unique_ptr<NormalFilm> normals
+        )
+{
+    std::unique_ptr<Request> request (new Request());
+    request->intensity = intensity.get();
+    request->distance = distance.get();
+    request->normals = normals.get();
+    request->owned_intensity = std::move(intensity);
+    request->owned_distance = std::move(distance);
+    request->owned_normals = std::move(normals);
+    return enqueue(std::move(request));
+}
+
+// ============================================================================
+void IisptNnService::worker_loop()
+{
+    // Batches submitted to the connector, oldest first
+    std::deque<Batch> in_flight;
+    int max_in_flight = connector->max_in_flight();
+
+    IisptTrace::getInstance().set_thread_name("NN service");
+
+    while (true) {
+        Batch batch;
+        batch.requests.reserve(max_batch_size);
+        {
+            std::unique_lock<std::mutex> lock (mutex);
+
+            if (in_flight.empty()) {
+                // Wait for the first request
+                cv.wait(lock, [this]() {
+                    return stopping || !queue.empty();
+                });
+                if (queue.empty()) {
+                    // Stopping and nothing left to do
+                    break;
+                }
+
+                // Give the other runners a chance to fill the batch, but never
+                // keep the oldest request waiting longer than max_latency
+                auto deadline = queue.front()->enqueued + max_latency;
+                cv.wait_until(lock, deadline, [this]() {
+                    return stopping || queue.size() >= max_batch_size;
+                });
+            }
+
+            // With a batch in flight, only take the requests already
+            // waiting, its results must not wait for this one to fill
+            if ((int) in_flight.size() < max_in_flight) {
+                while (!queue.empty() &&
+                       batch.requests.size() < max_batch_size) {
+                    batch.requests.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+        }
+
+        bool took = !batch.requests.empty();
+        if (took) {
+            int status = submit_batch(batch);
+            if (status) {
+                complete_batch(batch, status);
+            } else {
+                in_flight.push_back(std::move(batch));
+            }
+        }
+
+        // Collect the oldest batch when nothing else can be submitted
+        if (!in_flight.empty() &&
+                (!took || (int) in_flight.size() >= max_in_flight)) {
+            complete_batch(in_flight.front(), 0);
+            in_flight.pop_front();
+        }
+    }
+
+    ReportThreadStats();
+}
+
+// ============================================================================
+// Pack <batch> into the connector and send it
+// Returns 0 if all ok, 1 if an error occurred
+int IisptNnService::submit_batch(Batch &batch)
+{
+    int count = batch.requests.size();
+
+    // Hemispheres can have different sizes, see iispthemilod.h. They are
+    // packed one after the other
+    batch.sizes.resize(count);
+    for (int i = 0; i < count; i++) {
+        batch.sizes[i] =
+                batch.requests[i]->intensity->get_image_film()->get_width();
+    }
+
+    // Pack straight into the buffer seen by the child
+    float* input_buffer = connector->input_buffer();
+    batch.submitted = std::chrono::steady_clock::now();
+    int in_offset = 0;
+    for (int i = 0; i < count; i++) {
+        Request* request = batch.requests[i].get();
+        std::chrono::duration<double, std::milli> waited =
+                batch.submitted - request->enqueued;
+        ReportValue(nnQueueWaitMs, waited.count());
+        IisptNnConnector::pack_input(
+                    request->intensity,
+                    request->distance,
+                    request->normals,
+                    &input_buffer[in_offset]
+                    );
+        in_offset += IisptNnConnector::input_floats(batch.sizes[i]);
+    }
+
+    ReportValue(nnBatchOccupancy, count);
+    ++nnBatches;
+    nnHemispheres += count;
+
+    return connector->submit_buffer(count, &batch.sizes[0]);
+}
+
+// ============================================================================
+// Wait for the outputs of <batch> and hand them to the requests
+// With a non zero <status> the batch was not submitted, and every request
+// gets an error
+void IisptNnService::complete_batch(Batch &batch, int status)
+{
+    const float* output_buffer = NULL;
+    if (!status) {
+        status = connector->wait_buffer(&output_buffer);
+    }
+
+    IisptTrace &trace = IisptTrace::getInstance();
+    trace.record("NN batch", trace.to_us(batch.submitted),
+                 trace.to_us(std::chrono::steady_clock::now()));
+
+    int count = batch.requests.size();
+    int out_offset = 0;
+    for (int i = 0; i < count; i++) {
+        IisptNnResult result;
+        result.status = status;
+        result.film = std::unique_ptr<IntensityFilm>(
+                    new IntensityFilm(batch.sizes[i], batch.sizes[i])
+                    );
+        if (!status) {
+            result.film->populate_from_float_array(
+                        (float*) &output_buffer[out_offset]);
+        }
+        out_offset += IisptNnConnector::output_floats(batch.sizes[i]);
+        batch.requests[i]->result.set_value(std::move(result));
+    }
+}
+
+// ============================================================================
+// Flushes the pending requests, then stops the worker and the child process
+void IisptNnService::sendEOF()
+{
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+    }
+    connector->sendEOF();
+}
+
+} // namespace pbrt
@@ -0,0 +1,104 @@
+#ifndef IISPTNNSERVICE_H
+#define IISPTNNSERVICE_H
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "integrators/iisptnnbackend.h"
+#include "integrators/iisptnnconnector.h"
+
+namespace pbrt {
+
+// ============================================================================
+// Shared inference service
+// All render runners enqueue their hemispheres here. A single worker thread
+// drains the queue into dynamic batches and sends each batch to one
+// batched child process, so that only one copy of the model is resident
+// and the network runs with batch size > 1.
+// Batches are flushed when IISPT_NN_BATCH_SIZE requests are waiting or
+// when the oldest request has waited IISPT_NN_BATCH_LATENCY_US.
+// While a batch is being evaluated, the requests already waiting are
+// packed and submitted as the next one, up to the connector's
+// max_in_flight().
+class IisptNnService : public IisptNnBackend
+{
+private:
+
+    // A pending hemisphere.
+    // With communicate() the film pointers are owned by the caller, which
+    // is blocked on <result> until the worker is done with them.
+    // With submit() the request owns the films.
+    struct Request {
+        IntensityFilm* intensity;
+        DistanceFilm* distance;
+        NormalFilm* normals;
+        std::unique_ptr<IntensityFilm> owned_intensity;
+        std::unique_ptr<DistanceFilm> owned_distance;
+        std::unique_ptr<NormalFilm> owned_normals;
+        std::chrono::steady_clock::time_point enqueued;
+        std::promise<IisptNnResult> result;
+    };
+
+    // A batch submitted to the connector
+    struct Batch {
+        std::vector<std::unique_ptr<Request>> requests;
+        std::vector<int> sizes;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    std::unique_ptr<IisptNnConnector> connector;
+
+    int max_batch_size;
+
+    std::chrono::microseconds max_latency;
+
+    std::mutex mutex;
+
+    std::condition_variable cv;
+
+    std::deque<std::unique_ptr<Request>> queue;
+
+    bool stopping = false;
+
+    std::thread worker;
+
+    void worker_loop();
+
+    int submit_batch(Batch &batch);
+
+    void complete_batch(Batch &batch, int status);
+
+    std::future<IisptNnResult> enqueue(std::unique_ptr<Request> request);
+
+public:
+
+    // <max_batch_size> is used when IISPT_NN_BATCH_SIZE is not set
+    IisptNnService(int max_batch_size);
+
+    ~IisptNnService();
+
+    std::unique_ptr<IntensityFilm> communicate(
+            IntensityFilm* intensity,
+            DistanceFilm* distance,
+            NormalFilm* normals,
+            int &status
+            );
+
+    std::future<IisptNnResult> submit(
+            std::unique_ptr<IntensityFilm> intensity,
+            std::unique_ptr<DistanceFilm> distance,
+            std::unique_ptr<NormalFilm> normals
+            );
+
+    void sendEOF();
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTNNSERVICE_H
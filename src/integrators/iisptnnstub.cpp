@@ -0,0 +1,54 @@
+#include "iisptnnstub.h"
+
+#include <iostream>
+
+#include "integrators/iisptnnnative.h"
+
+namespace pbrt {
+
+// ============================================================================
+std::shared_ptr<IisptNnBackend> IisptNnStub::create(const std::string &name)
+{
+    if (name == "identity") {
+        return std::shared_ptr<IisptNnBackend>(new IisptNnStub(true));
+    } else if (name == "constant") {
+        return std::shared_ptr<IisptNnBackend>(new IisptNnStub(false));
+    } else if (name == "tiny") {
+        std::shared_ptr<IisptNnNet> net (new IisptNnNet());
+        if (!net->load(IisptNnNet::random_tensors(IISPT_NN_STUB_TINY_K, 1), false)) {
+            std::cerr << "iisptnnstub.cpp: could not build the tiny network\n";
+            return nullptr;
+        }
+        return std::shared_ptr<IisptNnBackend>(new IisptNnNative(net));
+    }
+    return nullptr;
+}
+
+// ============================================================================
+std::unique_ptr<IntensityFilm> IisptNnStub::communicate(
+        IntensityFilm* intensity,
+        DistanceFilm* distance,
+        NormalFilm* normals,
+        int &status
+        )
+{
+    // Hemispheres can have different sizes, see iispthemilod.h
+    std::unique_ptr<IntensityFilm> output_film (
+                new IntensityFilm(
+                    intensity->get_image_film()->get_width(),
+                    intensity->get_image_film()->get_height()
+                    )
+                );
+
+    if (identity) {
+        output_film->get_image_film()->populate_from_float_array(
+                    intensity->get_image_film()->get_data());
+    } else {
+        output_film->get_image_film()->add(0.5);
+    }
+
+    status = 0;
+    return output_film;
+}
+
+} // namespace pbrt
@@ -0,0 +1,54 @@
+#ifndef IISPTNNSTUB_H
+#define IISPTNNSTUB_H
+
+#include <memory>
+#include <string>
+
+#include "integrators/iisptnnbackend.h"
+
+namespace pbrt {
+
+// Channels of the fixed weight network used by the "tiny" stub
+const int IISPT_NN_STUB_TINY_K = 4;
+
+// ============================================================================
+// Stand-in networks for benchmarks and tests. They need neither the Python
+// child process nor trained weights, and always give the same output for
+// the same input:
+//
+//   identity  the normalized input intensity is returned as the prediction
+//   constant  a uniform hemisphere, rescaled upstream to the input mean
+//   tiny      the native IISPTNet with IISPT_NN_STUB_TINY_K channels and
+//             fixed pseudo-random weights
+//
+// The same object is shared by all render threads.
+class IisptNnStub : public IisptNnBackend
+{
+private:
+
+    bool identity;
+
+    IisptNnStub(bool identity) :
+        identity(identity)
+    {
+
+    }
+
+public:
+
+    // <name> one of identity, constant, tiny
+    // <return> nullptr if the name is unknown
+    static std::shared_ptr<IisptNnBackend> create(const std::string &name);
+
+    std::unique_ptr<IntensityFilm> communicate(
+            IntensityFilm* intensity,
+            DistanceFilm* distance,
+            NormalFilm* normals,
+            int &status
+            );
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTNNSTUB_H
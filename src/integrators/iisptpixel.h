@@ -1,6 +1,11 @@
 #ifndef IISPTPIXEL_H
 #define IISPTPIXEL_H
 
+#include <atomic>
+#include <cstdint>
+
+#include "pbrt.h"
+
 namespace pbrt {
 
 struct IisptPixel {
@@ -21,7 +26,77 @@ struct IisptPixel {
 
 };
 
+// ============================================================================
+// Double with lock free addition, same scheme as AtomicFloat in parallel.h
+class IisptAtomicDouble {
+private:
+
+    std::atomic<uint64_t> bits;
+
+public:
 
+    explicit IisptAtomicDouble(double v = 0.0) {
+        bits = FloatToBits(v);
+    }
+
+    double load() const {
+        return BitsToFloat(bits.load(std::memory_order_relaxed));
+    }
+
+    void store(double v) {
+        bits.store(FloatToBits(v), std::memory_order_relaxed);
+    }
+
+    void add(double v) {
+        uint64_t old_bits = bits.load(std::memory_order_relaxed);
+        uint64_t new_bits;
+        do {
+            new_bits = FloatToBits(BitsToFloat(old_bits) + v);
+        } while (!bits.compare_exchange_weak(
+                     old_bits, new_bits, std::memory_order_relaxed));
+    }
+
+};
+
+// ============================================================================
+// Accumulator that many threads can add to concurrently.
+// The four components are updated independently, so a reader running at
+// the same time as a writer may see a sample's colour without its weight.
+// That is fine for progressive previews; once the writers are done the
+// values are exact.
+struct IisptAtomicPixel {
+    IisptAtomicDouble r;
+    IisptAtomicDouble g;
+    IisptAtomicDouble b;
+    IisptAtomicDouble weight;
+
+    void add(double rr, double gg, double bb, double w)
+    {
+        r.add(rr);
+        g.add(gg);
+        b.add(bb);
+        weight.add(w);
+    }
+
+    void set(const IisptPixel &pix)
+    {
+        r.store(pix.r);
+        g.store(pix.g);
+        b.store(pix.b);
+        weight.store(pix.weight);
+    }
+
+    IisptPixel load() const
+    {
+        IisptPixel pix;
+        pix.r = r.load();
+        pix.g = g.load();
+        pix.b = b.load();
+        pix.weight = weight.load();
+        return pix;
+    }
+
+};
 
 }
 
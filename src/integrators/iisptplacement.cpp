@@ -0,0 +1,237 @@
+#include "iisptplacement.h"
+
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+
+#include "stats.h"
+#include "tools/iisptmathutils.h"
+
+namespace pbrt {
+
+STAT_COUNTER("IILE/Hemisphere points placed", hemiPointsPlaced);
+
+// Relative depth change between adjacent pixels that forces a split
+static const float DEPTH_THRESHOLD = 0.1;
+
+// Minimum dot product between adjacent normals on a smooth surface
+static const float NORMAL_THRESHOLD = 0.9;
+
+// ============================================================================
+// Coordinates from <a0> every <step>, and the last coordinate <a1> - 1
+static std::vector<int> grid_coordinates(int a0, int a1, int step)
+{
+    std::vector<int> res;
+    int v = a0;
+    res.push_back(v);
+    while (v < a1 - 1) {
+        v = std::min(v + step, a1 - 1);
+        res.push_back(v);
+    }
+    return res;
+}
+
+// ============================================================================
+IisptPlacement::IisptPlacement(const IisptScheduleMonitorTask &task)
+{
+    this->task = task;
+    this->adaptive = false;
+    place_grid();
+    hemiPointsPlaced += points.size();
+}
+
+// ============================================================================
+IisptPlacement::IisptPlacement(
+        const IisptScheduleMonitorTask &task,
+        const std::vector<IisptGSample> &gbuffer
+        )
+{
+    this->task = task;
+    this->adaptive = true;
+
+    int width = task.x1 - task.x0;
+    int height = task.y1 - task.y0;
+    if ((int) gbuffer.size() != width * height) {
+        std::cerr << "iisptplacement.cpp: G-buffer size " << gbuffer.size() << " does not match the task\n";
+        std::raise(SIGKILL);
+    }
+
+    pixel_cells = std::vector<int>(width * height, -1);
+
+    int root_size = std::max(1, 2 * task.tilesize);
+    int min_size = std::max(1, task.tilesize / 2);
+    for (int y = task.y0; y < task.y1; y += root_size) {
+        for (int x = task.x0; x < task.x1; x += root_size) {
+            subdivide(
+                        gbuffer,
+                        x,
+                        y,
+                        std::min(root_size, task.x1 - x),
+                        std::min(root_size, task.y1 - y),
+                        min_size
+                        );
+        }
+    }
+
+    // Corners of the leaves, in raster order
+    std::vector<char> used (width * height, 0);
+    for (const Cell &cell : cells) {
+        int ex = std::min(cell.x0 + cell.w, task.x1 - 1);
+        int ey = std::min(cell.y0 + cell.h, task.y1 - 1);
+        int xs[2] = {cell.x0, ex};
+        int ys[2] = {cell.y0, ey};
+        for (int j = 0; j < 2; j++) {
+            for (int i = 0; i < 2; i++) {
+                used[(ys[j] - task.y0) * width + (xs[i] - task.x0)] = 1;
+            }
+        }
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (used[y * width + x]) {
+                points.push_back(Point2i(task.x0 + x, task.y0 + y));
+            }
+        }
+    }
+
+    hemiPointsPlaced += points.size();
+}
+
+// ============================================================================
+void IisptPlacement::place_grid()
+{
+    std::vector<int> xs = grid_coordinates(task.x0, task.x1, task.tilesize);
+    std::vector<int> ys = grid_coordinates(task.y0, task.y1, task.tilesize);
+    for (int y : ys) {
+        for (int x : xs) {
+            points.push_back(Point2i(x, y));
+        }
+    }
+}
+
+// ============================================================================
+// Split the cell at <x0>, <y0> of size <w>, <h> until it is smooth or as
+// small as <min_size>
+void IisptPlacement::subdivide(
+        const std::vector<IisptGSample> &gbuffer,
+        int x0,
+        int y0,
+        int w,
+        int h,
+        int min_size
+        )
+{
+    int ex = std::min(x0 + w, task.x1 - 1);
+    int ey = std::min(y0 + h, task.y1 - 1);
+
+    bool split_x = w > min_size;
+    bool split_y = h > min_size;
+
+    if ((split_x || split_y) && discontinuous(gbuffer, x0, y0, ex, ey)) {
+        int w0 = split_x ? w / 2 : w;
+        int h0 = split_y ? h / 2 : h;
+        subdivide(gbuffer, x0, y0, w0, h0, min_size);
+        if (split_x) {
+            subdivide(gbuffer, x0 + w0, y0, w - w0, h0, min_size);
+        }
+        if (split_y) {
+            subdivide(gbuffer, x0, y0 + h0, w0, h - h0, min_size);
+        }
+        if (split_x && split_y) {
+            subdivide(gbuffer, x0 + w0, y0 + h0, w - w0, h - h0, min_size);
+        }
+        return;
+    }
+
+    // Leaf
+    int index = cells.size();
+    Cell cell;
+    cell.x0 = x0;
+    cell.y0 = y0;
+    cell.w = w;
+    cell.h = h;
+    cells.push_back(cell);
+
+    int width = task.x1 - task.x0;
+    for (int y = y0; y < y0 + h; y++) {
+        for (int x = x0; x < x0 + w; x++) {
+            pixel_cells[(y - task.y0) * width + (x - task.x0)] = index;
+        }
+    }
+}
+
+// ============================================================================
+// True if any two adjacent pixels in [x0, x1] x [y0, y1] belong to
+// different surfaces
+bool IisptPlacement::discontinuous(
+        const std::vector<IisptGSample> &gbuffer,
+        int x0,
+        int y0,
+        int x1,
+        int y1
+        )
+{
+    auto differ = [](const IisptGSample &a, const IisptGSample &b) {
+        if (a.hit != b.hit) {
+            return true;
+        }
+        if (!a.hit) {
+            return false;
+        }
+        if (a.object != b.object) {
+            return true;
+        }
+        float closest = std::min(a.depth, b.depth);
+        if (std::abs(a.depth - b.depth) > DEPTH_THRESHOLD * closest) {
+            return true;
+        }
+        return Dot(a.n, b.n) < NORMAL_THRESHOLD;
+    };
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            const IisptGSample &s = gsample(gbuffer, x, y);
+            if (x < x1 && differ(s, gsample(gbuffer, x + 1, y))) {
+                return true;
+            }
+            if (y < y1 && differ(s, gsample(gbuffer, x, y + 1))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// ============================================================================
+int IisptPlacement::neighbours(Point2i pixel, Point2i* out)
+{
+    Point2i s;
+    int size;
+    if (adaptive) {
+        int width = task.x1 - task.x0;
+        const Cell &cell = cells[pixel_cells[
+                (pixel.y - task.y0) * width + (pixel.x - task.x0)]];
+        s = Point2i(cell.x0, cell.y0);
+        out[1] = Point2i(
+                    std::min(cell.x0 + cell.w, task.x1 - 1),
+                    std::min(cell.y0 + cell.h, task.y1 - 1)
+                    );
+        size = std::max(cell.w, cell.h);
+    } else {
+        s = Point2i(
+                    pixel.x - (iispt::positiveModulo(pixel.x - task.x0, task.tilesize)),
+                    pixel.y - (iispt::positiveModulo(pixel.y - task.y0, task.tilesize))
+                    );
+        out[1] = Point2i(
+                    std::min(s.x + task.tilesize, task.x1 - 1),
+                    std::min(s.y + task.tilesize, task.y1 - 1)
+                    );
+        size = task.tilesize;
+    }
+    out[0] = s;
+    out[2] = Point2i(out[1].x, s.y);
+    out[3] = Point2i(s.x, out[1].y);
+    return size;
+}
+
+} // namespace pbrt
@@ -0,0 +1,119 @@
+#ifndef IISPTPLACEMENT_H
+#define IISPTPLACEMENT_H
+
+#include <vector>
+
+#include "geometry.h"
+#include "integrators/iisptschedulemonitor.h"
+
+namespace pbrt {
+
+// ============================================================================
+// First hit of the primary ray through a pixel centre
+struct IisptGSample
+{
+    bool hit = false;
+    float depth = 0.0;
+    // Facing the camera
+    Normal3f n;
+    // Identifies the primitive that was hit
+    const void* object = nullptr;
+};
+
+// ============================================================================
+// Where the hemispheres of a task are computed, and which 4 hemispheres
+// each pixel of the task interpolates.
+//
+// Grid placement puts a hemisphere every tilesize pixels, plus the last
+// row and column of the task.
+// Adaptive placement builds a quadtree over a G-buffer of the task. It
+// starts from cells twice the tile size and splits them down to half the
+// tile size wherever depth, normal or primitive change between adjacent
+// pixels, so hemispheres are dense along discontinuities and sparse on
+// smooth surfaces. Each pixel interpolates the corners of its leaf cell.
+class IisptPlacement
+{
+private:
+
+    // Leaf cell of the quadtree, covers pixels [x0, x0 + w) x [y0, y0 + h)
+    struct Cell {
+        int x0;
+        int y0;
+        int w;
+        int h;
+    };
+
+    IisptScheduleMonitorTask task;
+
+    bool adaptive;
+
+    std::vector<Point2i> points;
+
+    std::vector<Cell> cells;
+
+    // Cell index for every pixel of the task, row major
+    std::vector<int> pixel_cells;
+
+    // Private methods --------------------------------------------------------
+
+    void place_grid();
+
+    void subdivide(
+            const std::vector<IisptGSample> &gbuffer,
+            int x0,
+            int y0,
+            int w,
+            int h,
+            int min_size
+            );
+
+    bool discontinuous(
+            const std::vector<IisptGSample> &gbuffer,
+            int x0,
+            int y0,
+            int x1,
+            int y1
+            );
+
+    const IisptGSample& gsample(
+            const std::vector<IisptGSample> &gbuffer,
+            int x,
+            int y
+            ) {
+        return gbuffer[(y - task.y0) * (task.x1 - task.x0) + (x - task.x0)];
+    }
+
+public:
+
+    // Constructor ------------------------------------------------------------
+
+    // Grid placement
+    IisptPlacement(const IisptScheduleMonitorTask &task);
+
+    // Adaptive placement
+    // <gbuffer> one sample per pixel of the task, row major
+    IisptPlacement(
+            const IisptScheduleMonitorTask &task,
+            const std::vector<IisptGSample> &gbuffer
+            );
+
+    // Public methods ---------------------------------------------------------
+
+    // Film pixels where hemispheres are needed, no duplicates
+    const std::vector<Point2i>& get_points() {
+        return points;
+    }
+
+    // Hemisphere points around <pixel>, in the order
+    //     0 S - top left
+    //     1 E - bottom right
+    //     2 R - top right
+    //     3 B - bottom left
+    // <return> the distance between hemisphere points around <pixel>
+    int neighbours(Point2i pixel, Point2i* out);
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTPLACEMENT_H
@@ -0,0 +1,166 @@
+#include "iisptpreviewstream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_COUNTER("IILE/Preview tiles published", previewTilesPublished);
+STAT_COUNTER("IILE/Preview frames published", previewFramesPublished);
+
+static const char PREVIEW_MAGIC[8] = {'I', 'I', 'L', 'E', 'P', 'R', 'V', '1'};
+
+// Header fields
+static const int FINISHED_OFFSET = 36;
+static const int FRAME_OFFSET = 40;
+
+// ============================================================================
+IisptPreviewStream::IisptPreviewStream(
+        const std::string &directory,
+        IisptFilmMonitor* indirect
+        )
+{
+    this->path = directory + "/" + IISPT_PREVIEW_FILE_NAME;
+    this->width = indirect->get_width();
+    this->height = indirect->get_height();
+    this->tile_size = IisptFilmMonitor::PREVIEW_TILE;
+    this->tiles_x = indirect->get_tiles_x();
+    this->tiles_y = indirect->get_tiles_y();
+    this->frame = 0;
+
+    this->mapped_bytes = layers_offset() +
+            (size_t) IISPT_PREVIEW_LAYERS * width * height * 3 * sizeof(float);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "iisptpreviewstream.cpp: could not create " << path << ": " << strerror(errno) << std::endl;
+        std::raise(SIGKILL);
+    }
+    if (ftruncate(fd, mapped_bytes) != 0) {
+        std::cerr << "iisptpreviewstream.cpp: ftruncate() failed: " << strerror(errno) << std::endl;
+        std::raise(SIGKILL);
+    }
+    void* m = mmap(NULL, mapped_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        std::cerr << "iisptpreviewstream.cpp: mmap() failed: " << strerror(errno) << std::endl;
+        std::raise(SIGKILL);
+    }
+    this->mapped = (char*) m;
+
+    // The file is zero filled by ftruncate
+    int32_t fields[7] = {
+        IISPT_PREVIEW_VERSION, width, height, tile_size, tiles_x, tiles_y,
+        IISPT_PREVIEW_LAYERS
+    };
+    std::memcpy(mapped, PREVIEW_MAGIC, sizeof(PREVIEW_MAGIC));
+    std::memcpy(mapped + sizeof(PREVIEW_MAGIC), fields, sizeof(fields));
+}
+
+// ============================================================================
+IisptPreviewStream::~IisptPreviewStream()
+{
+    munmap(mapped, mapped_bytes);
+}
+
+// ============================================================================
+// Layers start on a 64 bytes boundary after the tile frames
+size_t IisptPreviewStream::layers_offset() const
+{
+    size_t end = IISPT_PREVIEW_HEADER_BYTES +
+            (size_t) tiles_x * tiles_y * sizeof(uint64_t);
+    return (end + 63) & ~((size_t) 63);
+}
+
+// ============================================================================
+void IisptPreviewStream::write_tile(
+        int tile,
+        IisptFilmMonitor* indirect,
+        IisptFilmMonitor* direct
+        )
+{
+    int x0 = (tile % tiles_x) * tile_size;
+    int y0 = (tile / tiles_x) * tile_size;
+    int x1 = std::min(x0 + tile_size, width);
+    int y1 = std::min(y0 + tile_size, height);
+
+    float* combined = layer(IISPT_PREVIEW_LAYER_COMBINED);
+    float* ind = layer(IISPT_PREVIEW_LAYER_INDIRECT);
+    float* dir = layer(IISPT_PREVIEW_LAYER_DIRECT);
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            IisptPixel ip = indirect->get_pixel(x, y);
+            IisptPixel dp = direct->get_pixel(x, y);
+            // Same as IisptFilmMonitor::merge_into
+            ip.normalize();
+            dp.normalize();
+            size_t i = 3 * ((size_t) y * width + x);
+            ind[i + 0] = (float) ip.r;
+            ind[i + 1] = (float) ip.g;
+            ind[i + 2] = (float) ip.b;
+            dir[i + 0] = (float) dp.r;
+            dir[i + 1] = (float) dp.g;
+            dir[i + 2] = (float) dp.b;
+            combined[i + 0] = (float) (ip.r + dp.r);
+            combined[i + 1] = (float) (ip.g + dp.g);
+            combined[i + 2] = (float) (ip.b + dp.b);
+        }
+    }
+}
+
+// ============================================================================
+int IisptPreviewStream::publish(
+        IisptFilmMonitor* indirect,
+        IisptFilmMonitor* direct
+        )
+{
+    tiles.clear();
+    indirect->take_dirty_tiles(tiles);
+    direct->take_dirty_tiles(tiles);
+    if (tiles.empty()) {
+        return 0;
+    }
+
+    // A tile changed in both monitors is only written once
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+
+    uint64_t next_frame = frame + 1;
+    for (int tile : tiles) {
+        write_tile(tile, indirect, direct);
+    }
+
+    // Pixels before tile frames, tile frames before the header frame
+    std::atomic_thread_fence(std::memory_order_release);
+    uint64_t* frames = tile_frames();
+    for (int tile : tiles) {
+        frames[tile] = next_frame;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(mapped + FRAME_OFFSET, &next_frame, sizeof(next_frame));
+
+    frame = next_frame;
+    previewTilesPublished += tiles.size();
+    ++previewFramesPublished;
+    return tiles.size();
+}
+
+// ============================================================================
+void IisptPreviewStream::set_finished()
+{
+    int32_t finished = 1;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(mapped + FINISHED_OFFSET, &finished, sizeof(finished));
+}
+
+} // namespace pbrt
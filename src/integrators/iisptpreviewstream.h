@@ -0,0 +1,115 @@
+#ifndef IISPTPREVIEWSTREAM_H
+#define IISPTPREVIEWSTREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "integrators/iisptfilmmonitor.h"
+
+namespace pbrt {
+
+const std::string IISPT_PREVIEW_FILE_NAME = std::string("preview.fb");
+
+const int IISPT_PREVIEW_VERSION = 1;
+const int IISPT_PREVIEW_HEADER_BYTES = 64;
+
+// Layers of the framebuffer, in order
+const int IISPT_PREVIEW_LAYER_COMBINED = 0;
+const int IISPT_PREVIEW_LAYER_INDIRECT = 1;
+const int IISPT_PREVIEW_LAYER_DIRECT = 2;
+const int IISPT_PREVIEW_LAYERS = 3;
+
+// ============================================================================
+// Progressive preview of the IILE render, published to the GUI through a
+// memory mapped framebuffer file in the control directory.
+//
+// preview.fb starts with a 64 bytes header:
+//   0  "IILEPRV1"
+//   8  int32 version, width, height, tile size, tiles x, tiles y, layers
+//   36 int32 finished, 1 once the render is complete
+//   40 uint64 frame, incremented by every publish()
+// followed by a uint64 per tile, the frame that last wrote it, and by the
+// layers (combined, indirect, direct) as float32 RGB pixels, rows from the
+// top of the image. Tiles and the frame counter are written after the
+// pixels, so a reader that sees frame n can read every tile written up to
+// frame n.
+//
+// publish() only converts and copies the tiles that the film monitors
+// flagged since the previous call.
+class IisptPreviewStream
+{
+private:
+
+    // Fields -----------------------------------------------------------------
+
+    std::string path;
+
+    int width;
+    int height;
+    int tile_size;
+    int tiles_x;
+    int tiles_y;
+
+    size_t mapped_bytes;
+    char* mapped;
+
+    uint64_t frame;
+
+    // Scratch list of tiles for publish()
+    std::vector<int> tiles;
+
+    // Private methods --------------------------------------------------------
+
+    uint64_t* tile_frames() {
+        return (uint64_t*) (mapped + IISPT_PREVIEW_HEADER_BYTES);
+    }
+
+    float* layer(int l) {
+        return (float*) (mapped + layers_offset()) + (size_t) l * width * height * 3;
+    }
+
+    size_t layers_offset() const;
+
+    void write_tile(
+            int tile,
+            IisptFilmMonitor* indirect,
+            IisptFilmMonitor* direct
+            );
+
+public:
+
+    // Constructor ------------------------------------------------------------
+    // Creates <directory>/preview.fb for monitors of the size of <indirect>
+    IisptPreviewStream(
+            const std::string &directory,
+            IisptFilmMonitor* indirect
+            );
+
+    ~IisptPreviewStream();
+
+    // Public methods ---------------------------------------------------------
+
+    // Copies the tiles changed in either monitor into the framebuffer.
+    // Returns the number of tiles published; the frame counter only moves
+    // when it's not 0
+    int publish(
+            IisptFilmMonitor* indirect,
+            IisptFilmMonitor* direct
+            );
+
+    void set_finished();
+
+    uint64_t get_frame() const {
+        return frame;
+    }
+
+    const std::string& get_path() const {
+        return path;
+    }
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTPREVIEWSTREAM_H
@@ -1,11 +1,28 @@
 #include "iisptrenderrunner.h"
+#include "iispttrace.h"
 #include "lightdistrib.h"
+#include "stats.h"
 
 #include <chrono>
 #include <csignal>
+#include <cstdlib>
 
 namespace pbrt {
 
+// Time spent in each stage of the indirect pass, summed over all threads
+STAT_COUNTER("IILE/Time in find_intersection() (ns)", findIntersectionNs);
+STAT_COUNTER("IILE/Time in RenderHemisphere() (ns)", renderHemisphereNs);
+STAT_COUNTER("IILE/Time in normalizeMapsDownstream() (ns)", normalizeMapsNs);
+STAT_COUNTER("IILE/Time in NN submit (ns)", nnSubmitNs);
+STAT_COUNTER("IILE/Time blocked on NN results (ns)", nnWaitNs);
+STAT_COUNTER("IILE/Time in sample_hemisphere() (ns)", sampleHemisphereNs);
+STAT_COUNTER("IILE/Time in film monitor adds (ns)", filmMonitorAddNs);
+
+STAT_COUNTER("IILE/Hemispheres rendered", hemispheresRendered);
+STAT_INT_DISTRIBUTION("IILE/Hemisphere size (pixels across)", hemisphereSizes);
+STAT_COUNTER("IILE/Indirect samples", indirectSamples);
+STAT_COUNTER("IILE/Direct samples", directSamples);
+
 // ============================================================================
 // Estimate direct (evaluate 1 hemisphere pixel)
 // Output is scaled by 1/pp(x)
@@ -137,6 +154,93 @@ static Spectrum estimate_direct(
 
 }
 
+// ============================================================================
+// Estimate direct with importance sampling of the NN hemisphere
+// One direction is sampled proportionally to the NN luminance and one from
+// the BSDF, combined with the power heuristic
+static Spectrum estimate_direct_importance(
+        const Interaction &it,
+        HemisphericCamera* auxCamera,
+        IisptRng* rng
+        ) {
+
+    BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+    Spectrum Ld(0.f);
+
+    Vector3f wi;
+    Float lightPdf = 0;
+    Float scatteringPdf = 0;
+
+    // Sample the NN hemisphere
+    Point2f uLight (
+                rng->uniform_float(),
+                rng->uniform_float()
+                );
+    Spectrum Li = auxCamera->sample_nn(uLight, &wi, &lightPdf);
+    if (lightPdf > 0 && !Li.IsBlack()) {
+        Spectrum f;
+        if (it.IsSurfaceInteraction()) {
+            const SurfaceInteraction &isect = (const SurfaceInteraction &) it;
+            f = isect.bsdf->f(isect.wo, wi, bsdfFlags) * AbsDot(wi, isect.shading.n);
+            scatteringPdf = isect.bsdf->Pdf(isect.wo, wi, bsdfFlags);
+        } else {
+            const MediumInteraction &mi = (const MediumInteraction &) it;
+            Float p = mi.phase->p(mi.wo, wi);
+            f = Spectrum(p);
+            scatteringPdf = p;
+        }
+        if (!f.IsBlack()) {
+            Float weight = PowerHeuristic(1, lightPdf, 1, scatteringPdf);
+            Ld += f * Li * weight / lightPdf;
+        }
+    }
+
+    // Sample the BSDF
+    Spectrum f;
+    Point2f uScattering (
+                rng->uniform_float(),
+                rng->uniform_float()
+                );
+    if (it.IsSurfaceInteraction()) {
+        const SurfaceInteraction &isect = (const SurfaceInteraction &) it;
+        f = isect.bsdf->Sample_f(
+                    isect.wo,
+                    &wi,
+                    uScattering,
+                    &scatteringPdf,
+                    bsdfFlags
+                    );
+        f *= AbsDot(wi, isect.shading.n);
+    } else {
+        const MediumInteraction &mi = (const MediumInteraction &) it;
+        Float p = mi.phase->Sample_p(mi.wo, &wi, uScattering);
+        f = Spectrum(p);
+        scatteringPdf = p;
+    }
+    if (!f.IsBlack() && scatteringPdf > 0) {
+        Li = auxCamera->eval_nn(wi, &lightPdf);
+        if (!Li.IsBlack()) {
+            Float weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+            Ld += f * Li * weight / scatteringPdf;
+        }
+    }
+
+    return Ld;
+}
+
+// ============================================================================
+// Angle between the primary rays of adjacent pixels, 0 without differentials
+static Float pixel_angle(const RayDifferential &r)
+{
+    if (!r.hasDifferentials) {
+        return 0.0;
+    }
+    Vector3f d = Normalize(r.d);
+    Float cos_x = Clamp(Dot(d, Normalize(r.rxDirection)), -1.0, 1.0);
+    Float cos_y = Clamp(Dot(d, Normalize(r.ryDirection)), -1.0, 1.0);
+    return std::max(std::acos(cos_x), std::acos(cos_y));
+}
+
 // ============================================================================
 // Sample hemisphere with multiple cameras and weights
 Spectrum IisptRenderRunner::sample_hemisphere(
@@ -146,6 +250,7 @@ Spectrum IisptRenderRunner::sample_hemisphere(
         HemisphericCamera** cameras
         )
 {
+    IisptStage stage (Prof::IILESampleHemisphere, sampleHemisphereNs);
     Spectrum L(0.f);
 
     int samples_taken = 0;
@@ -154,16 +259,21 @@ Spectrum IisptRenderRunner::sample_hemisphere(
         HemisphericCamera* a_camera = cameras[i];
         float a_weight = weights[i];
 
-        // Attempt HEMISPHERIC_IMPORTANCE_SAMPLES to sample this camera
+        // Attempt hemi_samples to sample this camera
         // The expected number of samples across all the cameras will be
-        // HEMISPHERIC_IMPORTANCE_SAMPLES
-        for (int j = 0; j < HEMISPHERIC_IMPORTANCE_SAMPLES; j++) {
+        // hemi_samples
+        for (int j = 0; j < hemi_samples; j++) {
             float rr = rng->uniform_float();
             if (rr < a_weight) {
                 samples_taken++;
-                if (a_camera != NULL) {
-                    int rx = rng->uniform_uint32(PbrtOptions.iisptHemiSize);
-                    int ry = rng->uniform_uint32(PbrtOptions.iisptHemiSize);
+                if (a_camera == NULL) {
+                    continue;
+                }
+                if (importance_sampling) {
+                    L += estimate_direct_importance(it, a_camera, rng.get());
+                } else {
+                    int rx = rng->uniform_uint32(a_camera->film->fullResolution.x);
+                    int ry = rng->uniform_uint32(a_camera->film->fullResolution.y);
                     L += estimate_direct(it, rx, ry, a_camera, rng.get());
                 }
             }
@@ -186,7 +296,8 @@ IisptRenderRunner::IisptRenderRunner(std::shared_ptr<IisptScheduleMonitor> sched
         std::shared_ptr<Sampler> sampler,
         int thread_no,
         Bounds2i pixel_bounds,
-        std::shared_ptr<IisptNnConnector> nnConnector)
+        std::shared_ptr<IisptNnBackend> nnConnector,
+        std::shared_ptr<IisptHemisphereCache> hemi_cache)
 {
     this->schedule_monitor = schedule_monitor;
 
@@ -200,15 +311,223 @@ IisptRenderRunner::IisptRenderRunner(std::shared_ptr<IisptScheduleMonitor> sched
 
     this->nn_connector = std::move(nnConnector);
 
+    this->hemi_cache = hemi_cache;
+
+    this->seed_offset = RESUME_SEED_STRIDE * schedule_monitor->get_resumes();
+
     this->rng = std::unique_ptr<IisptRng>(
-                new IisptRng(thread_no)
+                new IisptRng(thread_no + seed_offset)
                 );
 
-    this->sampler = sampler->Clone(thread_no);
+    this->sampler = sampler->Clone(thread_no + seed_offset);
 
     this->thread_no = thread_no;
 
     this->main_camera = main_camera;
+
+    char* pipeline_depth_env = std::getenv("IISPT_NN_PIPELINE_DEPTH");
+    if (pipeline_depth_env == NULL) {
+        pipeline_depth = 4;
+    } else {
+        pipeline_depth = std::max(1, std::stoi(std::string(pipeline_depth_env)));
+    }
+
+    char* sampling_env = std::getenv("IISPT_HEMI_SAMPLING");
+    if (sampling_env == NULL) {
+        importance_sampling = true;
+    } else {
+        std::string sampling (sampling_env);
+        if (sampling == "importance") {
+            importance_sampling = true;
+        } else if (sampling == "uniform") {
+            importance_sampling = false;
+        } else {
+            std::cerr << "iisptrenderrunner.cpp: unknown IISPT_HEMI_SAMPLING [" << sampling << "]\n";
+            std::raise(SIGKILL);
+        }
+    }
+
+    char* samples_env = std::getenv("IISPT_HEMI_SAMPLES");
+    if (samples_env == NULL) {
+        hemi_samples = HEMISPHERIC_IMPORTANCE_SAMPLES;
+    } else {
+        hemi_samples = std::max(1, std::stoi(std::string(samples_env)));
+    }
+
+    char* placement_env = std::getenv("IISPT_HEMI_PLACEMENT");
+    if (placement_env == NULL) {
+        adaptive_placement = false;
+    } else {
+        std::string placement (placement_env);
+        if (placement == "adaptive") {
+            adaptive_placement = true;
+        } else if (placement == "grid") {
+            adaptive_placement = false;
+        } else {
+            std::cerr << "iisptrenderrunner.cpp: unknown IISPT_HEMI_PLACEMENT [" << placement << "]\n";
+            std::raise(SIGKILL);
+        }
+    }
+}
+
+// ============================================================================
+// First hit of the primary ray through every pixel centre of <sm_task>
+void IisptRenderRunner::rasterize_gbuffer(
+        const Scene &scene,
+        const IisptScheduleMonitorTask &sm_task,
+        std::vector<IisptGSample> &gbuffer
+        )
+{
+    gbuffer.clear();
+    gbuffer.resize((sm_task.x1 - sm_task.x0) * (sm_task.y1 - sm_task.y0));
+
+    int idx = 0;
+    for (int y = sm_task.y0; y < sm_task.y1; y++) {
+        for (int x = sm_task.x0; x < sm_task.x1; x++) {
+            CameraSample camera_sample;
+            camera_sample.pFilm = Point2f(x + 0.5, y + 0.5);
+            camera_sample.pLens = Point2f(0.5, 0.5);
+            camera_sample.time = 0.0;
+
+            Ray ray;
+            main_camera->GenerateRay(camera_sample, &ray);
+
+            IisptGSample &sample = gbuffer[idx++];
+            SurfaceInteraction isect;
+            if (scene.Intersect(ray, &isect)) {
+                sample.hit = true;
+                sample.depth = Distance(ray.o, isect.p);
+                sample.n = Faceforward(isect.n, -ray.d);
+                sample.object = isect.primitive;
+            }
+        }
+    }
+}
+
+// ============================================================================
+// Render the hemisphere seen from <aux_ray> and submit it to the NN backend
+// The result is collected by complete_oldest_hemi()
+void IisptRenderRunner::submit_hemi(
+        const Scene &scene,
+        IISPTdIntegrator* d_integrator,
+        IisptPoint2i hemi_key,
+        const Ray &aux_ray,
+        const Normal3f &surface_normal,
+        int hemi_size
+        )
+{
+    // Create aux camera
+    std::unique_ptr<HemisphericCamera> aux_camera (
+                CreateHemisphericCamera(
+                    hemi_size,
+                    hemi_size,
+                    dcamera->medium,
+                    aux_ray.o,
+                    aux_ray.d,
+                    std::string("/tmp/null")
+                    )
+                );
+
+    // Run dintegrator render
+
+    // Obtain intensity, normals, distance maps
+
+    std::unique_ptr<IntensityFilm> aux_intensity;
+    {
+        IisptStage stage (Prof::IILERenderHemisphere, renderHemisphereNs, "RenderHemisphere");
+        aux_intensity = d_integrator->RenderHemisphere(
+                    scene,
+                    aux_camera.get()
+                    );
+    }
+    ++hemispheresRendered;
+    ReportValue(hemisphereSizes, hemi_size);
+
+    NormalFilm* aux_normals =
+            d_integrator->get_normal_film();
+
+    DistanceFilm* aux_distance =
+            d_integrator->get_distance_film();
+
+    // Extent of the cache validity, before the distances are normalized
+    float harmonic_mean_distance = aux_distance->harmonic_mean();
+
+    // Normalize the maps
+    float rmean, gmean, bmean;
+    normalizeMapsDownstream(
+                aux_intensity.get(),
+                aux_normals,
+                aux_distance,
+                rmean,
+                gmean,
+                bmean
+                );
+
+    // The normal and distance films are reused by the next
+    // RenderView, so the request gets its own copies
+    IisptRenderRunnerPending pending;
+    pending.hemi_key = hemi_key;
+    pending.rmean = rmean;
+    pending.gmean = gmean;
+    pending.bmean = bmean;
+    pending.harmonic_mean_distance = harmonic_mean_distance;
+    {
+        // Backends that can't overlap requests evaluate the NN here
+        IisptStage stage (Prof::IILENNSubmit, nnSubmitNs, "NN submit");
+        pending.result = nn_connector->submit(
+                    std::move(aux_intensity),
+                    aux_distance->clone(),
+                    aux_normals->clone()
+                    );
+    }
+    pending.camera = std::move(aux_camera);
+    pending.position = aux_ray.o;
+    pending.normal = surface_normal;
+    pending_hemis.push_back(std::move(pending));
+}
+
+// ============================================================================
+// Wait for the oldest submitted hemisphere and make it available to the
+// pixel evaluation
+void IisptRenderRunner::complete_oldest_hemi(
+        std::unordered_map<IisptPoint2i, std::shared_ptr<HemisphericCamera>>
+            &hemi_points
+        )
+{
+    IisptRenderRunnerPending pending = std::move(pending_hemis.front());
+    pending_hemis.pop_front();
+
+    IisptNnResult result;
+    {
+        IisptStage stage (Prof::IILENNWait, nnWaitNs, "NN wait");
+        result = pending.result.get();
+    }
+
+    if (result.status || !result.film) {
+        std::cerr << "iisptrenderrunner.cpp: Thread " << thread_no << " " << "NN communication issue" << std::endl;
+        raise(SIGKILL);
+    }
+
+    // Upstream transforms on returned intensity
+    transformMapsUpstream(
+                result.film.get(),
+                pending.rmean,
+                pending.gmean,
+                pending.bmean
+                );
+
+    std::shared_ptr<IntensityFilm> nn_film = std::move(result.film);
+    pending.camera->set_nn_film(nn_film);
+
+    std::shared_ptr<HemisphericCamera> camera = std::move(pending.camera);
+    hemi_cache->insert(
+                pending.position,
+                pending.normal,
+                pending.harmonic_mean_distance,
+                camera
+                );
+
+    hemi_points[pending.hemi_key] = camera;
 }
 
 // ============================================================================
@@ -217,7 +536,7 @@ void IisptRenderRunner::run(const Scene &scene)
 {
     // dintegrator
     std::shared_ptr<IISPTdIntegrator> d_integrator = CreateIISPTdIntegrator(
-                this->dcamera, 17 * thread_no + 243);
+                this->dcamera, 17 * thread_no + 243 + seed_offset);
 
     d_integrator->Preprocess(scene);
     lightDistribution =
@@ -225,10 +544,25 @@ void IisptRenderRunner::run(const Scene &scene)
 
     Point3f mainCameraOrigin = main_camera->getCameraWorldPosition();
 
+    IisptTrace &trace = IisptTrace::getInstance();
+    trace.set_thread_name(std::string("Render thread ") + std::to_string(thread_no));
+
     while (1) {
 
         // Obtain the current task
-        IisptScheduleMonitorTask sm_task = schedule_monitor->next_task();
+        IisptScheduleMonitorTask sm_task;
+        if (remote_tasks) {
+            if (!remote_tasks->next_task(sm_task)) {
+                break;
+            }
+            int seed = TASK_SEED_BASE + sm_task.taskNumber;
+            rng.reset(new IisptRng(seed));
+            sampler = sampler->Clone(seed);
+            sampler_pixel_counter = Point2i(0, 0);
+            d_integrator->reseed(seed);
+        } else {
+            sm_task = schedule_monitor->next_task(thread_no);
+        }
 
         // Check pass number for finish
         if (sm_task.taskNumber >= PbrtOptions.iileIndirectTasks) {
@@ -236,6 +570,7 @@ void IisptRenderRunner::run(const Scene &scene)
         }
 
         MemoryArena arena;
+        int64_t task_start = trace.to_us(std::chrono::steady_clock::now());
 
         // sm_task end points are exclusive
         std::cerr << "iisptrenderrunner.cpp: Thread " << thread_no << " " << "Task ["<< sm_task.taskNumber + 1 <<"] of ["<< PbrtOptions.iileIndirectTasks <<"]\n";
@@ -246,10 +581,20 @@ void IisptRenderRunner::run(const Scene &scene)
                 std::shared_ptr<HemisphericCamera>
                 > hemi_points;
 
-        // Check the iteration space of the tiles
-        int tile_x = sm_task.x0;
-        int tile_y = sm_task.y0;
-        while (1) {
+        // Choose where the hemispheres go
+        std::unique_ptr<IisptPlacement> placement;
+        if (adaptive_placement) {
+            std::vector<IisptGSample> gbuffer;
+            rasterize_gbuffer(scene, sm_task, gbuffer);
+            placement.reset(new IisptPlacement(sm_task, gbuffer));
+        } else {
+            placement.reset(new IisptPlacement(sm_task));
+        }
+
+        for (const Point2i &tile : placement->get_points()) {
+            int tile_x = tile.x;
+            int tile_y = tile.y;
+
             // Process current tile
             IisptPoint2i hemi_key;
             hemi_key.x = tile_x;
@@ -313,101 +658,43 @@ void IisptRenderRunner::run(const Scene &scene)
                 // points towards the intersection surface normal
                 Ray aux_ray = isect.SpawnRay(Vector3f(surface_normal));
 
-                // Create aux camera
-                std::unique_ptr<HemisphericCamera> aux_camera (
-                            CreateHemisphericCamera(
-                                PbrtOptions.iisptHemiSize,
-                                PbrtOptions.iisptHemiSize,
-                                dcamera->medium,
-                                aux_ray.o,
-                                aux_ray.d,
-                                std::string("/tmp/null")
-                                )
-                            );
-
-                // Run dintegrator render
-                d_integrator->RenderView(
-                            scene,
-                            aux_camera.get()
-                            );
-
-                // Use NN Connector
-
-                // Obtain intensity, normals, distance maps
-
-                std::unique_ptr<IntensityFilm> aux_intensity =
-                        d_integrator->get_intensity_film(aux_camera.get());
-
-                NormalFilm* aux_normals =
-                        d_integrator->get_normal_film();
-
-                DistanceFilm* aux_distance =
-                        d_integrator->get_distance_film();
-
-                // Normalize the maps
-                float rmean, gmean, bmean;
-                normalizeMapsDownstream(
-                            aux_intensity.get(),
-                            aux_normals,
-                            aux_distance,
-                            rmean,
-                            gmean,
-                            bmean
+                int hemi_size = hemi_lod.choose(
+                            *isect.bsdf,
+                            isect.wo,
+                            pixel_angle(r),
+                            sm_task.tilesize
                             );
 
-                int communicate_status = -1;
-                std::shared_ptr<IntensityFilm> nn_film =
-                        nn_connector->communicate(
-                            aux_intensity.get(),
-                            aux_distance,
-                            aux_normals,
-                            communicate_status
-                            );
+                // Reuse a hemisphere computed nearby, possibly in an
+                // earlier pass or by another thread
+                std::shared_ptr<HemisphericCamera> cached_camera =
+                        hemi_cache->lookup(aux_ray.o, surface_normal, hemi_size);
 
-                // Upstream transforms on returned intensity
-                transformMapsUpstream(nn_film.get(), rmean, gmean, bmean);
+                if (cached_camera) {
+                    hemi_points[hemi_key] = cached_camera;
+                } else {
+                    submit_hemi(
+                                scene,
+                                d_integrator.get(),
+                                hemi_key,
+                                aux_ray,
+                                surface_normal,
+                                hemi_size
+                                );
 
-                if (communicate_status) {
-                    std::cerr << "iisptrenderrunner.cpp: Thread " << thread_no << " " << "NN communication issue" << std::endl;
-                    raise(SIGKILL);
+                    // Keep tracing while up to pipeline_depth hemispheres
+                    // are being evaluated
+                    while (pending_hemis.size() >= (size_t) pipeline_depth) {
+                        complete_oldest_hemi(hemi_points);
+                    }
                 }
 
-                aux_camera->set_nn_film(nn_film);
-
-                hemi_points[hemi_key] = std::move(aux_camera);
-
-            }
-
-            // Advance to the next tile
-            bool advance_tile_y = false;
-            if (tile_x == sm_task.x1 - 1) {
-                // This was the last tile of the row, go to next row
-                tile_x = sm_task.x0;
-                advance_tile_y = true;
-            } else if (tile_x >= sm_task.x1) {
-                std::cerr << "iisptrenderrunner.cpp: Thread " << thread_no << " " << "iisptrenderrunner: ERROR tile has gone past the end\n";
-                std::raise(SIGKILL);
-            } else {
-                // Advance x only
-                tile_x = std::min(
-                            tile_x + sm_task.tilesize,
-                            sm_task.x1 - 1
-                            );
             }
+        }
 
-            if (advance_tile_y) {
-                if (tile_y == sm_task.y1 - 1) {
-                    // This was the last row,
-                    // complete the loop
-                    break;
-                } else {
-                    // Advance to the next row
-                    tile_y = std::min(
-                                tile_y + sm_task.tilesize,
-                                sm_task.y1 - 1
-                                );
-                }
-            }
+        // Wait for the hemispheres still in flight
+        while (!pending_hemis.empty()) {
+            complete_oldest_hemi(hemi_points);
         }
 
         // Evaluate pixels in the task
@@ -426,42 +713,18 @@ void IisptRenderRunner::run(const Scene &scene)
         std::vector<Spectrum> additions_spectrum;
         std::vector<double> additions_weights;
 
+        int64_t pixels_start = trace.to_us(std::chrono::steady_clock::now());
+
         for (int fy = sm_task.y0; fy < sm_task.y1; fy++) {
             for (int fx = sm_task.x0; fx < sm_task.x1; fx++) {
 
                 Point2i f_pixel (fx, fy);
 
-                Point2i neigh_s (
-                            fx - (iispt::positiveModulo(fx - sm_task.x0, sm_task.tilesize)),
-                            fy - (iispt::positiveModulo(fy - sm_task.y0, sm_task.tilesize))
-                            );
-
-                Point2i neigh_e (
-                            std::min(
-                                neigh_s.x + sm_task.tilesize,
-                                sm_task.x1 - 1
-                                ),
-                            std::min(
-                                neigh_s.y + sm_task.tilesize,
-                                sm_task.y1 - 1
-                                )
-                            );
-
-                Point2i neigh_r (
-                            neigh_e.x,
-                            neigh_s.y
-                            );
-
-                Point2i neigh_b (
-                            neigh_s.x,
-                            neigh_e.y
-                            );
-
                 Point2i neighbour_points[4];
-                neighbour_points[0] = neigh_s;
-                neighbour_points[1] = neigh_e;
-                neighbour_points[2] = neigh_r;
-                neighbour_points[3] = neigh_b;
+                int cell_size = placement->neighbours(
+                            f_pixel,
+                            neighbour_points
+                            );
 
                 HemisphericCamera* hemi_sampling_cameras[4];
 
@@ -537,7 +800,7 @@ void IisptRenderRunner::run(const Scene &scene)
                             hemi_sampling_cameras,
                             f_pixel,
                             f_isect,
-                            sm_task.tilesize,
+                            cell_size,
                             f_ray,
                             hemi_sampling_weights, // << output
                             mainCameraOrigin
@@ -578,11 +841,33 @@ void IisptRenderRunner::run(const Scene &scene)
             }
         }
 
-        film_monitor_indirect->add_n_samples(
-                    additions_pt,
-                    additions_spectrum,
-                    additions_weights
-                    );
+        trace.record("Evaluate pixels", pixels_start,
+                     trace.to_us(std::chrono::steady_clock::now()));
+
+        if (remote_tasks) {
+            IisptStage stage (Prof::IILEFilmMonitorAdd, filmMonitorAddNs, "Film monitor add");
+            remote_tasks->submit(
+                        sm_task,
+                        iispt_task_result(
+                            additions_pt,
+                            additions_spectrum,
+                            additions_weights
+                            )
+                        );
+        } else {
+            IisptScheduleCommit commit (schedule_monitor.get());
+            IisptStage stage (Prof::IILEFilmMonitorAdd, filmMonitorAddNs, "Film monitor add");
+            film_monitor_indirect->add_n_samples(
+                        additions_pt,
+                        additions_spectrum,
+                        additions_weights
+                        );
+            schedule_monitor->complete_task(sm_task);
+        }
+        indirectSamples += additions_pt.size();
+
+        trace.record("Indirect task", task_start,
+                     trace.to_us(std::chrono::steady_clock::now()));
 
         float progress = 1.0;
         if (PbrtOptions.iileIndirectTasks > 0) {
@@ -602,7 +887,7 @@ void IisptRenderRunner::run_direct(const Scene &scene)
 {
     std::cerr << "iisptrenderrunner.cpp: Thread " << thread_no << " " << "iisptrenderrunner.cpp: starting direct illumination pass\n";
 
-    std::unique_ptr<Sampler> directSampler = sampler->Clone(6284 + 17 * thread_no);
+    std::unique_ptr<Sampler> directSampler = sampler->Clone(6284 + 17 * thread_no + seed_offset);
 
     std::unique_ptr<DirectProgressiveIntegrator> directProgressiveIntegrator (
                 new DirectProgressiveIntegrator(
@@ -614,18 +899,30 @@ void IisptRenderRunner::run_direct(const Scene &scene)
 
     directProgressiveIntegrator->preprocess(scene);
 
-    while (1) {
+    IisptTrace &trace = IisptTrace::getInstance();
+    trace.set_thread_name(std::string("Render thread ") + std::to_string(thread_no));
 
-        int directPassNumber = schedule_monitor->getNextDirectPass();
-        if (directPassNumber >= PbrtOptions.iileDirectSamples) {
-            break;
-        }
+    // All the threads pull tiles from the same queue, so the threads that
+    // finish the indirect pass first take over the direct pass
+    IisptScheduleDirectTile tile;
+    while (schedule_monitor->next_direct_tile(PbrtOptions.iileDirectSamples, tile)) {
 
-        directProgressiveIntegrator->RenderOnePass(scene,
-                                                   film_monitor_direct.get());
+        Bounds2i tile_bounds (Point2i(tile.x0, tile.y0), Point2i(tile.x1, tile.y1));
 
-        float progress = ((float) (directPassNumber + 1)) / PbrtOptions.iileDirectSamples;
-        std::cout << "#DIRECTPROGRESS!" << progress << std::endl;
+        int64_t tile_start = trace.to_us(std::chrono::steady_clock::now());
+        {
+            // Tiles add their samples at the end, a checkpoint waits for
+            // the tiles being rendered
+            IisptScheduleCommit commit (schedule_monitor.get());
+            directSamples += directProgressiveIntegrator->RenderTile(
+                        scene,
+                        film_monitor_direct.get(),
+                        tile_bounds
+                        );
+            schedule_monitor->complete_direct_tile(tile);
+        }
+        trace.record("Direct tile", tile_start,
+                     trace.to_us(std::chrono::steady_clock::now()));
 
     }
 }
@@ -665,6 +962,7 @@ bool IisptRenderRunner::find_intersection(
         Spectrum* emitted_out
         )
 {
+    IisptStage stage (Prof::IILEFindIntersection, findIntersectionNs);
 
     Spectrum beta (1.0);
     RayDifferential ray (r);
@@ -1047,6 +1345,8 @@ void IisptRenderRunner::normalizeMapsDownstream(
         float &bmean
         )
 {
+    IisptStage stage (Prof::IILENormalizeMaps, normalizeMapsNs, "normalizeMapsDownstream");
+
     // Intensity --------------------------------------------------------------
 
     // Compute mean of intensity
@@ -2,11 +2,17 @@
 #define IISPTRENDERRUNNER_H
 
 #include <climits>
+#include <deque>
+#include <future>
 #include <unordered_map>
 
 #include "integrators/iispt.h"
+#include "integrators/iisptdistributed.h"
 #include "integrators/iisptfilmmonitor.h"
-#include "integrators/iisptnnconnector.h"
+#include "integrators/iispthemispherecache.h"
+#include "integrators/iispthemilod.h"
+#include "integrators/iisptnnbackend.h"
+#include "integrators/iisptplacement.h"
 #include "integrators/iisptschedulemonitor.h"
 #include "integrators/iispt_d.h"
 #include "integrators/directlighting.h"
@@ -24,6 +30,22 @@
 
 namespace pbrt {
 
+// ============================================================================
+// A hemisphere submitted to the NN backend whose result has not been
+// consumed yet
+struct IisptRenderRunnerPending {
+    IisptPoint2i hemi_key;
+    std::unique_ptr<HemisphericCamera> camera;
+    std::future<IisptNnResult> result;
+    float rmean;
+    float gmean;
+    float bmean;
+    // For the hemisphere cache
+    Point3f position;
+    Normal3f normal;
+    float harmonic_mean_distance;
+};
+
 // ============================================================================
 class IisptRenderRunner
 {
@@ -32,8 +54,15 @@ private:
 
     static const int HEMISPHERIC_IMPORTANCE_SAMPLES = 16;
 
+    // Resumed renders draw new random sequences instead of repeating the
+    // ones of the previous run
+    static const int RESUME_SEED_STRIDE = 65536;
+
     int thread_no;
 
+    // Added to every seed
+    int seed_offset;
+
     bool stop = false;
 
     Point2i sampler_pixel_counter = Point2i(0, 0);
@@ -50,18 +79,47 @@ private:
 
     std::shared_ptr<const Camera> main_camera;
 
+    std::shared_ptr<IisptHemisphereCache> hemi_cache;
+
+    // Null unless the indirect pass is distributed
+    IisptRemoteTasks* remote_tasks = nullptr;
+
     // Single objects
 
-    std::shared_ptr<IisptNnConnector> nn_connector;
+    std::shared_ptr<IisptNnBackend> nn_connector;
 
     std::unique_ptr<IisptRng> rng;
 
     std::unique_ptr<Sampler> sampler;
 
+    // Distributed tasks seed from their number, so they give the same
+    // samples on any worker. Above the seeds of the render threads
+    static const int TASK_SEED_BASE = 1 << 24;
+
     Bounds2i pixel_bounds;
 
     std::unique_ptr<LightDistribution> lightDistribution;
 
+    // Hemispheres in flight, oldest first. Up to pipeline_depth requests
+    // are outstanding while the next hemispheres are traced
+    // IISPT_NN_PIPELINE_DEPTH, 1 waits for every hemisphere
+    int pipeline_depth;
+
+    std::deque<IisptRenderRunnerPending> pending_hemis;
+
+    // IISPT_HEMI_SAMPLING, "importance" (default) samples the NN hemispheres
+    // by luminance with MIS, "uniform" picks random pixels
+    bool importance_sampling;
+
+    // IISPT_HEMI_SAMPLES, expected hemisphere samples per pixel
+    int hemi_samples;
+
+    // IISPT_HEMI_PLACEMENT, "grid" (default) or "adaptive"
+    bool adaptive_placement;
+
+    // Size of each hemisphere, IISPT_HEMI_LOD
+    IisptHemiLod hemi_lod;
+
     // Private methods --------------------------------------------------------
 
     void generate_random_pixel(int* x, int* y);
@@ -111,6 +169,26 @@ private:
 
     void sampler_next_pixel();
 
+    void rasterize_gbuffer(
+            const Scene &scene,
+            const IisptScheduleMonitorTask &sm_task,
+            std::vector<IisptGSample> &gbuffer
+            );
+
+    void submit_hemi(
+            const Scene &scene,
+            IISPTdIntegrator* d_integrator,
+            IisptPoint2i hemi_key,
+            const Ray &aux_ray,
+            const Normal3f &surface_normal,
+            int hemi_size
+            );
+
+    void complete_oldest_hemi(
+            std::unordered_map<IisptPoint2i,
+                std::shared_ptr<HemisphericCamera>> &hemi_points
+            );
+
     void compute_fpixel_weights(int len,
             Point2i *neighbour_points,
             HemisphericCamera **hemi_sampling_cameras,
@@ -146,7 +224,8 @@ public:
             std::shared_ptr<Sampler> sampler,
             int thread_no,
             Bounds2i pixel_bounds,
-            std::shared_ptr<IisptNnConnector> nnConnector
+            std::shared_ptr<IisptNnBackend> nnConnector,
+            std::shared_ptr<IisptHemisphereCache> hemi_cache
             );
 
     // Public methods ---------------------------------------------------------
@@ -155,6 +234,12 @@ public:
 
     void run_direct(const Scene &scene);
 
+    // run() takes its tasks from <tasks> and sends the results there,
+    // instead of the schedule and film monitors
+    void set_remote_tasks(IisptRemoteTasks* tasks) {
+        remote_tasks = tasks;
+    }
+
 };
 
 }
@@ -1,14 +1,40 @@
 #include "iisptschedulemonitor.h"
 
+#include <algorithm>
+#include <csignal>
 #include <cstdlib>
+#include <iostream>
 #include <string>
 
+#include "stats.h"
+
 namespace pbrt {
 
+STAT_COUNTER("IILE/Scheduler tasks stolen", schedulerSteals);
+STAT_COUNTER("IILE/Scheduler tasks split", schedulerSplits);
+STAT_PERCENT("IILE/Scheduler thread utilisation", schedulerBusyMs, schedulerSpanMs);
+
 // ============================================================================
-IisptScheduleMonitor::IisptScheduleMonitor(Bounds2i bounds) {
+IisptScheduleMonitor::IisptScheduleMonitor(Bounds2i bounds, int threads) {
     this->bounds = bounds;
 
+    this->threads = std::max(1, threads);
+
+    this->thread_state = std::unique_ptr<IisptScheduleThread[]>(
+                new IisptScheduleThread[this->threads]
+                );
+
+    this->cost_grid = std::vector<double>(COST_GRID * COST_GRID, -1.0);
+
+    this->generation = 0;
+
+    this->taskNumber = 0;
+
+    Vector2i extent = bounds.Diagonal();
+    this->direct_tiles_x = std::max(1, (extent.x + DIRECT_TILE - 1) / DIRECT_TILE);
+    this->direct_tiles_y = std::max(1, (extent.y + DIRECT_TILE - 1) / DIRECT_TILE);
+    this->nextDirectTile = 0;
+
     // Read environment variables
     char* radius_start_env = std::getenv("IISPT_SCHEDULE_RADIUS_START");
     if (radius_start_env == NULL) {
@@ -32,60 +58,616 @@ IisptScheduleMonitor::IisptScheduleMonitor(Bounds2i bounds) {
     }
 
     std::cerr << "iisptschedulemonitor.cpp: bounds pMin is " << bounds.pMin << std::endl;
-    nextx = bounds.pMin.x;
-    nexty = bounds.pMin.y;
 }
 
 // ============================================================================
-IisptScheduleMonitorTask IisptScheduleMonitor::next_task() {
+// Estimated cost of a rectangle, from the cost grid
+// Cells with no measurement count as the average of the measured ones
+double IisptScheduleMonitor::estimate_cost(int x0, int y0, int x1, int y1)
+{
+    double measured_sum = 0.0;
+    int measured_count = 0;
+    for (double c : cost_grid) {
+        if (c >= 0.0) {
+            measured_sum += c;
+            measured_count++;
+        }
+    }
+    double fallback = measured_count > 0 ? measured_sum / measured_count : 1.0;
+
+    Vector2i diagonal = bounds.Diagonal();
+    double cell_w = std::max(1, diagonal.x) / (double) COST_GRID;
+    double cell_h = std::max(1, diagonal.y) / (double) COST_GRID;
+
+    double cost = 0.0;
+    for (int cy = 0; cy < COST_GRID; cy++) {
+        double cy0 = bounds.pMin.y + cy * cell_h;
+        double oy = std::min((double) y1, cy0 + cell_h) - std::max((double) y0, cy0);
+        if (oy <= 0.0) {
+            continue;
+        }
+        for (int cx = 0; cx < COST_GRID; cx++) {
+            double cx0 = bounds.pMin.x + cx * cell_w;
+            double ox = std::min((double) x1, cx0 + cell_w) - std::max((double) x0, cx0);
+            if (ox <= 0.0) {
+                continue;
+            }
+            double c = cost_grid[cy * COST_GRID + cx];
+            cost += ox * oy * (c >= 0.0 ? c : fallback);
+        }
+    }
+    return cost;
+}
+
+// ============================================================================
+// Blend the measured seconds per pixel of <task> into the cost grid
+void IisptScheduleMonitor::record_cost(
+        const IisptScheduleMonitorTask &task,
+        double seconds
+        )
+{
+    int area = (task.x1 - task.x0) * (task.y1 - task.y0);
+    if (area <= 0) {
+        return;
+    }
+    double density = seconds / area;
+
+    Vector2i diagonal = bounds.Diagonal();
+    double cell_w = std::max(1, diagonal.x) / (double) COST_GRID;
+    double cell_h = std::max(1, diagonal.y) / (double) COST_GRID;
 
     std::unique_lock<std::mutex> lock (mutex);
 
+    for (int cy = 0; cy < COST_GRID; cy++) {
+        double cy0 = bounds.pMin.y + cy * cell_h;
+        if (cy0 >= task.y1 || cy0 + cell_h <= task.y0) {
+            continue;
+        }
+        for (int cx = 0; cx < COST_GRID; cx++) {
+            double cx0 = bounds.pMin.x + cx * cell_w;
+            if (cx0 >= task.x1 || cx0 + cell_w <= task.x0) {
+                continue;
+            }
+            double &c = cost_grid[cy * COST_GRID + cx];
+            // Later passes use smaller tiles and cost more per pixel, so
+            // recent measurements weigh more
+            c = c < 0.0 ? density : 0.5 * c + 0.5 * density;
+        }
+    }
+}
+
+// ============================================================================
+// The tasks covering the film with tiles of <tilesize>
+void IisptScheduleMonitor::pass_tasks(
+        int pass,
+        int tilesize,
+        std::vector<IisptScheduleMonitorTask> &tasks
+        )
+{
+    int task_size = tilesize * NUMBER_TILES;
+
+    for (int y = bounds.pMin.y; y < bounds.pMax.y; y += task_size) {
+        for (int x = bounds.pMin.x; x < bounds.pMax.x; x += task_size) {
+            IisptScheduleMonitorTask task;
+            task.x0 = x;
+            task.y0 = y;
+            task.x1 = std::min(x + task_size, bounds.pMax.x);
+            task.y1 = std::min(y + task_size, bounds.pMax.y);
+            task.tilesize = tilesize;
+            task.pass = pass;
+            task.taskNumber = -1;
+            task.cost = 0.0;
+            tasks.push_back(task);
+        }
+    }
+}
+
+// ============================================================================
+// Share <tasks> among the threads
+// <mutex> must be held
+void IisptScheduleMonitor::distribute(
+        std::vector<IisptScheduleMonitorTask> &tasks
+        )
+{
+    double total_cost = 0.0;
+    for (IisptScheduleMonitorTask &task : tasks) {
+        task.cost = estimate_cost(task.x0, task.y0, task.x1, task.y1);
+        total_cost += task.cost;
+    }
+
+    // Contiguous runs of tasks keep neighbouring tasks on the same thread
+    double share = total_cost / threads;
+    double accumulated = 0.0;
+    for (IisptScheduleMonitorTask &task : tasks) {
+        int t = 0;
+        if (share > 0.0) {
+            t = (int) ((accumulated + 0.5 * task.cost) / share);
+        }
+        t = std::max(0, std::min(threads - 1, t));
+        accumulated += task.cost;
+
+        IisptScheduleThread &state = thread_state[t];
+        std::unique_lock<std::mutex> lock (state.mutex);
+        state.tasks.push_back(task);
+    }
+}
+
+// ============================================================================
+// Create the tasks of the next pass and share them among the threads
+// <mutex> must be held
+void IisptScheduleMonitor::generate_pass()
+{
     int effective_radius = std::floor(current_radius);
     if (effective_radius < 1) {
         effective_radius = 1;
     }
 
-    int task_size = effective_radius * NUMBER_TILES;
+    std::vector<IisptScheduleMonitorTask> tasks;
+    pass_tasks(pass, effective_radius, tasks);
+    distribute(tasks);
+
+    IisptScheduleOpenPass open;
+    open.pass = pass;
+    open.tilesize = effective_radius;
+    open.completed_area = 0;
+    open_passes[pass] = open;
+
+    current_radius *= update_multiplier;
+    pass++;
+    generation++;
+}
+
+// ============================================================================
+bool IisptScheduleMonitor::pop_own(
+        int thread_no,
+        IisptScheduleMonitorTask &task
+        )
+{
+    IisptScheduleThread &state = thread_state[thread_no];
+    std::unique_lock<std::mutex> lock (state.mutex);
+    if (state.tasks.empty()) {
+        return false;
+    }
+    task = state.tasks.front();
+    state.tasks.pop_front();
+    return true;
+}
+
+// ============================================================================
+// Take a task from the back of the longest queue
+// If that was the last task queued there, it is split along its longer
+// side on a tile boundary and one half goes back to the victim
+bool IisptScheduleMonitor::steal(
+        int thread_no,
+        IisptScheduleMonitorTask &task
+        )
+{
+    int victim = -1;
+    size_t victim_size = 0;
+    for (int i = 1; i < threads; i++) {
+        int t = (thread_no + i) % threads;
+        IisptScheduleThread &state = thread_state[t];
+        std::unique_lock<std::mutex> lock (state.mutex);
+        if (state.tasks.size() > victim_size) {
+            victim = t;
+            victim_size = state.tasks.size();
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+
+    IisptScheduleThread &state = thread_state[victim];
+    std::unique_lock<std::mutex> lock (state.mutex);
+    if (state.tasks.empty()) {
+        return false;
+    }
+    task = state.tasks.back();
+    state.tasks.pop_back();
+
+    if (state.tasks.empty()) {
+        int columns = (task.x1 - task.x0 + task.tilesize - 1) / task.tilesize;
+        int rows = (task.y1 - task.y0 + task.tilesize - 1) / task.tilesize;
+        IisptScheduleMonitorTask other = task;
+        if (columns >= rows && columns >= 2) {
+            int mid = task.x0 + (columns / 2) * task.tilesize;
+            other.x0 = mid;
+            task.x1 = mid;
+        } else if (rows >= 2) {
+            int mid = task.y0 + (rows / 2) * task.tilesize;
+            other.y0 = mid;
+            task.y1 = mid;
+        } else {
+            return true;
+        }
+        double area = (double) (task.x1 - task.x0) * (task.y1 - task.y0);
+        double other_area = (double) (other.x1 - other.x0) * (other.y1 - other.y0);
+        double cost = task.cost;
+        task.cost = cost * area / (area + other_area);
+        other.cost = cost - task.cost;
+        state.tasks.push_back(other);
+        ++schedulerSplits;
+    }
+    return true;
+}
 
-    // Form the result
-    // The current nextx and nexty are valid starting coordinates
+// ============================================================================
+void IisptScheduleMonitor::finish_current(int thread_no)
+{
+    IisptScheduleThread &state = thread_state[thread_no];
+    if (!state.has_current) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - state.current_start;
+    state.busy_seconds += elapsed.count();
+    state.tasks_done++;
+    state.last_end = now;
+    state.has_current = false;
+    record_cost(state.current, elapsed.count());
+}
+
+// ============================================================================
+IisptScheduleMonitorTask IisptScheduleMonitor::take_task(int thread_no)
+{
+    if (thread_no < 0 || thread_no >= threads) {
+        std::cerr << "iisptschedulemonitor.cpp: thread number " << thread_no << " out of range\n";
+        std::raise(SIGKILL);
+    }
+
+    IisptScheduleThread &state = thread_state[thread_no];
     IisptScheduleMonitorTask res;
-    res.x0 = nextx;
-    res.y0 = nexty;
-    res.x1 = std::min(res.x0 + task_size, bounds.pMax.x);
-    res.y1 = std::min(res.y0 + task_size, bounds.pMax.y);
-    res.tilesize = effective_radius;
-    res.pass = pass;
+    while (1) {
+        int seen_generation = generation;
+        if (pop_own(thread_no, res)) {
+            break;
+        }
+        if (steal(thread_no, res)) {
+            state.steals++;
+            ++schedulerSteals;
+            break;
+        }
+        // Every queue is empty. Unless another thread got here first,
+        // start the next pass
+        std::unique_lock<std::mutex> lock (mutex);
+        if (generation == seen_generation) {
+            generate_pass();
+        }
+    }
+
     res.taskNumber = taskNumber++;
+    return res;
+}
 
-    // Advance to the next tile
+// ============================================================================
+IisptScheduleMonitorTask IisptScheduleMonitor::next_task(int thread_no) {
 
-    nextx += task_size;
-    if (nextx >= bounds.pMax.x) {
-        // Reset x, advance y
-        nextx = bounds.pMin.x;
-        nexty += task_size;
+    if (thread_no < 0 || thread_no >= threads) {
+        std::cerr << "iisptschedulemonitor.cpp: thread number " << thread_no << " out of range\n";
+        std::raise(SIGKILL);
     }
 
-    if (nexty >= bounds.pMax.y) {
-        // Reset y, advance radius
-        nexty = bounds.pMin.y;
-        current_radius *= update_multiplier;
-        pass++;
+    finish_current(thread_no);
+
+    IisptScheduleMonitorTask res = take_task(thread_no);
+
+    IisptScheduleThread &state = thread_state[thread_no];
+    auto now = std::chrono::steady_clock::now();
+    if (!state.started) {
+        state.started = true;
+        state.first_start = now;
+        state.last_end = now;
     }
+    state.has_current = true;
+    state.current = res;
+    state.current_start = now;
 
     return res;
 }
 
 // ============================================================================
-int IisptScheduleMonitor::getNextDirectPass()
+bool IisptScheduleMonitor::next_direct_tile(
+        int passes,
+        IisptScheduleDirectTile &tile
+        )
+{
+    int tiles_per_pass = direct_tiles_x * direct_tiles_y;
+
+    std::unique_lock<std::mutex> lock (direct_mutex);
+    direct_passes = passes;
+    int number = -1;
+    while (!resumed_direct_tiles.empty() && number < 0) {
+        number = resumed_direct_tiles.front();
+        resumed_direct_tiles.pop_front();
+        // The resumed render may have fewer passes
+        if (number >= passes * tiles_per_pass) {
+            number = -1;
+        }
+    }
+    if (number < 0) {
+        if (nextDirectTile >= passes * tiles_per_pass) {
+            return false;
+        }
+        number = nextDirectTile++;
+    }
+    running_direct_tiles.insert(number);
+
+    int t = number % tiles_per_pass;
+    tile.x0 = bounds.pMin.x + (t % direct_tiles_x) * DIRECT_TILE;
+    tile.y0 = bounds.pMin.y + (t / direct_tiles_x) * DIRECT_TILE;
+    tile.x1 = std::min(tile.x0 + DIRECT_TILE, bounds.pMax.x);
+    tile.y1 = std::min(tile.y0 + DIRECT_TILE, bounds.pMax.y);
+    tile.pass = number / tiles_per_pass;
+    tile.number = number;
+    tile.tiles_per_pass = tiles_per_pass;
+    return true;
+}
+
+// ============================================================================
+// Utilisation is the time spent inside tasks over the time from the first
+// task of any thread to the last task of any thread
+void IisptScheduleMonitor::print_utilisation()
+{
+    bool any = false;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    for (int i = 0; i < threads; i++) {
+        IisptScheduleThread &state = thread_state[i];
+        if (!state.started) {
+            continue;
+        }
+        if (!any || state.first_start < start) {
+            start = state.first_start;
+        }
+        if (!any || state.last_end > end) {
+            end = state.last_end;
+        }
+        any = true;
+    }
+    if (!any) {
+        return;
+    }
+    std::chrono::duration<double> span = end - start;
+
+    std::cerr << "iisptschedulemonitor.cpp: indirect pass took " << span.count() << "s\n";
+    for (int i = 0; i < threads; i++) {
+        IisptScheduleThread &state = thread_state[i];
+        double utilisation = span.count() > 0.0 ?
+                    100.0 * state.busy_seconds / span.count() :
+                    0.0;
+        std::cerr << "iisptschedulemonitor.cpp: Thread " << i
+                  << " tasks " << state.tasks_done
+                  << " stolen " << state.steals
+                  << " busy " << state.busy_seconds << "s"
+                  << " utilisation " << utilisation << "%\n";
+        schedulerBusyMs += (int64_t) (1000.0 * state.busy_seconds);
+        schedulerSpanMs += (int64_t) (1000.0 * span.count());
+    }
+}
+
+// ============================================================================
+void IisptScheduleMonitor::begin_commit()
+{
+    std::unique_lock<std::mutex> lock (commit_mutex);
+    commit_cv.wait(lock, [this]() { return !commits_paused; });
+    active_commits++;
+}
+
+// ============================================================================
+void IisptScheduleMonitor::end_commit()
+{
+    std::unique_lock<std::mutex> lock (commit_mutex);
+    active_commits--;
+    if (active_commits == 0) {
+        commit_cv.notify_all();
+    }
+}
+
+// ============================================================================
+void IisptScheduleMonitor::pause_commits()
+{
+    std::unique_lock<std::mutex> lock (commit_mutex);
+    // Later commits wait, so the running ones are bound to finish
+    commits_paused = true;
+    commit_cv.wait(lock, [this]() { return active_commits == 0; });
+}
+
+// ============================================================================
+void IisptScheduleMonitor::resume_commits()
+{
+    std::unique_lock<std::mutex> lock (commit_mutex);
+    commits_paused = false;
+    commit_cv.notify_all();
+}
+
+// ============================================================================
+// A pass is closed once its completed tasks cover the film, steals only
+// ever split tasks, so the areas add up exactly
+void IisptScheduleMonitor::complete_task(const IisptScheduleMonitorTask &task)
 {
     std::unique_lock<std::mutex> lock (mutex);
+    tasks_completed++;
+    auto found = open_passes.find(task.pass);
+    if (found == open_passes.end()) {
+        return;
+    }
+    IisptScheduleOpenPass &open = found->second;
+    open.completed.push_back(task);
+    open.completed_area += (int64_t) (task.x1 - task.x0) * (task.y1 - task.y0);
+    if (open.completed_area >= (int64_t) bounds.Area()) {
+        open_passes.erase(found);
+    }
+}
 
-    int res = this->nextDirectPass;
-    this->nextDirectPass++;
-    return res;
+// ============================================================================
+void IisptScheduleMonitor::complete_task(
+        const IisptScheduleMonitorTask &task,
+        double seconds
+        )
+{
+    record_cost(task, seconds);
+    complete_task(task);
+}
+
+// ============================================================================
+// <direct_mutex> must be held
+bool IisptScheduleMonitor::advance_direct_passes()
+{
+    int tiles_per_pass = direct_tiles_x * direct_tiles_y;
+    bool advanced = false;
+    auto found = direct_tiles_done.find(direct_passes_done);
+    while (found != direct_tiles_done.end() && found->second >= tiles_per_pass) {
+        direct_tiles_done.erase(found);
+        direct_passes_done++;
+        advanced = true;
+        found = direct_tiles_done.find(direct_passes_done);
+    }
+    return advanced;
+}
+
+// ============================================================================
+void IisptScheduleMonitor::complete_direct_tile(const IisptScheduleDirectTile &tile)
+{
+    std::unique_lock<std::mutex> lock (direct_mutex);
+    running_direct_tiles.erase(tile.number);
+
+    // Tiles of different passes complete in any order, the progress only
+    // moves when the earliest incomplete pass is done
+    direct_tiles_done[tile.pass]++;
+    if (advance_direct_passes() && direct_passes > 0) {
+        float progress = ((float) direct_passes_done) / direct_passes;
+        std::cout << "#DIRECTPROGRESS!" << progress << std::endl;
+    }
+}
+
+// ============================================================================
+IisptScheduleState IisptScheduleMonitor::save_state()
+{
+    IisptScheduleState state;
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        state.pass = pass;
+        state.current_radius = current_radius;
+        state.tasks_completed = tasks_completed;
+        state.resumes = resumes;
+        state.cost_grid = cost_grid;
+        for (const auto &entry : open_passes) {
+            state.open_passes.push_back(entry.second);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock (direct_mutex);
+        state.next_direct_tile = nextDirectTile;
+        state.pending_direct_tiles.assign(
+                    resumed_direct_tiles.begin(),
+                    resumed_direct_tiles.end()
+                    );
+        state.pending_direct_tiles.insert(
+                    state.pending_direct_tiles.end(),
+                    running_direct_tiles.begin(),
+                    running_direct_tiles.end()
+                    );
+    }
+    return state;
+}
+
+// ============================================================================
+// Removes the area of <done> from the rectangles in <pieces>
+static void subtract_task(
+        std::vector<IisptScheduleMonitorTask> &pieces,
+        const IisptScheduleMonitorTask &done
+        )
+{
+    std::vector<IisptScheduleMonitorTask> result;
+    for (const IisptScheduleMonitorTask &p : pieces) {
+        int ix0 = std::max(p.x0, done.x0);
+        int iy0 = std::max(p.y0, done.y0);
+        int ix1 = std::min(p.x1, done.x1);
+        int iy1 = std::min(p.y1, done.y1);
+        if (ix0 >= ix1 || iy0 >= iy1) {
+            result.push_back(p);
+            continue;
+        }
+        // Full width bands above and below, then the sides of the overlap
+        IisptScheduleMonitorTask band = p;
+        if (p.y0 < iy0) {
+            band.y1 = iy0;
+            result.push_back(band);
+        }
+        band = p;
+        if (iy1 < p.y1) {
+            band.y0 = iy1;
+            result.push_back(band);
+        }
+        band = p;
+        band.y0 = iy0;
+        band.y1 = iy1;
+        if (p.x0 < ix0) {
+            band.x1 = ix0;
+            result.push_back(band);
+        }
+        band.x1 = p.x1;
+        if (ix1 < p.x1) {
+            band.x0 = ix1;
+            result.push_back(band);
+        }
+    }
+    pieces.swap(result);
+}
+
+// ============================================================================
+// The unfinished part of every open pass is queued again, in pass order
+void IisptScheduleMonitor::restore_state(const IisptScheduleState &state)
+{
+    if (state.cost_grid.size() != cost_grid.size()) {
+        std::cerr << "iisptschedulemonitor.cpp: checkpoint cost grid has " << state.cost_grid.size() << " cells, expected " << cost_grid.size() << std::endl;
+        std::raise(SIGKILL);
+    }
+
+    std::unique_lock<std::mutex> lock (mutex);
+
+    pass = state.pass;
+    current_radius = state.current_radius;
+    tasks_completed = state.tasks_completed;
+    taskNumber = state.tasks_completed;
+    resumes = state.resumes + 1;
+    cost_grid = state.cost_grid;
+
+    std::vector<IisptScheduleMonitorTask> remaining;
+    open_passes.clear();
+    for (const IisptScheduleOpenPass &open : state.open_passes) {
+        std::vector<IisptScheduleMonitorTask> pieces;
+        pass_tasks(open.pass, open.tilesize, pieces);
+        for (const IisptScheduleMonitorTask &done : open.completed) {
+            subtract_task(pieces, done);
+        }
+        remaining.insert(remaining.end(), pieces.begin(), pieces.end());
+        open_passes[open.pass] = open;
+    }
+    distribute(remaining);
+    generation++;
+
+    std::unique_lock<std::mutex> direct_lock (direct_mutex);
+    nextDirectTile = state.next_direct_tile;
+    resumed_direct_tiles.assign(
+                state.pending_direct_tiles.begin(),
+                state.pending_direct_tiles.end()
+                );
+    running_direct_tiles.clear();
+
+    // The tiles handed out before the checkpoint and not pending are done
+    int tiles_per_pass = direct_tiles_x * direct_tiles_y;
+    std::set<int> pending (resumed_direct_tiles.begin(), resumed_direct_tiles.end());
+    direct_tiles_done.clear();
+    for (int number = 0; number < nextDirectTile; number++) {
+        if (pending.count(number) == 0) {
+            direct_tiles_done[number / tiles_per_pass]++;
+        }
+    }
+    direct_passes_done = 0;
+    advance_direct_passes();
+
+    std::cerr << "iisptschedulemonitor.cpp: resumed at pass " << pass << ", " << tasks_completed << " tasks and " << (nextDirectTile - (int) resumed_direct_tiles.size()) << " direct tiles completed, " << remaining.size() << " tasks requeued" << std::endl;
 }
 
 }
@@ -1,7 +1,16 @@
 #ifndef IISPTSCHEDULEMONITOR_H
 #define IISPTSCHEDULEMONITOR_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <vector>
 #include "geometry.h"
 
 namespace pbrt {
@@ -17,9 +26,99 @@ struct IisptScheduleMonitorTask
     int tilesize;
     int pass;
     int taskNumber;
+    // Estimated cost, relative to the other tasks of the same pass
+    double cost;
 };
 
 // ============================================================================
+// A tile of the direct pass, end points are exclusive
+struct IisptScheduleDirectTile
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int pass;
+    // Position in the whole direct pass, from 0 to passes * tiles_per_pass
+    int number;
+    int tiles_per_pass;
+};
+
+// ============================================================================
+// An indirect pass with tasks still to complete
+struct IisptScheduleOpenPass
+{
+    int pass;
+    int tilesize;
+    // Pixels covered by <completed>
+    int64_t completed_area;
+    std::vector<IisptScheduleMonitorTask> completed;
+};
+
+// ============================================================================
+// What a checkpoint needs to continue the schedule, see IisptCheckpoint
+struct IisptScheduleState
+{
+    // Next indirect pass to generate
+    int pass;
+    float current_radius;
+    int tasks_completed;
+    // Direct tiles below this number were handed out
+    int next_direct_tile;
+    // Direct tiles handed out but not completed
+    std::vector<int> pending_direct_tiles;
+    // Number of times the render was resumed, render threads derive their
+    // seeds from it
+    int resumes;
+    std::vector<double> cost_grid;
+    std::vector<IisptScheduleOpenPass> open_passes;
+};
+
+// ============================================================================
+// Per render thread scheduling state
+struct IisptScheduleThread
+{
+    // Tasks assigned to this thread and not started yet.
+    // The owner pops from the front, thieves take from the back.
+    std::mutex mutex;
+    std::deque<IisptScheduleMonitorTask> tasks;
+
+    // Only used by the owner thread ------------------------------------------
+
+    bool has_current = false;
+    IisptScheduleMonitorTask current;
+    std::chrono::steady_clock::time_point current_start;
+
+    // Utilisation
+    bool started = false;
+    std::chrono::steady_clock::time_point first_start;
+    std::chrono::steady_clock::time_point last_end;
+    double busy_seconds = 0.0;
+    int tasks_done = 0;
+    int steals = 0;
+};
+
+// ============================================================================
+// Hands out the tasks of the indirect pass.
+//
+// Tasks are generated one pass at a time; every pass covers the film with
+// square tasks of NUMBER_TILES x NUMBER_TILES tiles, and the tile size
+// shrinks geometrically from one pass to the next.
+// A new pass is split into contiguous runs of tasks of about the same
+// estimated cost, one run per thread. The estimate comes from a coarse grid
+// of measured seconds per pixel, updated every time a task completes, so
+// the first pass is split by area and the following ones by actual cost.
+// A thread that runs out of tasks steals from the back of the busiest
+// queue, splitting the stolen task in two when it was the last one there.
+//
+// The direct pass is a shared queue of DIRECT_TILE sized tiles, all the
+// tiles of a pass before the tiles of the next one.
+//
+// Render threads add the samples of a task or tile to the film monitors
+// inside a commit, together with complete_task() or complete_direct_tile().
+// Checkpoints pause the commits, so the state they save has either all of
+// a task or none of it, and a resumed render only repeats the tasks that
+// were running.
 class IisptScheduleMonitor
 {
 private:
@@ -27,11 +126,15 @@ private:
     // ------------------------------------------------------------------------
     // Members
 
+    // Protects pass generation and the cost grid
     std::mutex mutex;
 
     // Number of tiles per side in each task
     int NUMBER_TILES = 10;
 
+    // Resolution of the cost grid, cells per side
+    static const int COST_GRID = 32;
+
     // Size of a tile
     float current_radius;
 
@@ -43,29 +146,172 @@ private:
     // Film bounds
     Bounds2i bounds;
 
-    // Current pixels in the film
-    int nextx;
-    int nexty;
-
     // Pass number
     int pass = 1;
 
+    // Incremented every time a pass is generated
+    std::atomic<int> generation;
+
     // Task number
-    int taskNumber = 0;
+    std::atomic<int> taskNumber;
+
+    // Passes with tasks still to complete, by pass number. Under <mutex>
+    std::map<int, IisptScheduleOpenPass> open_passes;
+
+    // Under <mutex>
+    int tasks_completed = 0;
+
+    int resumes = 0;
+
+    // Direct pass tiles
+    static const int DIRECT_TILE = 32;
+
+    int direct_tiles_x;
+    int direct_tiles_y;
+
+    // Protects the direct tile fields below
+    std::mutex direct_mutex;
+
+    int nextDirectTile;
+
+    // Tiles of a checkpoint that were not completed, handed out first
+    std::deque<int> resumed_direct_tiles;
+
+    std::set<int> running_direct_tiles;
+
+    // Completed tiles of the passes not completed yet, by pass
+    std::map<int, int> direct_tiles_done;
 
-    // Direct passes
-    int nextDirectPass = 0;
+    // Passes whose tiles and the tiles of all the passes before them are
+    // completed
+    int direct_passes_done = 0;
+
+    // Number of passes of the direct pass, from next_direct_tile()
+    int direct_passes = 0;
+
+    // Commits
+    std::mutex commit_mutex;
+    std::condition_variable commit_cv;
+    int active_commits = 0;
+    bool commits_paused = false;
+
+    int threads;
+
+    std::unique_ptr<IisptScheduleThread[]> thread_state;
+
+    // Measured seconds per pixel, -1 where nothing was measured yet
+    std::vector<double> cost_grid;
+
+    // ------------------------------------------------------------------------
+    // Private methods
+
+    void generate_pass();
+
+    void pass_tasks(
+            int pass,
+            int tilesize,
+            std::vector<IisptScheduleMonitorTask> &tasks
+            );
+
+    void distribute(std::vector<IisptScheduleMonitorTask> &tasks);
+
+    double estimate_cost(int x0, int y0, int x1, int y1);
+
+    void record_cost(const IisptScheduleMonitorTask &task, double seconds);
+
+    bool pop_own(int thread_no, IisptScheduleMonitorTask &task);
+
+    bool steal(int thread_no, IisptScheduleMonitorTask &task);
+
+    void finish_current(int thread_no);
+
+    // Moves <direct_passes_done> past the passes whose tiles are all done
+    // <return> true if it moved
+    bool advance_direct_passes();
 
 public:
 
     // Constructor ------------------------------------------------------------
-    IisptScheduleMonitor(Bounds2i bounds);
+    IisptScheduleMonitor(Bounds2i bounds, int threads);
 
     // Public methods ---------------------------------------------------------
 
-    IisptScheduleMonitorTask next_task();
+    // Also marks the previous task of <thread_no> as completed
+    IisptScheduleMonitorTask next_task(int thread_no);
+
+    // Like next_task() without timing the task; the caller measures it and
+    // passes the seconds to complete_task()
+    IisptScheduleMonitorTask take_task(int thread_no);
+
+    // Next tile of a direct pass of <passes> passes
+    // <return> false when all the tiles were handed out
+    bool next_direct_tile(int passes, IisptScheduleDirectTile &tile);
+
+    // Per thread busy time, tasks and steals. Call after the threads are done
+    void print_utilisation();
+
+    // Commits ----------------------------------------------------------------
+
+    // Waits while a checkpoint is taken
+    void begin_commit();
+
+    void end_commit();
+
+    // Only inside a commit
+    void complete_task(const IisptScheduleMonitorTask &task);
+
+    // Only inside a commit, for tasks from take_task()
+    void complete_task(const IisptScheduleMonitorTask &task, double seconds);
+
+    // Only inside a commit. Reports the progress of the direct pass when
+    // it completes a pass
+    void complete_direct_tile(const IisptScheduleDirectTile &tile);
+
+    // Waits for the running commits to end, and blocks new ones until
+    // resume_commits()
+    void pause_commits();
+
+    void resume_commits();
+
+    // Checkpoints ------------------------------------------------------------
+
+    // Only while commits are paused
+    IisptScheduleState save_state();
+
+    // Continues the schedule of <state>. Call before any task is handed out
+    void restore_state(const IisptScheduleState &state);
+
+    int get_resumes() const {
+        return resumes;
+    }
+
+    // Number of the next task handed out
+    int get_task_number() const {
+        return taskNumber;
+    }
+
+};
+
+// ============================================================================
+// Commit for the lifetime of the object
+class IisptScheduleCommit
+{
+private:
+
+    IisptScheduleMonitor* monitor;
+
+public:
+
+    IisptScheduleCommit(IisptScheduleMonitor* monitor) :
+        monitor(monitor)
+    {
+        monitor->begin_commit();
+    }
 
-    int getNextDirectPass();
+    ~IisptScheduleCommit()
+    {
+        monitor->end_commit();
+    }
 
 };
 
@@ -0,0 +1,106 @@
+#include "iispttrace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+namespace pbrt {
+
+static PBRT_THREAD_LOCAL IisptTraceThread* trace_thread = nullptr;
+
+// ============================================================================
+IisptTrace::IisptTrace()
+{
+    char* path_env = std::getenv("IISPT_TRACE_FILE");
+    this->enabled = path_env != NULL && path_env[0] != '\0';
+    if (enabled) {
+        this->path = std::string(path_env);
+    }
+    this->epoch = std::chrono::steady_clock::now();
+}
+
+// ============================================================================
+// Buffer of the calling thread, created on first use
+IisptTraceThread* IisptTrace::current_thread()
+{
+    if (trace_thread == nullptr) {
+        std::lock_guard<std::mutex> lock (threads_mutex);
+        std::unique_ptr<IisptTraceThread> t (new IisptTraceThread());
+        t->tid = threads.size();
+        t->name = std::string("Thread ") + std::to_string(t->tid);
+        trace_thread = t.get();
+        threads.push_back(std::move(t));
+    }
+    return trace_thread;
+}
+
+// ============================================================================
+void IisptTrace::set_thread_name(const std::string &name)
+{
+    if (!enabled) {
+        return;
+    }
+    IisptTraceThread* t = current_thread();
+    std::lock_guard<std::mutex> lock (threads_mutex);
+    t->name = name;
+}
+
+// ============================================================================
+void IisptTrace::record(const char* name, int64_t start_us, int64_t end_us)
+{
+    if (!enabled) {
+        return;
+    }
+    IisptTraceEvent e;
+    e.name = name;
+    e.start_us = start_us;
+    e.duration_us = end_us - start_us;
+    current_thread()->events.push_back(e);
+}
+
+// ============================================================================
+void IisptTrace::write()
+{
+    if (!enabled) {
+        return;
+    }
+    FILE* f = std::fopen(path.c_str(), "w");
+    if (f == NULL) {
+        std::cerr << "iispttrace.cpp: could not create " << path << std::endl;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock (threads_mutex);
+    size_t events = 0;
+    std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char* separator = "";
+    for (const std::unique_ptr<IisptTraceThread> &t : threads) {
+        // Thread names are only set by the renderer, they need no escaping
+        std::fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                     separator, t->tid, t->name.c_str());
+        separator = ",\n";
+        for (const IisptTraceEvent &e : t->events) {
+            std::fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"iile\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                         separator, e.name, t->tid,
+                         (long long) e.start_us, (long long) e.duration_us);
+        }
+        events += t->events.size();
+    }
+    std::fprintf(f, "\n]}\n");
+    std::fclose(f);
+
+    std::cerr << "iispttrace.cpp: wrote " << events << " events to " << path << std::endl;
+}
+
+// ============================================================================
+IisptStage::~IisptStage()
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    ns_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    if (trace_name != nullptr) {
+        IisptTrace &trace = IisptTrace::getInstance();
+        trace.record(trace_name, trace.to_us(start), trace.to_us(end));
+    }
+}
+
+} // namespace pbrt
@@ -0,0 +1,122 @@
+#ifndef IISPTTRACE_H
+#define IISPTTRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+namespace pbrt {
+
+// ============================================================================
+// A timed interval of one thread
+struct IisptTraceEvent
+{
+    // Static string, the stage name
+    const char* name;
+    int64_t start_us;
+    int64_t duration_us;
+};
+
+// ============================================================================
+struct IisptTraceThread
+{
+    int tid;
+    std::string name;
+    std::vector<IisptTraceEvent> events;
+};
+
+// ============================================================================
+// Timeline of the IILE stages in the Chrome trace event format, enabled by
+// setting IISPT_TRACE_FILE to the output path. The file can be opened with
+// chrome://tracing or https://ui.perfetto.dev
+//
+// Every thread appends to its own buffer, so recording doesn't lock;
+// write() must only be called once the recording threads have finished.
+class IisptTrace
+{
+private:
+
+    bool enabled;
+    std::string path;
+    std::chrono::steady_clock::time_point epoch;
+
+    std::mutex threads_mutex;
+    std::vector<std::unique_ptr<IisptTraceThread>> threads;
+
+    IisptTrace();
+
+    IisptTraceThread* current_thread();
+
+public:
+
+    static IisptTrace& getInstance()
+    {
+        static IisptTrace instance;
+        return instance;
+    }
+
+    IisptTrace(IisptTrace const&) = delete;
+    void operator=(IisptTrace const&) = delete;
+
+    bool is_enabled() const {
+        return enabled;
+    }
+
+    // Microseconds from the start of the trace to <t>
+    int64_t to_us(std::chrono::steady_clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                    t - epoch).count();
+    }
+
+    // Name of the calling thread in the timeline
+    void set_thread_name(const std::string &name);
+
+    void record(const char* name, int64_t start_us, int64_t end_us);
+
+    // Writes the events recorded so far to IISPT_TRACE_FILE
+    void write();
+
+};
+
+// ============================================================================
+// Scope guard around one stage of the IILE pipeline.
+// The stage is attributed to <category> by the pbrt profiler, its duration
+// in nanoseconds is added to <ns_counter> (a STAT_COUNTER of the calling
+// thread), and when <trace_name> is not null it's recorded in the trace.
+// Stages that run once per pixel should not be traced, the timeline would
+// get too large.
+class IisptStage
+{
+private:
+
+    ProfilePhase phase;
+    int64_t &ns_counter;
+    const char* trace_name;
+    std::chrono::steady_clock::time_point start;
+
+public:
+
+    IisptStage(
+            Prof category,
+            int64_t &ns_counter,
+            const char* trace_name = nullptr
+            ) :
+        phase(category),
+        ns_counter(ns_counter),
+        trace_name(trace_name)
+    {
+        this->start = std::chrono::steady_clock::now();
+    }
+
+    ~IisptStage();
+
+};
+
+} // namespace pbrt
+
+#endif // IISPTTRACE_H
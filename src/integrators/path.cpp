@@ -64,6 +64,20 @@ void PathIntegrator::Preprocess(const Scene &scene, Sampler &sampler) {
 Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
                             Sampler &sampler, MemoryArena &arena,
                             int depth) const {
+    return LiPath(r, scene, sampler, arena, false, nullptr);
+}
+
+Spectrum PathIntegrator::LiFirstHit(const RayDifferential &r,
+                                    SurfaceInteraction *isect,
+                                    const Scene &scene, Sampler &sampler,
+                                    MemoryArena &arena) const {
+    return LiPath(r, scene, sampler, arena, true, isect);
+}
+
+Spectrum PathIntegrator::LiPath(const RayDifferential &r, const Scene &scene,
+                                Sampler &sampler, MemoryArena &arena,
+                                bool firstTraced,
+                                SurfaceInteraction *firstIsect) const {
     ProfilePhase p(Prof::SamplerIntegratorLi);
     Spectrum L(0.f), beta(1.f);
     RayDifferential ray(r);
@@ -85,7 +99,14 @@ Spectrum PathIntegrator::Li(const RayDifferential &r, const Scene &scene,
 
         // Intersect _ray_ with scene and store intersection in _isect_
         SurfaceInteraction isect;
-        bool foundIntersection = scene.Intersect(ray, &isect);
+        bool foundIntersection;
+        if (firstTraced) {
+            // The camera ray was traced with its packet
+            foundIntersection = firstIsect != nullptr;
+            if (foundIntersection) isect = *firstIsect;
+            firstTraced = false;
+        } else
+            foundIntersection = scene.Intersect(ray, &isect);
 
         // Possibly add emitted light at intersection
         if (bounces == 0 || specularBounce) {
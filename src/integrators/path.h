@@ -58,8 +58,17 @@ class PathIntegrator : public SamplerIntegrator {
     void Preprocess(const Scene &scene, Sampler &sampler);
     Spectrum Li(const RayDifferential &ray, const Scene &scene,
                 Sampler &sampler, MemoryArena &arena, int depth) const;
+    bool UsesFirstHits() const { return true; }
+    Spectrum LiFirstHit(const RayDifferential &ray, SurfaceInteraction *isect,
+                        const Scene &scene, Sampler &sampler,
+                        MemoryArena &arena) const;
 
   private:
+    // PathIntegrator Private Methods
+    Spectrum LiPath(const RayDifferential &ray, const Scene &scene,
+                    Sampler &sampler, MemoryArena &arena, bool firstTraced,
+                    SurfaceInteraction *firstIsect) const;
+
     // PathIntegrator Private Data
     const int maxDepth;
     const Float rrThreshold;
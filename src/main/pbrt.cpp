@@ -61,19 +61,43 @@ Rendering options:
                        Sets the number of samples for the reference
                        path tracer
   --reference_resume=<0|1>
-                       With resume disabled, output directory is not checked
-                       and existing files will be overwritten
-                       When it's enabled, existing files will be skipped and
-                       not re-rendered
+                       With resume disabled, the dataset in the output
+                       directory is started over
+                       When it's enabled, pixels already in the dataset
+                       index are skipped and not re-rendered
   --iispt_hemi_size=<pixel>
                        Set the dimension of the IISPT hemispherical renders
                        Defaults to 32
   --iileIndirect=<tasks>
                        Number of indirect tasks to be rendered
   --iileDirect=<samples>
-                       Number of direct pass samples
+                       Largest number of direct pass samples per pixel,
+                       converged pixels stop earlier
   --iileControl=<controlDirPath>
                        Enable and set control directory for use with IILE GUI
+  --iileCheckpoint=<file>
+                       Periodically save the IILE render state to <file>,
+                       every IISPT_CHECKPOINT_INTERVAL seconds and at the end
+  --resume             Continue the IILE render saved in the --iileCheckpoint
+                       file, if there is one. The indirect tasks and direct
+                       samples count from the start of the first run
+  --iileServe=<port>   Distribute the IILE indirect pass: listen for workers
+                       on <port>, and merge their results with the ones of
+                       the local threads
+  --iileWorker=<host:port>
+                       Render IILE indirect tasks for the coordinator at
+                       <host:port>, started with the same scene and options
+  --iileNnBackend=<service|pipe|native|stub>
+                       service: all threads share one batched NN process
+                       pipe: one NN process per render thread
+                       native: in process C++ network, weights read from
+                       IISPT_NN_WEIGHTS_PATH (see ml/export_weights.py)
+                       stub: fixed stand-in network for benchmarks, chosen
+                       with IISPT_NN_STUB=identity|constant|tiny
+                       Defaults to service
+  --bvhCache=<dir>     Save the BVHs of the scene in <dir>, and load them from
+                       there instead of building them when the geometry and
+                       the BVH parameters are the same
 
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
@@ -180,6 +204,29 @@ int main(int argc, char *argv[]) {
             options.iileControl = &argv[i][14];
             std::cerr << "Set IILE control directory to " << options.iileControl << std::endl;
         }
+        else if (!strncmp(argv[i], "--iileCheckpoint=", 17)) {
+            options.iileCheckpoint = std::string(&argv[i][17]);
+            std::cerr << "Set IILE checkpoint file to " << options.iileCheckpoint << std::endl;
+        }
+        else if (!strcmp(argv[i], "--resume") || !strcmp(argv[i], "-resume")) {
+            options.iileResume = true;
+        }
+        else if (!strncmp(argv[i], "--iileServe=", 12)) {
+            options.iileServe = atoi(&argv[i][12]);
+            std::cerr << "Set IILE coordinator port to " << options.iileServe << std::endl;
+        }
+        else if (!strncmp(argv[i], "--iileWorker=", 13)) {
+            options.iileWorker = std::string(&argv[i][13]);
+            std::cerr << "Set IILE coordinator address to " << options.iileWorker << std::endl;
+        }
+        else if (!strncmp(argv[i], "--iileNnBackend=", 16)) {
+            options.iileNnBackend = std::string(&argv[i][16]);
+            std::cerr << "Set IILE NN backend to " << options.iileNnBackend << std::endl;
+        }
+        else if (!strncmp(argv[i], "--bvhCache=", 11)) {
+            options.bvhCache = std::string(&argv[i][11]);
+            std::cerr << "Set BVH cache directory to " << options.bvhCache << std::endl;
+        }
         else {
             filenames.push_back(argv[i]);
         }
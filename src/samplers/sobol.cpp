@@ -59,7 +59,10 @@ Float SobolSampler::SampleDimension(int64_t index, int dim) const {
 }
 
 std::unique_ptr<Sampler> SobolSampler::Clone(int seed) {
-    return std::unique_ptr<Sampler>(new SobolSampler(*this));
+    SobolSampler *ss = new SobolSampler(*this);
+    // The copy would share the generator of the extra dimensions
+    ss->rng = std::make_shared<IisptRng>(seed);
+    return std::unique_ptr<Sampler>(ss);
 }
 
 SobolSampler *CreateSobolSampler(const ParamSet &params,
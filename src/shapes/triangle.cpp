@@ -185,15 +185,11 @@ Bounds3f Triangle::WorldBound() const {
     return Union(Bounds3f(p0, p1), p2);
 }
 
-bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
-                         bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersect);
+// Triangle Utility Functions
+bool IntersectTriangle(const Point3f &p0, const Point3f &p1,
+                       const Point3f &p2, const Ray &ray, Float *tHit,
+                       Float b[3]) {
     ++nTests;
-    // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-
     // Perform ray--triangle intersection test
 
     // Transform triangle vertices to ray coordinate space
@@ -262,9 +258,9 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
     // Compute barycentric coordinates and $t$ value for triangle intersection
     Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
+    b[0] = e0 * invDet;
+    b[1] = e1 * invDet;
+    b[2] = e2 * invDet;
     Float t = tScaled * invDet;
 
     // Ensure that computed triangle $t$ is conservatively greater than zero
@@ -289,11 +285,24 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
                    (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
                    std::abs(invDet);
     if (t <= deltaT) return false;
+    *tHit = t;
+    ++nHits;
+    return true;
+}
+
+bool TriangleInteraction(const TriangleMesh &mesh, const int *v,
+                         const Float b[3], const Ray &ray, const Shape *shape,
+                         bool flipNormal, int faceIndex,
+                         bool testAlphaTexture, SurfaceInteraction *isect) {
+    // Get triangle vertices in _p0_, _p1_, and _p2_
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
 
     // Compute triangle partial derivatives
     Vector3f dpdu, dpdv;
     Point2f uv[3];
-    GetUVs(uv);
+    mesh.GetUVs(v, uv);
 
     // Compute deltas for triangle partial derivatives
     Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -311,39 +320,40 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
     // Compute error bounds for triangle intersection
     Float xAbsSum =
-        (std::abs(b0 * p0.x) + std::abs(b1 * p1.x) + std::abs(b2 * p2.x));
+        (std::abs(b[0] * p0.x) + std::abs(b[1] * p1.x) + std::abs(b[2] * p2.x));
     Float yAbsSum =
-        (std::abs(b0 * p0.y) + std::abs(b1 * p1.y) + std::abs(b2 * p2.y));
+        (std::abs(b[0] * p0.y) + std::abs(b[1] * p1.y) + std::abs(b[2] * p2.y));
     Float zAbsSum =
-        (std::abs(b0 * p0.z) + std::abs(b1 * p1.z) + std::abs(b2 * p2.z));
+        (std::abs(b[0] * p0.z) + std::abs(b[1] * p1.z) + std::abs(b[2] * p2.z));
     Vector3f pError = gamma(7) * Vector3f(xAbsSum, yAbsSum, zAbsSum);
 
     // Interpolate $(u,v)$ parametric coordinates and hit point
-    Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
-    Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
+    Point3f pHit = b[0] * p0 + b[1] * p1 + b[2] * p2;
+    Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
 
     // Test intersection against alpha texture, if present
-    if (testAlphaTexture && mesh->alphaMask) {
+    if (testAlphaTexture && mesh.alphaMask) {
         SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
                                       dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+                                      Normal3f(0, 0, 0), ray.time, shape);
+        if (mesh.alphaMask->Evaluate(isectLocal) == 0) return false;
     }
 
     // Fill in _SurfaceInteraction_ from triangle hit
     *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
                                 Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time,
-                                this, faceIndex);
+                                shape, faceIndex);
 
     // Override surface normal in _isect_ for triangle
     isect->n = isect->shading.n = Normal3f(Normalize(Cross(dp02, dp12)));
-    if (mesh->n || mesh->s) {
+    if (mesh.n || mesh.s) {
         // Initialize _Triangle_ shading geometry
 
         // Compute shading normal _ns_ for triangle
         Normal3f ns;
-        if (mesh->n) {
-            ns = (b0 * mesh->n[v[0]] + b1 * mesh->n[v[1]] + b2 * mesh->n[v[2]]);
+        if (mesh.n) {
+            ns = (b[0] * mesh.n[v[0]] + b[1] * mesh.n[v[1]] +
+                  b[2] * mesh.n[v[2]]);
             if (ns.LengthSquared() > 0)
                 ns = Normalize(ns);
             else
@@ -353,8 +363,9 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute shading tangent _ss_ for triangle
         Vector3f ss;
-        if (mesh->s) {
-            ss = (b0 * mesh->s[v[0]] + b1 * mesh->s[v[1]] + b2 * mesh->s[v[2]]);
+        if (mesh.s) {
+            ss = (b[0] * mesh.s[v[0]] + b[1] * mesh.s[v[1]] +
+                  b[2] * mesh.s[v[2]]);
             if (ss.LengthSquared() > 0)
                 ss = Normalize(ss);
             else
@@ -372,12 +383,12 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
 
         // Compute $\dndu$ and $\dndv$ for triangle shading geometry
         Normal3f dndu, dndv;
-        if (mesh->n) {
+        if (mesh.n) {
             // Compute deltas for triangle partial derivatives of normal
             Vector2f duv02 = uv[0] - uv[2];
             Vector2f duv12 = uv[1] - uv[2];
-            Normal3f dn1 = mesh->n[v[0]] - mesh->n[v[2]];
-            Normal3f dn2 = mesh->n[v[1]] - mesh->n[v[2]];
+            Normal3f dn1 = mesh.n[v[0]] - mesh.n[v[2]];
+            Normal3f dn2 = mesh.n[v[1]] - mesh.n[v[2]];
             Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
             bool degenerateUV = std::abs(determinant) < 1e-8;
             if (degenerateUV)
@@ -393,153 +404,78 @@ bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
     }
 
     // Ensure correct orientation of the geometric normal
-    if (mesh->n)
+    if (mesh.n)
         isect->n = Faceforward(isect->n, isect->shading.n);
-    else if (reverseOrientation ^ transformSwapsHandedness)
+    else if (flipNormal)
         isect->n = isect->shading.n = -isect->n;
-    *tHit = t;
-    ++nHits;
     return true;
 }
 
-bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
-    ProfilePhase p(Prof::TriIntersectP);
-    ++nTests;
+bool TriangleShadowAlphaTest(const TriangleMesh &mesh, const int *v,
+                             const Float b[3], const Ray &ray,
+                             const Shape *shape) {
     // Get triangle vertices in _p0_, _p1_, and _p2_
-    const Point3f &p0 = mesh->p[v[0]];
-    const Point3f &p1 = mesh->p[v[1]];
-    const Point3f &p2 = mesh->p[v[2]];
-
-    // Perform ray--triangle intersection test
-
-    // Transform triangle vertices to ray coordinate space
-
-    // Translate vertices based on ray origin
-    Point3f p0t = p0 - Vector3f(ray.o);
-    Point3f p1t = p1 - Vector3f(ray.o);
-    Point3f p2t = p2 - Vector3f(ray.o);
-
-    // Permute components of triangle vertices and ray direction
-    int kz = MaxDimension(Abs(ray.d));
-    int kx = kz + 1;
-    if (kx == 3) kx = 0;
-    int ky = kx + 1;
-    if (ky == 3) ky = 0;
-    Vector3f d = Permute(ray.d, kx, ky, kz);
-    p0t = Permute(p0t, kx, ky, kz);
-    p1t = Permute(p1t, kx, ky, kz);
-    p2t = Permute(p2t, kx, ky, kz);
+    const Point3f &p0 = mesh.p[v[0]];
+    const Point3f &p1 = mesh.p[v[1]];
+    const Point3f &p2 = mesh.p[v[2]];
 
-    // Apply shear transformation to translated vertex positions
-    Float Sx = -d.x / d.z;
-    Float Sy = -d.y / d.z;
-    Float Sz = 1.f / d.z;
-    p0t.x += Sx * p0t.z;
-    p0t.y += Sy * p0t.z;
-    p1t.x += Sx * p1t.z;
-    p1t.y += Sy * p1t.z;
-    p2t.x += Sx * p2t.z;
-    p2t.y += Sy * p2t.z;
-
-    // Compute edge function coefficients _e0_, _e1_, and _e2_
-    Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
-    Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
-    Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+    // Compute triangle partial derivatives
+    Vector3f dpdu, dpdv;
+    Point2f uv[3];
+    mesh.GetUVs(v, uv);
 
-    // Fall back to double precision test at triangle edges
-    if (sizeof(Float) == sizeof(float) &&
-        (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
-        double p2txp1ty = (double)p2t.x * (double)p1t.y;
-        double p2typ1tx = (double)p2t.y * (double)p1t.x;
-        e0 = (float)(p2typ1tx - p2txp1ty);
-        double p0txp2ty = (double)p0t.x * (double)p2t.y;
-        double p0typ2tx = (double)p0t.y * (double)p2t.x;
-        e1 = (float)(p0typ2tx - p0txp2ty);
-        double p1txp0ty = (double)p1t.x * (double)p0t.y;
-        double p1typ0tx = (double)p1t.y * (double)p0t.x;
-        e2 = (float)(p1typ0tx - p1txp0ty);
+    // Compute deltas for triangle partial derivatives
+    Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+    Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
+    Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+    bool degenerateUV = std::abs(determinant) < 1e-8;
+    if (!degenerateUV) {
+        Float invdet = 1 / determinant;
+        dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+        dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
     }
+    if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0)
+        // Handle zero determinant for triangle partial derivative matrix
+        CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
 
-    // Perform triangle edge and determinant tests
-    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+    // Interpolate $(u,v)$ parametric coordinates and hit point
+    Point3f pHit = b[0] * p0 + b[1] * p1 + b[2] * p2;
+    Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
+    SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
+                                  dpdu, dpdv, Normal3f(0, 0, 0),
+                                  Normal3f(0, 0, 0), ray.time, shape);
+    if (mesh.alphaMask && mesh.alphaMask->Evaluate(isectLocal) == 0)
         return false;
-    Float det = e0 + e1 + e2;
-    if (det == 0) return false;
+    if (mesh.shadowAlphaMask &&
+        mesh.shadowAlphaMask->Evaluate(isectLocal) == 0)
+        return false;
+    return true;
+}
 
-    // Compute scaled hit distance to triangle and test against ray $t$ range
-    p0t.z *= Sz;
-    p1t.z *= Sz;
-    p2t.z *= Sz;
-    Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
-    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
+bool Triangle::Intersect(const Ray &ray, Float *tHit, SurfaceInteraction *isect,
+                         bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersect);
+    Float t, b[3];
+    if (!IntersectTriangle(mesh->p[v[0]], mesh->p[v[1]], mesh->p[v[2]], ray,
+                           &t, b))
         return false;
-    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
+    if (!TriangleInteraction(*mesh, v, b, ray, this,
+                             reverseOrientation ^ transformSwapsHandedness,
+                             faceIndex, testAlphaTexture, isect))
         return false;
+    *tHit = t;
+    return true;
+}
 
-    // Compute barycentric coordinates and $t$ value for triangle intersection
-    Float invDet = 1 / det;
-    Float b0 = e0 * invDet;
-    Float b1 = e1 * invDet;
-    Float b2 = e2 * invDet;
-    Float t = tScaled * invDet;
-
-    // Ensure that computed triangle $t$ is conservatively greater than zero
-
-    // Compute $\delta_z$ term for triangle $t$ error bounds
-    Float maxZt = MaxComponent(Abs(Vector3f(p0t.z, p1t.z, p2t.z)));
-    Float deltaZ = gamma(3) * maxZt;
-
-    // Compute $\delta_x$ and $\delta_y$ terms for triangle $t$ error bounds
-    Float maxXt = MaxComponent(Abs(Vector3f(p0t.x, p1t.x, p2t.x)));
-    Float maxYt = MaxComponent(Abs(Vector3f(p0t.y, p1t.y, p2t.y)));
-    Float deltaX = gamma(5) * (maxXt + maxZt);
-    Float deltaY = gamma(5) * (maxYt + maxZt);
-
-    // Compute $\delta_e$ term for triangle $t$ error bounds
-    Float deltaE =
-        2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
-
-    // Compute $\delta_t$ term for triangle $t$ error bounds and check _t_
-    Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
-    Float deltaT = 3 *
-                   (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
-                   std::abs(invDet);
-    if (t <= deltaT) return false;
-
+bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const {
+    ProfilePhase p(Prof::TriIntersectP);
+    Float t, b[3];
+    if (!IntersectTriangle(mesh->p[v[0]], mesh->p[v[1]], mesh->p[v[2]], ray,
+                           &t, b))
+        return false;
     // Test shadow ray intersection against alpha texture, if present
-    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
-        // Compute triangle partial derivatives
-        Vector3f dpdu, dpdv;
-        Point2f uv[3];
-        GetUVs(uv);
-
-        // Compute deltas for triangle partial derivatives
-        Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
-        Vector3f dp02 = p0 - p2, dp12 = p1 - p2;
-        Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
-        bool degenerateUV = std::abs(determinant) < 1e-8;
-        if (!degenerateUV) {
-            Float invdet = 1 / determinant;
-            dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
-            dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
-        }
-        if (degenerateUV || Cross(dpdu, dpdv).LengthSquared() == 0)
-            // Handle zero determinant for triangle partial derivative matrix
-            CoordinateSystem(Normalize(Cross(p2 - p0, p1 - p0)), &dpdu, &dpdv);
-
-        // Interpolate $(u,v)$ parametric coordinates and hit point
-        Point3f pHit = b0 * p0 + b1 * p1 + b2 * p2;
-        Point2f uvHit = b0 * uv[0] + b1 * uv[1] + b2 * uv[2];
-        SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
-                                      dpdu, dpdv, Normal3f(0, 0, 0),
-                                      Normal3f(0, 0, 0), ray.time, this);
-        if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
-            return false;
-        if (mesh->shadowAlphaMask &&
-            mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
-            return false;
-    }
-    ++nHits;
+    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask))
+        return TriangleShadowAlphaTest(*mesh, v, b, ray, this);
     return true;
 }
 
@@ -616,6 +552,108 @@ Float Triangle::SolidAngle(const Point3f &p, int nSamples) const {
         std::acos(Clamp(Dot(cross20, -cross01), -1, 1)) - Pi);
 }
 
+// TriangleMeshPrimitive Method Definitions
+TriangleMeshPrimitive::TriangleMeshPrimitive(
+    const std::shared_ptr<TriangleMesh> &mesh,
+    const std::shared_ptr<Shape> &orientation,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface)
+    : mesh(mesh),
+      orientation(orientation),
+      flipNormals(orientation->reverseOrientation ^
+                  orientation->transformSwapsHandedness),
+      material(material),
+      mediumInterface(mediumInterface) {
+    triMeshBytes += sizeof(*this);
+}
+
+Bounds3f TriangleMeshPrimitive::WorldBound() const {
+    Bounds3f bounds;
+    for (int i = 0; i < mesh->nVertices; ++i)
+        bounds = Union(bounds, mesh->p[i]);
+    return bounds;
+}
+
+Bounds3f TriangleMeshPrimitive::TriangleBound(int tri) const {
+    const int *v = &mesh->vertexIndices[3 * tri];
+    return Union(Bounds3f(mesh->p[v[0]], mesh->p[v[1]]), mesh->p[v[2]]);
+}
+
+bool TriangleMeshPrimitive::FillInteraction(int tri, const Float b[3],
+                                            const Ray &ray,
+                                            SurfaceInteraction *isect) const {
+    const int *v = &mesh->vertexIndices[3 * tri];
+    int faceIndex = mesh->faceIndices.size() ? mesh->faceIndices[tri] : 0;
+    if (!TriangleInteraction(*mesh, v, b, ray, orientation.get(), flipNormals,
+                             faceIndex, true, isect))
+        return false;
+    isect->primitive = this;
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+    // Initialize _SurfaceInteraction::mediumInterface_ like
+    // _GeometricPrimitive_ does
+    if (mediumInterface.IsMediumTransition())
+        isect->mediumInterface = mediumInterface;
+    else
+        isect->mediumInterface = MediumInterface(ray.medium);
+    return true;
+}
+
+bool TriangleMeshPrimitive::IntersectPTriangle(int tri, const Ray &ray) const {
+    Float t, b[3];
+    if (!IntersectTriangle(tri, ray, &t, b)) return false;
+    if (!mesh->alphaMask && !mesh->shadowAlphaMask) return true;
+    return TriangleShadowAlphaTest(*mesh, &mesh->vertexIndices[3 * tri], b, ray,
+                                   orientation.get());
+}
+
+// Outside of a _BVHAccel_, every triangle is tested
+bool TriangleMeshPrimitive::Intersect(const Ray &r,
+                                      SurfaceInteraction *isect) const {
+    bool hit = false;
+    for (int i = 0; i < mesh->nTriangles; ++i) {
+        Float t, b[3];
+        if (IntersectTriangle(i, r, &t, b) && FillInteraction(i, b, r, isect)) {
+            r.tMax = t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool TriangleMeshPrimitive::IntersectP(const Ray &r) const {
+    for (int i = 0; i < mesh->nTriangles; ++i)
+        if (IntersectPTriangle(i, r)) return true;
+    return false;
+}
+
+void TriangleMeshPrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction *isect, MemoryArena &arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    ProfilePhase p(Prof::ComputeScatteringFuncs);
+    if (material)
+        material->ComputeScatteringFunctions(isect, arena, mode,
+                                             allowMultipleLobes);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0.);
+}
+
+std::shared_ptr<Primitive> CreateTriangleMeshPrimitive(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface) {
+    const Triangle *first = dynamic_cast<const Triangle *>(shapes[0].get());
+    if (!first || first->mesh->nTriangles != (int)shapes.size()) return nullptr;
+    const std::shared_ptr<TriangleMesh> &mesh = first->mesh;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        const Triangle *tri = dynamic_cast<const Triangle *>(shapes[i].get());
+        if (!tri || tri->mesh != mesh || tri->v != &mesh->vertexIndices[3 * i])
+            return nullptr;
+    }
+    // The _Triangle_s other than the first go away with _shapes_
+    triMeshBytes -= (shapes.size() - 1) * sizeof(Triangle);
+    return std::make_shared<TriangleMeshPrimitive>(mesh, shapes[0], material,
+                                                   mediumInterface);
+}
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     const ParamSet &params,
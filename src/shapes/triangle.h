@@ -40,6 +40,7 @@
 
 // shapes/triangle.h*
 #include "shape.h"
+#include "primitive.h"
 #include "stats.h"
 #include <map>
 
@@ -56,6 +57,17 @@ struct TriangleMesh {
                  const std::shared_ptr<Texture<Float>> &alphaMask,
                  const std::shared_ptr<Texture<Float>> &shadowAlphaMask,
                  const int *faceIndices);
+    void GetUVs(const int *v, Point2f uv[3]) const {
+        if (this->uv) {
+            uv[0] = this->uv[v[0]];
+            uv[1] = this->uv[v[1]];
+            uv[2] = this->uv[v[2]];
+        } else {
+            uv[0] = Point2f(0, 0);
+            uv[1] = Point2f(1, 0);
+            uv[2] = Point2f(1, 1);
+        }
+    }
 
     // TriangleMesh Data
     const int nTriangles, nVertices;
@@ -95,17 +107,11 @@ class Triangle : public Shape {
 
   private:
     // Triangle Private Methods
-    void GetUVs(Point2f uv[3]) const {
-        if (mesh->uv) {
-            uv[0] = mesh->uv[v[0]];
-            uv[1] = mesh->uv[v[1]];
-            uv[2] = mesh->uv[v[2]];
-        } else {
-            uv[0] = Point2f(0, 0);
-            uv[1] = Point2f(1, 0);
-            uv[2] = Point2f(1, 1);
-        }
-    }
+    void GetUVs(Point2f uv[3]) const { mesh->GetUVs(v, uv); }
+    friend std::shared_ptr<Primitive> CreateTriangleMeshPrimitive(
+        const std::vector<std::shared_ptr<Shape>> &shapes,
+        const std::shared_ptr<Material> &material,
+        const MediumInterface &mediumInterface);
 
     // Triangle Private Data
     std::shared_ptr<TriangleMesh> mesh;
@@ -113,6 +119,67 @@ class Triangle : public Shape {
     int faceIndex;
 };
 
+// Triangle Function Declarations
+bool IntersectTriangle(const Point3f &p0, const Point3f &p1,
+                       const Point3f &p2, const Ray &ray, Float *tHit,
+                       Float b[3]);
+bool TriangleInteraction(const TriangleMesh &mesh, const int *v,
+                         const Float b[3], const Ray &ray, const Shape *shape,
+                         bool flipNormal, int faceIndex,
+                         bool testAlphaTexture, SurfaceInteraction *isect);
+bool TriangleShadowAlphaTest(const TriangleMesh &mesh, const int *v,
+                             const Float b[3], const Ray &ray,
+                             const Shape *shape);
+
+// TriangleMeshPrimitive Declarations
+// All the triangles of a mesh as one primitive, with a single material and
+// no area light. _BVHAccel_ takes it apart and keeps each triangle as an
+// index into the mesh, rather than as a _GeometricPrimitive_ holding a
+// _Triangle_
+class TriangleMeshPrimitive : public Primitive {
+  public:
+    // TriangleMeshPrimitive Public Methods
+    TriangleMeshPrimitive(const std::shared_ptr<TriangleMesh> &mesh,
+                          const std::shared_ptr<Shape> &orientation,
+                          const std::shared_ptr<Material> &material,
+                          const MediumInterface &mediumInterface);
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &r, SurfaceInteraction *isect) const;
+    bool IntersectP(const Ray &r) const;
+    const AreaLight *GetAreaLight() const { return nullptr; }
+    const Material *GetMaterial() const { return material.get(); }
+    void ComputeScatteringFunctions(SurfaceInteraction *isect,
+                                    MemoryArena &arena, TransportMode mode,
+                                    bool allowMultipleLobes) const;
+    int NumTriangles() const { return mesh->nTriangles; }
+    Bounds3f TriangleBound(int tri) const;
+    // Finds the barycentric coordinates _b_ of the hit, without filling in
+    // a _SurfaceInteraction_ or testing the alpha mask
+    bool IntersectTriangle(int tri, const Ray &ray, Float *tHit,
+                           Float b[3]) const {
+        ProfilePhase p(Prof::TriIntersect);
+        const int *v = &mesh->vertexIndices[3 * tri];
+        return pbrt::IntersectTriangle(mesh->p[v[0]], mesh->p[v[1]],
+                                       mesh->p[v[2]], ray, tHit, b);
+    }
+    bool HasAlphaMask() const { return mesh->alphaMask != nullptr; }
+    // Fills in _isect_ for the hit _IntersectTriangle()_ found; returns
+    // false if the alpha mask cuts it out
+    bool FillInteraction(int tri, const Float b[3], const Ray &ray,
+                         SurfaceInteraction *isect) const;
+    bool IntersectPTriangle(int tri, const Ray &ray) const;
+
+  private:
+    // TriangleMeshPrimitive Private Data
+    std::shared_ptr<TriangleMesh> mesh;
+    // One of the mesh's _Triangle_s, kept for the orientation of the
+    // _SurfaceInteraction_s, which they all share
+    std::shared_ptr<Shape> orientation;
+    bool flipNormals;
+    std::shared_ptr<Material> material;
+    MediumInterface mediumInterface;
+};
+
 std::vector<std::shared_ptr<Shape>> CreateTriangleMesh(
     const Transform *o2w, const Transform *w2o, bool reverseOrientation,
     int nTriangles, const int *vertexIndices, int nVertices, const Point3f *p,
@@ -125,6 +192,12 @@ std::vector<std::shared_ptr<Shape>> CreateTriangleMeshShape(
     const ParamSet &params,
     std::map<std::string, std::shared_ptr<Texture<Float>>> *floatTextures =
         nullptr);
+// The _Triangle_s of a single mesh, in the order _CreateTriangleMesh()_
+// made them, as a _TriangleMeshPrimitive_; nullptr for other shapes
+std::shared_ptr<Primitive> CreateTriangleMeshPrimitive(
+    const std::vector<std::shared_ptr<Shape>> &shapes,
+    const std::shared_ptr<Material> &material,
+    const MediumInterface &mediumInterface);
 
 bool WritePlyFile(const std::string &filename, int nTriangles,
                   const int *vertexIndices, int nVertices, const Point3f *P,
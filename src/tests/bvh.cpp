@@ -0,0 +1,329 @@
+#include "tests/gtest/gtest.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "pbrt.h"
+#include "parallel.h"
+#include "rng.h"
+#include "sampling.h"
+#include "primitive.h"
+#include "accelerators/bvh.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+
+using namespace pbrt;
+
+// Clusters of small triangles and a few large ones, so that the tree has
+// both deep and overlapping nodes. A single TriangleMeshPrimitive holds them
+// when <compact> is set
+static std::vector<std::shared_ptr<Primitive>> RandomTriangles(
+    int n, bool compact = false) {
+    static Transform identity;
+    RNG rng(7);
+    std::vector<Point3f> p;
+    std::vector<int> indices;
+    for (int i = 0; i < n; ++i) {
+        Float size = (i % 50) == 0 ? 2 : 0.05f;
+        Point3f center(rng.UniformFloat() * 2 - 1, rng.UniformFloat() * 2 - 1,
+                       rng.UniformFloat() * 2 - 1);
+        if (i % 3) center = Point3f(center.x, center.y * 0.1f, center.z);
+        for (int v = 0; v < 3; ++v) {
+            indices.push_back(p.size());
+            p.push_back(center + size * Vector3f(rng.UniformFloat() - 0.5f,
+                                                 rng.UniformFloat() - 0.5f,
+                                                 rng.UniformFloat() - 0.5f));
+        }
+    }
+    std::vector<std::shared_ptr<Shape>> tris =
+        CreateTriangleMesh(&identity, &identity, false, n, &indices[0],
+                           p.size(), &p[0], nullptr, nullptr, nullptr, nullptr,
+                           nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    if (compact) {
+        prims.push_back(
+            CreateTriangleMeshPrimitive(tris, nullptr, MediumInterface()));
+        return prims;
+    }
+    for (const auto &tri : tris)
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            tri, nullptr, nullptr, MediumInterface()));
+    return prims;
+}
+
+// Spheres among the triangles
+static std::vector<std::shared_ptr<Primitive>> RandomSpheres(int n) {
+    static std::vector<std::unique_ptr<Transform>> transforms;
+    RNG rng(13);
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (int i = 0; i < n; ++i) {
+        transforms.emplace_back(new Transform(Translate(
+            Vector3f(rng.UniformFloat() * 2 - 1, rng.UniformFloat() * 2 - 1,
+                     rng.UniformFloat() * 2 - 1))));
+        const Transform *o2w = transforms.back().get();
+        transforms.emplace_back(new Transform(Inverse(*o2w)));
+        const Transform *w2o = transforms.back().get();
+        Float radius = 0.05f + 0.1f * rng.UniformFloat();
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            std::make_shared<Sphere>(o2w, w2o, false, radius, -radius, radius,
+                                     360),
+            nullptr, nullptr, MediumInterface()));
+    }
+    return prims;
+}
+
+// Rays from inside and outside the triangles, some along the axes
+static std::vector<Ray> RandomRays(int n) {
+    RNG rng(11);
+    std::vector<Ray> rays;
+    for (int i = 0; i < n; ++i) {
+        Point3f o(rng.UniformFloat() * 6 - 3, rng.UniformFloat() * 6 - 3,
+                  rng.UniformFloat() * 6 - 3);
+        Vector3f d;
+        if (i % 10 == 0)
+            d[i / 10 % 3] = (i / 30) % 2 ? 1 : -1;
+        else
+            d = UniformSampleSphere(
+                Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        Float tMax = (i % 4) == 0 ? 2 : Infinity;
+        rays.push_back(Ray(o, d, tMax));
+    }
+    return rays;
+}
+
+// Wide trees, with and without SIMD box tests, find the same hits as the
+// binary tree
+TEST(BVHAccel, WideMatchesBinary) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(3000);
+    std::vector<Ray> rays = RandomRays(20000);
+    for (BVHAccel::SplitMethod split :
+         {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH}) {
+        BVHAccel binary(prims, 4, split);
+        for (int width : {4, 8})
+            for (bool simd : {true, false}) {
+                BVHAccel wide(prims, 4, split, width, simd);
+                EXPECT_EQ(binary.WorldBound(), wide.WorldBound());
+                int hits = 0;
+                for (const Ray &ray : rays) {
+                    Ray r0 = ray, r1 = ray;
+                    SurfaceInteraction i0, i1;
+                    bool h0 = binary.Intersect(r0, &i0);
+                    bool h1 = wide.Intersect(r1, &i1);
+                    ASSERT_EQ(h0, h1) << width << " " << simd << " " << ray;
+                    EXPECT_EQ(r0.tMax, r1.tMax) << width << " " << ray;
+                    if (h0) {
+                        EXPECT_EQ(i0.p, i1.p) << width << " " << ray;
+                        ++hits;
+                    }
+                    EXPECT_EQ(binary.IntersectP(ray), wide.IntersectP(ray))
+                        << width << " " << simd << " " << ray;
+                }
+                EXPECT_GT(hits, 1000);
+                EXPECT_LT(hits, 19000);
+            }
+    }
+}
+
+// A tree with one primitive is a single leaf
+TEST(BVHAccel, WideSingleLeaf) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(1);
+    for (int width : {4, 8}) {
+        BVHAccel wide(prims, 4, BVHAccel::SplitMethod::SAH, width);
+        BVHAccel binary(prims);
+        for (const Ray &r : RandomRays(1000)) {
+            SurfaceInteraction i0, i1;
+            Ray r0 = r, r1 = r;
+            EXPECT_EQ(binary.Intersect(r0, &i0), wide.Intersect(r1, &i1));
+            EXPECT_EQ(binary.IntersectP(r), wide.IntersectP(r));
+        }
+    }
+    BVHAccel empty(std::vector<std::shared_ptr<Primitive>>(), 4,
+                   BVHAccel::SplitMethod::SAH, 8);
+    SurfaceInteraction isect;
+    Ray r(Point3f(0, 0, 0), Vector3f(1, 0, 0));
+    EXPECT_FALSE(empty.Intersect(r, &isect));
+    EXPECT_FALSE(empty.IntersectP(r));
+}
+
+// Ray packets find the same hits as single rays, with and without SIMD box
+// tests, for streams that don't fill the last packet
+TEST(BVHAccel, PacketsMatchSingleRays) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(3000);
+    std::vector<Ray> rays = RandomRays(20003);
+    for (int width : {2, 8})
+        for (bool simd : {true, false}) {
+            BVHAccel bvh(prims, 4, BVHAccel::SplitMethod::SAH, width, simd);
+            std::vector<Ray> stream = rays;
+            std::vector<SurfaceInteraction> isects(stream.size());
+            std::unique_ptr<bool[]> hits(new bool[stream.size()]);
+            bvh.IntersectN(stream.size(), &stream[0], &isects[0], hits.get());
+            int nHits = 0;
+            for (size_t i = 0; i < rays.size(); ++i) {
+                Ray r = rays[i];
+                SurfaceInteraction isect;
+                bool hit = bvh.Intersect(r, &isect);
+                ASSERT_EQ(hit, hits[i]) << width << " " << simd << " " << r;
+                EXPECT_EQ(r.tMax, stream[i].tMax) << simd << " " << r;
+                if (hit) {
+                    EXPECT_EQ(isect.p, isects[i].p) << simd << " " << r;
+                    ++nHits;
+                }
+            }
+            EXPECT_GT(nHits, 1000);
+        }
+}
+
+// Scenes large enough for the parallel build get the same tree with any
+// number of threads
+TEST(BVHAccel, ParallelBuild) {
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(100000);
+    std::vector<Ray> rays = RandomRays(5000);
+    int savedThreads = PbrtOptions.nThreads;
+    for (BVHAccel::SplitMethod split :
+         {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::Middle,
+          BVHAccel::SplitMethod::EqualCounts}) {
+        PbrtOptions.nThreads = 1;
+        BVHAccel serial(prims, 4, split);
+        PbrtOptions.nThreads = 4;
+        ParallelInit();
+        BVHAccel parallel(prims, 4, split);
+        ParallelCleanup();
+        EXPECT_EQ(serial.WorldBound(), parallel.WorldBound());
+        int hits = 0;
+        for (const Ray &ray : rays) {
+            Ray r0 = ray, r1 = ray;
+            SurfaceInteraction i0, i1;
+            bool h0 = serial.Intersect(r0, &i0);
+            ASSERT_EQ(h0, parallel.Intersect(r1, &i1)) << ray;
+            EXPECT_EQ(r0.tMax, r1.tMax) << ray;
+            if (h0) {
+                EXPECT_EQ(i0.p, i1.p) << ray;
+                EXPECT_EQ(i0.shape, i1.shape) << ray;
+                ++hits;
+            }
+        }
+        EXPECT_GT(hits, 1000);
+    }
+    PbrtOptions.nThreads = savedThreads;
+}
+
+// Files in <dir>, with their path
+static std::vector<std::string> ListFiles(const std::string &dir) {
+    std::vector<std::string> files;
+    DIR *d = opendir(dir.c_str());
+    if (!d) return files;
+    while (struct dirent *entry = readdir(d))
+        if (entry->d_name[0] != '.') files.push_back(dir + "/" + entry->d_name);
+    closedir(d);
+    return files;
+}
+
+// The first build of a scene saves it to the cache, the second one loads
+// it from there without writing it again, and a damaged file is built over
+TEST(BVHAccel, Cache) {
+    char dir[] = "/tmp/pbrt-bvh-cache-XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != nullptr);
+    std::vector<std::shared_ptr<Primitive>> prims = RandomTriangles(3000);
+    std::vector<Ray> rays = RandomRays(5000);
+    for (BVHAccel::SplitMethod split :
+         {BVHAccel::SplitMethod::SAH, BVHAccel::SplitMethod::HLBVH})
+        for (int width : {2, 8}) {
+            BVHAccel reference(prims, 4, split, width);
+            ino_t savedInode = 0;
+            for (int run = 0; run < 3; ++run) {
+                std::vector<std::string> files = ListFiles(dir);
+                if (run == 2) {
+                    ASSERT_EQ(1u, files.size());
+                    std::ofstream(files[0], std::ios::trunc) << "damaged";
+                }
+                BVHAccel cached(prims, 4, split, width, true, dir);
+                files = ListFiles(dir);
+                ASSERT_EQ(1u, files.size()) << width << " " << run;
+                struct stat st;
+                ASSERT_EQ(0, stat(files[0].c_str(), &st));
+                if (run == 1)
+                    EXPECT_EQ(savedInode, st.st_ino) << width;
+                else
+                    EXPECT_NE(savedInode, st.st_ino) << width << " " << run;
+                savedInode = st.st_ino;
+
+                EXPECT_EQ(reference.WorldBound(), cached.WorldBound());
+                for (const Ray &ray : rays) {
+                    Ray r0 = ray, r1 = ray;
+                    SurfaceInteraction i0, i1;
+                    bool h0 = reference.Intersect(r0, &i0);
+                    ASSERT_EQ(h0, cached.Intersect(r1, &i1))
+                        << width << " " << run << " " << ray;
+                    EXPECT_EQ(r0.tMax, r1.tMax) << width << " " << ray;
+                    if (h0) EXPECT_EQ(i0.shape, i1.shape) << width << " " << ray;
+                    EXPECT_EQ(reference.IntersectP(ray), cached.IntersectP(ray))
+                        << width << " " << ray;
+                }
+            }
+            for (const std::string &file : ListFiles(dir))
+                remove(file.c_str());
+        }
+    rmdir(dir);
+}
+
+// Meshes kept as TriangleMeshPrimitives, alone and among other primitives,
+// find the same hits as a primitive per triangle, with every kind of node
+// and with packets
+TEST(BVHAccel, CompactTriangles) {
+    std::vector<std::shared_ptr<Primitive>> shapes = RandomTriangles(3000);
+    std::vector<std::shared_ptr<Primitive>> mesh = RandomTriangles(3000, true);
+    ASSERT_EQ(1u, mesh.size());
+    ASSERT_TRUE(mesh[0] != nullptr);
+    std::vector<std::shared_ptr<Primitive>> spheres = RandomSpheres(20);
+    std::vector<Ray> rays = RandomRays(20000);
+    for (bool mixed : {false, true}) {
+        std::vector<std::shared_ptr<Primitive>> reference = shapes;
+        std::vector<std::shared_ptr<Primitive>> compact = mesh;
+        if (mixed) {
+            reference.insert(reference.end(), spheres.begin(), spheres.end());
+            compact.insert(compact.begin(), spheres.begin(), spheres.end());
+        }
+        for (int width : {2, 4, 8}) {
+            BVHAccel r(reference, 4, BVHAccel::SplitMethod::SAH, width);
+            BVHAccel c(compact, 4, BVHAccel::SplitMethod::SAH, width);
+            EXPECT_EQ(r.WorldBound(), c.WorldBound());
+            int hits = 0;
+            for (const Ray &ray : rays) {
+                Ray r0 = ray, r1 = ray;
+                SurfaceInteraction i0, i1;
+                bool h0 = r.Intersect(r0, &i0);
+                ASSERT_EQ(h0, c.Intersect(r1, &i1)) << width << " " << ray;
+                EXPECT_EQ(r0.tMax, r1.tMax) << width << " " << ray;
+                if (h0) {
+                    EXPECT_EQ(i0.p, i1.p) << width << " " << ray;
+                    EXPECT_EQ(i0.n, i1.n) << width << " " << ray;
+                    EXPECT_EQ(i0.uv, i1.uv) << width << " " << ray;
+                    EXPECT_EQ(i0.shading.n, i1.shading.n) << width << " " << ray;
+                    if (i1.primitive != mesh[0].get())
+                        EXPECT_EQ(i0.primitive, i1.primitive) << ray;
+                    ++hits;
+                }
+                EXPECT_EQ(r.IntersectP(ray), c.IntersectP(ray))
+                    << width << " " << ray;
+            }
+            EXPECT_GT(hits, 1000);
+
+            std::vector<Ray> stream = rays;
+            std::vector<SurfaceInteraction> isects(stream.size());
+            std::unique_ptr<bool[]> packetHits(new bool[stream.size()]);
+            c.IntersectN(stream.size(), &stream[0], &isects[0],
+                         packetHits.get());
+            for (size_t i = 0; i < rays.size(); ++i) {
+                Ray r0 = rays[i];
+                SurfaceInteraction isect;
+                ASSERT_EQ(r.Intersect(r0, &isect), packetHits[i]) << r0;
+                EXPECT_EQ(r0.tMax, stream[i].tMax) << r0;
+                if (packetHits[i]) EXPECT_EQ(isect.p, isects[i].p) << r0;
+            }
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "cameras/hemispheric.h"
+
+using namespace pbrt;
+
+// 16x16 NN film, dim everywhere with a bright spot
+static std::shared_ptr<IntensityFilm> MakeNnFilm() {
+    std::shared_ptr<IntensityFilm> film(new IntensityFilm(16, 16));
+    for (int y = 0; y < 16; ++y)
+        for (int x = 0; x < 16; ++x)
+            film->set_camera_coord(x, y, 0.1f, 0.1f, 0.1f);
+    film->set_camera_coord(11, 5, 50.f, 40.f, 30.f);
+    return film;
+}
+
+// Radiance integrated over the hemisphere, pixel by pixel
+static Float ExactIntegral(IntensityFilm &film) {
+    Float sum = 0;
+    for (int y = 0; y < 16; ++y) {
+        Float solid_angle = (Pi / 16) * (std::cos(Pi * y / 16) -
+                                         std::cos(Pi * (y + 1) / 16));
+        for (int x = 0; x < 16; ++x)
+            sum += film.get_camera_coord(x, y).as_spectrum().y() * solid_angle;
+    }
+    return sum;
+}
+
+TEST(HemisphericCamera, NnSamplingPdf) {
+    std::unique_ptr<HemisphericCamera> camera(CreateHemisphericCamera(
+        16, 16, nullptr, Point3f(1, 2, 3), Vector3f(0, 0, 1), "/tmp/null"));
+    std::shared_ptr<IntensityFilm> film = MakeNnFilm();
+    camera->set_nn_film(film);
+
+    RNG rng(7);
+    int spot = 0;
+    Float estimate = 0;
+    const int n = 20000;
+    for (int i = 0; i < n; ++i) {
+        Point2f u(rng.UniformFloat(), rng.UniformFloat());
+        Vector3f wi;
+        Float pdf;
+        Spectrum L = camera->sample_nn(u, &wi, &pdf);
+        ASSERT_GT(pdf, 0);
+        // Facing the look direction
+        EXPECT_GE(wi.z, -1e-4f);
+
+        Float eval_pdf;
+        Spectrum eval_L = camera->eval_nn(wi, &eval_pdf);
+        EXPECT_NEAR(1.f, eval_pdf / pdf, 1e-2f);
+        EXPECT_NEAR(L.y(), eval_L.y(), 1e-3f * L.y());
+
+        if (L.y() > 1) ++spot;
+        estimate += L.y() / pdf;
+    }
+
+    // The spot is 1 / 256 of the pixels but most of the energy
+    EXPECT_GT(spot, n / 2);
+    Float exact = ExactIntegral(*film);
+    EXPECT_NEAR(1.f, estimate / n / exact, 0.02f);
+
+    // Nothing behind the hemisphere
+    Float pdf;
+    EXPECT_TRUE(camera->eval_nn(Vector3f(0, 0, -1), &pdf).IsBlack());
+    EXPECT_EQ(0, pdf);
+}
+
+TEST(HemisphericCamera, NnSamplingWithoutFilm) {
+    std::unique_ptr<HemisphericCamera> camera(CreateHemisphericCamera(
+        16, 16, nullptr, Point3f(0, 0, 0), Vector3f(0, 1, 0), "/tmp/null"));
+    Vector3f wi;
+    Float pdf;
+    EXPECT_TRUE(camera->sample_nn(Point2f(0.5f, 0.5f), &wi, &pdf).IsBlack());
+    EXPECT_EQ(0, pdf);
+}
@@ -43,13 +43,14 @@ void test_main8()
                     Bounds2i(
                         Point2i(10, 10),
                         Point2i(1280, 720)
-                        )
+                        ),
+                    1
                     )
                 );
 
     for (int i = 0; i < 250; i++) {
         IisptScheduleMonitorTask task =
-                schedule_monitor->next_task();
+                schedule_monitor->next_task(0);
         std::cerr << "Start ["<< task.x0 <<"]["<< task.y0 <<
                      "] Finish ["<< task.x1 <<"]["<< task.y1 <<
                      "] Radius ["<< task.tilesize <<"]\n";
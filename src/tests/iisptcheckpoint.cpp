@@ -0,0 +1,117 @@
+#include "tests/gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+#include "pbrt.h"
+#include "integrators/iisptcheckpoint.h"
+
+using namespace pbrt;
+
+static const Bounds2i bounds(Point2i(0, 0), Point2i(130, 90));
+
+static std::unique_ptr<IisptScheduleMonitor> make_schedule() {
+    setenv("IISPT_SCHEDULE_RADIUS_START", "4", 1);
+    setenv("IISPT_SCHEDULE_RADIUS_RATIO", "0.5", 1);
+    std::unique_ptr<IisptScheduleMonitor> monitor(
+        new IisptScheduleMonitor(bounds, 2));
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+    unsetenv("IISPT_SCHEDULE_RADIUS_RATIO");
+    return monitor;
+}
+
+static void add_task_samples(IisptFilmMonitor &film,
+                             const IisptScheduleMonitorTask &task) {
+    std::vector<Point2i> pts;
+    std::vector<Spectrum> ss;
+    std::vector<double> weights;
+    for (int y = task.y0; y < task.y1; ++y)
+        for (int x = task.x0; x < task.x1; ++x) {
+            pts.push_back(Point2i(x, y));
+            ss.push_back(Spectrum(Float(task.pass)));
+            weights.push_back(0.5);
+        }
+    film.add_n_samples(pts, ss, weights);
+}
+
+// A resumed schedule hands out exactly the parts of the open passes that
+// were not completed, then the tiles and tasks that came next
+TEST(IisptCheckpoint, Resume) {
+    char path[] = "/tmp/iisptcheckpointXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    std::unique_ptr<IisptScheduleMonitor> schedule = make_schedule();
+    IisptFilmMonitor indirect(bounds);
+    IisptFilmMonitor direct(bounds, true);
+
+    // Part of pass 1 completes, one task of each thread is still running
+    std::vector<int> covered(130 * 90, 0);
+    int completed = 0;
+    IisptScheduleMonitorTask task;
+    for (int i = 0; i < 8; ++i) {
+        task = schedule->next_task(i % 2);
+        if (i >= 6) continue;
+        IisptScheduleCommit commit(schedule.get());
+        add_task_samples(indirect, task);
+        schedule->complete_task(task);
+        for (int y = task.y0; y < task.y1; ++y)
+            for (int x = task.x0; x < task.x1; ++x) covered[y * 130 + x]++;
+        ++completed;
+    }
+
+    IisptScheduleDirectTile tile, running;
+    ASSERT_TRUE(schedule->next_direct_tile(2, tile));
+    ASSERT_TRUE(schedule->next_direct_tile(2, running));
+    {
+        IisptScheduleCommit commit(schedule.get());
+        direct.add_sample(Point2i(tile.x0, tile.y0), Spectrum(1.f), 1.0);
+        schedule->complete_direct_tile(tile);
+    }
+
+    IisptCheckpoint checkpoint(path, schedule.get(), &indirect, &direct);
+    ASSERT_TRUE(checkpoint.write());
+
+    std::unique_ptr<IisptScheduleMonitor> resumed = make_schedule();
+    IisptFilmMonitor resumed_indirect(bounds);
+    IisptFilmMonitor resumed_direct(bounds, true);
+    IisptCheckpoint reader(path, resumed.get(), &resumed_indirect,
+                           &resumed_direct);
+    ASSERT_TRUE(reader.read());
+    remove(path);
+
+    EXPECT_EQ(1, resumed->get_resumes());
+    EXPECT_EQ(indirect.save_state(), resumed_indirect.save_state());
+    EXPECT_EQ(direct.save_state(), resumed_direct.save_state());
+
+    // The running tile comes back first
+    ASSERT_TRUE(resumed->next_direct_tile(2, tile));
+    EXPECT_EQ(running.number, tile.number);
+    ASSERT_TRUE(resumed->next_direct_tile(2, tile));
+    EXPECT_EQ(2, tile.number);
+
+    // Pass 1 ends up covered exactly once
+    int number = completed;
+    while (true) {
+        task = resumed->next_task(0);
+        EXPECT_EQ(number++, task.taskNumber);
+        if (task.pass == 1)
+            for (int y = task.y0; y < task.y1; ++y)
+                for (int x = task.x0; x < task.x1; ++x) covered[y * 130 + x]++;
+        if (task.pass > 2) break;
+    }
+    for (int c : covered) EXPECT_EQ(1, c);
+}
+
+// Without a checkpoint file the render starts from the beginning
+TEST(IisptCheckpoint, Missing) {
+    std::unique_ptr<IisptScheduleMonitor> schedule = make_schedule();
+    IisptFilmMonitor indirect(bounds);
+    IisptFilmMonitor direct(bounds, true);
+    IisptCheckpoint checkpoint("/tmp/iisptcheckpoint_missing", schedule.get(),
+                               &indirect, &direct);
+    EXPECT_FALSE(checkpoint.read());
+    EXPECT_EQ(0, schedule->get_resumes());
+}
@@ -0,0 +1,144 @@
+#include "tests/gtest/gtest.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include "pbrt.h"
+#include "integrators/iisptdatasetwriter.h"
+
+using namespace pbrt;
+
+static const int SIZE = 4;
+
+static std::string make_directory() {
+    char dir[] = "/tmp/iisptdatasetXXXXXX";
+    EXPECT_TRUE(mkdtemp(dir) != nullptr);
+    return std::string(dir) + "/";
+}
+
+static void remove_directory(const std::string &dir) {
+    for (int k = 0; k < 4; ++k)
+        remove((dir + IISPT_DATASET_SHARD_PREFIX + std::to_string(k) +
+                IISPT_DATASET_SHARD_EXTENSION).c_str());
+    remove((dir + IISPT_DATASET_INDEX_NAME).c_str());
+    rmdir(dir.c_str());
+}
+
+static std::unique_ptr<ImageFilm> make_film(int components, float base) {
+    std::unique_ptr<ImageFilm> film(new ImageFilm(SIZE, SIZE, components));
+    for (int i = 0; i < film->size(); ++i) film->get_data()[i] = base + i;
+    return film;
+}
+
+static void write_record(IisptDatasetWriter &writer, int shard, int x, int y) {
+    float base = 1000 * x + y;
+    std::unique_ptr<ImageFilm> d = make_film(3, base);
+    std::unique_ptr<ImageFilm> n = make_film(3, base + 100);
+    std::unique_ptr<ImageFilm> z = make_film(1, base + 200);
+    std::unique_ptr<ImageFilm> p = make_film(3, base + 300);
+    writer.write(shard, x, y, d.get(), n.get(), z.get(), p.get());
+}
+
+static std::vector<char> read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in),
+                             std::istreambuf_iterator<char>());
+}
+
+static std::vector<IisptDatasetIndexEntry> read_index(const std::string &dir) {
+    std::vector<char> bytes = read_file(dir + IISPT_DATASET_INDEX_NAME);
+    EXPECT_GE(bytes.size(), (size_t)IISPT_DATASET_INDEX_HEADER_BYTES);
+    const IisptDatasetIndexEntry *e = (const IisptDatasetIndexEntry *)(
+        bytes.data() + IISPT_DATASET_INDEX_HEADER_BYTES);
+    size_t n = (bytes.size() - IISPT_DATASET_INDEX_HEADER_BYTES) /
+               sizeof(IisptDatasetIndexEntry);
+    return std::vector<IisptDatasetIndexEntry>(e, e + n);
+}
+
+// Records can be read back from the shards through the index, with the
+// planes in ImageFilm layout
+TEST(IisptDatasetWriter, RoundTrip) {
+    std::string dir = make_directory();
+    int record_bytes = IisptDatasetWriter::compute_record_bytes(SIZE);
+    {
+        IisptDatasetWriter writer(dir, SIZE, 2, false);
+        write_record(writer, 0, 3, 4);
+        write_record(writer, 1, 5, 6);
+        write_record(writer, 0, 7, 8);
+        EXPECT_EQ(3, writer.size());
+        EXPECT_TRUE(writer.contains(7, 8));
+        EXPECT_FALSE(writer.contains(8, 7));
+    }
+
+    std::vector<IisptDatasetIndexEntry> index = read_index(dir);
+    ASSERT_EQ(3u, index.size());
+    EXPECT_EQ(7, index[2].x);
+    EXPECT_EQ(8, index[2].y);
+    EXPECT_EQ(0, index[2].shard);
+    EXPECT_EQ(1, index[2].record);
+
+    std::vector<char> shard = read_file(dir + "dataset_0.bin");
+    ASSERT_EQ((size_t)(IISPT_DATASET_SHARD_HEADER_BYTES + 2 * record_bytes),
+              shard.size());
+    EXPECT_EQ(0, memcmp(shard.data(), "IISPTDS1", 8));
+    const char *record =
+        shard.data() + IISPT_DATASET_SHARD_HEADER_BYTES + record_bytes;
+    EXPECT_EQ(7, ((const int32_t *)record)[0]);
+    EXPECT_EQ(8, ((const int32_t *)record)[1]);
+    const float *planes =
+        (const float *)(record + IISPT_DATASET_RECORD_HEADER_BYTES);
+    int s2 = SIZE * SIZE;
+    EXPECT_EQ(7008.f, planes[0]);
+    EXPECT_EQ(7008.f + 3 * s2 - 1, planes[3 * s2 - 1]);
+    EXPECT_EQ(7108.f, planes[3 * s2]);
+    EXPECT_EQ(7208.f, planes[6 * s2]);
+    EXPECT_EQ(7308.f + 3 * s2 - 1, planes[10 * s2 - 1]);
+
+    remove_directory(dir);
+}
+
+// Resuming keeps the indexed records and drops a record that was being
+// written when the renderer stopped
+TEST(IisptDatasetWriter, Resume) {
+    std::string dir = make_directory();
+    int record_bytes = IisptDatasetWriter::compute_record_bytes(SIZE);
+    {
+        IisptDatasetWriter writer(dir, SIZE, 2, false);
+        write_record(writer, 0, 1, 1);
+        write_record(writer, 1, 2, 2);
+    }
+    // Half a record without an index entry
+    {
+        std::ofstream out(dir + "dataset_0.bin",
+                          std::ios::binary | std::ios::app);
+        std::vector<char> garbage(record_bytes / 2, 'x');
+        out.write(garbage.data(), garbage.size());
+    }
+    {
+        IisptDatasetWriter writer(dir, SIZE, 2, true);
+        EXPECT_EQ(2, writer.size());
+        EXPECT_TRUE(writer.contains(1, 1));
+        EXPECT_TRUE(writer.contains(2, 2));
+        write_record(writer, 0, 3, 3);
+    }
+
+    std::vector<IisptDatasetIndexEntry> index = read_index(dir);
+    ASSERT_EQ(3u, index.size());
+    EXPECT_EQ(3, index[2].x);
+    EXPECT_EQ(0, index[2].shard);
+    EXPECT_EQ(1, index[2].record);
+    EXPECT_EQ((size_t)(IISPT_DATASET_SHARD_HEADER_BYTES + 2 * record_bytes),
+              read_file(dir + "dataset_0.bin").size());
+
+    // Without resume the dataset starts over
+    {
+        IisptDatasetWriter writer(dir, SIZE, 2, false);
+        EXPECT_EQ(0, writer.size());
+    }
+    EXPECT_EQ(0u, read_index(dir).size());
+
+    remove_directory(dir);
+}
@@ -0,0 +1,266 @@
+#include "tests/gtest/gtest.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "pbrt.h"
+#include "accelerators/bvh.h"
+#include "cameras/perspective.h"
+#include "film.h"
+#include "filters/box.h"
+#include "integrators/iisptdistributed.h"
+#include "integrators/iisptnnstub.h"
+#include "integrators/iisptrenderrunner.h"
+#include "lights/point.h"
+#include "materials/matte.h"
+#include "samplers/random.h"
+#include "scene.h"
+#include "shapes/sphere.h"
+#include "textures/constant.h"
+
+using namespace pbrt;
+
+static const Bounds2i bounds(Point2i(0, 0), Point2i(64, 48));
+static const int nTasks = 40;
+
+static std::unique_ptr<IisptScheduleMonitor> make_schedule() {
+    setenv("IISPT_SCHEDULE_RADIUS_START", "2", 1);
+    std::unique_ptr<IisptScheduleMonitor> monitor(
+        new IisptScheduleMonitor(bounds, 1));
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+    return monitor;
+}
+
+// Values whose sums depend on the order they are added in
+static IisptTaskResult fake_result(const IisptScheduleMonitorTask &task) {
+    std::vector<Point2i> pts;
+    std::vector<Spectrum> ss;
+    std::vector<double> weights;
+    for (int y = task.y0; y < task.y1; ++y)
+        for (int x = task.x0; x < task.x1; ++x) {
+            pts.push_back(Point2i(x, y));
+            ss.push_back(Spectrum(Float(1.0 / (3 + task.taskNumber + x))));
+            weights.push_back(std::sqrt(2.0 + task.taskNumber));
+        }
+    return iispt_task_result(pts, ss, weights);
+}
+
+static void consume(IisptRemoteTasks *tasks, int delay_us) {
+    IisptScheduleMonitorTask task;
+    while (tasks->next_task(task)) {
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(delay_us * (task.taskNumber % 3)));
+        tasks->submit(task, fake_result(task));
+    }
+}
+
+// Workers over TCP and local threads finishing tasks in any order give
+// the same film, bit for bit, as one thread doing every task
+TEST(IisptDistributed, DeterministicMerge) {
+    int savedTasks = PbrtOptions.iileIndirectTasks;
+    PbrtOptions.iileIndirectTasks = nTasks;
+
+    std::unique_ptr<IisptScheduleMonitor> reference_schedule = make_schedule();
+    IisptFilmMonitor reference(bounds);
+    {
+        IisptCoordinator coordinator(reference_schedule.get(), &reference,
+                                     nTasks);
+        consume(&coordinator, 0);
+    }
+
+    std::unique_ptr<IisptScheduleMonitor> schedule = make_schedule();
+    IisptFilmMonitor film(bounds);
+    {
+        IisptCoordinator coordinator(schedule.get(), &film, nTasks);
+        ASSERT_TRUE(coordinator.listen(0));
+        std::string address =
+            "127.0.0.1:" + std::to_string(coordinator.get_port());
+
+        std::vector<std::thread> threads;
+        for (int w = 0; w < 2; ++w)
+            threads.push_back(std::thread([&address, w]() {
+                IisptWorkerClient client;
+                ASSERT_TRUE(client.connect(address, bounds));
+                std::thread second([&client]() { consume(&client, 300); });
+                consume(&client, 100 * (w + 1));
+                second.join();
+            }));
+        threads.push_back(
+            std::thread([&coordinator]() { consume(&coordinator, 200); }));
+        for (std::thread &t : threads) t.join();
+        coordinator.wait();
+    }
+
+    EXPECT_EQ(reference.save_state(), film.save_state());
+    PbrtOptions.iileIndirectTasks = savedTasks;
+}
+
+// The tasks of a worker that goes away are handed out again with the
+// same numbers; workers of another render are turned away
+TEST(IisptDistributed, Requeue) {
+    int savedTasks = PbrtOptions.iileIndirectTasks;
+    PbrtOptions.iileIndirectTasks = 3;
+
+    std::unique_ptr<IisptScheduleMonitor> schedule = make_schedule();
+    IisptFilmMonitor film(bounds);
+    IisptCoordinator coordinator(schedule.get(), &film, 3);
+    ASSERT_TRUE(coordinator.listen(0));
+    std::string address = "127.0.0.1:" + std::to_string(coordinator.get_port());
+
+    IisptScheduleMonitorTask lost;
+    {
+        IisptWorkerClient client;
+        ASSERT_TRUE(client.connect(address, bounds));
+        ASSERT_TRUE(client.next_task(lost));
+        EXPECT_EQ(0, lost.taskNumber);
+    }
+
+    {
+        IisptWorkerClient other;
+        EXPECT_FALSE(other.connect(
+            address, Bounds2i(Point2i(0, 0), Point2i(32, 32))));
+    }
+
+    // The coordinator notices the disconnection on its own thread
+    IisptScheduleMonitorTask task;
+    ASSERT_TRUE(coordinator.next_task(task));
+    for (int i = 0; i < 100 && task.taskNumber != 0; ++i) {
+        coordinator.submit(task, fake_result(task));
+        ASSERT_TRUE(coordinator.next_task(task));
+    }
+    EXPECT_EQ(0, task.taskNumber);
+    EXPECT_EQ(lost.x0, task.x0);
+    EXPECT_EQ(lost.y1, task.y1);
+    coordinator.submit(task, fake_result(task));
+    consume(&coordinator, 0);
+    coordinator.wait();
+    EXPECT_FALSE(coordinator.next_task(task));
+
+    PbrtOptions.iileIndirectTasks = savedTasks;
+}
+
+// Inside of a diffuse sphere with a smaller one in front of the camera,
+// lit by a point light
+static std::shared_ptr<Scene> render_scene() {
+    static Transform id;
+    static Transform inner = Translate(Vector3f(0.3f, 0.2f, 0.6f));
+    static Transform innerInverse = Inverse(inner);
+    std::shared_ptr<Texture<Spectrum>> Kd =
+        std::make_shared<ConstantTexture<Spectrum>>(Spectrum(0.5));
+    std::shared_ptr<Texture<Float>> sigma =
+        std::make_shared<ConstantTexture<Float>>(0.);
+    std::shared_ptr<Material> material =
+        std::make_shared<MatteMaterial>(Kd, sigma, nullptr);
+
+    MediumInterface mediumInterface;
+    std::vector<std::shared_ptr<Primitive>> prims;
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&id, &id, true, 1, -1, 1, 360), material,
+        nullptr, mediumInterface));
+    prims.push_back(std::make_shared<GeometricPrimitive>(
+        std::make_shared<Sphere>(&inner, &innerInverse, false, 0.2f, -0.2f,
+                                 0.2f, 360),
+        material, nullptr, mediumInterface));
+
+    std::vector<std::shared_ptr<Light>> lights;
+    lights.push_back(std::make_shared<PointLight>(
+        Translate(Vector3f(-0.4f, 0.3f, 0.1f)), nullptr, Spectrum(Pi)));
+    return std::make_shared<Scene>(std::make_shared<BVHAccel>(prims), lights);
+}
+
+static std::shared_ptr<Camera> render_camera(int width, int height) {
+    static AnimatedTransform identity(new Transform, 0, new Transform, 1);
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(0.5, 0.5)));
+    Film *film = new Film(Point2i(width, height),
+                          Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::move(filter), 1., "/tmp/null", 1.);
+    return std::make_shared<PerspectiveCamera>(
+        identity, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0., 10.,
+        60, film, nullptr);
+}
+
+// Runs <threads> render threads on the tasks of <tasks>
+static void render_tasks(const Scene &scene,
+                         std::shared_ptr<const Camera> camera,
+                         IisptRemoteTasks *tasks, int threads) {
+    std::shared_ptr<Camera> dcamera =
+        render_camera(PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize);
+    Bounds2i film_bounds = camera->film->GetSampleBounds();
+    // Only gives the runners their seeds
+    std::shared_ptr<IisptScheduleMonitor> schedule(
+        new IisptScheduleMonitor(film_bounds, threads));
+    std::shared_ptr<IisptFilmMonitor> unused(
+        new IisptFilmMonitor(film_bounds));
+    std::shared_ptr<IisptHemisphereCache> hemi_cache(
+        new IisptHemisphereCache(scene.WorldBound()));
+    std::shared_ptr<Sampler> sampler(new RandomSampler(4));
+
+    std::vector<std::thread> runners;
+    for (int i = 0; i < threads; ++i)
+        runners.push_back(std::thread([&, i]() {
+            IisptRenderRunner runner(
+                schedule, unused, unused, camera, dcamera, sampler, i,
+                film_bounds, IisptNnStub::create("identity"), hemi_cache);
+            runner.set_remote_tasks(tasks);
+            runner.run(scene);
+        }));
+    for (std::thread &t : runners) t.join();
+}
+
+// Hemispheres are rendered with samplers seeded by the task, so the film
+// doesn't depend on which thread or worker rendered each task
+TEST(IisptDistributed, RenderLayouts) {
+    int savedTasks = PbrtOptions.iileIndirectTasks;
+    int savedHemiSize = PbrtOptions.iisptHemiSize;
+    PbrtOptions.iileIndirectTasks = 8;
+    PbrtOptions.iisptHemiSize = 16;
+    setenv("IISPT_HEMI_CACHE_SIZE", "0", 1);
+    setenv("IISPT_SCHEDULE_RADIUS_START", "2", 1);
+
+    std::shared_ptr<Scene> scene = render_scene();
+    std::shared_ptr<const Camera> camera = render_camera(40, 30);
+    Bounds2i film_bounds = camera->film->GetSampleBounds();
+
+    // One thread of the coordinator
+    IisptScheduleMonitor reference_schedule(film_bounds, 1);
+    IisptFilmMonitor reference(film_bounds);
+    {
+        IisptCoordinator coordinator(&reference_schedule, &reference,
+                                     PbrtOptions.iileIndirectTasks);
+        render_tasks(*scene, camera, &coordinator, 1);
+        coordinator.wait();
+    }
+
+    // Two threads of the coordinator and three of a worker
+    IisptScheduleMonitor schedule(film_bounds, 1);
+    IisptFilmMonitor film(film_bounds);
+    {
+        IisptCoordinator coordinator(&schedule, &film,
+                                     PbrtOptions.iileIndirectTasks);
+        ASSERT_TRUE(coordinator.listen(0));
+        std::string address =
+            "127.0.0.1:" + std::to_string(coordinator.get_port());
+        std::thread worker([&]() {
+            IisptWorkerClient client;
+            ASSERT_TRUE(client.connect(address, film_bounds));
+            render_tasks(*scene, camera, &client, 3);
+        });
+        render_tasks(*scene, camera, &coordinator, 2);
+        worker.join();
+        coordinator.wait();
+    }
+
+    std::vector<double> expected = reference.save_state();
+    EXPECT_EQ(expected, film.save_state());
+    double sum = 0;
+    for (double v : expected) sum += v;
+    EXPECT_GT(sum, 0);
+
+    unsetenv("IISPT_HEMI_CACHE_SIZE");
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+    PbrtOptions.iisptHemiSize = savedHemiSize;
+    PbrtOptions.iileIndirectTasks = savedTasks;
+}
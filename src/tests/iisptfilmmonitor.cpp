@@ -0,0 +1,129 @@
+
+#include "tests/gtest/gtest.h"
+#include <thread>
+#include <vector>
+#include "pbrt.h"
+#include "integrators/iisptfilmmonitor.h"
+
+using namespace pbrt;
+
+TEST(IisptFilmMonitor, ConcurrentAccumulation) {
+    Bounds2i bounds(Point2i(2, 3), Point2i(9, 7));
+    IisptFilmMonitor monitor(bounds);
+
+    // Every thread adds the same samples to every pixel, partly in batches
+    const int nThreads = 8, nRounds = 200;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nThreads; ++t) {
+        threads.push_back(std::thread([&]() {
+            for (int round = 0; round < nRounds; ++round) {
+                std::vector<Point2i> pts;
+                std::vector<Spectrum> ss;
+                std::vector<double> weights;
+                for (int y = bounds.pMin.y; y <= bounds.pMax.y; ++y)
+                    for (int x = bounds.pMin.x; x <= bounds.pMax.x; ++x) {
+                        Float rgb[3] = {Float(x), Float(y), 1.f};
+                        Spectrum s = Spectrum::FromRGB(rgb);
+                        if (round % 2)
+                            monitor.add_sample(Point2i(x, y), s, 0.5);
+                        else {
+                            pts.push_back(Point2i(x, y));
+                            ss.push_back(s);
+                            weights.push_back(0.5);
+                        }
+                    }
+                monitor.add_n_samples(pts, ss, weights);
+                // Snapshots must not block or disturb the writers
+                if (round % 50 == 0) monitor.to_intensity_film();
+            }
+        }));
+    }
+    for (std::thread &t : threads) t.join();
+
+    // Sum of colours / sum of weights
+    std::shared_ptr<IntensityFilm> film = monitor.to_intensity_film();
+    for (int y = bounds.pMin.y; y <= bounds.pMax.y; ++y)
+        for (int x = bounds.pMin.x; x <= bounds.pMax.x; ++x) {
+            PfmItem pix = film->get_image_coord(x - bounds.pMin.x,
+                                                y - bounds.pMin.y);
+            EXPECT_FLOAT_EQ(2.f * x, pix.r);
+            EXPECT_FLOAT_EQ(2.f * y, pix.g);
+            EXPECT_FLOAT_EQ(2.f, pix.b);
+        }
+
+    // The reversed film flips Y
+    std::shared_ptr<IntensityFilm> reversed =
+        monitor.to_intensity_film_reversed();
+    int height = bounds.pMax.y - bounds.pMin.y + 1;
+    EXPECT_FLOAT_EQ(2.f * bounds.pMin.y,
+                    reversed->get_image_coord(0, height - 1).g);
+}
+
+// Only the tiles written since the last take_dirty_tiles() are returned
+TEST(IisptFilmMonitor, DirtyTiles) {
+    Bounds2i bounds(Point2i(10, 20), Point2i(79, 59));
+    IisptFilmMonitor monitor(bounds);
+    EXPECT_EQ(3, monitor.get_tiles_x());
+    EXPECT_EQ(2, monitor.get_tiles_y());
+
+    std::vector<int> tiles;
+    monitor.take_dirty_tiles(tiles);
+    EXPECT_TRUE(tiles.empty());
+
+    Float rgb[3] = {1.f, 2.f, 3.f};
+    Spectrum s = Spectrum::FromRGB(rgb);
+    monitor.add_sample(Point2i(10, 20), s, 1.0);
+    monitor.add_sample(Point2i(11, 21), s, 1.0);
+    monitor.add_sample(Point2i(79, 59), s, 1.0);
+    monitor.take_dirty_tiles(tiles);
+    EXPECT_EQ(std::vector<int>({0, 5}), tiles);
+
+    tiles.clear();
+    monitor.take_dirty_tiles(tiles);
+    EXPECT_TRUE(tiles.empty());
+
+    std::vector<Point2i> pts = {Point2i(45, 20)};
+    std::vector<Spectrum> ss = {s};
+    std::vector<double> weights = {1.0};
+    monitor.add_n_samples(pts, ss, weights);
+    monitor.take_dirty_tiles(tiles);
+    EXPECT_EQ(std::vector<int>({1}), tiles);
+
+    IisptPixel pix = monitor.get_pixel(69, 39);
+    EXPECT_DOUBLE_EQ(1.0, pix.weight);
+}
+
+// A pixel converges once it has enough samples and a small relative
+// standard error; monitors without variance tracking never converge
+TEST(IisptFilmMonitor, Convergence) {
+    Bounds2i bounds(Point2i(0, 0), Point2i(4, 4));
+    IisptFilmMonitor monitor(bounds, true);
+    IisptFilmMonitor untracked(bounds);
+
+    Float grey[3] = {0.5f, 0.5f, 0.5f};
+    Spectrum flat = Spectrum::FromRGB(grey);
+    for (int i = 0; i < 3; ++i) {
+        monitor.add_sample(Point2i(1, 1), flat, 1.0);
+        untracked.add_sample(Point2i(1, 1), flat, 1.0);
+    }
+    EXPECT_FALSE(monitor.converged(1, 1, 4, 0.02));
+    monitor.add_sample(Point2i(1, 1), flat, 1.0);
+    EXPECT_TRUE(monitor.converged(1, 1, 4, 0.02));
+    EXPECT_FALSE(untracked.converged(1, 1, 1, 0.02));
+
+    // Alternating black and white samples: the relative error is
+    // 1 / sqrt(n), with the sample variance
+    Float white[3] = {1.f, 1.f, 1.f};
+    Spectrum s = Spectrum::FromRGB(white);
+    for (int i = 0; i < 100; ++i)
+        monitor.add_sample(Point2i(2, 3), i % 2 ? s : Spectrum(0.f), 1.0);
+    EXPECT_FALSE(monitor.converged(2, 3, 4, 0.05));
+    EXPECT_TRUE(monitor.converged(2, 3, 4, 0.2));
+
+    // Black pixels have no error
+    std::vector<Point2i> pts(4, Point2i(0, 2));
+    std::vector<Spectrum> ss(4, Spectrum(0.f));
+    std::vector<double> weights(4, 1.0);
+    monitor.add_n_samples(pts, ss, weights);
+    EXPECT_TRUE(monitor.converged(0, 2, 4, 0.02));
+}
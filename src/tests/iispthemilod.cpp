@@ -0,0 +1,99 @@
+#include "tests/gtest/gtest.h"
+#include <cstdlib>
+#include <memory>
+#include "pbrt.h"
+#include "interaction.h"
+#include "memory.h"
+#include "microfacet.h"
+#include "reflection.h"
+#include "integrators/iispthemilod.h"
+#include "integrators/iisptnnstub.h"
+
+using namespace pbrt;
+
+// BSDF of a surface facing +z
+static BSDF* MakeBSDF(MemoryArena &arena, Float roughness) {
+    SurfaceInteraction isect(Point3f(0, 0, 0), Vector3f(0, 0, 0),
+                             Point2f(0.5f, 0.5f), Vector3f(0, 0, 1),
+                             Vector3f(1, 0, 0), Vector3f(0, 1, 0),
+                             Normal3f(0, 0, 0), Normal3f(0, 0, 0), 0, nullptr);
+    BSDF* bsdf = ARENA_ALLOC(arena, BSDF)(isect);
+    if (roughness <= 0) {
+        bsdf->Add(ARENA_ALLOC(arena, LambertianReflection)(Spectrum(0.5f)));
+    } else {
+        Float alpha = TrowbridgeReitzDistribution::RoughnessToAlpha(roughness);
+        MicrofacetDistribution* distrib =
+            ARENA_ALLOC(arena, TrowbridgeReitzDistribution)(alpha, alpha);
+        Fresnel* fresnel = ARENA_ALLOC(arena, FresnelNoOp)();
+        bsdf->Add(ARENA_ALLOC(arena, MicrofacetReflection)(Spectrum(1.f),
+                                                           distrib, fresnel));
+    }
+    return bsdf;
+}
+
+TEST(IisptHemiLod, Levels) {
+    int savedSize = PbrtOptions.iisptHemiSize;
+    PbrtOptions.iisptHemiSize = 24;
+    EXPECT_EQ(std::vector<int>({24}), iispt_hemi_levels());
+    EXPECT_FALSE(IisptHemiLod().enabled());
+
+    setenv("IISPT_HEMI_LOD", "32,8,64,16,8", 1);
+    EXPECT_EQ(std::vector<int>({8, 16, 32, 64}), iispt_hemi_levels());
+    EXPECT_EQ(64, iispt_hemi_max_size());
+    EXPECT_TRUE(IisptHemiLod().enabled());
+    unsetenv("IISPT_HEMI_LOD");
+    PbrtOptions.iisptHemiSize = savedSize;
+}
+
+// Diffuse surfaces get the smallest hemispheres, glossy ones the largest,
+// unless the tile is large on screen
+TEST(IisptHemiLod, Choose) {
+    MemoryArena arena;
+    IisptHemiLod lod({8, 16, 32, 64});
+    Vector3f wo = Normalize(Vector3f(0.3f, 0, 1));
+
+    BSDF* matte = MakeBSDF(arena, 0);
+    BSDF* glossy = MakeBSDF(arena, 0.001f);
+    EXPECT_EQ(8, lod.choose(*matte, wo, 0, 0));
+    EXPECT_EQ(64, lod.choose(*glossy, wo, 0, 0));
+    EXPECT_EQ(16, lod.choose(*MakeBSDF(arena, 0.02f), wo, 0, 0));
+    EXPECT_EQ(32, lod.choose(*MakeBSDF(arena, 0.005f), wo, 0, 0));
+
+    // Finer levels as the roughness goes down
+    int previous = 8;
+    for (Float roughness : {0.5f, 0.1f, 0.02f, 0.01f, 0.005f, 0.002f}) {
+        int size = lod.choose(*MakeBSDF(arena, roughness), wo, 0, 0);
+        EXPECT_GE(size, previous) << roughness;
+        previous = size;
+    }
+
+    // A small tile doesn't limit the size, a large one does
+    EXPECT_EQ(64, lod.choose(*glossy, wo, 0.001f, 4));
+    EXPECT_EQ(16, lod.choose(*glossy, wo, 0.01f, 20));
+    EXPECT_EQ(8, lod.choose(*glossy, wo, 0.01f, 100));
+    EXPECT_EQ(8, lod.choose(*matte, wo, 0.001f, 4));
+
+    // One level is the old fixed size
+    IisptHemiLod fixed({32});
+    EXPECT_EQ(32, fixed.choose(*matte, wo, 0.01f, 100));
+}
+
+// In-process backends answer with a hemisphere of the size they were given
+TEST(IisptHemiLod, BackendSizes) {
+    for (const char* name : {"identity", "constant", "tiny"}) {
+        std::shared_ptr<IisptNnBackend> backend = IisptNnStub::create(name);
+        ASSERT_TRUE(backend != nullptr);
+        for (int size : {8, 16, 64}) {
+            IntensityFilm intensity(size, size);
+            DistanceFilm distance(size, size);
+            NormalFilm normals(size, size);
+            intensity.set_camera_coord(size - 1, 0, 1.f, 2.f, 3.f);
+            int status = 1;
+            std::unique_ptr<IntensityFilm> out =
+                backend->communicate(&intensity, &distance, &normals, status);
+            EXPECT_EQ(0, status) << name;
+            EXPECT_EQ(size, out->get_image_film()->get_width()) << name;
+            EXPECT_EQ(size, out->get_image_film()->get_height()) << name;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+
+#include "tests/gtest/gtest.h"
+#include <cstdlib>
+#include "pbrt.h"
+#include "integrators/iispthemispherecache.h"
+
+using namespace pbrt;
+
+static std::shared_ptr<HemisphericCamera> MakeCamera(Point3f p, Vector3f n) {
+    return std::shared_ptr<HemisphericCamera>(
+        CreateHemisphericCamera(8, 8, nullptr, p, n, "/tmp/null"));
+}
+
+TEST(IisptHemisphereCache, LookupBounds) {
+    setenv("IISPT_HEMI_CACHE_REUSE", "2", 1);
+    Bounds3f world(Point3f(0, 0, 0), Point3f(100, 100, 100));
+    IisptHemisphereCache cache(world);
+    unsetenv("IISPT_HEMI_CACHE_REUSE");
+    ASSERT_TRUE(cache.enabled());
+
+    Point3f p(50, 50, 50);
+    Normal3f n(0, 0, 1);
+    EXPECT_EQ(nullptr, cache.lookup(p, n));
+
+    // Valid within 0.1 * 5 = 0.5
+    std::shared_ptr<HemisphericCamera> camera =
+        MakeCamera(p, Vector3f(0, 0, 1));
+    cache.insert(p, n, 5.f, camera);
+
+    EXPECT_EQ(camera, cache.lookup(p + Vector3f(0.3f, 0.2f, 0), n));
+    EXPECT_EQ(nullptr, cache.lookup(p + Vector3f(0.6f, 0, 0), n));
+    // Normal too far
+    EXPECT_EQ(nullptr, cache.lookup(p, Normal3f(0, 1, 0)));
+    // Second use exhausts the reuse budget
+    EXPECT_EQ(camera, cache.lookup(p, n));
+    EXPECT_EQ(nullptr, cache.lookup(p, n));
+
+    // Closest entry wins, also across cell boundaries
+    Point3f q(49.99f, 10, 10);
+    std::shared_ptr<HemisphericCamera> far =
+        MakeCamera(q + Vector3f(0.4f, 0, 0), Vector3f(0, 0, 1));
+    std::shared_ptr<HemisphericCamera> near =
+        MakeCamera(q + Vector3f(0.1f, 0, 0), Vector3f(0, 0, 1));
+    cache.insert(q + Vector3f(0.4f, 0, 0), n, 10.f, far);
+    cache.insert(q + Vector3f(0.1f, 0, 0), n, 10.f, near);
+    EXPECT_EQ(near, cache.lookup(q, n));
+}
+
+TEST(IisptHemisphereCache, Eviction) {
+    setenv("IISPT_HEMI_CACHE_SIZE", "64", 1);
+    Bounds3f world(Point3f(0, 0, 0), Point3f(100, 100, 100));
+    IisptHemisphereCache cache(world);
+    unsetenv("IISPT_HEMI_CACHE_SIZE");
+
+    // A single shard holds one entry, the newest
+    Normal3f n(0, 0, 1);
+    Point3f p(20, 20, 20);
+    std::shared_ptr<HemisphericCamera> first = MakeCamera(p, Vector3f(n));
+    std::shared_ptr<HemisphericCamera> second = MakeCamera(p, Vector3f(n));
+    cache.insert(p, n, 1.f, first);
+    cache.insert(p, n, 1.f, second);
+    EXPECT_EQ(second, cache.lookup(p, n));
+    EXPECT_EQ(second, cache.lookup(p, n));
+}
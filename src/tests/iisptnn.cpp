@@ -0,0 +1,348 @@
+
+#include "tests/gtest/gtest.h"
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include "pbrt.h"
+#include "integrators/iisptnnnative.h"
+#include "integrators/iisptnnstub.h"
+
+using namespace pbrt;
+
+// Straightforward implementation of IISPTNet working directly on the
+// PyTorch tensor layouts, used as reference for IisptNnNet.
+
+typedef std::vector<float> Buf;
+
+static void RefConv(const IisptNnNet::Tensor &w, const IisptNnNet::Tensor &b,
+                    const Buf &in, int size, Buf &out) {
+    int cout = w.shape[0], cin = w.shape[1], k = w.shape[2], pad = k / 2;
+    out.assign(cout * size * size, 0.f);
+    for (int o = 0; o < cout; ++o)
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x) {
+                double sum = b.data[o];
+                for (int i = 0; i < cin; ++i)
+                    for (int ky = 0; ky < k; ++ky)
+                        for (int kx = 0; kx < k; ++kx) {
+                            int iy = y + ky - pad, ix = x + kx - pad;
+                            if (iy < 0 || iy >= size || ix < 0 || ix >= size)
+                                continue;
+                            sum += w.data[((o * cin + i) * k + ky) * k + kx] *
+                                   in[(i * size + iy) * size + ix];
+                        }
+                out[(o * size + y) * size + x] = sum;
+            }
+}
+
+// Transposed convolution as defined by PyTorch: every input pixel scatters
+// its weighted kernel into the output
+static void RefConvTranspose(const IisptNnNet::Tensor &w,
+                             const IisptNnNet::Tensor &b, const Buf &in,
+                             int size, Buf &out) {
+    int cin = w.shape[0], cout = w.shape[1], k = w.shape[2], pad = 1;
+    out.assign(cout * size * size, 0.f);
+    for (int o = 0; o < cout; ++o)
+        for (int p = 0; p < size * size; ++p) out[o * size * size + p] = b.data[o];
+    for (int i = 0; i < cin; ++i)
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x)
+                for (int o = 0; o < cout; ++o)
+                    for (int ky = 0; ky < k; ++ky)
+                        for (int kx = 0; kx < k; ++kx) {
+                            int oy = y - pad + ky, ox = x - pad + kx;
+                            if (oy < 0 || oy >= size || ox < 0 || ox >= size)
+                                continue;
+                            out[(o * size + oy) * size + ox] +=
+                                w.data[((i * cout + o) * k + ky) * k + kx] *
+                                in[(i * size + y) * size + x];
+                        }
+}
+
+static void RefLeaky(Buf &v) {
+    for (float &f : v) f = f < 0 ? 0.2f * f : f;
+}
+
+static void RefBatchNorm(const IisptNnNet::TensorMap &t, const std::string &p,
+                         Buf &v, int size) {
+    const IisptNnNet::Tensor &g = t.at(p + ".weight"), &b = t.at(p + ".bias"),
+                             &m = t.at(p + ".running_mean"),
+                             &var = t.at(p + ".running_var");
+    int plane = size * size;
+    for (size_t c = 0; c < g.data.size(); ++c)
+        for (int i = 0; i < plane; ++i) {
+            float &f = v[c * plane + i];
+            f = (f - m.data[c]) / std::sqrt(var.data[c] + 1e-5f) * g.data[c] +
+                b.data[c];
+        }
+}
+
+static Buf RefMaxPool(const Buf &in, int size) {
+    int c = in.size() / (size * size), h = size / 2;
+    Buf out(c * h * h);
+    for (int ch = 0; ch < c; ++ch)
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < h; ++x) {
+                float m = -1e30f;
+                for (int dy = 0; dy < 2; ++dy)
+                    for (int dx = 0; dx < 2; ++dx)
+                        m = std::max(m, in[(ch * size + 2 * y + dy) * size +
+                                           2 * x + dx]);
+                out[(ch * h + y) * h + x] = m;
+            }
+    return out;
+}
+
+static Buf RefUpsample(const Buf &in, int size, bool alignCorners) {
+    int c = in.size() / (size * size), o = 2 * size;
+    Buf out(c * o * o);
+    auto coord = [&](int d, int &i0, int &i1, float &l) {
+        float s = alignCorners ? d * float(size - 1) / float(o - 1)
+                               : std::max((d + 0.5f) / 2 - 0.5f, 0.f);
+        i0 = std::min(int(std::floor(s)), size - 1);
+        i1 = std::min(i0 + 1, size - 1);
+        l = s - i0;
+    };
+    for (int ch = 0; ch < c; ++ch)
+        for (int y = 0; y < o; ++y)
+            for (int x = 0; x < o; ++x) {
+                int y0, y1, x0, x1;
+                float ly, lx;
+                coord(y, y0, y1, ly);
+                coord(x, x0, x1, lx);
+                auto at = [&](int yy, int xx) {
+                    return in[(ch * size + yy) * size + xx];
+                };
+                out[(ch * o + y) * o + x] =
+                    (1 - ly) * ((1 - lx) * at(y0, x0) + lx * at(y0, x1)) +
+                    ly * ((1 - lx) * at(y1, x0) + lx * at(y1, x1));
+            }
+    return out;
+}
+
+static Buf Cat(const Buf &a, const Buf &b) {
+    Buf r(a);
+    r.insert(r.end(), b.begin(), b.end());
+    return r;
+}
+
+static Buf RefForward(const IisptNnNet::TensorMap &t, bool ac, const Buf &in,
+                      int s) {
+    auto conv = [&](const std::string &p, const Buf &x, int size) {
+        Buf r;
+        RefConv(t.at(p + ".weight"), t.at(p + ".bias"), x, size, r);
+        return r;
+    };
+    auto convT = [&](const std::string &p, const Buf &x, int size) {
+        Buf r;
+        RefConvTranspose(t.at(p + ".weight"), t.at(p + ".bias"), x, size, r);
+        return r;
+    };
+    Buf a;
+    a = conv("encoder0.0", in, s); RefLeaky(a);
+    Buf x0 = conv("encoder0.2", a, s); RefLeaky(x0);
+
+    a = conv("encoder1.1", RefMaxPool(x0, s), s / 2); RefLeaky(a);
+    RefBatchNorm(t, "encoder1.3", a, s / 2);
+    Buf x1 = conv("encoder1.4", a, s / 2); RefLeaky(x1);
+
+    a = conv("encoder2.1", RefMaxPool(x1, s / 2), s / 4); RefLeaky(a);
+    RefBatchNorm(t, "encoder2.3", a, s / 4);
+    Buf x2 = conv("encoder2.4", a, s / 4); RefLeaky(x2);
+
+    a = conv("encoder3.1", RefMaxPool(x2, s / 4), s / 8); RefLeaky(a);
+    RefBatchNorm(t, "encoder3.3", a, s / 8);
+    a = conv("encoder3.4", a, s / 8); RefLeaky(a);
+    Buf x3 = RefUpsample(a, s / 8, ac);
+
+    a = convT("decoder0.0", Cat(x3, x2), s / 4); RefLeaky(a);
+    RefBatchNorm(t, "decoder0.2", a, s / 4);
+    a = convT("decoder0.3", a, s / 4); RefLeaky(a);
+    Buf x4 = RefUpsample(a, s / 4, ac);
+
+    a = convT("decoder1.0", Cat(x4, x1), s / 2); RefLeaky(a);
+    RefBatchNorm(t, "decoder1.2", a, s / 2);
+    a = convT("decoder1.3", a, s / 2); RefLeaky(a);
+    Buf x5 = RefUpsample(a, s / 2, ac);
+
+    a = convT("decoder2.0", Cat(x5, x0), s); RefLeaky(a);
+    a = convT("decoder2.2", a, s); RefLeaky(a);
+    a = conv("decoder2.4", a, s);
+    for (float &f : a) f = std::max(f, 0.f);
+    return a;
+}
+
+static void CheckAgainstReference(int K, int size, bool alignCorners) {
+    std::mt19937 rng(K * 31 + size + alignCorners);
+    IisptNnNet::TensorMap tensors = IisptNnNet::random_tensors(K, rng());
+
+    // Go through the binary format, as the renderer does
+    std::stringstream file;
+    IisptNnNet::write_tensors(file, tensors, alignCorners);
+    IisptNnNet net;
+    ASSERT_TRUE(net.load(file));
+    EXPECT_EQ(K, net.get_k());
+    EXPECT_EQ(alignCorners, net.get_align_corners());
+
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    Buf input(7 * size * size);
+    for (float &f : input) f = u(rng);
+
+    Buf expected = RefForward(tensors, alignCorners, input, size);
+    IisptNnSimd levels[] = {IisptNnSimd::Scalar, IisptNnSimd::Sse,
+                            IisptNnSimd::Avx2, IisptNnSimd::Avx512};
+    for (IisptNnSimd level : levels) {
+        if (!IisptNnKernels::supported(level)) continue;
+        Buf output(3 * size * size);
+        net.forward(&input[0], &output[0], size, IisptNnKernels(level));
+
+        for (size_t i = 0; i < output.size(); ++i)
+            EXPECT_NEAR(expected[i], output[i],
+                        1e-4f * std::max(1.f, std::abs(expected[i])))
+                << IisptNnKernels::name(level) << " at " << i;
+    }
+}
+
+TEST(IisptNnNet, MatchesReference) {
+    CheckAgainstReference(2, 8, false);
+    CheckAgainstReference(4, 16, false);
+    CheckAgainstReference(4, 16, true);
+}
+
+// SIMD kernels against the scalar ones, with sizes that exercise the
+// vector tails
+TEST(IisptNnKernels, MatchScalar) {
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    IisptNnKernels scalar(IisptNnSimd::Scalar);
+    IisptNnSimd levels[] = {IisptNnSimd::Sse, IisptNnSimd::Avx2,
+                            IisptNnSimd::Avx512};
+    struct Shape { int cin, cout, ksize, size; };
+    Shape shapes[] = {{7, 8, 3, 32}, {5, 7, 3, 12}, {16, 3, 1, 32},
+                      {9, 6, 3, 1},  {4, 13, 3, 6}, {3, 5, 1, 3}};
+    std::vector<float> scratch;
+    for (IisptNnSimd level : levels) {
+        if (!IisptNnKernels::supported(level)) continue;
+        IisptNnKernels kernels(level);
+        for (const Shape &sh : shapes) {
+            Buf w(sh.cout * sh.cin * sh.ksize * sh.ksize), b(sh.cout);
+            Buf in(sh.cin * sh.size * sh.size);
+            for (float &f : w) f = u(rng);
+            for (float &f : b) f = u(rng);
+            for (float &f : in) f = u(rng);
+            int n = sh.cout * sh.size * sh.size;
+            Buf expected(n), out(n);
+            scalar.conv2d(&w[0], &b[0], sh.cin, sh.cout, sh.ksize, &in[0],
+                          sh.size, sh.size, &expected[0], scratch);
+            kernels.conv2d(&w[0], &b[0], sh.cin, sh.cout, sh.ksize, &in[0],
+                           sh.size, sh.size, &out[0], scratch);
+            for (int i = 0; i < n; ++i)
+                EXPECT_NEAR(expected[i], out[i], 1e-4f)
+                    << IisptNnKernels::name(level) << " conv " << sh.cin
+                    << "x" << sh.cout << " size " << sh.size;
+        }
+
+        for (int size : {2, 6, 16, 32, 34}) {
+            int c = 3;
+            Buf in(c * size * size);
+            for (float &f : in) f = u(rng);
+            Buf expected(c * size * size / 4), out(c * size * size / 4);
+            scalar.max_pool2(&in[0], c, size, size, &expected[0]);
+            kernels.max_pool2(&in[0], c, size, size, &out[0]);
+            EXPECT_EQ(expected, out) << IisptNnKernels::name(level);
+
+            for (bool ac : {false, true}) {
+                Buf up(c * size * size * 4), upExpected(c * size * size * 4);
+                scalar.upsample_bilinear2(&in[0], c, size, size,
+                                          &upExpected[0], ac, scratch);
+                kernels.upsample_bilinear2(&in[0], c, size, size, &up[0], ac,
+                                           scratch);
+                EXPECT_EQ(upExpected, up) << IisptNnKernels::name(level);
+            }
+        }
+    }
+}
+
+TEST(IisptNnNet, RejectsBadFiles) {
+    std::stringstream garbage("not a weights file");
+    IisptNnNet net;
+    EXPECT_FALSE(net.load(garbage));
+
+    // Missing layer
+    std::mt19937 rng(3);
+    IisptNnNet::TensorMap tensors = IisptNnNet::random_tensors(2, rng());
+    tensors.erase("decoder1.2.running_var");
+    std::stringstream file;
+    IisptNnNet::write_tensors(file, tensors, false);
+    EXPECT_FALSE(net.load(file));
+}
+
+// Comparison with the output of PyTorch, written by
+//   python3 ml/export_weights.py <weights> <fixture>
+// Only runs when IISPT_NN_WEIGHTS_PATH and IISPT_NN_FIXTURE_PATH are set.
+TEST(IisptNnNet, MatchesPyTorch) {
+    const char *weightsPath = getenv("IISPT_NN_WEIGHTS_PATH");
+    const char *fixturePath = getenv("IISPT_NN_FIXTURE_PATH");
+    if (!weightsPath || !fixturePath) return;
+
+    std::ifstream weights(weightsPath, std::ios::binary);
+    IisptNnNet net;
+    ASSERT_TRUE(net.load(weights));
+
+    std::ifstream fixture(fixturePath, std::ios::binary);
+    int32_t size;
+    fixture.read((char *)&size, 4);
+    ASSERT_TRUE(fixture.good());
+    Buf input(7 * size * size), expected(3 * size * size);
+    fixture.read((char *)&input[0], input.size() * sizeof(float));
+    fixture.read((char *)&expected[0], expected.size() * sizeof(float));
+    ASSERT_TRUE(fixture.good());
+
+    Buf output(3 * size * size);
+    net.forward(&input[0], &output[0], size);
+    for (size_t i = 0; i < output.size(); ++i)
+        EXPECT_NEAR(expected[i], output[i],
+                    1e-3f * std::max(1.f, std::abs(expected[i])));
+}
+
+// The stub networks used by pbrt_bench_iile
+TEST(IisptNnStub, Outputs) {
+    int size = PbrtOptions.iisptHemiSize;
+    IntensityFilm intensity(size, size);
+    DistanceFilm distance(size, size);
+    NormalFilm normals(size, size);
+    ImageFilm *in = intensity.get_image_film().get();
+    for (int i = 0; i < in->size(); ++i) in->get_data()[i] = 0.01f * i;
+
+    std::shared_ptr<IisptNnBackend> identity = IisptNnStub::create("identity");
+    ASSERT_TRUE(identity != nullptr);
+    int status = 1;
+    std::unique_ptr<IntensityFilm> out =
+        identity->communicate(&intensity, &distance, &normals, status);
+    EXPECT_EQ(0, status);
+    for (int i = 0; i < in->size(); ++i)
+        EXPECT_EQ(in->get_data()[i], out->get_image_film()->get_data()[i]);
+
+    std::shared_ptr<IisptNnBackend> constant = IisptNnStub::create("constant");
+    ASSERT_TRUE(constant != nullptr);
+    out = constant->communicate(&intensity, &distance, &normals, status);
+    EXPECT_EQ(0, status);
+    EXPECT_EQ(0.5f, out->get_image_film()->computeMax());
+    EXPECT_EQ(0.5f, out->get_image_film()->computeMean());
+
+    std::shared_ptr<IisptNnBackend> tiny = IisptNnStub::create("tiny");
+    ASSERT_TRUE(tiny != nullptr);
+    status = 1;
+    out = tiny->communicate(&intensity, &distance, &normals, status);
+    EXPECT_EQ(0, status);
+    // Fixed weights, so the output doesn't change between calls
+    std::unique_ptr<IntensityFilm> again =
+        tiny->communicate(&intensity, &distance, &normals, status);
+    for (int i = 0; i < out->get_image_film()->size(); ++i)
+        EXPECT_EQ(out->get_image_film()->get_data()[i],
+                  again->get_image_film()->get_data()[i]);
+
+    EXPECT_TRUE(IisptNnStub::create("resnet") == nullptr);
+}
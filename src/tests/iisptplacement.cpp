@@ -0,0 +1,120 @@
+#include "tests/gtest/gtest.h"
+#include <set>
+#include <utility>
+#include <vector>
+#include "pbrt.h"
+#include "integrators/iisptplacement.h"
+
+using namespace pbrt;
+
+static IisptScheduleMonitorTask make_task(int x0, int y0, int x1, int y1,
+                                          int tilesize) {
+    IisptScheduleMonitorTask task;
+    task.x0 = x0;
+    task.y0 = y0;
+    task.x1 = x1;
+    task.y1 = y1;
+    task.tilesize = tilesize;
+    task.pass = 1;
+    task.taskNumber = 0;
+    task.cost = 0.0;
+    return task;
+}
+
+// Every pixel interpolates 4 hemisphere points that are actually placed,
+// and that surround it
+static void check_neighbours(const IisptScheduleMonitorTask &task,
+                             IisptPlacement &placement) {
+    std::set<std::pair<int, int>> placed;
+    for (const Point2i &p : placement.get_points()) {
+        EXPECT_TRUE(placed.insert(std::make_pair(p.x, p.y)).second);
+    }
+    for (int y = task.y0; y < task.y1; ++y) {
+        for (int x = task.x0; x < task.x1; ++x) {
+            Point2i neigh[4];
+            int size = placement.neighbours(Point2i(x, y), neigh);
+            EXPECT_GE(size, 1);
+            for (int i = 0; i < 4; ++i) {
+                EXPECT_EQ(1, placed.count(std::make_pair(neigh[i].x, neigh[i].y)));
+            }
+            EXPECT_LE(neigh[0].x, x);
+            EXPECT_LE(neigh[0].y, y);
+            EXPECT_GE(neigh[1].x, x);
+            EXPECT_GE(neigh[1].y, y);
+        }
+    }
+}
+
+// Grid placement matches the old tile iteration: every tilesize pixels,
+// plus the last row and column
+TEST(IisptPlacement, Grid) {
+    IisptScheduleMonitorTask task = make_task(3, 5, 20, 12, 4);
+    IisptPlacement placement(task);
+
+    std::vector<int> xs = {3, 7, 11, 15, 19};
+    std::vector<int> ys = {5, 9, 11};
+    const std::vector<Point2i> &points = placement.get_points();
+    ASSERT_EQ(xs.size() * ys.size(), points.size());
+    int i = 0;
+    for (int y : ys) {
+        for (int x : xs) {
+            EXPECT_EQ(Point2i(x, y), points[i++]);
+        }
+    }
+
+    Point2i neigh[4];
+    EXPECT_EQ(4, placement.neighbours(Point2i(13, 10), neigh));
+    EXPECT_EQ(Point2i(11, 9), neigh[0]);
+    EXPECT_EQ(Point2i(15, 11), neigh[1]);
+    EXPECT_EQ(Point2i(15, 9), neigh[2]);
+    EXPECT_EQ(Point2i(11, 11), neigh[3]);
+
+    check_neighbours(task, placement);
+}
+
+// A depth edge at x = 21 gets small cells, the flat regions get large ones
+TEST(IisptPlacement, Adaptive) {
+    IisptScheduleMonitorTask task = make_task(0, 0, 64, 32, 8);
+    int width = task.x1 - task.x0;
+    int height = task.y1 - task.y0;
+    std::vector<IisptGSample> gbuffer(width * height);
+    int near_object = 0;
+    int far_object = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            IisptGSample &s = gbuffer[y * width + x];
+            s.hit = true;
+            s.n = Normal3f(0, 0, 1);
+            s.depth = x < 21 ? 1.0 : 5.0;
+            s.object = x < 21 ? (void *) &near_object : (void *) &far_object;
+        }
+    }
+    IisptPlacement placement(task, gbuffer);
+    IisptPlacement grid(task);
+
+    int near_edge = 0;
+    int far_from_edge = 0;
+    for (const Point2i &p : placement.get_points()) {
+        if (p.x >= 16 && p.x <= 24) near_edge++;
+        if (p.x >= 40) far_from_edge++;
+    }
+    // Root cells of 16 pixels away from the edge, 4 pixels across it
+    EXPECT_GT(near_edge, 2 * far_from_edge);
+    EXPECT_LT(placement.get_points().size(), grid.get_points().size());
+
+    Point2i neigh[4];
+    EXPECT_EQ(4, placement.neighbours(Point2i(21, 10), neigh));
+    EXPECT_EQ(16, placement.neighbours(Point2i(50, 10), neigh));
+
+    check_neighbours(task, placement);
+}
+
+// No geometry at all, the whole task is covered by root cells
+TEST(IisptPlacement, AdaptiveEmpty) {
+    IisptScheduleMonitorTask task = make_task(10, 10, 45, 27, 6);
+    std::vector<IisptGSample> gbuffer((task.x1 - task.x0) * (task.y1 - task.y0));
+    IisptPlacement placement(task, gbuffer);
+    // Roots start at 10, 22, 34 and 10, 22
+    EXPECT_EQ(4u * 3u, placement.get_points().size());
+    check_neighbours(task, placement);
+}
@@ -0,0 +1,159 @@
+
+#include "tests/gtest/gtest.h"
+#include <algorithm>
+#include <cstdlib>
+#include <set>
+#include <thread>
+#include <vector>
+#include "pbrt.h"
+#include "integrators/iisptschedulemonitor.h"
+
+using namespace pbrt;
+
+// A thread whose queue runs dry steals, splitting tasks, and every pass
+// still covers the film exactly once
+TEST(IisptScheduleMonitor, PassCoverage) {
+    setenv("IISPT_SCHEDULE_RADIUS_START", "4", 1);
+    setenv("IISPT_SCHEDULE_RADIUS_RATIO", "0.5", 1);
+    Bounds2i bounds(Point2i(0, 0), Point2i(130, 90));
+    IisptScheduleMonitor monitor(bounds, 4);
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+    unsetenv("IISPT_SCHEDULE_RADIUS_RATIO");
+
+    // Thread 2 does all the work, the others never ask
+    std::vector<std::vector<int>> covered(3, std::vector<int>(130 * 90, 0));
+    while (true) {
+        IisptScheduleMonitorTask task = monitor.next_task(2);
+        if (task.pass > 2) break;
+        EXPECT_EQ(task.pass == 1 ? 4 : 2, task.tilesize);
+        EXPECT_LT(task.x0, task.x1);
+        EXPECT_LT(task.y0, task.y1);
+        for (int y = task.y0; y < task.y1; ++y)
+            for (int x = task.x0; x < task.x1; ++x)
+                covered[task.pass][y * 130 + x]++;
+    }
+    for (int pass = 1; pass <= 2; ++pass)
+        for (int c : covered[pass]) EXPECT_EQ(1, c);
+}
+
+TEST(IisptScheduleMonitor, ConcurrentTaskNumbers) {
+    setenv("IISPT_SCHEDULE_RADIUS_START", "3", 1);
+    Bounds2i bounds(Point2i(10, 20), Point2i(210, 170));
+    const int nThreads = 6, nTasks = 500;
+    IisptScheduleMonitor monitor(bounds, nThreads);
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+
+    std::vector<std::vector<int>> numbers(nThreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nThreads; ++t)
+        threads.push_back(std::thread([&, t]() {
+            while (true) {
+                IisptScheduleMonitorTask task = monitor.next_task(t);
+                if (task.taskNumber >= nTasks) break;
+                EXPECT_TRUE(Inside(Point2i(task.x0, task.y0), bounds));
+                EXPECT_LE(task.x1, bounds.pMax.x);
+                EXPECT_LE(task.y1, bounds.pMax.y);
+                numbers[t].push_back(task.taskNumber);
+            }
+        }));
+    for (std::thread &t : threads) t.join();
+
+    std::set<int> all;
+    for (const std::vector<int> &n : numbers) all.insert(n.begin(), n.end());
+    EXPECT_EQ(nTasks, (int)all.size());
+    EXPECT_EQ(0, *all.begin());
+    EXPECT_EQ(nTasks - 1, *all.rbegin());
+}
+
+// Every pass of the direct queue covers the film once, and passes come
+// one after the other
+TEST(IisptScheduleMonitor, DirectTiles) {
+    Bounds2i bounds(Point2i(10, 20), Point2i(85, 52));
+    IisptScheduleMonitor monitor(bounds, 2);
+
+    std::vector<std::vector<int>> covered(3, std::vector<int>(75 * 32, 0));
+    IisptScheduleDirectTile tile;
+    int count = 0;
+    int last_pass = 0;
+    while (monitor.next_direct_tile(3, tile)) {
+        EXPECT_EQ(count, tile.number);
+        EXPECT_EQ(3, tile.tiles_per_pass);
+        EXPECT_GE(tile.pass, last_pass);
+        last_pass = tile.pass;
+        for (int y = tile.y0; y < tile.y1; ++y)
+            for (int x = tile.x0; x < tile.x1; ++x)
+                covered[tile.pass][(y - 20) * 75 + (x - 10)]++;
+        ++count;
+    }
+    EXPECT_EQ(9, count);
+    EXPECT_FALSE(monitor.next_direct_tile(3, tile));
+    for (int pass = 0; pass < 3; ++pass)
+        for (int c : covered[pass]) EXPECT_EQ(1, c);
+}
+
+// Tasks from take_task() are costed by the seconds passed to
+// complete_task(), which drive the estimates of the next pass
+TEST(IisptScheduleMonitor, ReportedCost) {
+    setenv("IISPT_SCHEDULE_RADIUS_START", "4", 1);
+    setenv("IISPT_SCHEDULE_RADIUS_RATIO", "0.5", 1);
+    Bounds2i bounds(Point2i(0, 0), Point2i(64, 64));
+    IisptScheduleMonitor monitor(bounds, 1);
+    unsetenv("IISPT_SCHEDULE_RADIUS_START");
+    unsetenv("IISPT_SCHEDULE_RADIUS_RATIO");
+
+    // The left column of the first pass is expensive
+    IisptScheduleMonitorTask task = monitor.take_task(0);
+    int number = 0;
+    while (task.pass == 1) {
+        EXPECT_EQ(number++, task.taskNumber);
+        {
+            IisptScheduleCommit commit (&monitor);
+            monitor.complete_task(task, task.x0 == 0 ? 1.0 : 0.001);
+        }
+        task = monitor.take_task(0);
+    }
+    EXPECT_EQ(4, number);
+
+    // Seconds per pixel on either side of the first pass boundary
+    double left = 0.0, right = 0.0;
+    while (task.pass == 2) {
+        double density =
+            task.cost / ((task.x1 - task.x0) * (task.y1 - task.y0));
+        if (task.x1 <= 40) left = std::max(left, density);
+        if (task.x0 >= 40) right = std::max(right, density);
+        task = monitor.take_task(0);
+    }
+    EXPECT_GT(right, 0.0);
+    EXPECT_GT(left, 100.0 * right);
+}
+
+// A direct pass is reported once all its tiles and those of the passes
+// before it are done, whichever thread finishes last
+TEST(IisptScheduleMonitor, DirectProgress) {
+    Bounds2i bounds(Point2i(10, 20), Point2i(85, 52));
+    IisptScheduleMonitor monitor(bounds, 2);
+
+    std::vector<IisptScheduleDirectTile> tiles(9);
+    for (IisptScheduleDirectTile &tile : tiles)
+        ASSERT_TRUE(monitor.next_direct_tile(3, tile));
+
+    auto complete = [&](int number) {
+        testing::internal::CaptureStdout();
+        {
+            IisptScheduleCommit commit (&monitor);
+            monitor.complete_direct_tile(tiles[number]);
+        }
+        return testing::internal::GetCapturedStdout();
+    };
+    // The last tile of a pass, and all of the next pass
+    EXPECT_EQ("", complete(2));
+    EXPECT_EQ("", complete(4));
+    EXPECT_EQ("", complete(3));
+    EXPECT_EQ("", complete(5));
+    EXPECT_EQ("", complete(0));
+    // Completes the first two passes at once
+    EXPECT_EQ("#DIRECTPROGRESS!0.666667\n", complete(1));
+    EXPECT_EQ("", complete(8));
+    EXPECT_EQ("", complete(6));
+    EXPECT_EQ("#DIRECTPROGRESS!1\n", complete(7));
+}
@@ -0,0 +1,55 @@
+#include "tests/gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include "pbrt.h"
+#include "integrators/iispttrace.h"
+
+using namespace pbrt;
+
+static int count_occurrences(const std::string &s, const std::string &what) {
+    int n = 0;
+    for (size_t i = s.find(what); i != std::string::npos;
+         i = s.find(what, i + 1))
+        ++n;
+    return n;
+}
+
+// Stages add their duration to the counter and show up in the trace of
+// the thread that ran them; per-pixel stages without a name are not traced
+TEST(IisptTrace, Stages) {
+    char path[] = "/tmp/iispttraceXXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    // The file name is read when the trace is first used
+    setenv("IISPT_TRACE_FILE", path, 1);
+    IisptTrace &trace = IisptTrace::getInstance();
+    ASSERT_TRUE(trace.is_enabled());
+
+    int64_t ns = 0;
+    std::thread worker([&ns, &trace]() {
+        trace.set_thread_name("Worker");
+        {
+            IisptStage stage(Prof::IILENNWait, ns, "NN wait");
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        IisptStage stage(Prof::IILESampleHemisphere, ns);
+    });
+    worker.join();
+    EXPECT_GE(ns, 2000000);
+
+    trace.write();
+    std::ifstream in(path);
+    std::string json((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    EXPECT_EQ(0u, json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["));
+    EXPECT_EQ(1, count_occurrences(json, "\"args\":{\"name\":\"Worker\"}"));
+    EXPECT_EQ(1, count_occurrences(json, "\"ph\":\"X\""));
+    EXPECT_EQ(1, count_occurrences(json, "\"name\":\"NN wait\""));
+    remove(path);
+}
@@ -0,0 +1,91 @@
+
+#include "tests/gtest/gtest.h"
+#include <cmath>
+#include <cstdint>
+#include "pbrt.h"
+#include "film/imagefilm.h"
+#include "film/intensityfilm.h"
+
+using namespace pbrt;
+
+TEST(ImageFilm, PlanarLayout) {
+    int w = 5, h = 3;
+    ImageFilm film(w, h, 3);
+    EXPECT_EQ(0, ((uintptr_t)film.get_data()) % PBRT_L1_CACHE_LINE_SIZE);
+    EXPECT_EQ(w * h * 3, film.size());
+
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+            film.set(x, y, PfmItem(x + 10 * y, 100 + x, -y));
+
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) {
+            int idx = y * w + x;
+            EXPECT_EQ(x + 10 * y, film.get_plane(0)[idx]);
+            EXPECT_EQ(100 + x, film.get_plane(1)[idx]);
+            EXPECT_EQ(-y, film.get_plane(2)[idx]);
+            PfmItem item = film.get(x, y);
+            EXPECT_EQ(x + 10 * y, item.r);
+            EXPECT_EQ(100 + x, item.g);
+            EXPECT_EQ(-y, item.b);
+        }
+
+    // Round trip through a float array and a copy
+    std::vector<float> floats(film.size());
+    film.copy_to_float_array(&floats[0]);
+    ImageFilm other(w, h, 3);
+    other.populate_from_float_array(&floats[0]);
+    ImageFilm copy(other);
+    for (int i = 0; i < film.size(); ++i)
+        EXPECT_EQ(film.get_data()[i], copy.get_data()[i]);
+
+    // Camera coordinates flip Y
+    IntensityFilm intensity(w, h);
+    intensity.set_camera_coord(1, 0, 1.f, 2.f, 3.f);
+    EXPECT_EQ(2.f, intensity.get_image_coord(1, h - 1).g);
+}
+
+TEST(ImageFilm, Operations) {
+    int w = 7, h = 6;
+    ImageFilm film(w, h, 3);
+    ImageFilm grey(w, h, 1);
+    double sum[3] = {0, 0, 0};
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) {
+            float r = 0.5f * x, g = 0.25f * y, b = x * y - 3.f;
+            film.set(x, y, PfmItem(r, g, b));
+            grey.set(x, y, PfmItem(r - g));
+            sum[0] += r;
+            sum[1] += g;
+            sum[2] += b;
+        }
+
+    float rm, gm, bm;
+    film.computeMeanChannels(rm, gm, bm);
+    EXPECT_FLOAT_EQ(sum[0] / (w * h), rm);
+    EXPECT_FLOAT_EQ(sum[1] / (w * h), gm);
+    EXPECT_FLOAT_EQ(sum[2] / (w * h), bm);
+    EXPECT_FLOAT_EQ((sum[0] + sum[1] + sum[2]) / (3 * w * h),
+                    film.computeMean());
+    EXPECT_FLOAT_EQ((w - 1) * (h - 1) - 3.f, film.computeMax());
+
+    film.multiplyChannels(2.f, 3.f, 4.f);
+    EXPECT_FLOAT_EQ(2.f * 0.5f * 3, film.get(3, 2).r);
+    EXPECT_FLOAT_EQ(3.f * 0.25f * 2, film.get(3, 2).g);
+    EXPECT_FLOAT_EQ(4.f * 3.f, film.get(3, 2).b);
+
+    film.positiveLog();
+    EXPECT_FLOAT_EQ(std::log(1.f + 3.f), film.get(3, 2).r);
+    EXPECT_FLOAT_EQ(0.f, film.get(0, 0).b);
+    film.positiveLogInverse();
+    EXPECT_NEAR(3.f, film.get(3, 2).r, 1e-5f);
+
+    grey.normalize(-1.f, 1.f);
+    grey.add(0.5f);
+    grey.multiply(2.f);
+    for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x) {
+            float v = std::min(1.f, std::max(-1.f, 0.5f * x - 0.25f * y));
+            EXPECT_FLOAT_EQ(2.f * (v + 0.5f), grey.get(x, y).r);
+        }
+}
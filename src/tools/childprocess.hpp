@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <vector>
 
 namespace pbrt {
 
@@ -21,9 +24,11 @@ public: // ====================================================================
 
     // Constructor ------------------------------------------------------------
     // The array's last element is NULL
+    // <inherit_fds> are kept open in the child even if they are close on exec
     ChildProcess(
             std::string process_path,
-            char *const argv[]
+            char *const argv[],
+            std::vector<int> inherit_fds = std::vector<int>()
             )
     {
         pipe(stdout_pipe);
@@ -43,6 +48,11 @@ public: // ====================================================================
             // Child receives read end of stdin pipe
             dup2(stdin_pipe[0], STDIN_FILENO);
 
+            for (int fd : inherit_fds) {
+                int flags = fcntl(fd, F_GETFD);
+                fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+            }
+
             execvp(process_path.c_str(), argv);
 
             std::cerr << "execvp() failed" << std::endl;
@@ -75,6 +85,14 @@ public: // ====================================================================
         write(stdin_pipe[1], buffer, 1);
     }
 
+    // ------------------------------------------------------------------------
+    // False once the child has exited
+    bool is_alive()
+    {
+        int wstatus;
+        return waitpid(child_pid, &wstatus, WNOHANG) == 0;
+    }
+
     // ------------------------------------------------------------------------
     void writeEOF()
     {
@@ -129,9 +147,28 @@ public: // ====================================================================
 
     // ------------------------------------------------------------------------
     // Write N float32
+    // Large batches may not fit in the pipe buffer in one go, so keep
+    // writing until everything has been accepted
     void write_n_float32(float* val, int n) {
-        int bytes = n * 4;
-        write(stdin_pipe[1], val, bytes);
+        int bytesRemaining = n * 4;
+        char* barray = (char*) val;
+        int currentPosition = 0;
+
+        while (bytesRemaining > 0) {
+            ssize_t bytesWritten = write(stdin_pipe[1], &barray[currentPosition], bytesRemaining);
+            if (bytesWritten <= 0) {
+                std::cerr << "childprocess.hpp: write failed after ["<< currentPosition <<"] bytes\n";
+                return;
+            }
+            bytesRemaining -= bytesWritten;
+            currentPosition += bytesWritten;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // Write int32
+    void write_int32(int32_t val) {
+        write(stdin_pipe[1], &val, 4);
     }
 
 };
@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <chrono>
+#include "pbrt.h"
 
 namespace pbrt {
 namespace iile {
@@ -16,7 +17,11 @@ static unsigned cpusCountHalf() {
     return std::max(1u, count / 2);
 }
 
+// Render threads of the IILE passes, --nthreads when it's given
 static unsigned cpusCountFull() {
+    if (PbrtOptions.nThreads > 0) {
+        return PbrtOptions.nThreads;
+    }
     unsigned count = std::thread::hardware_concurrency();
     return std::max(1u, count);
 }
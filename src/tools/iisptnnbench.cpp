@@ -0,0 +1,157 @@
+// iisptnnbench.cpp
+// Microbenchmark of the native IISPTNet kernels: every instruction set
+// supported by the CPU is compared against the scalar reference, layer by
+// layer and for the full forward pass.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "integrators/iisptnnkernels.h"
+#include "integrators/iisptnnnative.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "iisptnnbench: %s\n\n", msg);
+    fprintf(stderr, R"(usage: iisptnnbench [options]
+Options:
+  --size=<pixels>      Hemisphere size, a multiple of 8. Default: 32
+  --k=<channels>       IISPTNet base channel count. Default: 64
+  --iterations=<n>     Timed iterations per kernel. Default: 20
+)");
+    exit(1);
+}
+
+// Average milliseconds per call of <f>, after one warm up call
+static double timeMs(int iterations, const std::function<void()> &f) {
+    f();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) f();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+static float maxAbsDiff(const std::vector<float> &a,
+                        const std::vector<float> &b) {
+    float m = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+        m = std::max(m, std::abs(a[i] - b[i]));
+    return m;
+}
+
+static std::vector<IisptNnSimd> supportedLevels() {
+    std::vector<IisptNnSimd> levels;
+    for (IisptNnSimd level : {IisptNnSimd::Scalar, IisptNnSimd::Sse,
+                              IisptNnSimd::Avx2, IisptNnSimd::Avx512})
+        if (IisptNnKernels::supported(level)) levels.push_back(level);
+    return levels;
+}
+
+// Runs <run> for every level, prints time, speedup over scalar and the
+// largest deviation from the scalar output
+static void benchmark(
+    const char *label, int iterations, int outSize,
+    const std::function<void(const IisptNnKernels &, float *)> &run) {
+    std::vector<float> reference(outSize), out(outSize);
+    double scalarMs = 0;
+    printf("%-28s", label);
+    for (IisptNnSimd level : supportedLevels()) {
+        IisptNnKernels kernels(level);
+        float *dst = level == IisptNnSimd::Scalar ? &reference[0] : &out[0];
+        double ms = timeMs(iterations, [&]() { run(kernels, dst); });
+        if (level == IisptNnSimd::Scalar) {
+            scalarMs = ms;
+            printf(" %s %8.3fms", IisptNnKernels::name(level).c_str(), ms);
+        } else {
+            printf(" | %s %8.3fms x%5.2f diff %.1e",
+                   IisptNnKernels::name(level).c_str(), ms, scalarMs / ms,
+                   maxAbsDiff(reference, out));
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int size = 32;
+    int k = 64;
+    int iterations = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--size=", 7))
+            size = atoi(&argv[i][7]);
+        else if (!strncmp(argv[i], "--k=", 4))
+            k = atoi(&argv[i][4]);
+        else if (!strncmp(argv[i], "--iterations=", 13))
+            iterations = atoi(&argv[i][13]);
+        else
+            usage("unknown option");
+    }
+    if (size < 8 || size % 8 != 0) usage("size must be a multiple of 8");
+    if (k < 1 || iterations < 1) usage("k and iterations must be positive");
+
+    printf("IISPTNet kernels, size %d, K %d, best level %s\n", size, k,
+           IisptNnKernels::name(IisptNnKernels::get().get_level()).c_str());
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    std::vector<float> scratch;
+
+    // Convolutions with the shapes of the network layers
+    struct ConvShape {
+        const char *label;
+        int cin, cout, ksize, size;
+    };
+    ConvShape shapes[] = {
+        {"conv encoder0 7->K", 7, k, 3, size},
+        {"conv encoder0 K->K", k, k, 3, size},
+        {"conv encoder1 2K->2K", 2 * k, 2 * k, 3, size / 2},
+        {"conv encoder2 4K->4K", 4 * k, 4 * k, 3, size / 4},
+        {"conv encoder3 4K->8K", 4 * k, 8 * k, 3, size / 8},
+        {"convT decoder0 8K->4K", 8 * k, 4 * k, 3, size / 4},
+        {"convT decoder1 4K->2K", 4 * k, 2 * k, 3, size / 2},
+        {"convT decoder2 2K->K", 2 * k, k, 3, size},
+        {"conv decoder2 1x1 K->3", k, 3, 1, size},
+    };
+    for (const ConvShape &s : shapes) {
+        std::vector<float> w(s.cout * s.cin * s.ksize * s.ksize), b(s.cout);
+        std::vector<float> in(s.cin * s.size * s.size);
+        for (float &f : w) f = u(rng) / std::sqrt(float(s.cin * 9));
+        for (float &f : b) f = u(rng);
+        for (float &f : in) f = u(rng);
+        benchmark(s.label, iterations, s.cout * s.size * s.size,
+                  [&](const IisptNnKernels &kernels, float *out) {
+                      kernels.conv2d(&w[0], &b[0], s.cin, s.cout, s.ksize,
+                                     &in[0], s.size, s.size, out, scratch);
+                  });
+    }
+
+    std::vector<float> planes(k * size * size);
+    for (float &f : planes) f = u(rng);
+    benchmark("maxpool K", iterations, k * size * size / 4,
+              [&](const IisptNnKernels &kernels, float *out) {
+                  kernels.max_pool2(&planes[0], k, size, size, out);
+              });
+    benchmark("upsample K", iterations, k * size * size,
+              [&](const IisptNnKernels &kernels, float *out) {
+                  kernels.upsample_bilinear2(&planes[0], k, size / 2, size / 2,
+                                             out, false, scratch);
+              });
+
+    // Full network
+    IisptNnNet net;
+    if (!net.load(IisptNnNet::random_tensors(k, 2), false)) return 1;
+    std::vector<float> input(7 * size * size);
+    for (float &f : input) f = u(rng);
+    benchmark("forward", std::max(1, iterations / 4), 3 * size * size,
+              [&](const IisptNnKernels &kernels, float *out) {
+                  net.forward(&input[0], out, size, kernels);
+              });
+    return 0;
+}
@@ -0,0 +1,165 @@
+// iisptrenderbench.cpp
+// Hemisphere render throughput of IISPTdIntegrator: RenderView through the
+// camera film against the RenderHemisphere path used by the indirect pass,
+// on hemispheres placed on random visible points of a scene.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "parser.h"
+#include "rng.h"
+#include "scene.h"
+#include "cameras/hemispheric.h"
+#include "integrators/iispt_d.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "iisptrenderbench: %s\n\n", msg);
+    fprintf(stderr, R"(usage: iisptrenderbench [options] <scene.pbrt>
+Options:
+  --hemispheres=<n>    Hemispheres rendered by each path. Default: 500
+  --size=<pixels>      Hemisphere size. Default: 32
+  --seed=<n>           Seed for the hemisphere positions. Default: 1
+)");
+    exit(1);
+}
+
+static int hemispheres = 500;
+static int seed = 1;
+
+// Hemisphere origins on random points seen by the scene camera, facing
+// away from the surface
+static std::vector<Ray> place_hemispheres(const Scene &scene,
+                                          const Camera &camera) {
+    RNG rng(seed);
+    Bounds2i bounds = camera.film->croppedPixelBounds;
+    Vector2i extent = bounds.Diagonal();
+    std::vector<Ray> rays;
+    for (int attempt = 0;
+         attempt < 50 * hemispheres && (int)rays.size() < hemispheres;
+         ++attempt) {
+        CameraSample sample;
+        sample.pFilm = Point2f(bounds.pMin.x + rng.UniformFloat() * extent.x,
+                               bounds.pMin.y + rng.UniformFloat() * extent.y);
+        sample.pLens = Point2f(0.5, 0.5);
+        sample.time = 0;
+        Ray ray;
+        if (camera.GenerateRay(sample, &ray) <= 0) continue;
+        SurfaceInteraction isect;
+        if (!scene.Intersect(ray, &isect)) continue;
+        Normal3f n = Faceforward(isect.n, -ray.d);
+        rays.push_back(isect.SpawnRay(Vector3f(n)));
+    }
+    return rays;
+}
+
+static std::vector<std::unique_ptr<HemisphericCamera>> make_cameras(
+    const std::vector<Ray> &rays, const Medium *medium) {
+    std::vector<std::unique_ptr<HemisphericCamera>> cameras;
+    for (const Ray &r : rays)
+        cameras.emplace_back(CreateHemisphericCamera(
+            PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize, medium, r.o,
+            r.d, std::string("/tmp/null")));
+    return cameras;
+}
+
+// Renders every camera with <render>, prints hemispheres per second and
+// the average intensity of the results
+static double benchmark(
+    const char *label, const Scene &scene,
+    std::vector<std::unique_ptr<HemisphericCamera>> &cameras,
+    const std::function<std::unique_ptr<IntensityFilm>(Camera *)> &render) {
+    double intensity = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto &c : cameras) {
+        std::unique_ptr<IntensityFilm> film = render(c.get());
+        const ImageFilm *image = film->get_image_film().get();
+        for (int i = 0; i < image->size(); ++i)
+            intensity += image->get_data()[i];
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double rate = cameras.size() / elapsed.count();
+    int pixels = PbrtOptions.iisptHemiSize * PbrtOptions.iisptHemiSize;
+    printf("%-18s %6d hemispheres %8.3fs %10.1f hemispheres/s mean %.4f\n",
+           label, (int)cameras.size(), elapsed.count(), rate,
+           intensity / (3.0 * pixels * cameras.size()));
+    return rate;
+}
+
+static void run(const Scene &scene, std::shared_ptr<const Camera> camera) {
+    std::vector<Ray> rays = place_hemispheres(scene, *camera);
+    if (rays.empty()) {
+        fprintf(stderr, "iisptrenderbench: the camera sees no geometry\n");
+        exit(1);
+    }
+
+    // The integrators only use the camera for its sampler bounds
+    std::shared_ptr<Camera> dcamera(CreateHemisphericCamera(
+        PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize, camera->medium,
+        rays[0].o, rays[0].d, std::string("/tmp/null")));
+    std::shared_ptr<IISPTdIntegrator> film_integrator =
+        CreateIISPTdIntegrator(dcamera, 243);
+    std::shared_ptr<IISPTdIntegrator> direct_integrator =
+        CreateIISPTdIntegrator(dcamera, 243);
+    film_integrator->Preprocess(scene);
+    direct_integrator->Preprocess(scene);
+
+    // Cameras are created up front, only the render is timed
+    std::vector<std::unique_ptr<HemisphericCamera>> film_cameras =
+        make_cameras(rays, camera->medium);
+    std::vector<std::unique_ptr<HemisphericCamera>> direct_cameras =
+        make_cameras(rays, camera->medium);
+
+    printf("%d hemispheres of %dx%d\n", (int)rays.size(),
+           PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize);
+    double film_rate = benchmark(
+        "RenderView", scene, film_cameras, [&](Camera *c) {
+            film_integrator->RenderView(scene, c);
+            return film_integrator->get_intensity_film(c);
+        });
+    double direct_rate = benchmark(
+        "RenderHemisphere", scene, direct_cameras, [&](Camera *c) {
+            return direct_integrator->RenderHemisphere(scene, c);
+        });
+    printf("speedup x%.2f\n", direct_rate / film_rate);
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    const char *filename = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--hemispheres=", 14))
+            hemispheres = atoi(&argv[i][14]);
+        else if (!strncmp(argv[i], "--size=", 7))
+            options.iisptHemiSize = atoi(&argv[i][7]);
+        else if (!strncmp(argv[i], "--seed=", 7))
+            seed = atoi(&argv[i][7]);
+        else if (argv[i][0] == '-')
+            usage("unknown option");
+        else if (filename)
+            usage("only one scene file");
+        else
+            filename = argv[i];
+    }
+    if (!filename) usage("no scene file");
+    if (hemispheres < 1 || options.iisptHemiSize < 1)
+        usage("hemispheres and size must be positive");
+
+    pbrtInit(options);
+    pbrtSetWorldEndCallback(run);
+    ParseFile(filename);
+    pbrtCleanup();
+    return 0;
+}
@@ -10,17 +10,50 @@ void NnConnectorManager::start(int noThreads)
         std::raise(SIGKILL);
     }
 
-    for (int i = 0; i < noThreads; i++) {
-        std::cerr << "nnconnectormanager.cpp: Starting NN connector " << i << std::endl;
-        nnConnectors.push_back(
-                    std::shared_ptr<IisptNnConnector>(
-                        new IisptNnConnector()
-                        )
+    if (PbrtOptions.iileNnBackend == "service") {
+        std::cerr << "nnconnectormanager.cpp: Starting shared NN service for " << noThreads << " threads" << std::endl;
+        std::shared_ptr<IisptNnBackend> service (
+                    new IisptNnService(noThreads)
                     );
+        for (int i = 0; i < noThreads; i++) {
+            nnConnectors.push_back(service);
+        }
+    } else if (PbrtOptions.iileNnBackend == "native") {
+        std::cerr << "nnconnectormanager.cpp: Starting native NN for " << noThreads << " threads" << std::endl;
+        std::shared_ptr<IisptNnBackend> native (
+                    new IisptNnNative()
+                    );
+        for (int i = 0; i < noThreads; i++) {
+            nnConnectors.push_back(native);
+        }
+    } else if (PbrtOptions.iileNnBackend == "stub") {
+        char* stub_env = std::getenv("IISPT_NN_STUB");
+        std::string stub_name = stub_env == NULL ? std::string("identity") : std::string(stub_env);
+        std::cerr << "nnconnectormanager.cpp: Starting " << stub_name << " stub NN for " << noThreads << " threads" << std::endl;
+        std::shared_ptr<IisptNnBackend> stub = IisptNnStub::create(stub_name);
+        if (!stub) {
+            std::cerr << "nnconnectormanager.cpp: Unknown stub NN ["<< stub_name <<"]\n";
+            std::raise(SIGKILL);
+        }
+        for (int i = 0; i < noThreads; i++) {
+            nnConnectors.push_back(stub);
+        }
+    } else if (PbrtOptions.iileNnBackend == "pipe") {
+        for (int i = 0; i < noThreads; i++) {
+            std::cerr << "nnconnectormanager.cpp: Starting NN connector " << i << std::endl;
+            nnConnectors.push_back(
+                        std::shared_ptr<IisptNnBackend>(
+                            new IisptNnConnector()
+                            )
+                        );
+        }
+    } else {
+        std::cerr << "nnconnectormanager.cpp: Unknown NN backend ["<< PbrtOptions.iileNnBackend <<"]\n";
+        std::raise(SIGKILL);
     }
 }
 
-std::shared_ptr<IisptNnConnector> NnConnectorManager::get(int threadNumber)
+std::shared_ptr<IisptNnBackend> NnConnectorManager::get(int threadNumber)
 {
     if (threadNumber >= nnConnectors.size()) {
         std::cerr << "nnconnectormanager.cpp: Requested connector number ["<< threadNumber <<"] but only ["<< nnConnectors.size() <<"] available\n";
@@ -33,6 +66,7 @@ std::shared_ptr<IisptNnConnector> NnConnectorManager::get(int threadNumber)
 void NnConnectorManager::stopAll()
 {
     std::cerr << "nnconnectormanager.cpp: Stopping all python processes...\n";
+    // sendEOF() is idempotent for the shared service
     for (int i = 0; i < nnConnectors.size(); i++) {
         nnConnectors[i]->sendEOF();
     }
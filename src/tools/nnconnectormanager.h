@@ -3,9 +3,14 @@
 
 #include <iostream>
 #include <csignal>
+#include <cstdlib>
 #include <vector>
 #include <memory>
+#include "integrators/iisptnnbackend.h"
 #include "integrators/iisptnnconnector.h"
+#include "integrators/iisptnnnative.h"
+#include "integrators/iisptnnservice.h"
+#include "integrators/iisptnnstub.h"
 
 namespace pbrt {
 namespace iile {
@@ -13,7 +18,9 @@ namespace iile {
 class NnConnectorManager
 {
 private:
-    std::vector<std::shared_ptr<IisptNnConnector>> nnConnectors;
+    // One entry per render thread. With the service and native backends all entries
+    // point to the same shared object
+    std::vector<std::shared_ptr<IisptNnBackend>> nnConnectors;
 
     NnConnectorManager()
     {
@@ -32,7 +39,7 @@ public:
 
     void start(int noThreads);
 
-    std::shared_ptr<IisptNnConnector> get(int threadNumber);
+    std::shared_ptr<IisptNnBackend> get(int threadNumber);
 
     void stopAll();
 };
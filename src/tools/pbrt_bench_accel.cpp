@@ -0,0 +1,303 @@
+// pbrt_bench_accel.cpp
+// Ray throughput of BVHAccel with binary, 4-wide and 8-wide nodes, with and
+// without SIMD box tests. The scene is loaded once per configuration and
+// traced single threaded with the same rays: camera rays, and the
+// incoherent rays that IILE hemispheres shoot from the visible points, as
+// closest hit and as occlusion queries. Camera rays in raster order are also
+// traced one at a time and as packets. The results are written as JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "paramset.h"
+#include "parser.h"
+#include "rng.h"
+#include "sampling.h"
+#include "scene.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "pbrt_bench_accel: %s\n\n", msg);
+    fprintf(stderr, R"(usage: pbrt_bench_accel [options] <scene.pbrt>
+Options:
+  --widths=<list>      Comma separated BVH widths among 2, 4 and 8. Wide
+                       trees run with and without SIMD. Default: 2,4,8
+  --split=<method>     BVH split method: sah, hlbvh, middle or equal.
+                       Default: sah
+  --rays=<n>           Rays of each kind. Default: 200000
+  --repeat=<n>         Times each kind of ray is traced. Default: 5
+  --compact=<0|1>      Keep triangle meshes as TriangleMeshPrimitives
+                       rather than a GeometricPrimitive per triangle.
+                       Default: 1
+  --out=<file.json>    Where the results go. Default: pbrt_bench_accel.json
+)");
+    exit(1);
+}
+
+struct Config {
+    int width;
+    bool simd;
+};
+
+static std::string sceneFile;
+static std::string splitMethod = "sah";
+static int nRays = 200000;
+static int repeat = 5;
+static bool compact = true;
+static std::string outFile = "pbrt_bench_accel.json";
+static std::ostringstream runsJson;
+static int runCount = 0;
+static Config current;
+static std::chrono::steady_clock::time_point loadStart;
+// Rays/s of the binary tree, for the speedups
+static const int nKinds = 5;
+static double baseline[nKinds];
+
+// Primary rays through random film positions, and rays leaving the points
+// they hit in cosine distributed directions, like hemisphere pixels do
+static void make_rays(const Scene &scene, const Camera &camera,
+                      std::vector<Ray> &cameraRays,
+                      std::vector<Ray> &hemisphereRays) {
+    RNG rng(1);
+    Bounds2i bounds = camera.film->croppedPixelBounds;
+    Vector2i extent = bounds.Diagonal();
+    for (int attempt = 0;
+         attempt < 50 * nRays && (int)hemisphereRays.size() < nRays;
+         ++attempt) {
+        CameraSample sample;
+        sample.pFilm = Point2f(bounds.pMin.x + rng.UniformFloat() * extent.x,
+                               bounds.pMin.y + rng.UniformFloat() * extent.y);
+        sample.pLens = Point2f(rng.UniformFloat(), rng.UniformFloat());
+        sample.time = 0;
+        Ray ray;
+        if (camera.GenerateRay(sample, &ray) <= 0) continue;
+        if ((int)cameraRays.size() < nRays) cameraRays.push_back(ray);
+        SurfaceInteraction isect;
+        if (!scene.Intersect(ray, &isect)) continue;
+        Normal3f n = Faceforward(isect.n, -ray.d);
+        Vector3f s, t;
+        CoordinateSystem(Vector3f(n), &s, &t);
+        Vector3f w = CosineSampleHemisphere(
+            Point2f(rng.UniformFloat(), rng.UniformFloat()));
+        hemisphereRays.push_back(
+            isect.SpawnRay(w.x * s + w.y * t + w.z * Vector3f(n)));
+    }
+}
+
+// One ray through each pixel of the film, tile by tile and in rows within
+// the tiles, like the integrators generate them
+static void make_raster_rays(const Camera &camera, std::vector<Ray> &rays) {
+    const int tileSize = 16;
+    RNG rng(2);
+    Bounds2i bounds = camera.film->croppedPixelBounds;
+    for (int ty = bounds.pMin.y; ty < bounds.pMax.y; ty += tileSize)
+        for (int tx = bounds.pMin.x; tx < bounds.pMax.x; tx += tileSize)
+            for (int y = ty; y < std::min(ty + tileSize, bounds.pMax.y); ++y)
+                for (int x = tx; x < std::min(tx + tileSize, bounds.pMax.x);
+                     ++x) {
+                    if ((int)rays.size() == nRays) return;
+                    CameraSample sample;
+                    sample.pFilm = Point2f(x + rng.UniformFloat(),
+                                           y + rng.UniformFloat());
+                    sample.pLens =
+                        Point2f(rng.UniformFloat(), rng.UniformFloat());
+                    sample.time = 0;
+                    Ray ray;
+                    if (camera.GenerateRay(sample, &ray) > 0)
+                        rays.push_back(ray);
+                }
+}
+
+// Traces <rays> <repeat> times, returns rays per second
+static double trace(const std::vector<Ray> &rays,
+                    const std::function<bool(Ray &)> &query, int *hits) {
+    *hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i)
+        for (const Ray &r : rays) {
+            Ray ray = r;
+            if (query(ray) && i == 0) ++*hits;
+        }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return repeat * rays.size() / elapsed.count();
+}
+
+// Same as trace(), with Scene::IntersectN() on a tile of rays at a time
+static double trace_packets(const Scene &scene, const std::vector<Ray> &rays,
+                            int *hits) {
+    const int tileRays = 256;
+    std::vector<Ray> stream(tileRays);
+    std::vector<SurfaceInteraction> isects(tileRays);
+    std::unique_ptr<bool[]> hit(new bool[tileRays]);
+    *hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i)
+        for (size_t first = 0; first < rays.size(); first += tileRays) {
+            int n = std::min<size_t>(tileRays, rays.size() - first);
+            std::copy(&rays[first], &rays[first] + n, &stream[0]);
+            scene.IntersectN(n, &stream[0], &isects[0], hit.get());
+            if (i == 0)
+                for (int j = 0; j < n; ++j) *hits += hit[j];
+        }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return repeat * rays.size() / elapsed.count();
+}
+
+static void run(const Scene &scene, std::shared_ptr<const Camera> camera) {
+    std::chrono::duration<double> load =
+        std::chrono::steady_clock::now() - loadStart;
+    std::vector<Ray> cameraRays, hemisphereRays, rasterRays;
+    make_rays(scene, *camera, cameraRays, hemisphereRays);
+    make_raster_rays(*camera, rasterRays);
+    if (hemisphereRays.empty()) {
+        fprintf(stderr, "pbrt_bench_accel: the camera sees no geometry\n");
+        exit(1);
+    }
+
+    const char *kinds[nKinds] = {"camera", "hemisphere", "occlusion",
+                                 "raster", "raster-packets"};
+    const std::vector<Ray> *rays[nKinds] = {&cameraRays, &hemisphereRays,
+                                            &hemisphereRays, &rasterRays,
+                                            &rasterRays};
+    std::function<bool(Ray &)> queries[nKinds - 1] = {
+        [&](Ray &r) {
+            SurfaceInteraction isect;
+            return scene.Intersect(r, &isect);
+        },
+        [&](Ray &r) {
+            SurfaceInteraction isect;
+            return scene.Intersect(r, &isect);
+        },
+        [&](Ray &r) { return scene.IntersectP(r); },
+        [&](Ray &r) {
+            SurfaceInteraction isect;
+            return scene.Intersect(r, &isect);
+        }};
+
+    std::string label = "bvh" + std::to_string(current.width) +
+                        (current.width > 2 && !current.simd ? "-scalar" : "");
+    runsJson << (runCount++ ? ",\n" : "\n") << "    {\"accelerator\": \""
+             << label << "\", \"width\": " << current.width
+             << ", \"simd\": " << (current.simd ? "true" : "false")
+             << ", \"load_seconds\": " << load.count();
+    for (int k = 0; k < nKinds; ++k) {
+        int hits;
+        double rate = k < nKinds - 1 ? trace(*rays[k], queries[k], &hits)
+                                     : trace_packets(scene, *rays[k], &hits);
+        if (current.width == 2) baseline[k] = rate;
+        fprintf(stderr, "%-12s %-14s %8d rays %12.0f rays/s", label.c_str(),
+                kinds[k], (int)rays[k]->size(), rate);
+        if (baseline[k] > 0)
+            fprintf(stderr, "  x%.2f", rate / baseline[k]);
+        fprintf(stderr, "\n");
+        runsJson << ",\n     \"" << kinds[k]
+                 << "\": {\"rays\": " << rays[k]->size()
+                 << ", \"hits\": " << hits
+                 << ", \"rays_per_second\": " << rate;
+        if (baseline[k] > 0)
+            runsJson << ", \"speedup\": " << rate / baseline[k];
+        runsJson << "}";
+    }
+    runsJson << "}";
+}
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    options.quiet = true;
+    options.nThreads = 1;
+    std::vector<int> widths = {2, 4, 8};
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--widths=", 9)) {
+            widths.clear();
+            for (const std::string &w : split(&argv[i][9]))
+                widths.push_back(atoi(w.c_str()));
+        } else if (!strncmp(argv[i], "--split=", 8))
+            splitMethod = &argv[i][8];
+        else if (!strncmp(argv[i], "--rays=", 7))
+            nRays = atoi(&argv[i][7]);
+        else if (!strncmp(argv[i], "--repeat=", 9))
+            repeat = atoi(&argv[i][9]);
+        else if (!strncmp(argv[i], "--compact=", 10))
+            compact = atoi(&argv[i][10]) != 0;
+        else if (!strncmp(argv[i], "--out=", 6))
+            outFile = &argv[i][6];
+        else if (argv[i][0] == '-')
+            usage("unknown option");
+        else if (!sceneFile.empty())
+            usage("only one scene file");
+        else
+            sceneFile = argv[i];
+    }
+    if (sceneFile.empty()) usage("no scene file");
+    if (nRays < 1 || repeat < 1) usage("rays and repeat must be positive");
+    if (widths.empty()) usage("no widths");
+
+    std::vector<Config> configs;
+    for (int w : widths) {
+        if (w != 2 && w != 4 && w != 8) usage("widths must be 2, 4 or 8");
+        configs.push_back({w, true});
+        if (w > 2) configs.push_back({w, false});
+    }
+
+    pbrtInit(options);
+    pbrtSetWorldEndCallback(run);
+    for (const Config &config : configs) {
+        // Set before the scene is parsed. An Accelerator directive in the
+        // scene file replaces it
+        ParamSet params;
+        std::unique_ptr<int[]> width(new int[1]{config.width});
+        std::unique_ptr<bool[]> simd(new bool[1]{config.simd});
+        std::unique_ptr<std::string[]> method(new std::string[1]{splitMethod});
+        std::unique_ptr<bool[]> compactTriangles(new bool[1]{compact});
+        params.AddInt("width", std::move(width), 1);
+        params.AddBool("simd", std::move(simd), 1);
+        params.AddString("splitmethod", std::move(method), 1);
+        params.AddBool("compacttriangles", std::move(compactTriangles), 1);
+        pbrtAccelerator("bvh", params);
+        current = config;
+        loadStart = std::chrono::steady_clock::now();
+        ParseFile(sceneFile);
+    }
+    pbrtCleanup();
+
+    std::ostringstream json;
+    json << "{\n  \"scene\": \"" << sceneFile << "\",\n"
+         << "  \"split_method\": \"" << splitMethod << "\",\n"
+         << "  \"compact\": " << (compact ? "true" : "false") << ",\n"
+         << "  \"repeat\": " << repeat << ",\n"
+         << "  \"runs\": [" << runsJson.str() << "\n  ]\n}\n";
+    std::ofstream out(outFile);
+    out << json.str();
+    if (!out) {
+        fprintf(stderr, "pbrt_bench_accel: could not write %s\n",
+                outFile.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "pbrt_bench_accel: results written to %s\n",
+            outFile.c_str());
+    return 0;
+}
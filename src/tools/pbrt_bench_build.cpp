@@ -0,0 +1,200 @@
+// pbrt_bench_build.cpp
+// BVH construction time against the number of threads. The triangles of
+// PLY meshes, optionally repeated side by side to make a larger scene, are
+// built into a BVHAccel once per thread count, and the fastest of a few
+// builds is reported with the speedup over one thread. The triangles are
+// either a GeometricPrimitive each or a TriangleMeshPrimitive per mesh, as
+// pbrt makes them. The results are written as JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pbrt.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "transform.h"
+#include "accelerators/bvh.h"
+#include "shapes/plymesh.h"
+#include "shapes/triangle.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "pbrt_bench_build: %s\n\n", msg);
+    fprintf(stderr, R"(usage: pbrt_bench_build [options] <mesh.ply> [more.ply...]
+Options:
+  --threads=<list>     Comma separated thread counts. Default: 1, 2, 4...
+                       up to the number of cores
+  --copies=<n>         Times each mesh is loaded, side by side. Default: 1
+  --split=<method>     BVH split method: sah, hlbvh, middle or equal.
+                       Default: sah
+  --maxprims=<n>       Primitives per leaf node. Default: 4
+  --repeat=<n>         Builds per thread count. Default: 3
+  --compact=<0|1>      One primitive per mesh rather than per triangle.
+                       Default: 1
+  --out=<file.json>    Where the results go. Default: pbrt_bench_build.json
+)");
+    exit(1);
+}
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+// Triangles of <files>, each loaded <copies> times along x
+static std::vector<std::shared_ptr<Primitive>> load_meshes(
+    const std::vector<std::string> &files, int copies, bool compact,
+    std::vector<std::unique_ptr<Transform>> &transforms, int *nTriangles) {
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const std::string &file : files) {
+        Float offset = 0;
+        for (int c = 0; c < copies; ++c) {
+            ParamSet params;
+            std::unique_ptr<std::string[]> name(new std::string[1]{file});
+            params.AddString("filename", std::move(name), 1);
+            transforms.emplace_back(
+                new Transform(Translate(Vector3f(offset, 0, 0))));
+            Transform *o2w = transforms.back().get();
+            transforms.emplace_back(new Transform(Inverse(*o2w)));
+            Transform *w2o = transforms.back().get();
+            std::vector<std::shared_ptr<Shape>> tris =
+                CreatePLYMesh(o2w, w2o, false, params);
+            if (tris.empty()) {
+                fprintf(stderr, "pbrt_bench_build: no triangles in %s\n",
+                        file.c_str());
+                exit(1);
+            }
+            *nTriangles += tris.size();
+            Bounds3f bounds;
+            for (const auto &tri : tris)
+                bounds = Union(bounds, tri->WorldBound());
+            if (compact)
+                prims.push_back(CreateTriangleMeshPrimitive(tris, nullptr,
+                                                            MediumInterface()));
+            else
+                for (const auto &tri : tris)
+                    prims.push_back(std::make_shared<GeometricPrimitive>(
+                        tri, nullptr, nullptr, MediumInterface()));
+            offset = bounds.pMax.x + 0.1f * bounds.Diagonal().x;
+        }
+    }
+    return prims;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> files;
+    std::vector<int> threads;
+    int copies = 1, maxPrims = 4, repeat = 3;
+    bool compact = true;
+    std::string splitName = "sah";
+    std::string outFile = "pbrt_bench_build.json";
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--threads=", 10)) {
+            for (const std::string &t : split(&argv[i][10]))
+                threads.push_back(atoi(t.c_str()));
+        } else if (!strncmp(argv[i], "--copies=", 9))
+            copies = atoi(&argv[i][9]);
+        else if (!strncmp(argv[i], "--split=", 8))
+            splitName = &argv[i][8];
+        else if (!strncmp(argv[i], "--maxprims=", 11))
+            maxPrims = atoi(&argv[i][11]);
+        else if (!strncmp(argv[i], "--repeat=", 9))
+            repeat = atoi(&argv[i][9]);
+        else if (!strncmp(argv[i], "--compact=", 10))
+            compact = atoi(&argv[i][10]) != 0;
+        else if (!strncmp(argv[i], "--out=", 6))
+            outFile = &argv[i][6];
+        else if (argv[i][0] == '-')
+            usage("unknown option");
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.empty()) usage("no PLY files");
+    if (copies < 1 || maxPrims < 1 || repeat < 1)
+        usage("copies, maxprims and repeat must be positive");
+    if (threads.empty()) {
+        for (int t = 1; t < NumSystemCores(); t *= 2) threads.push_back(t);
+        threads.push_back(NumSystemCores());
+    }
+    for (int t : threads)
+        if (t < 1) usage("thread counts must be positive");
+
+    BVHAccel::SplitMethod splitMethod;
+    if (splitName == "sah")
+        splitMethod = BVHAccel::SplitMethod::SAH;
+    else if (splitName == "hlbvh")
+        splitMethod = BVHAccel::SplitMethod::HLBVH;
+    else if (splitName == "middle")
+        splitMethod = BVHAccel::SplitMethod::Middle;
+    else if (splitName == "equal")
+        splitMethod = BVHAccel::SplitMethod::EqualCounts;
+    else
+        usage("unknown split method");
+
+    PbrtOptions.quiet = true;
+    std::vector<std::unique_ptr<Transform>> transforms;
+    int nTriangles = 0;
+    std::vector<std::shared_ptr<Primitive>> prims =
+        load_meshes(files, copies, compact, transforms, &nTriangles);
+    fprintf(stderr, "pbrt_bench_build: %d triangles, %d cores\n", nTriangles,
+            NumSystemCores());
+
+    std::ostringstream runsJson;
+    double baseline = 0;
+    for (size_t r = 0; r < threads.size(); ++r) {
+        PbrtOptions.nThreads = threads[r];
+        ParallelInit();
+        double best = 0;
+        for (int i = 0; i < repeat; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            {
+                BVHAccel bvh(prims, maxPrims, splitMethod);
+            }
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            if (i == 0 || elapsed.count() < best) best = elapsed.count();
+        }
+        ParallelCleanup();
+        if (threads[r] == 1) baseline = best;
+
+        fprintf(stderr, "%3d threads %10.3f s %10.2f Mprims/s", threads[r],
+                best, nTriangles / best * 1e-6);
+        if (baseline > 0) fprintf(stderr, "  x%.2f", baseline / best);
+        fprintf(stderr, "\n");
+        runsJson << (r ? ",\n" : "\n") << "    {\"threads\": " << threads[r]
+                 << ", \"seconds\": " << best;
+        if (baseline > 0) runsJson << ", \"speedup\": " << baseline / best;
+        runsJson << "}";
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"triangles\": " << nTriangles << ",\n"
+         << "  \"compact\": " << (compact ? "true" : "false") << ",\n"
+         << "  \"split_method\": \"" << splitName << "\",\n"
+         << "  \"max_prims_in_node\": " << maxPrims << ",\n"
+         << "  \"cores\": " << NumSystemCores() << ",\n"
+         << "  \"runs\": [" << runsJson.str() << "\n  ]\n}\n";
+    std::ofstream out(outFile);
+    out << json.str();
+    if (!out) {
+        fprintf(stderr, "pbrt_bench_build: could not write %s\n",
+                outFile.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "pbrt_bench_build: results written to %s\n",
+            outFile.c_str());
+    return 0;
+}
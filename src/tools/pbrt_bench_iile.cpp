@@ -0,0 +1,235 @@
+// pbrt_bench_iile.cpp
+// Throughput of the full IILE render (IISPTIntegrator::render_normal_2) with
+// the stub NN backends, so it can run without Python, PyTorch or trained
+// weights. Every backend is run at 1, 2, 4, ... threads up to --threads and
+// the results are written as JSON for regression tracking.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api.h"
+#include "camera.h"
+#include "film.h"
+#include "paramset.h"
+#include "parser.h"
+#include "scene.h"
+#include "stats.h"
+#include "cameras/hemispheric.h"
+#include "integrators/iispt.h"
+#include "tools/nnconnectormanager.h"
+
+using namespace pbrt;
+
+static void usage(const char *msg = nullptr) {
+    if (msg) fprintf(stderr, "pbrt_bench_iile: %s\n\n", msg);
+    fprintf(stderr, R"(usage: pbrt_bench_iile [options] <scene.pbrt>
+Options:
+  --threads=<n>        Largest thread count, runs 1, 2, 4, ... and <n>.
+                       Default: number of CPUs
+  --backends=<list>    Comma separated stub networks among identity,
+                       constant and tiny. Default: identity,constant,tiny
+  --indirect=<tasks>   Indirect tasks of each run. Default: 4
+  --direct=<samples>   Direct samples of each run. Default: 1
+  --size=<pixels>      Hemisphere size. Default: 32
+  --out=<file.json>    Where the results go. Default: pbrt_bench_iile.json
+  --image=<file>       Where each run writes its image.
+                       Default: /tmp/pbrt_bench_iile.exr
+)");
+    exit(1);
+}
+
+// Stage name in the results, counter of the stage time
+static const std::pair<const char *, const char *> stageCounters[] = {
+    {"find_intersection", "IILE/Time in find_intersection() (ns)"},
+    {"render_hemisphere", "IILE/Time in RenderHemisphere() (ns)"},
+    {"normalize_maps", "IILE/Time in normalizeMapsDownstream() (ns)"},
+    {"nn_submit", "IILE/Time in NN submit (ns)"},
+    {"nn_wait", "IILE/Time blocked on NN results (ns)"},
+    {"sample_hemisphere", "IILE/Time in sample_hemisphere() (ns)"},
+    {"film_monitor_add", "IILE/Time in film monitor adds (ns)"},
+};
+
+static std::string sceneFile;
+static int maxThreads = 0;
+static std::vector<std::string> backends = {"identity", "constant", "tiny"};
+// The renderer prints its progress on standard output
+static std::string outFile = "pbrt_bench_iile.json";
+static std::ostringstream runsJson;
+static int runCount = 0;
+
+static std::vector<int> thread_counts() {
+    std::vector<int> counts;
+    for (int t = 1; t < maxThreads; t *= 2) counts.push_back(t);
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// Restarts the peak resident set size, where the kernel supports it
+static void reset_peak_rss() {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+static int64_t peak_rss_bytes() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (!line.compare(0, 6, "VmHWM:"))
+            return 1024 * (int64_t)atoll(line.c_str() + 6);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return 1024 * (int64_t)usage.ru_maxrss;
+}
+
+static int64_t counter(const std::map<std::string, int64_t> &counters,
+                       const std::string &name) {
+    auto it = counters.find(name);
+    return it == counters.end() ? 0 : it->second;
+}
+
+static void bench_one(const Scene &scene, std::shared_ptr<const Camera> camera,
+                      std::shared_ptr<Camera> dcamera,
+                      const std::string &backend, int threads) {
+    fprintf(stderr, "pbrt_bench_iile: %s network, %d threads\n",
+            backend.c_str(), threads);
+    PbrtOptions.nThreads = threads;
+    setenv("IISPT_NN_STUB", backend.c_str(), 1);
+    iile::NnConnectorManager::getInstance().start(threads);
+    std::unique_ptr<IISPTIntegrator> integrator(
+        CreateIISPTIntegrator(ParamSet(), camera, dcamera));
+
+    ClearStats();
+    reset_peak_rss();
+    auto start = std::chrono::steady_clock::now();
+    // Stops the NN backends when done
+    integrator->Render(scene);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    ReportThreadStats();
+    std::map<std::string, int64_t> counters = GetStatsCounters();
+
+    double seconds = elapsed.count();
+    int64_t hemispheres = counter(counters, "IILE/Hemispheres rendered");
+    int64_t indirect = counter(counters, "IILE/Indirect samples");
+    int64_t direct = counter(counters, "IILE/Direct samples");
+
+    runsJson << (runCount++ ? ",\n" : "\n") << "    {\"backend\": \""
+             << backend << "\", \"threads\": " << threads
+             << ", \"seconds\": " << seconds
+             << ", \"hemispheres\": " << hemispheres
+             << ", \"hemispheres_per_second\": " << hemispheres / seconds
+             << ", \"indirect_samples\": " << indirect
+             << ", \"direct_samples\": " << direct
+             << ", \"samples_per_second\": " << (indirect + direct) / seconds
+             << ", \"peak_rss_bytes\": " << peak_rss_bytes()
+             << ",\n     \"stage_seconds\": {";
+    // Stage times are summed over the threads
+    bool first = true;
+    for (const auto &stage : stageCounters) {
+        runsJson << (first ? "" : ", ") << "\"" << stage.first
+                 << "\": " << counter(counters, stage.second) * 1e-9;
+        first = false;
+    }
+    runsJson << "}}";
+}
+
+static void run(const Scene &scene, std::shared_ptr<const Camera> camera) {
+    // Started by the parser if the scene uses the iispt integrator
+    iile::NnConnectorManager::getInstance().stopAll();
+
+    // The hemisphere integrators only use this camera for the sampler bounds
+    std::shared_ptr<Camera> dcamera(CreateHemisphericCamera(
+        PbrtOptions.iisptHemiSize, PbrtOptions.iisptHemiSize, camera->medium,
+        Point3f(0, 0, 0), Vector3f(0, 0, 1), std::string("/tmp/null")));
+
+    for (const std::string &backend : backends)
+        for (int threads : thread_counts())
+            bench_one(scene, camera, dcamera, backend, threads);
+
+    Bounds2i bounds = camera->film->GetSampleBounds();
+    std::ostringstream json;
+    json << "{\n  \"scene\": \"" << sceneFile << "\",\n"
+         << "  \"width\": " << bounds.Diagonal().x << ",\n"
+         << "  \"height\": " << bounds.Diagonal().y << ",\n"
+         << "  \"hemi_size\": " << PbrtOptions.iisptHemiSize << ",\n"
+         << "  \"indirect_tasks\": " << PbrtOptions.iileIndirectTasks << ",\n"
+         << "  \"direct_samples\": " << PbrtOptions.iileDirectSamples << ",\n"
+         << "  \"cpus\": " << std::thread::hardware_concurrency() << ",\n"
+         << "  \"runs\": [" << runsJson.str() << "\n  ]\n}\n";
+
+    std::ofstream out(outFile);
+    out << json.str();
+    if (!out) {
+        fprintf(stderr, "pbrt_bench_iile: could not write %s\n",
+                outFile.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "pbrt_bench_iile: results written to %s\n",
+            outFile.c_str());
+}
+
+static std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    options.quiet = true;
+    options.iileNnBackend = "stub";
+    options.iileIndirectTasks = 4;
+    options.iileDirectSamples = 1;
+    options.imageFile = "/tmp/pbrt_bench_iile.exr";
+    maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--threads=", 10))
+            maxThreads = atoi(&argv[i][10]);
+        else if (!strncmp(argv[i], "--backends=", 11))
+            backends = split(&argv[i][11]);
+        else if (!strncmp(argv[i], "--indirect=", 11))
+            options.iileIndirectTasks = atoi(&argv[i][11]);
+        else if (!strncmp(argv[i], "--direct=", 9))
+            options.iileDirectSamples = atoi(&argv[i][9]);
+        else if (!strncmp(argv[i], "--size=", 7))
+            options.iisptHemiSize = atoi(&argv[i][7]);
+        else if (!strncmp(argv[i], "--out=", 6))
+            outFile = &argv[i][6];
+        else if (!strncmp(argv[i], "--image=", 8))
+            options.imageFile = &argv[i][8];
+        else if (argv[i][0] == '-')
+            usage("unknown option");
+        else if (!sceneFile.empty())
+            usage("only one scene file");
+        else
+            sceneFile = argv[i];
+    }
+    if (sceneFile.empty()) usage("no scene file");
+    if (maxThreads < 1 || options.iisptHemiSize < 1)
+        usage("threads and size must be positive");
+    if (backends.empty()) usage("no backends");
+    for (const std::string &b : backends)
+        if (!IisptNnStub::create(b)) usage("unknown backend");
+    options.nThreads = maxThreads;
+
+    pbrtInit(options);
+    pbrtSetWorldEndCallback(run);
+    ParseFile(sceneFile);
+    pbrtCleanup();
+    return 0;
+}
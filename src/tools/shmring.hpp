@@ -0,0 +1,233 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+namespace pbrt {
+
+// Ring of request/response slots in a memfd shared memory segment, shared
+// with a child process. Signalling uses two eventfds:
+//   request eventfd   parent -> child, incremented once per submitted slot
+//   response eventfd  child -> parent, incremented once per completed slot
+// Slots are used in order, slot i holds request number i modulo the slot
+// count, so the counters are enough to know which slots are ready.
+//
+// Segment layout, all fields int32 in native byte order:
+//   header (HEADER_BYTES)
+//     magic, version, slot count, max hemispheres per slot,
+//     input floats per hemisphere, output floats per hemisphere,
+//     slot stride in bytes
+//   slots, each one:
+//     count (hemispheres in this request, -1 asks the child to exit)
+//     status (0 = ok, set by the child)
+//     padding up to SLOT_HEADER_BYTES
+//     sizes  [max hemispheres], pixels across each hemisphere, padded to
+//            64 bytes
+//     input  [max hemispheres][input floats]
+//     output [max hemispheres][output floats]
+// Input and output floats are for the largest hemispheres. Smaller ones
+// are packed one after the other from the start of each area
+class ShmRing {
+
+public:
+
+    static const int32_t MAGIC = 0x4d485349; // "ISHM"
+    static const int32_t VERSION = 2;
+    static const int HEADER_BYTES = 64;
+    static const int SLOT_HEADER_BYTES = 64;
+
+private: // ===================================================================
+
+    int memfd = -1;
+    int request_fd = -1;
+    int response_fd = -1;
+    char* base = NULL;
+    size_t total_bytes = 0;
+
+    int slots;
+    int max_batch;
+    int input_floats;
+    int output_floats;
+    size_t slot_bytes;
+
+    char* slot_base(int slot) {
+        return base + HEADER_BYTES + slot * slot_bytes;
+    }
+
+    static size_t round_up(size_t v) {
+        return (v + 63) & ~((size_t) 63);
+    }
+
+public: // ====================================================================
+
+    // Constructor ------------------------------------------------------------
+    // Check ok() afterwards, shared memory is not available everywhere
+    ShmRing(int slots, int max_batch, int input_floats, int output_floats) :
+        slots(slots),
+        max_batch(max_batch),
+        input_floats(input_floats),
+        output_floats(output_floats)
+    {
+        slot_bytes = round_up(SLOT_HEADER_BYTES +
+                              round_up(max_batch * sizeof(int32_t)) +
+                              round_up(max_batch * input_floats * sizeof(float)) +
+                              max_batch * output_floats * sizeof(float));
+        total_bytes = HEADER_BYTES + slots * slot_bytes;
+
+        memfd = memfd_create("iispt_nn", MFD_CLOEXEC);
+        if (memfd < 0) {
+            std::cerr << "shmring.hpp: memfd_create() failed: " << strerror(errno) << std::endl;
+            return;
+        }
+        if (ftruncate(memfd, total_bytes) != 0) {
+            std::cerr << "shmring.hpp: ftruncate() failed: " << strerror(errno) << std::endl;
+            close_all();
+            return;
+        }
+        void* mapped = mmap(NULL, total_bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, memfd, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "shmring.hpp: mmap() failed: " << strerror(errno) << std::endl;
+            close_all();
+            return;
+        }
+        base = (char*) mapped;
+
+        request_fd = eventfd(0, EFD_CLOEXEC);
+        response_fd = eventfd(0, EFD_CLOEXEC);
+        if (request_fd < 0 || response_fd < 0) {
+            std::cerr << "shmring.hpp: eventfd() failed: " << strerror(errno) << std::endl;
+            close_all();
+            return;
+        }
+
+        int32_t* header = (int32_t*) base;
+        header[0] = MAGIC;
+        header[1] = VERSION;
+        header[2] = slots;
+        header[3] = max_batch;
+        header[4] = input_floats;
+        header[5] = output_floats;
+        header[6] = slot_bytes;
+    }
+
+    ~ShmRing() {
+        close_all();
+    }
+
+    ShmRing(ShmRing const&) = delete;
+    void operator=(ShmRing const&) = delete;
+
+    void close_all() {
+        if (base != NULL) {
+            munmap(base, total_bytes);
+            base = NULL;
+        }
+        if (memfd >= 0) {
+            close(memfd);
+            memfd = -1;
+        }
+        if (request_fd >= 0) {
+            close(request_fd);
+            request_fd = -1;
+        }
+        if (response_fd >= 0) {
+            close(response_fd);
+            response_fd = -1;
+        }
+    }
+
+    bool ok() {
+        return base != NULL;
+    }
+
+    // File descriptors the child must inherit, in the order expected by
+    // main_stdio_net.py --shm
+    std::vector<int> get_fds() {
+        return {memfd, request_fd, response_fd};
+    }
+
+    int get_slots() {
+        return slots;
+    }
+
+    int get_max_batch() {
+        return max_batch;
+    }
+
+    // ------------------------------------------------------------------------
+    // Slot access
+    int32_t* count(int slot) {
+        return (int32_t*) slot_base(slot);
+    }
+
+    int32_t* status(int slot) {
+        return ((int32_t*) slot_base(slot)) + 1;
+    }
+
+    int32_t* sizes(int slot) {
+        return (int32_t*) (slot_base(slot) + SLOT_HEADER_BYTES);
+    }
+
+    float* input(int slot) {
+        return (float*) (slot_base(slot) + SLOT_HEADER_BYTES +
+                         round_up(max_batch * sizeof(int32_t)));
+    }
+
+    float* output(int slot) {
+        return (float*) (slot_base(slot) + SLOT_HEADER_BYTES +
+                         round_up(max_batch * sizeof(int32_t)) +
+                         round_up(max_batch * input_floats * sizeof(float)));
+    }
+
+    // ------------------------------------------------------------------------
+    // Hand the next slot in order to the child
+    void submit() {
+        uint64_t one = 1;
+        // The slot contents must be visible before the counter increments
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        ssize_t written = write(request_fd, &one, sizeof(one));
+        if (written != sizeof(one)) {
+            std::cerr << "shmring.hpp: eventfd write failed: " << strerror(errno) << std::endl;
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // Wait until the child completes at least one slot
+    // <return> the number of slots completed since the last call
+    //          0 if <timeout_ms> elapsed, -1 on error
+    int wait_completed(int timeout_ms) {
+        struct pollfd pfd;
+        pfd.fd = response_fd;
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0) {
+            return 0;
+        } else if (ready < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+            return -1;
+        }
+        uint64_t completed = 0;
+        if (read(response_fd, &completed, sizeof(completed)) != sizeof(completed)) {
+            return -1;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return (int) completed;
+    }
+
+};
+
+}
+
+#endif // SHM_RING_H
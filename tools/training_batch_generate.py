@@ -6,7 +6,7 @@ import subprocess
 
 rootdir = os.path.abspath(os.path.join(__file__, "..", ".."))
 
-multiprocess_reference_py = os.path.join(rootdir, "tools", "multiprocess_reference.py")
+pbrt_bin = os.path.join(rootdir, "bin", "pbrt")
 
 TASK_LIST = [
     "/home/gj/git/pbrt-v3-custom-scenes/mbed1/scene.pbrt"
@@ -19,8 +19,7 @@ for task in TASK_LIST:
     os.chdir(taskdir)
 
     cmd = []
-    cmd.append("python3")
-    cmd.append(multiprocess_reference_py)
+    cmd.append(pbrt_bin)
     cmd.append(task)
     cmd.append("--reference=18")
     cmd.append("--reference_samples=1024")